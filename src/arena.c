@@ -0,0 +1,119 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_MIN_SIZE 64
+
+// Alignment of memory handed out by an arena allocator, enough for the
+// integers, doubles and pointers in protobuf messages
+#define ARENA_ALIGN 8
+
+unsigned char *ttngwc_arena_reserve(struct Arena *arena, size_t size) {
+  if (size <= arena->size)
+    return arena->data;
+  if (arena->limit && size > arena->limit)
+    return NULL;
+
+  size_t grow = arena->size * 2;
+  if (grow < ARENA_MIN_SIZE)
+    grow = ARENA_MIN_SIZE;
+  if (grow < size)
+    grow = size;
+  if (arena->limit && grow > arena->limit)
+    grow = arena->limit;
+
+  unsigned char *data = realloc(arena->data, grow);
+  if (!data)
+    return NULL;
+  arena->data = data;
+  arena->size = grow;
+  arena->allocations++;
+  return data;
+}
+
+void ttngwc_arena_free(struct Arena *arena) {
+  free(arena->data);
+  arena->data = NULL;
+  arena->size = 0;
+}
+
+static void ttngwc_arena_append(ProtobufCBuffer *buffer, size_t len,
+                                const uint8_t *data) {
+  struct ArenaAppender *appender = (struct ArenaAppender *)buffer;
+  if (appender->failed)
+    return;
+  if (!ttngwc_arena_reserve(appender->arena, appender->len + len)) {
+    appender->failed = 1;
+    return;
+  }
+  memcpy(&appender->arena->data[appender->len], data, len);
+  appender->len += len;
+}
+
+void ttngwc_arena_appender_init(struct ArenaAppender *appender,
+                                struct Arena *arena, size_t offset) {
+  appender->base.append = &ttngwc_arena_append;
+  appender->arena = arena;
+  appender->len = offset;
+  appender->failed = 0;
+}
+
+static void *ttngwc_arena_alloc(void *data, size_t size) {
+  struct ArenaAllocator *allocator = (struct ArenaAllocator *)data;
+  size_t offset =
+      (allocator->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  struct ArenaBlock *block;
+
+  if (offset + size <= allocator->arena.size) {
+    allocator->used = offset + size;
+    return &allocator->arena.data[offset];
+  }
+  // The block header is padded to keep the memory aligned
+  block = (struct ArenaBlock *)malloc(ARENA_ALIGN + size);
+  if (!block)
+    return NULL;
+  block->next = allocator->blocks;
+  allocator->blocks = block;
+  allocator->overflow += ARENA_ALIGN + size;
+  allocator->allocations++;
+  return (unsigned char *)block + ARENA_ALIGN;
+}
+
+static void ttngwc_arena_dealloc(void *data, void *ptr) {}
+
+void ttngwc_arena_allocator_init(struct ArenaAllocator *allocator, size_t size,
+                                 size_t limit) {
+  memset(allocator, 0, sizeof(struct ArenaAllocator));
+  allocator->base.alloc = &ttngwc_arena_alloc;
+  allocator->base.free = &ttngwc_arena_dealloc;
+  allocator->base.allocator_data = allocator;
+  allocator->arena.limit = limit;
+  ttngwc_arena_reserve(&allocator->arena, size);
+}
+
+void ttngwc_arena_allocator_reset(struct ArenaAllocator *allocator) {
+  size_t needed = allocator->used + allocator->overflow;
+
+  while (allocator->blocks) {
+    struct ArenaBlock *block = allocator->blocks;
+    allocator->blocks = block->next;
+    free(block);
+  }
+  if (allocator->overflow > 0) {
+    if (allocator->arena.limit && needed > allocator->arena.limit)
+      needed = allocator->arena.limit;
+    ttngwc_arena_reserve(&allocator->arena, needed);
+  }
+  allocator->used = 0;
+  allocator->overflow = 0;
+}
+
+void ttngwc_arena_allocator_free(struct ArenaAllocator *allocator) {
+  ttngwc_arena_allocator_reset(allocator);
+  ttngwc_arena_free(&allocator->arena);
+}
@@ -0,0 +1,71 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+#if !defined(__TTN_GW_ARENA_H_)
+#define __TTN_GW_ARENA_H_
+
+#include <stddef.h>
+
+#include <protobuf-c/protobuf-c.h>
+
+// Growable memory that is kept between uses, so that encoding messages does
+// not allocate once the arena is large enough. The arena does not grow beyond
+// its limit, unless the limit is 0
+struct Arena {
+  unsigned char *data;
+  size_t size;
+  size_t limit;
+  unsigned long allocations;
+};
+
+// Makes sure the arena holds at least size bytes
+// Returns the memory of the arena or NULL when out of memory or over the limit
+unsigned char *ttngwc_arena_reserve(struct Arena *arena, size_t size);
+
+// Releases the memory of the arena
+void ttngwc_arena_free(struct Arena *arena);
+
+// Protobuf output buffer that appends to an arena from the given offset
+struct ArenaAppender {
+  ProtobufCBuffer base;
+  struct Arena *arena;
+  size_t len;
+  int failed;
+};
+
+// Initializes an appender that writes to the arena after offset bytes
+void ttngwc_arena_appender_init(struct ArenaAppender *appender,
+                                struct Arena *arena, size_t offset);
+
+// Memory that did not fit in the arena of an allocator
+struct ArenaBlock {
+  struct ArenaBlock *next;
+};
+
+// Protobuf allocator that hands out memory from an arena by bumping an
+// offset. Freeing does nothing: all memory is released at once on reset.
+// Memory that does not fit is allocated separately, and the arena grows on
+// reset to fit it next time, so that decoding messages of the same size does
+// not allocate
+struct ArenaAllocator {
+  ProtobufCAllocator base;
+  struct Arena arena;
+  size_t used;
+  // Bytes allocated outside the arena since the last reset
+  size_t overflow;
+  struct ArenaBlock *blocks;
+  unsigned long allocations;
+};
+
+// Initializes an allocator with an arena of the given size, that grows up to
+// the limit
+void ttngwc_arena_allocator_init(struct ArenaAllocator *allocator, size_t size,
+                                 size_t limit);
+
+// Releases all memory handed out by the allocator
+void ttngwc_arena_allocator_reset(struct ArenaAllocator *allocator);
+
+// Releases the memory of the allocator
+void ttngwc_arena_allocator_free(struct ArenaAllocator *allocator);
+
+#endif
@@ -0,0 +1,262 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "network.h"
+
+// Priority of join requests, above any spreading factor
+#define PRIORITY_JOIN 7
+
+// Join requests come first, then frames with a lower spreading factor, as
+// these take the least airtime to repeat
+static int ttngwc_backlog_priority(const Router__UplinkMessage *uplink) {
+  const Protocol__RxMetadata *metadata = uplink->protocol_metadata;
+  const char *data_rate;
+
+  // The message type is in the upper bits of the MAC header
+  if (uplink->has_payload && uplink->payload.len > 0 &&
+      (uplink->payload.data[0] >> 5) == 0)
+    return PRIORITY_JOIN;
+  if (!metadata ||
+      metadata->protocol_case != PROTOCOL__RX_METADATA__PROTOCOL_LORAWAN ||
+      !metadata->lorawan)
+    return 0;
+  if (metadata->lorawan->has_modulation &&
+      metadata->lorawan->modulation == LORAWAN__MODULATION__FSK)
+    return PRIORITY_JOIN - 1;
+  data_rate = metadata->lorawan->data_rate;
+  if (data_rate && data_rate[0] == 'S' && data_rate[1] == 'F') {
+    int sf = atoi(&data_rate[2]);
+    if (sf >= 7 && sf <= 12)
+      return 13 - sf;
+  }
+  return 0;
+}
+
+static int ttngwc_backlog_expired(struct Session *session,
+                                  struct BacklogEntry *entry) {
+  return session->config.backlog_max_age_ms > 0 &&
+         TimerIsExpired(&entry->expiry);
+}
+
+// Removes the entry at the index from the head, moving the later entries
+// forward. The memory of the removed entry is kept at the end of the ring
+static void ttngwc_backlog_remove(struct Backlog *backlog, int index) {
+  struct BacklogEntry removed = backlog->entries[(backlog->head + index) %
+                                                 backlog->size];
+  int i;
+
+  // The oldest entry is at the head, right after the end of the ring
+  if (index == 0 && backlog->count == backlog->size) {
+    backlog->head = (backlog->head + 1) % backlog->size;
+    backlog->count--;
+    return;
+  }
+  for (i = index; i < backlog->count - 1; i++) {
+    backlog->entries[(backlog->head + i) % backlog->size] =
+        backlog->entries[(backlog->head + i + 1) % backlog->size];
+  }
+  backlog->entries[(backlog->head + backlog->count - 1) % backlog->size] =
+      removed;
+  backlog->count--;
+}
+
+void ttngwc_backlog_init(struct Session *session) {
+  struct Backlog *backlog = &session->backlog;
+  int i;
+
+  MutexInit(&backlog->mutex);
+  if (session->config.backlog_size <= 0)
+    return;
+  backlog->entries = (struct BacklogEntry *)calloc(
+      session->config.backlog_size, sizeof(struct BacklogEntry));
+  if (!backlog->entries)
+    return;
+  backlog->size = session->config.backlog_size;
+  for (i = 0; i < backlog->size; i++)
+    backlog->entries[i].payload.limit = session->config.max_buffer_size;
+}
+
+void ttngwc_backlog_destroy(struct Session *session) {
+  struct Backlog *backlog = &session->backlog;
+  int i;
+
+  while (backlog->count > 0) {
+    struct BacklogEntry *entry = &backlog->entries[backlog->head];
+    backlog->head = (backlog->head + 1) % backlog->size;
+    backlog->count--;
+    ttngwc_counters_add(&session->counters, COUNTER_UPLINKS_FAILED, 1);
+    if (entry->handler)
+      entry->handler(TTNGWC_DROPPED, entry->arg);
+  }
+  for (i = 0; i < backlog->size; i++)
+    ttngwc_arena_free(&backlog->entries[i].payload);
+  free(backlog->entries);
+  backlog->entries = NULL;
+  backlog->size = 0;
+}
+
+int ttngwc_backlog_wanted(struct Session *session) {
+  struct Backlog *backlog = &session->backlog;
+  int wanted;
+
+  if (backlog->size == 0)
+    return 0;
+  MutexLock(&backlog->mutex);
+  wanted = !session->connected || backlog->count > 0 ||
+           ttngwc_outbox_depth(session) >= OUTBOX_SIZE;
+  MutexUnlock(&backlog->mutex);
+  return wanted;
+}
+
+int ttngwc_backlog_push(struct Session *session, Router__UplinkMessage *uplink,
+                        TTNCompletionHandler handler, void *arg) {
+  struct Backlog *backlog = &session->backlog;
+  struct BacklogEntry dropped = {0};
+  int priority = ttngwc_backlog_priority(uplink);
+  int rc = SUCCESS, evicted = 0, i;
+
+  if (backlog->size == 0)
+    return FAILURE;
+
+  // Make room by dropping stale uplinks first. In threaded mode, only the I/O
+  // thread moves uplinks to the outbox
+  if (ttngwc_sender_threaded(session))
+    ttngwc_backlog_expire(session);
+  else
+    ttngwc_backlog_feed(session);
+
+  MutexLock(&backlog->mutex);
+  if (backlog->count == backlog->size) {
+    int victim = -1;
+    switch (session->config.backlog_policy) {
+    case TTN_DROP_OLDEST:
+      victim = 0;
+      break;
+    case TTN_DROP_NEWEST:
+      break;
+    case TTN_DROP_PRIORITY:
+      // The oldest uplink with the lowest priority makes room for an uplink
+      // with a higher priority
+      for (i = 0; i < backlog->count; i++) {
+        int p = backlog->entries[(backlog->head + i) % backlog->size].priority;
+        if (p < priority &&
+            (victim < 0 ||
+             p < backlog->entries[(backlog->head + victim) % backlog->size]
+                     .priority))
+          victim = i;
+      }
+      break;
+    }
+    if (victim < 0) {
+      backlog->stats.rejected++;
+      rc = TTNGWC_DROPPED;
+    } else {
+      dropped = backlog->entries[(backlog->head + victim) % backlog->size];
+      ttngwc_backlog_remove(backlog, victim);
+      backlog->stats.evicted++;
+      evicted = 1;
+    }
+  }
+
+  if (rc == SUCCESS) {
+    struct BacklogEntry *entry =
+        &backlog->entries[(backlog->head + backlog->count) % backlog->size];
+    size_t len = protobuf_c_message_get_packed_size(&uplink->base);
+    if (ttngwc_arena_reserve(&entry->payload, len)) {
+      entry->len = protobuf_c_message_pack(&uplink->base, entry->payload.data);
+      entry->priority = priority;
+      entry->handler = handler;
+      entry->arg = arg;
+      TimerInit(&entry->expiry);
+      TimerCountdownMS(&entry->expiry, session->config.backlog_max_age_ms);
+      backlog->count++;
+      backlog->stats.stored++;
+    } else {
+      rc = FAILURE;
+    }
+  }
+  MutexUnlock(&backlog->mutex);
+
+  ttngwc_counters_add(&session->counters, COUNTER_UPLINKS_FAILED,
+                      evicted + (rc != SUCCESS));
+  if (dropped.handler)
+    dropped.handler(TTNGWC_DROPPED, dropped.arg);
+  if (rc == SUCCESS && ttngwc_sender_threaded(session))
+    ttngwc_sender_pump(session);
+  return rc;
+}
+
+// Completes the expired uplinks at the head, and queues the next ones in the
+// outbox when publish is set
+static void ttngwc_backlog_take(struct Session *session, int publish) {
+  struct Backlog *backlog = &session->backlog;
+  int queued = 0;
+
+  if (backlog->size == 0)
+    return;
+
+  // Handlers are called without holding the lock, one uplink at a time
+  for (;;) {
+    struct BacklogEntry *entry;
+    TTNCompletionHandler handler;
+    void *arg;
+    int rc;
+
+    MutexLock(&backlog->mutex);
+    if (backlog->count == 0) {
+      MutexUnlock(&backlog->mutex);
+      break;
+    }
+    entry = &backlog->entries[backlog->head];
+    if (ttngwc_backlog_expired(session, entry)) {
+      rc = TTNGWC_DROPPED;
+      backlog->stats.expired++;
+    } else if (!publish || !session->connected) {
+      MutexUnlock(&backlog->mutex);
+      break;
+    } else {
+      rc = ttngwc_outbox_push_raw(session, CLASS_UP, entry->payload.data,
+                                  entry->len, entry->handler, entry->arg);
+      // Wait for the outbox to make room
+      if (rc == TTNGWC_DROPPED) {
+        MutexUnlock(&backlog->mutex);
+        break;
+      }
+      if (rc == SUCCESS) {
+        backlog->stats.published++;
+        queued++;
+      }
+    }
+    handler = entry->handler;
+    arg = entry->arg;
+    backlog->head = (backlog->head + 1) % backlog->size;
+    backlog->count--;
+    MutexUnlock(&backlog->mutex);
+
+    if (rc != SUCCESS) {
+      ttngwc_counters_add(&session->counters, COUNTER_UPLINKS_FAILED, 1);
+      if (handler)
+        handler(rc, arg);
+    }
+  }
+
+  if (queued > 0)
+    ttngwc_sender_pump(session);
+}
+
+void ttngwc_backlog_feed(struct Session *session) {
+  ttngwc_backlog_take(session, 1);
+}
+
+void ttngwc_backlog_expire(struct Session *session) {
+  ttngwc_backlog_take(session, 0);
+}
+
+void ttngwc_backlog_get_stats(struct Session *session, TTNBacklogStats *stats) {
+  struct Backlog *backlog = &session->backlog;
+  MutexLock(&backlog->mutex);
+  *stats = backlog->stats;
+  stats->depth = backlog->count;
+  MutexUnlock(&backlog->mutex);
+}
@@ -0,0 +1,63 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+#if !defined(__TTN_GW_BACKLOG_H_)
+#define __TTN_GW_BACKLOG_H_
+
+#include <MQTTClient.h>
+
+#include "arena.h"
+#include "connector.h"
+
+struct Session;
+
+// An uplink that is packed and waiting to be queued in the outbox
+struct BacklogEntry {
+  struct Arena payload;
+  size_t len;
+  int priority;
+  Timer expiry;
+  TTNCompletionHandler handler;
+  void *arg;
+};
+
+// Uplinks are kept in a ring in the order they were sent. Entries keep their
+// memory when they move, so that storing does not allocate once the payloads
+// have grown to fit
+struct Backlog {
+  Mutex mutex;
+  struct BacklogEntry *entries;
+  int size;
+  int head;
+  int count;
+  TTNBacklogStats stats;
+};
+
+// Allocates the backlog of the session. Without a backlog size, the backlog
+// is disabled
+void ttngwc_backlog_init(struct Session *session);
+
+// Drops all uplinks and releases the backlog
+void ttngwc_backlog_destroy(struct Session *session);
+
+// Returns whether uplinks should be stored in the backlog rather than queued
+// in the outbox: when not connected, when the outbox is full or when earlier
+// uplinks are still waiting
+int ttngwc_backlog_wanted(struct Session *session);
+
+// Stores an uplink, applying the drop policy when the backlog is full
+// Returns 0 when stored, -1 on failure or -3 when dropped
+int ttngwc_backlog_push(struct Session *session, Router__UplinkMessage *uplink,
+                        TTNCompletionHandler handler, void *arg);
+
+// Drops uplinks older than the age cutoff and queues the others in the outbox
+// while it has room
+void ttngwc_backlog_feed(struct Session *session);
+
+// Drops uplinks older than the age cutoff without queuing the others
+void ttngwc_backlog_expire(struct Session *session);
+
+// Gets the counters of the backlog
+void ttngwc_backlog_get_stats(struct Session *session, TTNBacklogStats *stats);
+
+#endif
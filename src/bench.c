@@ -0,0 +1,419 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include "arena.h"
+#include "connector.h"
+#include "view.h"
+
+// Minimum time in nanoseconds that each benchmark runs
+#define BENCH_TIME 200000000ULL
+
+#define MAX_ANTENNAS 8
+#define MAX_PARENTS 2
+
+static FILE *out;
+static int results;
+static uint8_t buffer[4096];
+
+// Allocations made through the allocator passed to unpack
+static unsigned long allocations;
+
+static void *count_alloc(void *data, size_t size) {
+  allocations++;
+  return malloc(size);
+}
+
+static void count_free(void *data, void *ptr) { free(ptr); }
+
+static ProtobufCAllocator allocator = {&count_alloc, &count_free, NULL};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// A benchmark runs one operation and returns the number of bytes it handled
+typedef size_t (*Operation)(void *arg);
+
+// Runs the operation in batches that double in size until the minimum time
+// has passed, and writes the result of the last batch
+static void bench(const char *name, Operation op, void *arg) {
+  unsigned long iterations = 1, i;
+  uint64_t start, elapsed;
+  size_t bytes = 0;
+
+  for (;;) {
+    allocations = 0;
+    bytes = 0;
+    start = now_ns();
+    for (i = 0; i < iterations; i++)
+      bytes += op(arg);
+    elapsed = now_ns() - start;
+    if (elapsed >= BENCH_TIME)
+      break;
+    iterations *= 2;
+  }
+
+  fprintf(out,
+          "%s\n    {\"name\": \"%s\", \"iterations\": %lu, \"ns_per_op\": %.1f, "
+          "\"bytes_per_op\": %.1f, \"allocs_per_op\": %.2f}",
+          results++ ? "," : "", name, iterations, (double)elapsed / iterations,
+          (double)bytes / iterations, (double)allocations / iterations);
+  fprintf(stderr, "%-40s %10.1f ns/op %8.1f B/op %6.2f allocs/op\n", name,
+          (double)elapsed / iterations, (double)bytes / iterations,
+          (double)allocations / iterations);
+}
+
+struct Uplink {
+  Router__UplinkMessage up;
+  Protocol__RxMetadata protocol;
+  Lorawan__Metadata lorawan;
+  Gateway__RxMetadata gateway;
+  Gateway__RxMetadata__Antenna antennas[MAX_ANTENNAS];
+  Gateway__RxMetadata__Antenna *antenna_ptrs[MAX_ANTENNAS];
+  Gateway__GPSMetadata gps;
+  uint8_t payload[23];
+};
+
+struct Trace {
+  Trace__Trace trace;
+  Trace__Trace parents[MAX_PARENTS];
+  Trace__Trace *parent_ptrs[MAX_PARENTS];
+  Trace__Trace__MetadataEntry metadata[2];
+  Trace__Trace__MetadataEntry *metadata_ptrs[2];
+};
+
+static void init_trace(struct Trace *t) {
+  int i;
+
+  trace__trace__init(&t->trace);
+  t->trace.id = "01BX5ZZKBKACTAV9WEVGEMMVRZ";
+  t->trace.has_time = 1;
+  t->trace.time = 1500000000000000000LL;
+  t->trace.service_id = "ttn-router-eu";
+  t->trace.service_name = "router";
+  t->trace.event = "receive";
+  for (i = 0; i < 2; i++) {
+    trace__trace__metadata_entry__init(&t->metadata[i]);
+    t->metadata_ptrs[i] = &t->metadata[i];
+  }
+  t->metadata[0].key = "gateway";
+  t->metadata[0].value = "eui-0000024b08060112";
+  t->metadata[1].key = "frequency";
+  t->metadata[1].value = "868100000";
+  t->trace.n_metadata = 2;
+  t->trace.metadata = t->metadata_ptrs;
+  for (i = 0; i < MAX_PARENTS; i++) {
+    trace__trace__init(&t->parents[i]);
+    t->parents[i].id = "01BX5ZZKBKACTAV9WEVGEMMVRY";
+    t->parents[i].has_time = 1;
+    t->parents[i].time = 1500000000000000000LL - i;
+    t->parents[i].service_id = "ttn-bridge";
+    t->parents[i].service_name = "bridge";
+    t->parents[i].event = "forward";
+    t->parents[i].n_metadata = 2;
+    t->parents[i].metadata = t->metadata_ptrs;
+    t->parent_ptrs[i] = &t->parents[i];
+  }
+  t->trace.n_parents = MAX_PARENTS;
+  t->trace.parents = t->parent_ptrs;
+}
+
+static void init_uplink(struct Uplink *u, int antennas, int gps) {
+  int i;
+
+  router__uplink_message__init(&u->up);
+  for (i = 0; i < (int)sizeof(u->payload); i++)
+    u->payload[i] = (uint8_t)(0x40 + i);
+  u->up.has_payload = 1;
+  u->up.payload.len = sizeof(u->payload);
+  u->up.payload.data = u->payload;
+
+  protocol__rx_metadata__init(&u->protocol);
+  lorawan__metadata__init(&u->lorawan);
+  u->protocol.protocol_case = PROTOCOL__RX_METADATA__PROTOCOL_LORAWAN;
+  u->lorawan.has_modulation = 1;
+  u->lorawan.modulation = LORAWAN__MODULATION__LORA;
+  u->lorawan.data_rate = "SF7BW125";
+  u->lorawan.coding_rate = "4/5";
+  u->lorawan.has_f_cnt = 1;
+  u->lorawan.f_cnt = 4242;
+  u->protocol.lorawan = &u->lorawan;
+  u->up.protocol_metadata = &u->protocol;
+
+  gateway__rx_metadata__init(&u->gateway);
+  u->gateway.has_timestamp = 1;
+  u->gateway.timestamp = 2871239123u;
+  u->gateway.has_rf_chain = 1;
+  u->gateway.rf_chain = 1;
+  u->gateway.has_channel = 1;
+  u->gateway.channel = 3;
+  u->gateway.has_frequency = 1;
+  u->gateway.frequency = 867100000;
+  u->gateway.has_rssi = 1;
+  u->gateway.rssi = -97;
+  u->gateway.has_snr = 1;
+  u->gateway.snr = 7.5f;
+  for (i = 0; i < antennas; i++) {
+    gateway__rx_metadata__antenna__init(&u->antennas[i]);
+    u->antennas[i].has_antenna = 1;
+    u->antennas[i].antenna = i;
+    u->antennas[i].has_channel = 1;
+    u->antennas[i].channel = 3;
+    u->antennas[i].has_rssi = 1;
+    u->antennas[i].rssi = -97 - i;
+    u->antennas[i].has_snr = 1;
+    u->antennas[i].snr = 7.5f - i;
+    u->antenna_ptrs[i] = &u->antennas[i];
+  }
+  u->gateway.n_antennas = antennas;
+  u->gateway.antennas = u->antenna_ptrs;
+  if (gps) {
+    gateway__gpsmetadata__init(&u->gps);
+    u->gps.has_time = 1;
+    u->gps.time = 1500000000000000000LL;
+    u->gps.has_latitude = 1;
+    u->gps.latitude = 52.3731f;
+    u->gps.has_longitude = 1;
+    u->gps.longitude = 4.8922f;
+    u->gps.has_altitude = 1;
+    u->gps.altitude = 12;
+    u->gateway.gps = &u->gps;
+  }
+  u->up.gateway_metadata = &u->gateway;
+}
+
+static size_t uplink_size(void *arg) {
+  return router__uplink_message__get_packed_size((Router__UplinkMessage *)arg);
+}
+
+static size_t uplink_pack(void *arg) {
+  return router__uplink_message__pack((Router__UplinkMessage *)arg, buffer);
+}
+
+struct Packed {
+  uint8_t data[1024];
+  size_t len;
+};
+
+static size_t downlink_unpack(void *arg) {
+  struct Packed *packed = (struct Packed *)arg;
+  Router__DownlinkMessage *down =
+      router__downlink_message__unpack(&allocator, packed->len, packed->data);
+  if (!down)
+    return 0;
+  router__downlink_message__free_unpacked(down, &allocator);
+  return packed->len;
+}
+
+// Decodes like the session does, in memory that is reused for each downlink
+static struct ArenaAllocator arena;
+
+static size_t downlink_unpack_arena(void *arg) {
+  struct Packed *packed = (struct Packed *)arg;
+  unsigned long before = arena.allocations + arena.arena.allocations;
+  Router__DownlinkMessage *down =
+      router__downlink_message__unpack(&arena.base, packed->len, packed->data);
+  ttngwc_arena_allocator_reset(&arena);
+  allocations += arena.allocations + arena.arena.allocations - before;
+  return down ? packed->len : 0;
+}
+
+// Reads what a packet forwarder needs through a view, without decoding the
+// rest of the downlink
+static size_t downlink_view(void *arg) {
+  struct Packed *packed = (struct Packed *)arg;
+  struct DownlinkView view;
+  Gateway__TxConfiguration tx;
+  const uint8_t *payload;
+  size_t len;
+
+  gateway__tx_configuration__init(&tx);
+  if (ttngwc_view_init(&view, &arena, packed->data, packed->len) != 0 ||
+      ttngwc_view_payload(&view, &payload, &len) != 0 ||
+      ttngwc_view_tx(&view, &tx) != 0)
+    return 0;
+  return packed->len;
+}
+
+static void pack_downlink(struct Packed *packed, Trace__Trace *trace) {
+  uint8_t payload[] = {0x60, 0x04, 0x03, 0x02, 0x01, 0x00, 0x2a, 0x00,
+                       0x01, 0x61, 0x70, 0x70, 0x6c, 0x65, 0x01, 0x02,
+                       0x03, 0x04};
+  Router__DownlinkMessage down = ROUTER__DOWNLINK_MESSAGE__INIT;
+  Protocol__TxConfiguration protocol = PROTOCOL__TX_CONFIGURATION__INIT;
+  Lorawan__TxConfiguration lorawan = LORAWAN__TX_CONFIGURATION__INIT;
+  Gateway__TxConfiguration gateway = GATEWAY__TX_CONFIGURATION__INIT;
+
+  down.has_payload = 1;
+  down.payload.len = sizeof(payload);
+  down.payload.data = payload;
+  protocol.protocol_case = PROTOCOL__TX_CONFIGURATION__PROTOCOL_LORAWAN;
+  lorawan.has_modulation = 1;
+  lorawan.modulation = LORAWAN__MODULATION__LORA;
+  lorawan.data_rate = "SF9BW125";
+  lorawan.coding_rate = "4/5";
+  lorawan.has_f_cnt = 1;
+  lorawan.f_cnt = 42;
+  protocol.lorawan = &lorawan;
+  down.protocol_configuration = &protocol;
+  gateway.has_timestamp = 1;
+  gateway.timestamp = 2872239123u;
+  gateway.has_rf_chain = 1;
+  gateway.rf_chain = 0;
+  gateway.has_frequency = 1;
+  gateway.frequency = 869525000;
+  gateway.has_power = 1;
+  gateway.power = 14;
+  gateway.has_polarization_inversion = 1;
+  gateway.polarization_inversion = 1;
+  down.gateway_configuration = &gateway;
+  down.trace = trace;
+  packed->len = router__downlink_message__pack(&down, packed->data);
+}
+
+struct Status {
+  Gateway__Status status;
+  Gateway__Status__OSMetrics os;
+  Gateway__GPSMetadata gps;
+  char *ip[3];
+  char *messages[4];
+};
+
+static void init_status(struct Status *s, int full) {
+  static char *ip[] = {"192.168.1.12", "10.0.0.4", "fe80::1"};
+  static char *messages[] = {"concentrator started", "gps fix acquired",
+                             "temperature high", "backhaul restored"};
+
+  gateway__status__init(&s->status);
+  s->status.has_timestamp = 1;
+  s->status.timestamp = 2871239123u;
+  s->status.has_time = 1;
+  s->status.time = 1500000000000000000LL;
+  s->status.has_rx_in = 1;
+  s->status.rx_in = 1042;
+  s->status.has_rx_ok = 1;
+  s->status.rx_ok = 1000;
+  s->status.has_tx_in = 1;
+  s->status.tx_in = 20;
+  s->status.has_tx_ok = 1;
+  s->status.tx_ok = 19;
+  if (!full)
+    return;
+  s->status.has_boot_time = 1;
+  s->status.boot_time = 1499990000000000000LL;
+  s->status.n_ip = 3;
+  s->status.ip = ip;
+  s->status.platform = "IMST + Rpi";
+  s->status.contact_email = "gateway@example.com";
+  s->status.description = "Rooftop";
+  s->status.frequency_plan = "EU_863_870";
+  s->status.has_fpga = 1;
+  s->status.fpga = 31;
+  s->status.has_dsp = 1;
+  s->status.dsp = 31;
+  s->status.hal = "5.0.1";
+  gateway__gpsmetadata__init(&s->gps);
+  s->gps.has_latitude = 1;
+  s->gps.latitude = 52.3731f;
+  s->gps.has_longitude = 1;
+  s->gps.longitude = 4.8922f;
+  s->status.gps = &s->gps;
+  s->status.has_rtt = 1;
+  s->status.rtt = 42;
+  gateway__status__osmetrics__init(&s->os);
+  s->os.has_load_1 = 1;
+  s->os.load_1 = 0.42f;
+  s->os.has_cpu_percentage = 1;
+  s->os.cpu_percentage = 12.5f;
+  s->os.has_memory_percentage = 1;
+  s->os.memory_percentage = 40.0f;
+  s->os.has_temperature = 1;
+  s->os.temperature = 48.5f;
+  s->status.os = &s->os;
+  s->status.n_messages = 4;
+  s->status.messages = messages;
+}
+
+static size_t status_pack(void *arg) {
+  return gateway__status__pack((Gateway__Status *)arg, buffer);
+}
+
+static size_t connect_pack(void *arg) {
+  return types__connect_message__pack((Types__ConnectMessage *)arg, buffer);
+}
+
+int main(int argc, char **argv) {
+  static struct Uplink uplink;
+  static struct Trace trace;
+  static struct Packed packed;
+  static struct Status status;
+  Types__ConnectMessage conn = TYPES__CONNECT_MESSAGE__INIT;
+  struct utsname system;
+  const char *commit = getenv("BENCH_COMMIT");
+  int antennas, gps;
+  char name[64];
+
+  out = stdout;
+  if (argc > 1) {
+    out = fopen(argv[1], "w");
+    if (!out) {
+      perror(argv[1]);
+      return 1;
+    }
+  }
+  uname(&system);
+  fprintf(out,
+          "{\n  \"commit\": \"%s\",\n  \"machine\": \"%s\",\n  \"system\": "
+          "\"%s\",\n  \"compiler\": \"%s\",\n  \"benchmarks\": [",
+          commit ? commit : "", system.machine, system.sysname, __VERSION__);
+
+  init_trace(&trace);
+  for (antennas = 1; antennas <= MAX_ANTENNAS; antennas *= 2) {
+    for (gps = 0; gps <= 1; gps++) {
+      init_uplink(&uplink, antennas, gps);
+      snprintf(name, sizeof(name), "uplink/size/%dant%s", antennas,
+               gps ? "/gps" : "");
+      bench(name, &uplink_size, &uplink.up);
+      snprintf(name, sizeof(name), "uplink/pack/%dant%s", antennas,
+               gps ? "/gps" : "");
+      bench(name, &uplink_pack, &uplink.up);
+    }
+  }
+  init_uplink(&uplink, MAX_ANTENNAS, 1);
+  uplink.up.trace = &trace.trace;
+  bench("uplink/size/8ant/gps/trace", &uplink_size, &uplink.up);
+  bench("uplink/pack/8ant/gps/trace", &uplink_pack, &uplink.up);
+
+  ttngwc_arena_allocator_init(&arena, 1024, 16384);
+  pack_downlink(&packed, NULL);
+  bench("downlink/unpack", &downlink_unpack, &packed);
+  bench("downlink/unpack/arena", &downlink_unpack_arena, &packed);
+  bench("downlink/view", &downlink_view, &packed);
+  pack_downlink(&packed, &trace.trace);
+  bench("downlink/unpack/trace", &downlink_unpack, &packed);
+  bench("downlink/unpack/trace/arena", &downlink_unpack_arena, &packed);
+  bench("downlink/view/trace", &downlink_view, &packed);
+  ttngwc_arena_allocator_free(&arena);
+
+  init_status(&status, 0);
+  bench("status/pack", &status_pack, &status.status);
+  init_status(&status, 1);
+  bench("status/pack/full", &status_pack, &status.status);
+
+  conn.id = "eui-0000024b08060112";
+  conn.key = "ttn-account-v2.Xgf7p7C6tJkmJbMsTmTzLl5QlXbL9cHRm_jPL4ZsU8k";
+  bench("connect/pack", &connect_pack, &conn);
+
+  fprintf(out, "\n  ]\n}\n");
+  if (out != stdout)
+    fclose(out);
+  return 0;
+}
@@ -0,0 +1,167 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "network.h"
+
+// Returns the extended counter value estimated at the monotonic time
+static int64_t ttngwc_clock_estimate(struct Clock *clock, int64_t monotonic) {
+  return clock->counter0 +
+         (int64_t)((double)(monotonic - clock->monotonic0) / clock->rate);
+}
+
+// Extends the counter value to the one closest to the current value
+static int64_t ttngwc_clock_extend(struct Clock *clock, uint32_t counter,
+                                   int64_t monotonic) {
+  int64_t current = ttngwc_clock_estimate(clock, monotonic);
+  return current + (int32_t)(counter - (uint32_t)current);
+}
+
+// Fits the rate through the mean of the samples. The sums are taken relative
+// to the mean, so that the large values do not lose precision
+static void ttngwc_clock_fit(struct Clock *clock) {
+  double x = 0, y = 0, xx = 0, xy = 0;
+  int64_t counter = clock->samples[0].counter;
+  int64_t monotonic = clock->samples[0].monotonic;
+  int i;
+
+  for (i = 0; i < clock->count; i++) {
+    x += (double)(clock->samples[i].counter - counter);
+    y += (double)(clock->samples[i].monotonic - monotonic);
+  }
+  x /= clock->count;
+  y /= clock->count;
+  for (i = 0; i < clock->count; i++) {
+    double dx = (double)(clock->samples[i].counter - counter) - x;
+    double dy = (double)(clock->samples[i].monotonic - monotonic) - y;
+    xx += dx * dx;
+    xy += dx * dy;
+  }
+
+  clock->counter0 = counter + (int64_t)x;
+  clock->monotonic0 = monotonic + (int64_t)y;
+  clock->rate = xx > 0 ? xy / xx : 1;
+  // A concentrator crystal is off by parts per million. Anything else comes
+  // from readings taken too close together
+  if (clock->rate < 0.999 || clock->rate > 1.001)
+    clock->rate = 1;
+}
+
+void ttngwc_clock_init(struct Session *session) {
+  struct Clock *clock = &session->clock;
+  MutexInit(&clock->mutex);
+  clock->rate = 1;
+}
+
+void ttngwc_clock_update(struct Session *session, uint32_t counter) {
+  struct Clock *clock = &session->clock;
+  int64_t monotonic = (int64_t)ClockMicros();
+  int64_t extended = counter;
+
+  MutexLock(&clock->mutex);
+  if (clock->count > 0) {
+    extended = ttngwc_clock_extend(clock, counter, monotonic);
+    if (llabs(extended - ttngwc_clock_estimate(clock, monotonic)) >
+        CLOCK_JUMP) {
+      extended = counter;
+      __atomic_store_n(&clock->count, 0, __ATOMIC_RELEASE);
+      clock->next = 0;
+      clock->gps = 0;
+    }
+  }
+  clock->samples[clock->next].counter = extended;
+  clock->samples[clock->next].monotonic = monotonic;
+  clock->next = (clock->next + 1) % CLOCK_SAMPLES;
+  if (clock->count < CLOCK_SAMPLES)
+    __atomic_store_n(&clock->count, clock->count + 1, __ATOMIC_RELEASE);
+  ttngwc_clock_fit(clock);
+  MutexUnlock(&clock->mutex);
+}
+
+void ttngwc_clock_update_gps(struct Session *session, uint32_t counter,
+                             int64_t time) {
+  struct Clock *clock = &session->clock;
+
+  MutexLock(&clock->mutex);
+  if (clock->count > 0) {
+    clock->gps_counter =
+        ttngwc_clock_extend(clock, counter, (int64_t)ClockMicros());
+    clock->gps_time = time;
+    clock->gps = 1;
+  }
+  MutexUnlock(&clock->mutex);
+}
+
+int ttngwc_clock_synced(struct Session *session) {
+  return __atomic_load_n(&session->clock.count, __ATOMIC_ACQUIRE) > 0;
+}
+
+uint32_t ttngwc_clock_counter(struct Session *session) {
+  struct Clock *clock = &session->clock;
+  uint32_t counter = 0;
+
+  if (!ttngwc_clock_synced(session))
+    return 0;
+  MutexLock(&clock->mutex);
+  if (clock->count > 0)
+    counter =
+        (uint32_t)ttngwc_clock_estimate(clock, (int64_t)ClockMicros());
+  MutexUnlock(&clock->mutex);
+
+  return counter;
+}
+
+int ttngwc_clock_to_monotonic(struct Session *session, uint32_t counter,
+                              uint64_t *monotonic) {
+  struct Clock *clock = &session->clock;
+  int rc = FAILURE;
+
+  if (!ttngwc_clock_synced(session))
+    return FAILURE;
+  MutexLock(&clock->mutex);
+  if (clock->count > 0) {
+    int64_t extended =
+        ttngwc_clock_extend(clock, counter, (int64_t)ClockMicros());
+    *monotonic = (uint64_t)(clock->monotonic0 +
+                            (int64_t)(clock->rate *
+                                      (double)(extended - clock->counter0)));
+    rc = SUCCESS;
+  }
+  MutexUnlock(&clock->mutex);
+
+  return rc;
+}
+
+int ttngwc_clock_to_time(struct Session *session, uint32_t counter,
+                         int64_t *time) {
+  struct Clock *clock = &session->clock;
+  int64_t now, extended;
+  int rc = FAILURE;
+
+  // Uplinks of a gateway that does not feed the clock do not wait for it
+  if (!ttngwc_clock_synced(session))
+    return FAILURE;
+  now = (int64_t)ClockMicros();
+  MutexLock(&clock->mutex);
+  if (clock->count > 0) {
+    extended = ttngwc_clock_extend(clock, counter, now);
+    if (clock->gps) {
+      *time = clock->gps_time +
+              (int64_t)(clock->rate *
+                        (double)(extended - clock->gps_counter) * 1000);
+      rc = SUCCESS;
+    } else {
+      int64_t unix_now = ClockUnixNanos();
+      int64_t monotonic =
+          clock->monotonic0 +
+          (int64_t)(clock->rate * (double)(extended - clock->counter0));
+      if (unix_now != 0) {
+        *time = unix_now + (monotonic - now) * 1000;
+        rc = SUCCESS;
+      }
+    }
+  }
+  MutexUnlock(&clock->mutex);
+
+  return rc;
+}
@@ -0,0 +1,78 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+#if !defined(__TTN_GW_CLOCK_H_)
+#define __TTN_GW_CLOCK_H_
+
+#include <stdint.h>
+
+#include <MQTTClient.h>
+
+#include "connector.h"
+
+// Number of recent readings that the drift is estimated from
+#define CLOCK_SAMPLES 16
+
+// Difference in microseconds between a reading and the estimate beyond which
+// the concentrator is considered restarted, and tracking starts over
+#define CLOCK_JUMP 100000
+
+struct Session;
+
+// A reading of the extended counter and the monotonic clock at the same time
+struct ClockSample {
+  int64_t counter;
+  int64_t monotonic;
+};
+
+// Tracks the 32-bit microsecond counter of the concentrator. Counter values
+// are extended to 64 bits relative to the current value, which is estimated
+// from the monotonic clock, so they are placed right when the counter rolled
+// over since. The rate of the counter against the monotonic clock is fitted
+// by least squares over the recent readings
+struct Clock {
+  Mutex mutex;
+  struct ClockSample samples[CLOCK_SAMPLES];
+  // Number of samples, also read without the mutex to tell whether synced
+  int count;
+  int next;
+  // monotonic = monotonic0 + rate * (counter - counter0)
+  int64_t counter0;
+  int64_t monotonic0;
+  double rate;
+  // Unix time in nanoseconds of a PPS pulse and the extended counter value
+  // at which it was latched
+  int gps;
+  int64_t gps_counter;
+  int64_t gps_time;
+};
+
+// Initializes the clock of the session
+void ttngwc_clock_init(struct Session *session);
+
+// Adds a reading of the counter, taken just now
+void ttngwc_clock_update(struct Session *session, uint32_t counter);
+
+// Sets the counter value at which the PPS pulse of the given Unix time in
+// nanoseconds was latched
+void ttngwc_clock_update_gps(struct Session *session, uint32_t counter,
+                             int64_t time);
+
+// Returns whether the counter has been read
+int ttngwc_clock_synced(struct Session *session);
+
+// Returns the estimated current value of the counter, or 0 when not synced
+uint32_t ttngwc_clock_counter(struct Session *session);
+
+// Converts a counter value to monotonic time in microseconds
+// Returns 0 on success or -1 when not synced
+int ttngwc_clock_to_monotonic(struct Session *session, uint32_t counter,
+                              uint64_t *monotonic);
+
+// Converts a counter value to Unix time in nanoseconds, using the PPS pulse
+// when known and the system time otherwise
+// Returns 0 on success or -1 when not synced
+int ttngwc_clock_to_time(struct Session *session, uint32_t counter,
+                         int64_t *time);
+
+#endif
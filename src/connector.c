@@ -4,67 +4,253 @@
 
 #include "network.h"
 
-void ttngwc_init(TTN **s, const char *id, TTNDownlinkHandler downlink_handler,
-                 void *cb_arg) {
+// Collects the completions of messages sent together
+struct Batch {
+  Mutex mutex;
+  Event event;
+  int pending;
+  int *results;
+};
+
+struct BatchItem {
+  struct Batch *batch;
+  int index;
+};
+
+// Fixed header, variable header, string lengths and will topic of a CONNECT
+#define CONNECT_OVERHEAD 35
+
+// Fixed header, topic length, packet identifier and QoS of PUBLISH and
+// SUBSCRIBE packets
+#define PACKET_OVERHEAD 10
+
+void ttngwc_config_init(TTNConfig *config) {
+  config->read_buffer_size = READ_BUFFER_SIZE;
+  config->send_buffer_size = SEND_BUFFER_SIZE;
+  config->max_buffer_size = MAX_BUFFER_SIZE;
+  config->command_timeout_ms = COMMAND_TIMEOUT;
+  config->keep_alive_interval = KEEP_ALIVE_INTERVAL;
+  config->qos_up = QOS_UP;
+  config->qos_status = QOS_STATUS;
+  config->qos_down = QOS_DOWN;
+  config->qos_connect = QOS_CONNECT;
+  config->qos_will = QOS_WILL;
+  config->journal_path = NULL;
+  config->journal_size = JOURNAL_SIZE;
+  config->journal_rate = JOURNAL_RATE;
+  config->journal_sync_records = JOURNAL_SYNC_RECORDS;
+  config->journal_sync_interval_ms = JOURNAL_SYNC_INTERVAL;
+  config->backlog_size = BACKLOG_SIZE;
+  config->backlog_policy = BACKLOG_POLICY;
+  config->backlog_max_age_ms = BACKLOG_MAX_AGE;
+  config->reconnect_min_ms = RECONNECT_MIN;
+  config->reconnect_max_ms = RECONNECT_MAX;
+  config->threaded = 0;
+  config->sender_queue_size = SENDER_QUEUE_SIZE;
+  config->scheduler_size = SCHEDULER_SIZE;
+  config->scheduler_lead_ms = SCHEDULER_LEAD;
+  config->dedup_window_ms = DEDUP_WINDOW;
+  config->filter_updates = FILTER_UPDATES;
+  config->envelope_size = ENVELOPE_SIZE;
+  config->envelope_delay_ms = ENVELOPE_DELAY;
+}
+
+int ttngwc_init(TTN **s, const char *id, TTNDownlinkHandler downlink_handler,
+                void *cb_arg) {
+  return ttngwc_init_ex(s, id, NULL, downlink_handler, cb_arg);
+}
+
+// Returns the topic of the session with the given suffix, or NULL when out of
+// memory
+static char *ttngwc_topic(const char *id, const char *suffix) {
+  char *topic;
+  if (asprintf(&topic, "%s%s", id, suffix) < 0)
+    return NULL;
+  return topic;
+}
+
+int ttngwc_init_ex(TTN **s, const char *id, const TTNConfig *config,
+                   TTNDownlinkHandler downlink_handler, void *cb_arg) {
   struct Session *session = (struct Session *)malloc(sizeof(struct Session));
+  int rc;
+
+  *s = NULL;
+  if (!session)
+    return FAILURE;
   memset(session, 0, sizeof(struct Session));
-   
+
+  if (config)
+    session->config = *config;
+  else
+    ttngwc_config_init(&session->config);
+  config = &session->config;
+  if (config->read_buffer_size <= 0)
+    session->config.read_buffer_size = READ_BUFFER_SIZE;
+  if (config->send_buffer_size <= 0)
+    session->config.send_buffer_size = SEND_BUFFER_SIZE;
+  if (config->max_buffer_size < config->read_buffer_size)
+    session->config.max_buffer_size = config->read_buffer_size;
+  if (config->max_buffer_size < config->send_buffer_size)
+    session->config.max_buffer_size = config->send_buffer_size;
+  // The outbox does not handle the QoS 2 flow
+  if (config->qos_up > QOS1)
+    session->config.qos_up = QOS1;
+  if (config->qos_status > QOS1)
+    session->config.qos_status = QOS1;
+  if (config->reconnect_min_ms <= 0)
+    session->config.reconnect_min_ms = RECONNECT_MIN;
+  if (config->reconnect_max_ms < config->reconnect_min_ms)
+    session->config.reconnect_max_ms = config->reconnect_min_ms;
+
   session->id = strdup(id);
   session->key = NULL;
   session->downlink_handler = downlink_handler;
   session->cb_arg = cb_arg;
-  session->read_buffer = malloc(READ_BUFFER_SIZE);
-  session->send_buffer = malloc(SEND_BUFFER_SIZE);
-
-  NetworkInit(&session->network);
-  MQTTClientInit(&session->client, &session->network, COMMAND_TIMEOUT,
-                 session->send_buffer, SEND_BUFFER_SIZE, session->read_buffer,
-                 READ_BUFFER_SIZE);
-
+  session->read_buffer.limit = config->max_buffer_size;
+  session->send_buffer.limit = config->max_buffer_size;
+  session->scratch.limit = config->max_buffer_size;
+  ttngwc_arena_allocator_init(&session->downlink_allocator, DOWNLINK_ARENA_SIZE,
+                              config->max_buffer_size);
+  if (session->id) {
+    session->uplink_topic = ttngwc_topic(id, "/up");
+    session->batch_topic = ttngwc_topic(id, "/up/batch");
+    session->status_topic = ttngwc_topic(id, "/status");
+    session->downlink_topic = ttngwc_topic(id, "/down");
+    session->filter_topic = ttngwc_topic(id, "/filter");
+  }
+  if (!ttngwc_arena_reserve(&session->read_buffer, config->read_buffer_size) ||
+      !ttngwc_arena_reserve(&session->send_buffer, config->send_buffer_size) ||
+      !session->uplink_topic || !session->batch_topic ||
+      !session->status_topic || !session->downlink_topic ||
+      !session->filter_topic)
+    rc = FAILURE;
+  else
+    rc = SUCCESS;
+
+  ttngwc_network_init(session);
+  ttngwc_outbox_init(session);
+  if (rc == SUCCESS)
+    rc = ttngwc_journal_open(session);
+  ttngwc_backlog_init(session);
+  ttngwc_supervisor_init(session);
+  ttngwc_sender_init(session);
+  ttngwc_scheduler_init(session);
+  ttngwc_clock_init(session);
+  ttngwc_dedup_init(session);
+  ttngwc_filter_init(session);
+  ttngwc_envelope_init(session);
+
+  MQTTClientInit(&session->client, &session->network,
+                 config->command_timeout_ms, session->send_buffer.data,
+                 session->send_buffer.size, session->read_buffer.data,
+                 session->read_buffer.size);
+
+  // The session is set up completely, so that it can be cleaned up as usual
+  if (rc != SUCCESS) {
+    ttngwc_cleanup(session);
+    return rc;
+  }
   *s = (TTN *)session;
+  return SUCCESS;
 }
 
 void ttngwc_cleanup(TTN *s) {
   struct Session *session = (struct Session *)s;
 
+  ttngwc_reactor_detach(session);
+  ttngwc_supervisor_destroy(session);
+  ttngwc_envelope_stop(session);
+  ttngwc_sender_destroy(session);
+  ttngwc_scheduler_destroy(session);
   MQTTClientDestroy(&session->client);
+  ttngwc_backlog_destroy(session);
+  ttngwc_outbox_destroy(session);
+  ttngwc_envelope_destroy(session);
+  ttngwc_journal_close(session);
+  ttngwc_loopback_detach(session);
+  ttngwc_filter_destroy(session);
+  ttngwc_arena_free(&session->scratch);
+  ttngwc_arena_allocator_free(&session->downlink_allocator);
 
   if (session->key != NULL) 
       free(session->key);
   free(session->id);
-  free(session->read_buffer);
-  free(session->send_buffer);
+  free(session->uplink_topic);
+  free(session->batch_topic);
+  free(session->status_topic);
+  free(session->downlink_topic);
+  free(session->filter_topic);
+  ttngwc_arena_free(&session->read_buffer);
+  ttngwc_arena_free(&session->inbound);
+  ttngwc_arena_free(&session->send_buffer);
   free(session);
 }
 
 void ttngwc_downlink_cb(struct MessageData *data, void *s) {
   struct Session *session = (struct Session *)s;
-
-  Router__DownlinkMessage *downlink = router__downlink_message__unpack(
-      NULL, data->message->payloadlen, data->message->payload);
-  if (!downlink)
+  const uint8_t *payload = (const uint8_t *)data->message->payload;
+  size_t len = data->message->payloadlen;
+  Gateway__TxConfiguration tx = GATEWAY__TX_CONFIGURATION__INIT;
+  struct DownlinkView view;
+
+  ttngwc_counters_add(&session->counters, COUNTER_DOWNLINKS_RECEIVED, 1);
+  // The scheduler only reads the fields that place the downlink in time
+  if (session->scheduler.running &&
+      ttngwc_view_init(&view, &session->downlink_allocator, payload, len) ==
+          SUCCESS &&
+      ttngwc_view_tx(&view, &tx) == SUCCESS &&
+      ttngwc_scheduler_wanted(session, &tx)) {
+    ttngwc_scheduler_push(session, &view, &tx);
+    ttngwc_arena_allocator_reset(&session->downlink_allocator);
+    return;
+  }
+  // The view handler has the downlink decoded only when it asks
+  if (session->downlink_view_handler) {
+    ttngwc_view_deliver(session, &session->downlink_allocator, payload, len,
+                        NULL);
+    ttngwc_arena_allocator_reset(&session->downlink_allocator);
     return;
+  }
 
-  if (session->downlink_handler)
+  // The downlink is decoded in the memory of the session, which is released
+  // at once after the handler returns
+  Router__DownlinkMessage *downlink = router__downlink_message__unpack(
+      &session->downlink_allocator.base, len, payload);
+  if (!downlink) {
+    ttngwc_counters_add(&session->counters, COUNTER_DOWNLINKS_DECODE_FAILED,
+                        1);
+  } else if (session->downlink_handler) {
+    ttngwc_counters_add(&session->counters, COUNTER_DOWNLINKS_DELIVERED, 1);
     session->downlink_handler(downlink, session->cb_arg);
+  }
 
-  router__downlink_message__free_unpacked(downlink, NULL);
+  ttngwc_arena_allocator_reset(&session->downlink_allocator);
 }
 
 int ttngwc_connect(TTN *s, const char *host_name, int port, const char *key) {
   struct Session *session = (struct Session *)s;
+  if (session->key != NULL) {
+    free(session->key);
+    session->key = NULL;
+  }
   if (key)
     session->key = strdup(key);
 
   int err;
   MQTTPacket_connectData connect = MQTTPacket_connectData_initializer;
 
-  err = NetworkConnect(&session->network, (char *)host_name, port);
+  // Messages in flight on a previous connection are published again
+  session->connected = 0;
+  ttngwc_outbox_reset(session);
+  // MQTTClient takes a few packet identifiers per connection, counting up from
+  // 1 again so that they stay below the ones of the outbox
+  session->client.next_packetid = 1;
+  err = session->network_connect(&session->network, (char *)host_name, port);
   if (err != SUCCESS)
     goto exit;
 
   connect.clientID.cstring = session->id;
-  connect.keepAliveInterval = KEEP_ALIVE_INTERVAL;
+  connect.keepAliveInterval = session->config.keep_alive_interval;
   // Only set credentials when we have a key
   if (key) {
     connect.username.cstring = session->id;
@@ -79,18 +265,23 @@ int ttngwc_connect(TTN *s, const char *host_name, int port, const char *key) {
   connect.will.topicName.cstring = "disconnect";
   connect.will.message.lenstring.len =
       types__disconnect_message__get_packed_size(&will);
-  connect.will.message.lenstring.data =
-      malloc(connect.will.message.lenstring.len);
-  connect.will.qos = QOS_WILL;
+  connect.will.message.lenstring.data = (char *)ttngwc_arena_reserve(
+      &session->scratch, connect.will.message.lenstring.len);
+  connect.will.qos = session->config.qos_will;
   connect.will.retained = 0;
+  if (!connect.will.message.lenstring.data) {
+    err = FAILURE;
+    goto exit;
+  }
   types__disconnect_message__pack(
       &will, (uint8_t *)connect.will.message.lenstring.data);
 #endif
 
+  ttngwc_network_reserve(session,
+                         CONNECT_OVERHEAD + 2 * strlen(session->id) +
+                             (key ? strlen(key) : 0) +
+                             connect.will.message.lenstring.len);
   err = MQTTConnect(&session->client, &connect);
-#if SEND_DISCONNECT_WILL
-  free(connect.will.message.lenstring.data);
-#endif
   if (err != SUCCESS)
     goto exit;
 
@@ -99,26 +290,39 @@ int ttngwc_connect(TTN *s, const char *host_name, int port, const char *key) {
   conn.id = session->id;
   conn.key = (char *)key;
   MQTTMessage message;
-  message.qos = QOS_CONNECT;
+  message.qos = session->config.qos_connect;
   message.retained = 0;
   message.dup = 0;
   message.payloadlen = types__connect_message__get_packed_size(&conn);
-  message.payload = malloc(message.payloadlen);
-  types__connect_message__pack(&conn, (uint8_t *)message.payload);
-  MQTTPublish(&session->client, "connect", &message);
-  free(message.payload);
+  message.payload = ttngwc_arena_reserve(&session->scratch, message.payloadlen);
+  if (message.payload) {
+    types__connect_message__pack(&conn, (uint8_t *)message.payload);
+    ttngwc_network_reserve(session, PACKET_OVERHEAD + strlen("connect") +
+                                        message.payloadlen);
+    MQTTPublish(&session->client, "connect", &message);
+  }
 #endif
 
-  asprintf(&session->downlink_topic, "%s/down", session->id);
-  err = MQTTSubscribe(&session->client, session->downlink_topic, QOS_DOWN,
-                      &ttngwc_downlink_cb, session);
+  ttngwc_network_reserve(session,
+                         PACKET_OVERHEAD + strlen(session->downlink_topic));
+  err = MQTTSubscribe(&session->client, session->downlink_topic,
+                      session->config.qos_down, &ttngwc_downlink_cb, session);
+  if (err == SUCCESS && session->config.filter_updates) {
+    ttngwc_network_reserve(session,
+                           PACKET_OVERHEAD + strlen(session->filter_topic));
+    err = MQTTSubscribe(&session->client, session->filter_topic,
+                        session->config.qos_down, &ttngwc_filter_cb, session);
+  }
+  if (err == SUCCESS) {
+    // Send the messages that were queued while disconnected
+    ttngwc_network_connected(session);
+    ttngwc_sender_pump(session);
+    ttngwc_journal_replay(session);
+    ttngwc_backlog_feed(session);
+  }
 
 exit:
   if (err != SUCCESS) {
-    if(session->downlink_topic != NULL) {
-      free(session->downlink_topic);
-      session->downlink_topic = NULL;
-    }
     if(session->key != NULL) {
       free(session->key);
       session->key = NULL;
@@ -127,8 +331,55 @@ exit:
   return err;
 }
 
+int ttngwc_connect_auto(TTN *s, const char *host_name, int port,
+                        const char *key, TTNStateHandler handler, void *arg) {
+  struct Session *session = (struct Session *)s;
+  return ttngwc_supervisor_start(session, host_name, port, key, handler, arg);
+}
+
+int ttngwc_loopback(TTN *s) {
+  return ttngwc_loopback_attach((struct Session *)s);
+}
+
+int ttngwc_loopback_downlink(TTN *s, Router__DownlinkMessage *downlink) {
+  struct Session *session = (struct Session *)s;
+  size_t len = router__downlink_message__get_packed_size(downlink);
+  uint8_t *payload = ttngwc_arena_reserve(&session->scratch, len);
+  if (!payload)
+    return FAILURE;
+  router__downlink_message__pack(downlink, payload);
+  return ttngwc_loopback_inject(session, session->downlink_topic, payload, len);
+}
+
+int ttngwc_fd(TTN *s) { return ttngwc_network_fd((struct Session *)s); }
+
+int ttngwc_interest(TTN *s) {
+  return ttngwc_network_interest((struct Session *)s);
+}
+
+int ttngwc_poll(TTN *s, unsigned long now) {
+  return ttngwc_network_poll((struct Session *)s, now);
+}
+
 int ttngwc_disconnect(TTN *s) {
+  ttngwc_disconnect_flush(s, 0);
+  return 0;
+}
+
+int ttngwc_disconnect_flush(TTN *s, int timeout_ms) {
   struct Session *session = (struct Session *)s;
+  int rc = SUCCESS;
+
+  // Stop reconnecting before tearing down the connection
+  ttngwc_supervisor_stop(session);
+  if (timeout_ms > 0) {
+    ttngwc_envelope_flush(session);
+    rc = ttngwc_outbox_flush(session, timeout_ms);
+  }
+  session->connected = 0;
+  ttngwc_envelope_drop(session);
+  ttngwc_sender_drop(session);
+  ttngwc_outbox_drop(session);
 
 #if SEND_DISCONNECT_WILL
   Types__DisconnectMessage will = TYPES__DISCONNECT_MESSAGE__INIT;
@@ -136,97 +387,491 @@ int ttngwc_disconnect(TTN *s) {
   if (session->key)
     will.key = session->key;
   MQTTMessage message;
-  message.qos = QOS_WILL;
+  message.qos = session->config.qos_will;
   message.retained = 0;
   message.dup = 0;
   message.payloadlen = types__disconnect_message__get_packed_size(&will);
-  message.payload = malloc(message.payloadlen);
-  types__disconnect_message__pack(&will, (uint8_t *)message.payload);
-  MQTTPublish(&session->client, "disconnect", &message);
-  free(message.payload);
+  message.payload = ttngwc_arena_reserve(&session->scratch, message.payloadlen);
+  if (message.payload) {
+    types__disconnect_message__pack(&will, (uint8_t *)message.payload);
+    ttngwc_network_reserve(session, PACKET_OVERHEAD + strlen("disconnect") +
+                                        message.payloadlen);
+    MQTTPublish(&session->client, "disconnect", &message);
+  }
 #endif
 
   MQTTDisconnect(&session->client);
-  NetworkDisconnect(&session->network);
+  session->network_disconnect(&session->network);
 
   if(session->key != NULL) {
     free(session->key);
     session->key = NULL;
   }
 
-  if(session->downlink_topic != NULL) {
-    free(session->downlink_topic);
-    session->downlink_topic = NULL;
+  return rc;
+}
+
+// Records the result of a message. The event is set under the lock, so the
+// batch can be released once the lock has been taken after the wait
+static void ttngwc_batch_done(struct Batch *batch, int index, int rc) {
+  MutexLock(&batch->mutex);
+  batch->results[index] = rc;
+  if (--batch->pending == 0)
+    EventSet(&batch->event);
+  MutexUnlock(&batch->mutex);
+}
+
+static void ttngwc_wake(int rc, void *arg) {
+  struct BatchItem *item = (struct BatchItem *)arg;
+  ttngwc_batch_done(item->batch, item->index, rc);
+}
+
+static int ttngwc_submit(struct Session *session, enum MessageClass class,
+                         const ProtobufCMessage *message,
+                         TTNCompletionHandler handler, void *arg) {
+  int rc;
+  if (class == CLASS_UP && ttngwc_envelope_wanted(session))
+    return ttngwc_envelope_push(session, message, handler, arg);
+  if (ttngwc_sender_threaded(session))
+    return ttngwc_sender_push(session, class, message, handler, arg);
+  rc = ttngwc_outbox_push(session, class, message, handler, arg);
+  if (rc == SUCCESS)
+    ttngwc_sender_pump(session);
+  return rc;
+}
+
+// Queues the messages, writes them at once and waits for their completion.
+// At most OUTBOX_SIZE messages can be sent in one batch
+static void ttngwc_send_batch(struct Session *session, enum MessageClass class,
+                              const ProtobufCMessage **messages, int n,
+                              int *results) {
+  struct BatchItem items[OUTBOX_SIZE];
+  struct Batch batch;
+  int threaded = ttngwc_sender_threaded(session);
+  int i, rc, queued = 0;
+
+  MutexInit(&batch.mutex);
+  EventInit(&batch.event);
+  batch.pending = n;
+  batch.results = results;
+
+  for (i = 0; i < n; i++) {
+    items[i].batch = &batch;
+    items[i].index = i;
+    if (class == CLASS_UP && ttngwc_envelope_wanted(session))
+      rc = ttngwc_envelope_push(session, messages[i], &ttngwc_wake,
+                                &items[i]);
+    else if (threaded)
+      rc = ttngwc_sender_push(session, class, messages[i], &ttngwc_wake,
+                              &items[i]);
+    else
+      rc = ttngwc_outbox_push(session, class, messages[i], &ttngwc_wake,
+                              &items[i]);
+    if (rc == SUCCESS) {
+      queued++;
+      continue;
+    }
+    if (class == CLASS_UP)
+      ttngwc_counters_add(&session->counters, COUNTER_UPLINKS_FAILED, 1);
+    ttngwc_batch_done(&batch, i, rc);
   }
 
+  if (queued > 0)
+    ttngwc_sender_pump(session);
+  if (EventWait(&batch.event, session->config.command_timeout_ms) !=
+      SUCCESS) {
+    // Messages are canceled wherever they wait: in an envelope, in the queue
+    // of the I/O thread or in the outbox
+    for (i = 0; i < n; i++) {
+      if (ttngwc_envelope_cancel(session, &items[i]) +
+              ttngwc_sender_cancel(session, &items[i]) >
+          0)
+        ttngwc_batch_done(&batch, i, TTNGWC_TIMEOUT);
+    }
+    // Messages that completed while timing out still call their handler
+    EventWait(&batch.event, -1);
+  }
+  MutexLock(&batch.mutex);
+  MutexUnlock(&batch.mutex);
 
-  return 0;
+  EventDestroy(&batch.event);
+}
+
+// Queues the message and waits for its completion
+static int ttngwc_send(struct Session *session, enum MessageClass class,
+                       const ProtobufCMessage *message) {
+  int rc;
+
+  if (!session->connected) {
+    if (class == CLASS_UP)
+      ttngwc_counters_add(&session->counters, COUNTER_UPLINKS_FAILED, 1);
+    return FAILURE;
+  }
+
+  ttngwc_send_batch(session, class, &message, 1, &rc);
+  return rc;
+}
+
+// Copies the uplink with the time of reception filled in, when it is unset and
+// the concentrator clock is tracked. Returns the uplink to send
+static Router__UplinkMessage *ttngwc_uplink_fill(struct Session *session,
+                                                 Router__UplinkMessage *uplink,
+                                                 Router__UplinkMessage *copy,
+                                                 Gateway__RxMetadata *metadata) {
+  const Gateway__RxMetadata *gateway = uplink->gateway_metadata;
+  int64_t time;
+
+  if (!gateway || !gateway->has_timestamp || gateway->has_time ||
+      ttngwc_clock_to_time(session, gateway->timestamp, &time) != SUCCESS)
+    return uplink;
+  *copy = *uplink;
+  *metadata = *gateway;
+  metadata->has_time = 1;
+  metadata->time = time;
+  copy->gateway_metadata = metadata;
+  return copy;
+}
+
+// Publishes the uplinks that are stored in the journal. In threaded mode, the
+// I/O thread does so once woken up
+static void ttngwc_journal_publish(struct Session *session) {
+  if (ttngwc_sender_threaded(session))
+    ttngwc_sender_pump(session);
+  else
+    ttngwc_journal_feed(session);
+}
+
+// Stores the uplink in the journal, from where it is published
+static int ttngwc_store(struct Session *session,
+                        Router__UplinkMessage *uplink) {
+  int rc = ttngwc_journal_append(session, &uplink->base);
+  if (rc != SUCCESS)
+    ttngwc_counters_add(&session->counters, COUNTER_UPLINKS_FAILED, 1);
+  ttngwc_journal_publish(session);
+  return rc;
 }
 
 int ttngwc_send_uplink(TTN *s, Router__UplinkMessage *uplink) {
   struct Session *session = (struct Session *)s;
+  Router__UplinkMessage copy;
+  Gateway__RxMetadata metadata;
+  int rc;
+
+  ttngwc_counters_add(&session->counters, COUNTER_UPLINKS_SUBMITTED, 1);
+  if (!ttngwc_filter_pass(session, uplink) ||
+      ttngwc_dedup_check(session, uplink, ttngwc_dedup_batch(session), 0) !=
+          DEDUP_UNIQUE)
+    return SUCCESS;
+  uplink = ttngwc_uplink_fill(session, uplink, &copy, &metadata);
+  if (ttngwc_journal_enabled(session))
+    rc = ttngwc_store(session, uplink);
+  else if (ttngwc_backlog_wanted(session))
+    rc = ttngwc_backlog_push(session, uplink, NULL, NULL);
+  else
+    rc = ttngwc_send(session, CLASS_UP, &uplink->base);
+  // An uplink that failed is no duplicate when it is sent again
+  if (rc != SUCCESS)
+    ttngwc_dedup_forget(session, uplink);
+  return rc;
+}
 
-  int rc = FAILURE;
-  void *payload = NULL;
-  char *topic = NULL;
-
-  size_t len = router__uplink_message__get_packed_size(uplink);
-  payload = malloc(len);
-  if (!payload)
-    goto exit;
+// Copies the status message, filling in the fields that the session measures
+// and that the caller left unset
+static void ttngwc_status_fill(struct Session *session,
+                               const Gateway__Status *status,
+                               Gateway__Status *filled) {
+  uint32_t rtt;
+  int64_t time;
+
+  *filled = *status;
+  if (filled->has_timestamp && !filled->has_time &&
+      ttngwc_clock_to_time(session, filled->timestamp, &time) == SUCCESS) {
+    filled->has_time = 1;
+    filled->time = time;
+  }
+  if (!filled->has_rtt) {
+    rtt = ttngwc_outbox_rtt_median(session, CLASS_UP);
+    if (rtt == 0)
+      rtt = ttngwc_outbox_rtt_median(session, CLASS_BATCH);
+    if (rtt == 0)
+      rtt = ttngwc_outbox_rtt_median(session, CLASS_STATUS);
+    if (rtt > 0) {
+      filled->has_rtt = 1;
+      filled->rtt = rtt;
+    }
+  }
+  if (!filled->has_rx_in) {
+    filled->has_rx_in = 1;
+    filled->rx_in = (uint32_t)ttngwc_counters_get(&session->counters,
+                                                  COUNTER_UPLINKS_SUBMITTED);
+  }
+  if (!filled->has_rx_ok) {
+    filled->has_rx_ok = 1;
+    filled->rx_ok = (uint32_t)ttngwc_counters_get(&session->counters,
+                                                  COUNTER_UPLINKS_ACKED);
+  }
+  if (!filled->has_tx_in) {
+    filled->has_tx_in = 1;
+    filled->tx_in = (uint32_t)ttngwc_counters_get(&session->counters,
+                                                  COUNTER_DOWNLINKS_RECEIVED);
+  }
+  if (!filled->has_tx_ok) {
+    filled->has_tx_ok = 1;
+    filled->tx_ok = (uint32_t)ttngwc_counters_get(&session->counters,
+                                                  COUNTER_DOWNLINKS_DELIVERED);
+  }
+}
 
-  router__uplink_message__pack(uplink, payload);
+int ttngwc_send_status(TTN *s, Gateway__Status *status) {
+  struct Session *session = (struct Session *)s;
+  Gateway__Status filled;
+  ttngwc_status_fill(session, status, &filled);
+  return ttngwc_send(session, CLASS_STATUS, &filled.base);
+}
 
-  MQTTMessage message;
-  message.qos = QOS_UP;
-  message.retained = 0;
-  message.dup = 0;
-  message.payload = payload;
-  message.payloadlen = len;
+// Fills in the uplinks and merges their duplicates into the first copy.
+// origin holds, for each uplink, the index of the uplink in kept that is sent
+// for it, or DEDUP_SEEN when none is, because the uplink is filtered or an
+// earlier copy was sent already
+// Returns the number of uplinks to send
+static int ttngwc_uplinks_fill(struct Session *session,
+                               Router__UplinkMessage **uplinks, int n,
+                               Router__UplinkMessage **kept,
+                               struct DedupCopy *copies, int *origin) {
+  uint32_t batch = ttngwc_dedup_batch(session);
+  Router__UplinkMessage *uplink;
+  int i, count = 0;
+
+  for (i = 0; i < n; i++) {
+    if (!ttngwc_filter_pass(session, uplinks[i])) {
+      origin[i] = DEDUP_SEEN;
+      continue;
+    }
+    uplink = ttngwc_uplink_fill(session, uplinks[i], &copies[count].uplink,
+                                &copies[count].metadata);
+    origin[i] = ttngwc_dedup_check(session, uplink, batch, count);
+    if (origin[i] == DEDUP_UNIQUE) {
+      kept[count] = uplink;
+      origin[i] = count++;
+    } else if (origin[i] >= 0) {
+      ttngwc_dedup_merge(session, &kept[origin[i]], &copies[origin[i]],
+                         uplink);
+    }
+  }
+  return count;
+}
 
-  if (asprintf(&topic, "%s/up", session->id) == -1)
-    goto exit;
+int ttngwc_send_uplinks(TTN *s, Router__UplinkMessage **uplinks, int n,
+                        int *results) {
+  struct Session *session = (struct Session *)s;
+  const ProtobufCMessage *messages[OUTBOX_SIZE];
+  Router__UplinkMessage *kept[OUTBOX_SIZE];
+  struct DedupCopy copies[OUTBOX_SIZE];
+  int origin[OUTBOX_SIZE], sent[OUTBOX_SIZE];
+  int i, j, count, m, acked = 0;
+  int journal = ttngwc_journal_enabled(session);
+
+  ttngwc_counters_add(&session->counters, COUNTER_UPLINKS_SUBMITTED, n);
+  for (i = 0; i < n; i += count) {
+    count = n - i < OUTBOX_SIZE ? n - i : OUTBOX_SIZE;
+    m = ttngwc_uplinks_fill(session, &uplinks[i], count, kept, copies, origin);
+    if (journal) {
+      for (j = 0; j < m; j++) {
+        sent[j] = ttngwc_journal_append(session, &kept[j]->base);
+        if (sent[j] != SUCCESS)
+          ttngwc_counters_add(&session->counters, COUNTER_UPLINKS_FAILED, 1);
+      }
+    } else if (ttngwc_backlog_wanted(session)) {
+      for (j = 0; j < m; j++)
+        sent[j] = ttngwc_backlog_push(session, kept[j], NULL, NULL);
+    } else if (!session->connected) {
+      for (j = 0; j < m; j++)
+        sent[j] = FAILURE;
+      ttngwc_counters_add(&session->counters, COUNTER_UPLINKS_FAILED, m);
+    } else {
+      for (j = 0; j < m; j++)
+        messages[j] = &kept[j]->base;
+      ttngwc_send_batch(session, CLASS_UP, messages, m, sent);
+    }
+    for (j = 0; j < m; j++) {
+      if (sent[j] != SUCCESS)
+        ttngwc_dedup_forget(session, kept[j]);
+    }
+    // Duplicates share the result of the uplink that was sent for them
+    for (j = 0; j < count; j++)
+      results[i + j] = origin[j] == DEDUP_SEEN ? SUCCESS : sent[origin[j]];
+  }
+  if (journal)
+    ttngwc_journal_publish(session);
 
-  rc = MQTTPublish(&session->client, topic, &message);
+  for (i = 0; i < n; i++) {
+    if (results[i] == SUCCESS)
+      acked++;
+  }
+  return acked;
+}
 
-exit:
-  if (topic != NULL)
-    free(topic);
-  if (payload != NULL)
-    free(payload);
+int ttngwc_submit_uplink(TTN *s, Router__UplinkMessage *uplink,
+                         TTNCompletionHandler handler, void *arg) {
+  struct Session *session = (struct Session *)s;
+  Router__UplinkMessage copy;
+  Gateway__RxMetadata metadata;
+  int rc;
+
+  ttngwc_counters_add(&session->counters, COUNTER_UPLINKS_SUBMITTED, 1);
+  if (!ttngwc_filter_pass(session, uplink) ||
+      ttngwc_dedup_check(session, uplink, ttngwc_dedup_batch(session), 0) !=
+          DEDUP_UNIQUE) {
+    if (handler)
+      handler(SUCCESS, arg);
+    return SUCCESS;
+  }
+  uplink = ttngwc_uplink_fill(session, uplink, &copy, &metadata);
+  if (ttngwc_journal_enabled(session)) {
+    rc = ttngwc_store(session, uplink);
+    if (rc == SUCCESS && handler)
+      handler(SUCCESS, arg);
+  } else if (ttngwc_backlog_wanted(session)) {
+    rc = ttngwc_backlog_push(session, uplink, handler, arg);
+  } else {
+    rc = ttngwc_submit(session, CLASS_UP, &uplink->base, handler, arg);
+    // The outbox filled up in the meantime
+    if (rc == TTNGWC_DROPPED && ttngwc_backlog_wanted(session))
+      rc = ttngwc_backlog_push(session, uplink, handler, arg);
+    else if (rc != SUCCESS)
+      ttngwc_counters_add(&session->counters, COUNTER_UPLINKS_FAILED, 1);
+  }
+  // An uplink that was not accepted is no duplicate when it is sent again
+  if (rc != SUCCESS)
+    ttngwc_dedup_forget(session, uplink);
   return rc;
 }
 
-int ttngwc_send_status(TTN *s, Gateway__Status *status) {
+int ttngwc_submit_status(TTN *s, Gateway__Status *status,
+                         TTNCompletionHandler handler, void *arg) {
   struct Session *session = (struct Session *)s;
+  Gateway__Status filled;
+  ttngwc_status_fill(session, status, &filled);
+  return ttngwc_submit(session, CLASS_STATUS, &filled.base, handler, arg);
+}
 
-  int rc = FAILURE;
-  void *payload = NULL;
-  char *topic = NULL;
+int ttngwc_queue_depth(TTN *s) {
+  struct Session *session = (struct Session *)s;
+  return ttngwc_outbox_depth(session) + ttngwc_sender_depth(session);
+}
 
-  size_t len = gateway__status__get_packed_size(status);
-  payload = malloc(len);
-  if (!payload)
-    goto exit;
+void ttngwc_backlog_stats(TTN *s, TTNBacklogStats *stats) {
+  ttngwc_backlog_get_stats((struct Session *)s, stats);
+}
 
-  gateway__status__pack(status, payload);
+int ttngwc_journal_depth(TTN *s) {
+  return ttngwc_journal_records((struct Session *)s);
+}
 
-  MQTTMessage message;
-  message.qos = QOS_STATUS;
-  message.retained = 0;
-  message.dup = 0;
-  message.payload = payload;
-  message.payloadlen = len;
+void ttngwc_set_window(TTN *s, int window) {
+  ttngwc_outbox_set_window((struct Session *)s, window);
+}
 
-  if (asprintf(&topic, "%s/status", session->id) == -1)
-    goto exit;
+void ttngwc_set_qos(TTN *s, int qos_up, int qos_status) {
+  struct Session *session = (struct Session *)s;
+  ttngwc_outbox_set_qos(session, CLASS_UP, qos_up > 0 ? QOS1 : QOS0);
+  ttngwc_outbox_set_qos(session, CLASS_STATUS, qos_status > 0 ? QOS1 : QOS0);
+}
 
-  rc = MQTTPublish(&session->client, topic, &message);
+void ttngwc_loss_stats(TTN *s, TTNLossStats *stats) {
+  ttngwc_outbox_loss_stats((struct Session *)s, stats);
+}
 
-exit:
-  if (topic != NULL)
-    free(topic);
-  if (payload != NULL)
-    free(payload);
-  return rc;
+void ttngwc_uplink_rtt(TTN *s, Api__Percentiles *percentiles) {
+  ttngwc_outbox_rtt((struct Session *)s, CLASS_UP, percentiles);
+}
+
+void ttngwc_status_rtt(TTN *s, Api__Percentiles *percentiles) {
+  ttngwc_outbox_rtt((struct Session *)s, CLASS_STATUS, percentiles);
+}
+
+void ttngwc_traffic_stats(TTN *s, TTNTrafficStats *stats) {
+  ttngwc_counters_snapshot(&((struct Session *)s)->counters, stats);
+}
+
+void ttngwc_dedup_stats(TTN *s, TTNDedupStats *stats) {
+  ttngwc_dedup_get_stats((struct Session *)s, stats);
+}
+
+int ttngwc_filter_prefix(TTN *s, uint32_t prefix, int bits) {
+  return ttngwc_filter_add_prefix((struct Session *)s, prefix, bits);
+}
+
+int ttngwc_filter_netid(TTN *s, uint32_t net_id) {
+  uint32_t prefix;
+  int bits;
+
+  if (ttngwc_netid_prefix(net_id, &prefix, &bits) != SUCCESS)
+    return FAILURE;
+  return ttngwc_filter_add_prefix((struct Session *)s, prefix, bits);
+}
+
+int ttngwc_filter_bloom(TTN *s, const uint8_t *filter, size_t len) {
+  return ttngwc_filter_set_bloom((struct Session *)s, filter, len);
+}
+
+void ttngwc_filter_clear(TTN *s) {
+  ttngwc_filter_reset((struct Session *)s);
+}
+
+void ttngwc_filter_stats(TTN *s, TTNFilterStats *stats) {
+  ttngwc_filter_get_stats((struct Session *)s, stats);
+}
+
+void ttngwc_envelope_stats(TTN *s, TTNEnvelopeStats *stats) {
+  ttngwc_envelope_get_stats((struct Session *)s, stats);
+}
+
+void ttngwc_envelope_latency(TTN *s, Api__Percentiles *percentiles) {
+  ttngwc_envelope_get_latency((struct Session *)s, percentiles);
+}
+
+int ttngwc_schedule_downlinks(TTN *s, TTNCounterFunc counter, void *arg) {
+  return ttngwc_scheduler_start((struct Session *)s, counter, arg);
+}
+
+void ttngwc_scheduler_stats(TTN *s, TTNSchedulerStats *stats) {
+  ttngwc_scheduler_get_stats((struct Session *)s, stats);
+}
+
+void ttngwc_set_downlink_view_handler(TTN *s, TTNDownlinkViewHandler handler,
+                                      void *arg) {
+  struct Session *session = (struct Session *)s;
+  session->downlink_view_handler = handler;
+  session->view_arg = arg;
+}
+
+int ttngwc_downlink_payload(const TTNDownlinkView *view, const uint8_t **data,
+                            size_t *len) {
+  return ttngwc_view_payload((struct DownlinkView *)view, data, len);
+}
+
+int ttngwc_downlink_tx(const TTNDownlinkView *view,
+                       Gateway__TxConfiguration *tx) {
+  return ttngwc_view_tx((struct DownlinkView *)view, tx);
+}
+
+Router__DownlinkMessage *ttngwc_downlink_decode(const TTNDownlinkView *view) {
+  return ttngwc_view_decode((struct DownlinkView *)view);
+}
+
+void ttngwc_clock_sync(TTN *s, uint32_t counter) {
+  ttngwc_clock_update((struct Session *)s, counter);
+}
+
+void ttngwc_clock_sync_gps(TTN *s, uint32_t counter, int64_t time) {
+  ttngwc_clock_update_gps((struct Session *)s, counter, time);
+}
+
+int ttngwc_clock_time(TTN *s, uint32_t counter, int64_t *time) {
+  return ttngwc_clock_to_time((struct Session *)s, counter, time);
+}
+
+int ttngwc_clock_monotonic(TTN *s, uint32_t counter, uint64_t *monotonic) {
+  return ttngwc_clock_to_monotonic((struct Session *)s, counter, monotonic);
 }
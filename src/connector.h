@@ -12,15 +12,239 @@
 #define SEND_DISCONNECT_WILL 1
 #define SEND_CONNECT 1
 
+#include "github.com/TheThingsNetwork/ttn/api/api.pb-c.h"
 #include "github.com/TheThingsNetwork/ttn/api/gateway/gateway.pb-c.h"
 #include "github.com/TheThingsNetwork/ttn/api/router/router.pb-c.h"
 #include "github.com/TheThingsNetwork/gateway-connector-bridge/types/types.pb-c.h"
 
 typedef void TTN;
+typedef void TTNReactor;
+typedef void TTNDownlinkView;
 typedef void (*TTNDownlinkHandler)(Router__DownlinkMessage *, void *);
+typedef void (*TTNDownlinkViewHandler)(const TTNDownlinkView *, void *);
+typedef void (*TTNUplinkHandler)(Router__UplinkMessage *, void *);
+typedef void (*TTNCompletionHandler)(int, void *);
+
+// State of a session that is kept connected in the background
+typedef enum TTNState {
+  TTN_STATE_DISCONNECTED,
+  TTN_STATE_CONNECTING,
+  TTN_STATE_CONNECTED
+} TTNState;
+
+typedef void (*TTNStateHandler)(TTNState, void *);
+
+// Returns the current value of the microsecond counter of the concentrator
+typedef uint32_t (*TTNCounterFunc)(void *);
+
+// Socket events that ttngwc_poll waits for
+#define TTN_POLL_READ 1
+#define TTN_POLL_WRITE 2
+
+// Uplink to drop when the backlog is full
+typedef enum TTNDropPolicy {
+  TTN_DROP_OLDEST,
+  TTN_DROP_NEWEST,
+  // The oldest uplink with the lowest priority is dropped, if the new uplink
+  // has a higher priority. Join requests have the highest priority, followed
+  // by uplinks with a lower spreading factor
+  TTN_DROP_PRIORITY
+} TTNDropPolicy;
+
+// Counters of the backlog of uplinks
+typedef struct TTNBacklogStats {
+  // Uplinks stored while disconnected or congested
+  unsigned long stored;
+  // Stored uplinks that were queued for publishing
+  unsigned long published;
+  // Stored uplinks dropped to make room for a new uplink
+  unsigned long evicted;
+  // New uplinks dropped because the backlog was full
+  unsigned long rejected;
+  // Stored uplinks dropped because they were older than the age cutoff
+  unsigned long expired;
+  // Uplinks currently stored
+  int depth;
+} TTNBacklogStats;
+
+// Settings of a session. Use ttngwc_config_init for the defaults
+typedef struct TTNConfig {
+  // Initial sizes of the MQTT buffers in bytes, or 0 for the defaults
+  int read_buffer_size;
+  int send_buffer_size;
+  // Size in bytes up to which buffers grow to hold large messages
+  int max_buffer_size;
+  // Time to wait for the router to acknowledge a command in milliseconds
+  int command_timeout_ms;
+  // Keep alive interval in seconds, or 0 to disable pings and the detection
+  // of silent connections
+  int keep_alive_interval;
+  // QoS per message class. Uplink and status messages use QoS 0 or 1
+  int qos_up;
+  int qos_status;
+  int qos_down;
+  int qos_connect;
+  int qos_will;
+  // Path of the file in which uplinks are stored until acknowledged, or NULL
+  // to send uplinks without storing them
+  const char *journal_path;
+  // Size in bytes of a new journal file
+  int journal_size;
+  // Uplinks per second that are replayed from the journal after connecting,
+  // or 0 for no limit
+  int journal_rate;
+  // Number of writes or time in milliseconds after which the journal file is
+  // synced to storage
+  int journal_sync_records;
+  int journal_sync_interval_ms;
+  // Number of uplinks kept in memory while disconnected or congested, or 0
+  // to fail sending instead. Not used with a journal
+  int backlog_size;
+  TTNDropPolicy backlog_policy;
+  // Age in milliseconds after which stored uplinks are dropped, or 0 to keep
+  // them until sent
+  int backlog_max_age_ms;
+  // Bounds in milliseconds of the random delay between reconnection attempts
+  int reconnect_min_ms;
+  int reconnect_max_ms;
+  // Whether messages are published from a background I/O thread. Sending is
+  // then safe from any number of threads without locking
+  int threaded;
+  // Number of messages that may wait for the I/O thread in threaded mode.
+  // Sending fails with -3 when the queue is full
+  int sender_queue_size;
+  // Number of downlinks that the scheduler holds until their transmission
+  int scheduler_size;
+  // Time in milliseconds before transmission at which the scheduler passes
+  // a downlink to the handler
+  int scheduler_lead_ms;
+  // Time in milliseconds within which uplinks with the same payload and
+  // concentrator timestamp are sent once, or 0 to send all uplinks
+  int dedup_window_ms;
+  // Whether Bloom filters of the DevAddrs to publish are received from the
+  // router, see ttngwc_filter_bloom
+  int filter_updates;
+  // Number of uplinks that are published together in a compressed envelope
+  // on <id>/up/batch, or 0 to publish uplinks one by one. Envelopes are not
+  // used when max_buffer_size leaves no room for their headers
+  int envelope_size;
+  // Time in milliseconds after which an envelope is published when it is
+  // not full
+  int envelope_delay_ms;
+} TTNConfig;
+
+// Delivery estimate of messages published at QoS 0. The router does not
+// acknowledge these, but an acknowledgement or ping response confirms the
+// messages written before it
+typedef struct TTNLossStats {
+  // Messages written to the network
+  unsigned long sent;
+  // Messages confirmed by a later response of the router
+  unsigned long confirmed;
+  // Messages written since the last confirmation
+  unsigned long unconfirmed;
+  // Messages that were not confirmed when the connection was reset
+  unsigned long lost;
+  // Messages of which writing failed. These are written again
+  unsigned long send_failures;
+} TTNLossStats;
+
+// Traffic of a session since it was initialized
+typedef struct TTNTrafficStats {
+  // Uplinks passed to the session
+  uint64_t uplinks_submitted;
+  // Uplinks acknowledged by the router, or written to the network at QoS 0
+  uint64_t uplinks_acked;
+  // Uplinks that failed, timed out or were dropped. Uplinks replayed from the
+  // journal are counted each time publishing fails
+  uint64_t uplinks_failed;
+  // Downlinks received from the router
+  uint64_t downlinks_received;
+  // Downlinks passed to the downlink handler
+  uint64_t downlinks_delivered;
+  // Downlinks that could not be decoded
+  uint64_t downlinks_decode_failed;
+  // Bytes read from and written to the network
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+} TTNTrafficStats;
+
+// Counters of the downlink scheduler
+typedef struct TTNSchedulerStats {
+  // Downlinks held until their transmission
+  unsigned long scheduled;
+  // Held downlinks passed to the handler
+  unsigned long released;
+  // Downlinks dropped because they arrived less than the lead time before
+  // their transmission
+  unsigned long late;
+  // Downlinks dropped because their transmission overlaps with another
+  // downlink on the same RF chain
+  unsigned long collisions;
+  // Downlinks dropped because the scheduler was full
+  unsigned long rejected;
+  // Downlinks currently held
+  int depth;
+} TTNSchedulerStats;
+
+// Counters of the uplink deduplication filter
+typedef struct TTNDedupStats {
+  // Uplinks checked against the uplinks received within the window
+  unsigned long checked;
+  // Duplicates that were not published
+  unsigned long suppressed;
+  // Duplicates of which the antennas were merged into an uplink of the same
+  // batch
+  unsigned long merged;
+  // Antennas merged, and antennas dropped because the uplink was full
+  unsigned long antennas_merged;
+  unsigned long antennas_dropped;
+  // Uplinks forgotten before the end of the window to make room
+  unsigned long evicted;
+} TTNDedupStats;
+
+// Counters of the uplink filter
+typedef struct TTNFilterStats {
+  // Uplinks checked while the filter has prefixes or a Bloom filter
+  unsigned long checked;
+  // Uplinks that are not LoRaWAN data frames, such as join requests, and
+  // passed without a DevAddr
+  unsigned long passed_other;
+  // Data frames of other networks that were not published
+  unsigned long filtered;
+  // Size of the uplinks that were not published
+  uint64_t bytes_saved;
+  // Bloom filters received, and those that were malformed
+  unsigned long updates;
+  unsigned long update_failures;
+} TTNFilterStats;
+
+// Counters of the uplink envelopes
+typedef struct TTNEnvelopeStats {
+  // Envelopes published and the uplinks in them
+  unsigned long envelopes;
+  unsigned long uplinks;
+  // Size of the packed uplinks and of the compressed envelopes. Their ratio
+  // is the compression ratio
+  uint64_t raw_bytes;
+  uint64_t compressed_bytes;
+  // Envelopes of which the uplinks failed before publishing
+  unsigned long failures;
+} TTNEnvelopeStats;
+
+// Fills the configuration with the default settings
+void ttngwc_config_init(TTNConfig *config);
 
 // Initializes a new session
-void ttngwc_init(TTN **session, const char *id, TTNDownlinkHandler, void *);
+// Returns 0 on success, -1 on failure. The session is set to NULL on failure
+int ttngwc_init(TTN **session, const char *id, TTNDownlinkHandler, void *);
+
+// Initializes a new session with the given settings, or the defaults if config
+// is NULL
+// Returns 0 on success, -1 on failure, for example when out of memory or when
+// the journal file cannot be opened. The session is set to NULL on failure
+int ttngwc_init_ex(TTN **session, const char *id, const TTNConfig *config,
+                   TTNDownlinkHandler, void *);
 
 // Cleans up a message
 void ttngwc_cleanup(TTN *session);
@@ -30,16 +254,265 @@ void ttngwc_cleanup(TTN *session);
 int ttngwc_connect(TTN *session, const char *host_name, int port,
                    const char *key);
 
-// Disconnects from The Things Network Router
+// Connects to The Things Network router in the background and reconnects when
+// the connection is lost, waiting a random delay that grows with each failed
+// attempt. On reconnection, the downlink topic is subscribed again and queued
+// messages are published. The handler is called from the background thread on
+// each change of state and must not disconnect or clean up the session. A
+// session in a reactor is connected by the connect worker of its loop instead
+// Returns 0 when started, -1 on failure
+int ttngwc_connect_auto(TTN *session, const char *host_name, int port,
+                        const char *key, TTNStateHandler handler, void *arg);
+
+// Connects the session to an in-process MQTT responder instead of the
+// network, for benchmarks without sockets. The responder acknowledges
+// connections, subscriptions, publications and pings right away. Call before
+// ttngwc_connect, which then ignores the host and port
+// Returns 0 on success, -1 on failure
+int ttngwc_loopback(TTN *session);
+
+// Has the responder of a loopback session publish a downlink to the session
+// Returns 0 on success, -1 when not connected through a loopback
+int ttngwc_loopback_downlink(TTN *session, Router__DownlinkMessage *downlink);
+
+// Returns the socket of the connection for use in an event loop, or -1 when
+// not connected
+int ttngwc_fd(TTN *session);
+
+// Returns the socket events that the session waits for: TTN_POLL_READ while
+// connected and TTN_POLL_WRITE when queued messages can be sent
+int ttngwc_interest(TTN *session);
+
+// Makes progress without blocking on the socket: reads available packets,
+// sends keep alive pings and queued messages and times out messages in
+// flight. now is a monotonic time in milliseconds. Use this instead of a
+// thread that reads from the client
+// Returns the time in milliseconds until the next call is due, or -1 when not
+// connected or the connection is lost
+int ttngwc_poll(TTN *session, unsigned long now);
+
+// Holds downlinks that have a concentrator timestamp and passes them to the
+// downlink handler from a background thread, the lead time before their
+// transmission, in order of transmission. Downlinks that arrive too late or
+// that overlap on air with another downlink on the same RF chain are dropped.
+// Downlinks without a timestamp are passed to the handler right away. The
+// counter function is called from the scheduler and network threads. Without
+// a counter function, the counter is estimated with the clock of the session,
+// see ttngwc_clock_sync
+// Returns 0 when started, -1 on failure
+int ttngwc_schedule_downlinks(TTN *session, TTNCounterFunc counter, void *arg);
+
+// Gets the counters of the downlink scheduler
+void ttngwc_scheduler_stats(TTN *session, TTNSchedulerStats *stats);
+
+// Passes downlinks to the view handler instead of the downlink handler. The
+// handler gets a view over the message as received, and only the parts that
+// it asks for are decoded. The view and everything gotten from it are valid
+// until the handler returns. Set this before connecting
+void ttngwc_set_downlink_view_handler(TTN *session,
+                                      TTNDownlinkViewHandler handler,
+                                      void *arg);
+
+// Gets the payload of the downlink, pointing into the received message
+// Returns 0 on success or -1 when the downlink has no payload
+int ttngwc_downlink_payload(const TTNDownlinkView *view, const uint8_t **data,
+                            size_t *len);
+
+// Decodes the gateway configuration of the downlink into tx, which must be
+// initialized with gateway__tx_configuration__init. Nothing is allocated
+// Returns 0 on success or -1 when the downlink has no gateway configuration
+// or it is malformed
+int ttngwc_downlink_tx(const TTNDownlinkView *view,
+                       Gateway__TxConfiguration *tx);
+
+// Decodes the whole downlink, including the LoRaWAN metadata and trace
+// Returns the downlink or NULL when malformed
+Router__DownlinkMessage *ttngwc_downlink_decode(const TTNDownlinkView *view);
+
+// Reports a reading of the microsecond counter of the concentrator, taken
+// just now. Call this regularly, for example every second. The session then
+// tracks the counter over its rollovers and its drift against the monotonic
+// clock, and fills in the time of uplinks and status messages that have a
+// timestamp but no time
+void ttngwc_clock_sync(TTN *session, uint32_t counter);
+
+// Reports the counter value at which the PPS pulse of the GPS receiver was
+// latched, and the Unix time in nanoseconds of the pulse. Times are then
+// derived from the GPS rather than the system clock
+void ttngwc_clock_sync_gps(TTN *session, uint32_t counter, int64_t time);
+
+// Converts a counter value to Unix time in nanoseconds
+// Returns 0 on success or -1 when the counter has not been read
+int ttngwc_clock_time(TTN *session, uint32_t counter, int64_t *time);
+
+// Converts a counter value to CLOCK_MONOTONIC time in microseconds
+// Returns 0 on success or -1 when the counter has not been read
+int ttngwc_clock_monotonic(TTN *session, uint32_t counter,
+                           uint64_t *monotonic);
+
+// Creates a reactor that runs the given number of event loops, each on its
+// own thread pinned to a core, or one loop per core if loops is 0. Each loop
+// has a connect worker thread that makes the connection attempts
+// Returns 0 on success, -1 on failure or when not supported on the platform
+int ttngwc_reactor_create(TTNReactor **reactor, int loops);
+
+// Stops the event loops and releases the reactor. Sessions are removed
+void ttngwc_reactor_destroy(TTNReactor *reactor);
+
+// Adds a session to the loop picked by the hash of its identifier. The loop
+// calls ttngwc_poll when the socket is ready or the session is due, and
+// follows the socket when the session reconnects. A session that connects
+// automatically is connected by the connect worker of the loop, which stops
+// its thread. Handlers of the session are called from the loop or its connect
+// worker and must not add or remove sessions
+// Returns 0 on success, -1 on failure
+int ttngwc_reactor_add(TTNReactor *reactor, TTN *session);
+
+// Removes a session from the reactor. After this returns, the loop no longer
+// uses the session
+// Returns 0 on success, -1 when the session was not added to this reactor
+int ttngwc_reactor_remove(TTNReactor *reactor, TTN *session);
+
+// Disconnects from The Things Network Router. Queued messages are dropped
 // Returns always 0
 int ttngwc_disconnect(TTN *session);
 
-// Sends uplink message
-// Returns 0 on success, -1 on failure or -2 on timeout
+// Waits at most timeout_ms for queued messages to be acknowledged and
+// disconnects from The Things Network Router. Remaining messages are dropped
+// Returns 0 when all messages were flushed or -2 on timeout
+int ttngwc_disconnect_flush(TTN *session, int timeout_ms);
+
+// Sends uplink message. With a journal, the message is stored and published
+// once connected. With a backlog, the message is kept in memory while not
+// connected or congested
+// Returns 0 on success, -1 on failure, -2 on timeout or -3 when dropped from
+// the backlog or when the queue is full
 int ttngwc_send_uplink(TTN *session, Router__UplinkMessage *uplink);
 
-// Sends status message
-// Returns 0 on success, -1 on failure or -2 on timeout
+// Sends n uplink messages, writing them to the network together and waiting
+// for all acknowledgements. The result of each message is stored in results:
+// 0 on success, -1 on failure, -2 on timeout or -3 when dropped from the
+// backlog or when the queue is full
+// Returns the number of acknowledged or stored messages
+int ttngwc_send_uplinks(TTN *session, Router__UplinkMessage **uplinks, int n,
+                        int *results);
+
+// Sends status message. When the round-trip time is not set, it is filled in
+// with the median time to acknowledge uplinks, or status messages when no
+// uplinks were acknowledged. Unset packet counters are filled in from the
+// traffic of the session: rx_in with the submitted uplinks, rx_ok with the
+// acknowledged uplinks, tx_in with the received downlinks and tx_ok with the
+// delivered downlinks. The time is filled in from the timestamp when the
+// concentrator clock is tracked, see ttngwc_clock_sync
+// Returns 0 on success, -1 on failure, -2 on timeout or -3 when the queue is
+// full
 int ttngwc_send_status(TTN *session, Gateway__Status *status);
 
+// Queues uplink message and returns without waiting for the router. The
+// completion handler is called with 0 when acknowledged, -1 on failure, -2 on
+// timeout or -3 when dropped. Handlers are called from the network task and
+// must not block. With a journal, the handler is called with 0 once the
+// message is stored
+// Returns 0 when queued, -1 on failure or -3 when the queue is full
+int ttngwc_submit_uplink(TTN *session, Router__UplinkMessage *uplink,
+                         TTNCompletionHandler, void *);
+
+// Queues status message and returns without waiting for the router. The
+// round-trip time and packet counters are filled in as with
+// ttngwc_send_status. See
+// ttngwc_submit_uplink for the completion handler
+// Returns 0 when queued, -1 on failure or -3 when the queue is full
+int ttngwc_submit_status(TTN *session, Gateway__Status *status,
+                         TTNCompletionHandler, void *);
+
+// Returns the number of queued and unacknowledged messages
+int ttngwc_queue_depth(TTN *session);
+
+// Returns the number of uplinks stored in the journal or -1 without a journal
+int ttngwc_journal_depth(TTN *session);
+
+// Gets the counters of the uplink backlog
+void ttngwc_backlog_stats(TTN *session, TTNBacklogStats *stats);
+
+// Sets the number of messages that may be published without waiting for
+// acknowledgement, between 1 and 32. The default is 8
+void ttngwc_set_window(TTN *session, int window);
+
+// Sets the QoS of uplink and status messages that are sent from now on, 0 or
+// 1. Messages at QoS 0 complete once written to the network
+void ttngwc_set_qos(TTN *session, int qos_up, int qos_status);
+
+// Gets the delivery estimate of messages published at QoS 0
+void ttngwc_loss_stats(TTN *session, TTNLossStats *stats);
+
+// Fills the percentiles of the time in milliseconds from publishing an uplink
+// to its acknowledgement. Only uplinks sent at QoS 1 are measured, and not
+// when retransmitted. Percentiles are left unset until an uplink is
+// acknowledged
+void ttngwc_uplink_rtt(TTN *session, Api__Percentiles *percentiles);
+
+// Fills the percentiles of the round-trip time of status messages. See
+// ttngwc_uplink_rtt
+void ttngwc_status_rtt(TTN *session, Api__Percentiles *percentiles);
+
+// Gets the traffic counters of the session. This does not lock and may be
+// called from any thread, also while messages are sent
+void ttngwc_traffic_stats(TTN *session, TTNTrafficStats *stats);
+
+// Gets the counters of the uplink deduplication filter, see dedup_window_ms
+void ttngwc_dedup_stats(TTN *session, TTNDedupStats *stats);
+
+// Publishes only the LoRaWAN data frames of which the DevAddr starts with
+// prefix, in addition to the other prefixes and the Bloom filter. Frames
+// without a DevAddr, such as join requests, are always published. Without
+// prefixes and Bloom filter, all uplinks are published
+// Returns 0 on success or -1 when bits is not between 0 and 32 or there are
+// 16 prefixes already
+int ttngwc_filter_prefix(TTN *session, uint32_t prefix, int bits);
+
+// Publishes the data frames of the network with the given NetID
+// Returns 0 on success or -1 on failure
+int ttngwc_filter_netid(TTN *session, uint32_t net_id);
+
+// Replaces the Bloom filter of the DevAddrs to publish. The filter starts
+// with a version byte of 1 and the number of hash functions, up to 16,
+// followed by the bits. With filter_updates, the router publishes filters in
+// this form on <id>/filter. An empty filter removes it
+// Returns 0 on success or -1 when malformed
+int ttngwc_filter_bloom(TTN *session, const uint8_t *filter, size_t len);
+
+// Removes the prefixes and the Bloom filter, so that all uplinks are
+// published
+void ttngwc_filter_clear(TTN *session);
+
+// Gets the counters of the uplink filter
+void ttngwc_filter_stats(TTN *session, TTNFilterStats *stats);
+
+// Gets the DevAddr prefix of a NetID and its length in bits
+// Returns 0 on success or -1 when the NetID is over 24 bits
+int ttngwc_netid_prefix(uint32_t net_id, uint32_t *prefix, int *bits);
+
+// Adds a DevAddr to an encoded Bloom filter, of which the caller sets the
+// version and number of hash functions. Bit i of the filter is bit i % 8 of
+// byte 2 + i / 8. The k-th hash function, from 0, sets bit
+// (h1 + k * h2) % bits, where h1 is the CRC-32C of the DevAddr in little
+// endian, h2 is the CRC-32C of the DevAddr continuing from h1, with its
+// lowest bit set, and bits is the number of bits of the filter
+// Returns 0 on success or -1 when malformed
+int ttngwc_bloom_add(uint8_t *filter, size_t len, uint32_t dev_addr);
+
+// Gets the counters of the uplink envelopes, see envelope_size
+void ttngwc_envelope_stats(TTN *session, TTNEnvelopeStats *stats);
+
+// Fills the percentiles of the time in milliseconds that uplinks wait for
+// their envelope to be published
+void ttngwc_envelope_latency(TTN *session, Api__Percentiles *percentiles);
+
+// Decodes an envelope published on <id>/up/batch and calls the handler with
+// each uplink in it. The uplinks are freed when the handler returns
+// Returns the number of uplinks, or -1 when the envelope is malformed, after
+// passing the uplinks before the malformed part
+int ttngwc_envelope_decode(const uint8_t *data, size_t len,
+                           TTNUplinkHandler handler, void *arg);
+
 #endif
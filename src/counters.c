@@ -0,0 +1,30 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "counters.h"
+
+void ttngwc_counters_add(struct Counters *counters, enum Counter counter,
+                         uint64_t n) {
+  __atomic_fetch_add(&counters->slots[counter].value, n, __ATOMIC_RELAXED);
+}
+
+uint64_t ttngwc_counters_get(struct Counters *counters, enum Counter counter) {
+  return __atomic_load_n(&counters->slots[counter].value, __ATOMIC_RELAXED);
+}
+
+void ttngwc_counters_snapshot(struct Counters *counters,
+                              TTNTrafficStats *stats) {
+  stats->uplinks_submitted =
+      ttngwc_counters_get(counters, COUNTER_UPLINKS_SUBMITTED);
+  stats->uplinks_acked = ttngwc_counters_get(counters, COUNTER_UPLINKS_ACKED);
+  stats->uplinks_failed = ttngwc_counters_get(counters, COUNTER_UPLINKS_FAILED);
+  stats->downlinks_received =
+      ttngwc_counters_get(counters, COUNTER_DOWNLINKS_RECEIVED);
+  stats->downlinks_delivered =
+      ttngwc_counters_get(counters, COUNTER_DOWNLINKS_DELIVERED);
+  stats->downlinks_decode_failed =
+      ttngwc_counters_get(counters, COUNTER_DOWNLINKS_DECODE_FAILED);
+  stats->bytes_in = ttngwc_counters_get(counters, COUNTER_BYTES_IN);
+  stats->bytes_out = ttngwc_counters_get(counters, COUNTER_BYTES_OUT);
+}
@@ -0,0 +1,51 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+#if !defined(__TTN_GW_COUNTERS_H_)
+#define __TTN_GW_COUNTERS_H_
+
+#include <stdint.h>
+
+#include "connector.h"
+
+// Size in bytes of a cache line
+#define COUNTER_LINE_SIZE 64
+
+enum Counter {
+  COUNTER_UPLINKS_SUBMITTED,
+  COUNTER_UPLINKS_ACKED,
+  COUNTER_UPLINKS_FAILED,
+  COUNTER_DOWNLINKS_RECEIVED,
+  COUNTER_DOWNLINKS_DELIVERED,
+  COUNTER_DOWNLINKS_DECODE_FAILED,
+  COUNTER_BYTES_IN,
+  COUNTER_BYTES_OUT,
+  COUNTER_COUNT
+};
+
+// Each counter has a cache line of its own, so that the threads that submit,
+// read and complete messages do not invalidate each other's caches
+struct CounterSlot {
+  uint64_t value;
+  char padding[COUNTER_LINE_SIZE - sizeof(uint64_t)];
+};
+
+// Counters are updated and read with relaxed atomics, without locking. A
+// snapshot is not taken at a single instant, but each counter is exact
+struct Counters {
+  char padding[COUNTER_LINE_SIZE];
+  struct CounterSlot slots[COUNTER_COUNT];
+};
+
+// Adds to the counter
+void ttngwc_counters_add(struct Counters *counters, enum Counter counter,
+                         uint64_t n);
+
+// Returns the value of the counter
+uint64_t ttngwc_counters_get(struct Counters *counters, enum Counter counter);
+
+// Reads all counters
+void ttngwc_counters_snapshot(struct Counters *counters,
+                              TTNTrafficStats *stats);
+
+#endif
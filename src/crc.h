@@ -0,0 +1,13 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+#if !defined(__TTN_GW_CRC_H_)
+#define __TTN_GW_CRC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Updates the CRC-32C of data. Start with a crc of 0
+uint32_t ttngwc_crc32c(uint32_t crc, const void *data, size_t len);
+
+#endif
@@ -0,0 +1,168 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "crc.h"
+#include "network.h"
+
+void ttngwc_dedup_init(struct Session *session) {
+  struct Dedup *dedup = &session->dedup;
+  MutexInit(&dedup->mutex);
+  dedup->window = (uint32_t)session->config.dedup_window_ms * 1000;
+}
+
+uint32_t ttngwc_dedup_batch(struct Session *session) {
+  struct Dedup *dedup = &session->dedup;
+  uint32_t batch;
+
+  MutexLock(&dedup->mutex);
+  batch = ++dedup->batch;
+  MutexUnlock(&dedup->mutex);
+
+  return batch;
+}
+
+// Returns the distance in microseconds between two concentrator times
+static uint32_t ttngwc_dedup_distance(uint32_t a, uint32_t b) {
+  int32_t d = (int32_t)(a - b);
+  return d < 0 ? -(uint32_t)d : (uint32_t)d;
+}
+
+int ttngwc_dedup_check(struct Session *session,
+                       const Router__UplinkMessage *uplink, uint32_t batch,
+                       int index) {
+  struct Dedup *dedup = &session->dedup;
+  const Gateway__RxMetadata *gateway = uplink->gateway_metadata;
+  struct DedupEntry *entry, *slot = NULL;
+  uint32_t hash, len, timestamp, age, oldest = 0;
+  int i, reuse = 0, rc = DEDUP_UNIQUE;
+
+  if (!dedup->window || !uplink->has_payload || !gateway ||
+      !gateway->has_timestamp)
+    return DEDUP_UNIQUE;
+  hash = ttngwc_crc32c(0, uplink->payload.data, uplink->payload.len);
+  len = (uint32_t)uplink->payload.len;
+  timestamp = gateway->timestamp;
+
+  MutexLock(&dedup->mutex);
+  dedup->stats.checked++;
+  for (i = 0; i < DEDUP_PROBES; i++) {
+    entry = &dedup->entries[(hash + i) & (DEDUP_SIZE - 1)];
+    age = ttngwc_dedup_distance(timestamp, entry->timestamp);
+    if (!entry->used || age > dedup->window) {
+      if (!reuse) {
+        slot = entry;
+        reuse = 1;
+      }
+      continue;
+    }
+    if (entry->hash == hash && entry->len == len) {
+      rc = entry->batch == batch ? entry->index : DEDUP_SEEN;
+      break;
+    }
+    if (!reuse && (!slot || age > oldest)) {
+      slot = entry;
+      oldest = age;
+    }
+  }
+  if (rc == DEDUP_UNIQUE) {
+    if (!reuse)
+      dedup->stats.evicted++;
+    slot->hash = hash;
+    slot->len = len;
+    slot->timestamp = timestamp;
+    slot->batch = batch;
+    slot->index = index;
+    slot->used = 1;
+  } else {
+    dedup->stats.suppressed++;
+  }
+  MutexUnlock(&dedup->mutex);
+
+  return rc;
+}
+
+void ttngwc_dedup_forget(struct Session *session,
+                         const Router__UplinkMessage *uplink) {
+  struct Dedup *dedup = &session->dedup;
+  const Gateway__RxMetadata *gateway = uplink->gateway_metadata;
+  struct DedupEntry *entry;
+  uint32_t hash, len;
+  int i;
+
+  if (!dedup->window || !uplink->has_payload || !gateway ||
+      !gateway->has_timestamp)
+    return;
+  hash = ttngwc_crc32c(0, uplink->payload.data, uplink->payload.len);
+  len = (uint32_t)uplink->payload.len;
+
+  // Lookups search all probes, so an entry can be freed in between
+  MutexLock(&dedup->mutex);
+  for (i = 0; i < DEDUP_PROBES; i++) {
+    entry = &dedup->entries[(hash + i) & (DEDUP_SIZE - 1)];
+    if (entry->used && entry->hash == hash && entry->len == len &&
+        entry->timestamp == gateway->timestamp) {
+      entry->used = 0;
+      break;
+    }
+  }
+  MutexUnlock(&dedup->mutex);
+}
+
+void ttngwc_dedup_merge(struct Session *session, Router__UplinkMessage **kept,
+                        struct DedupCopy *copy,
+                        const Router__UplinkMessage *duplicate) {
+  struct Dedup *dedup = &session->dedup;
+  const Gateway__RxMetadata *other = duplicate->gateway_metadata;
+  Gateway__RxMetadata *metadata;
+  size_t i, j, n;
+  unsigned long merged = 0, dropped = 0;
+
+  if (*kept != &copy->uplink) {
+    copy->uplink = **kept;
+    copy->metadata = *(*kept)->gateway_metadata;
+    copy->uplink.gateway_metadata = &copy->metadata;
+    *kept = &copy->uplink;
+  }
+  metadata = copy->uplink.gateway_metadata;
+  if (metadata->antennas != copy->antennas) {
+    n = metadata->n_antennas < DEDUP_ANTENNAS ? metadata->n_antennas
+                                              : DEDUP_ANTENNAS;
+    for (i = 0; i < n; i++)
+      copy->antennas[i] = metadata->antennas[i];
+    metadata->antennas = copy->antennas;
+    metadata->n_antennas = n;
+  }
+
+  // An antenna that reported the frame twice is kept with the stronger signal
+  for (i = 0; i < other->n_antennas; i++) {
+    Gateway__RxMetadata__Antenna *antenna = other->antennas[i];
+    for (j = 0; j < metadata->n_antennas; j++) {
+      if (metadata->antennas[j]->antenna == antenna->antenna)
+        break;
+    }
+    if (j < metadata->n_antennas) {
+      if (antenna->rssi > metadata->antennas[j]->rssi)
+        metadata->antennas[j] = antenna;
+      merged++;
+    } else if (metadata->n_antennas < DEDUP_ANTENNAS) {
+      metadata->antennas[metadata->n_antennas++] = antenna;
+      merged++;
+    } else {
+      dropped++;
+    }
+  }
+
+  MutexLock(&dedup->mutex);
+  dedup->stats.merged++;
+  dedup->stats.antennas_merged += merged;
+  dedup->stats.antennas_dropped += dropped;
+  MutexUnlock(&dedup->mutex);
+}
+
+void ttngwc_dedup_get_stats(struct Session *session, TTNDedupStats *stats) {
+  struct Dedup *dedup = &session->dedup;
+  MutexLock(&dedup->mutex);
+  *stats = dedup->stats;
+  MutexUnlock(&dedup->mutex);
+}
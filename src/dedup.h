@@ -0,0 +1,87 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+#if !defined(__TTN_GW_DEDUP_H_)
+#define __TTN_GW_DEDUP_H_
+
+#include <stdint.h>
+
+#include <MQTTClient.h>
+
+#include "connector.h"
+#include "platform.h"
+
+// Number of uplinks remembered, a power of two
+#define DEDUP_SIZE 256
+// Slots searched from the slot of a hash
+#define DEDUP_PROBES 8
+// Antennas that an uplink holds after merging its duplicates
+#define DEDUP_ANTENNAS 8
+
+// Results of ttngwc_dedup_check other than the index of the kept copy
+#define DEDUP_UNIQUE -1
+#define DEDUP_SEEN -2
+
+struct Session;
+
+// An uplink that was passed on
+struct DedupEntry {
+  uint32_t hash;
+  uint32_t len;
+  // Concentrator time of reception
+  uint32_t timestamp;
+  // Batch and index in the batch in which the uplink was checked
+  uint32_t batch;
+  int index;
+  int used;
+};
+
+// Remembers the payloads of the uplinks received within the window, in an
+// open-addressed table of hashes. Slots that are older than the window are
+// reused, and when all slots searched are in use, the oldest is replaced
+struct Dedup {
+  Mutex mutex;
+  // Window in concentrator microseconds, or 0 when disabled
+  uint32_t window;
+  uint32_t batch;
+  struct DedupEntry entries[DEDUP_SIZE];
+  TTNDedupStats stats;
+};
+
+// Copy of an uplink into which the antennas of its duplicates are merged
+struct DedupCopy {
+  Router__UplinkMessage uplink;
+  Gateway__RxMetadata metadata;
+  Gateway__RxMetadata__Antenna *antennas[DEDUP_ANTENNAS];
+};
+
+// Initializes the filter of the session with the window of the config
+void ttngwc_dedup_init(struct Session *session);
+
+// Starts a batch of uplinks, of which duplicates are merged
+// Returns the batch
+uint32_t ttngwc_dedup_batch(struct Session *session);
+
+// Checks whether the payload of the uplink was received within the window.
+// Uplinks without a payload or timestamp are not checked
+// Returns DEDUP_UNIQUE when not, after remembering the uplink at the index of
+// the batch, the index of the kept copy when a duplicate within the batch, or
+// DEDUP_SEEN when a duplicate of an uplink that was already passed on
+int ttngwc_dedup_check(struct Session *session,
+                       const Router__UplinkMessage *uplink, uint32_t batch,
+                       int index);
+
+// Forgets the uplink, so that it can be sent again after it failed
+void ttngwc_dedup_forget(struct Session *session,
+                         const Router__UplinkMessage *uplink);
+
+// Merges the antennas of the duplicate into the kept uplink. The kept uplink
+// is copied into copy first, unless it is that copy already
+void ttngwc_dedup_merge(struct Session *session, Router__UplinkMessage **kept,
+                        struct DedupCopy *copy,
+                        const Router__UplinkMessage *duplicate);
+
+// Gets the counters of the filter
+void ttngwc_dedup_get_stats(struct Session *session, TTNDedupStats *stats);
+
+#endif
@@ -0,0 +1,448 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "network.h"
+
+// Preset dictionary of the strings that recur in the metadata of uplinks.
+// zlib finds matches closer to the end more cheaply, so the most common
+// strings come last. Changing the dictionary requires a new version
+static const char envelope_dictionary[] =
+    "SF12BW500SF11BW500SF10BW500SF9BW500SF8BW500SF7BW500"
+    "SF12BW250SF11BW250SF10BW250SF9BW250SF8BW250SF7BW250"
+    "50000FSK4/84/74/6"
+    "SF12BW125SF11BW125SF10BW125SF9BW125SF8BW125"
+    "EU_863_870US_902_928AU_915_928AS_923CN_470_510"
+    "SF7BW1254/5eui-";
+
+static void ttngwc_envelope_done(int rc, void *arg);
+
+// Handler of canceled uplinks, which is never called
+static void ttngwc_envelope_canceled(int rc, void *arg) {}
+
+// Appends the value as a varint
+static size_t ttngwc_envelope_varint(uint8_t *out, uint64_t value) {
+  size_t n = 0;
+  do {
+    out[n] = value & 127;
+    value >>= 7;
+    if (value)
+      out[n] |= 128;
+    n++;
+  } while (value);
+  return n;
+}
+
+// Compresses the records into the compressed arena
+// Returns the size of the envelope or 0 on failure
+static size_t ttngwc_envelope_compress(struct Envelope *envelope) {
+  z_stream *stream = &envelope->stream;
+  size_t size = 1 + deflateBound(stream, envelope->len);
+  uint8_t *out = ttngwc_arena_reserve(&envelope->compressed, size);
+
+  if (!out || deflateReset(stream) != Z_OK ||
+      deflateSetDictionary(stream, (const Bytef *)envelope_dictionary,
+                           sizeof(envelope_dictionary) - 1) != Z_OK)
+    return 0;
+  out[0] = ENVELOPE_VERSION;
+  stream->next_in = envelope->records.data;
+  stream->avail_in = (uInt)envelope->len;
+  stream->next_out = &out[1];
+  stream->avail_out = (uInt)(size - 1);
+  if (deflate(stream, Z_FINISH) != Z_STREAM_END)
+    return 0;
+  return size - stream->avail_out;
+}
+
+// Publishes the current envelope. Call with the mutex locked
+// Returns the envelope to complete with rc once unlocked, or NULL
+static struct EnvelopeFlight *ttngwc_envelope_publish(struct Session *session,
+                                                      int *rc) {
+  struct Envelope *envelope = &session->envelope;
+  struct EnvelopeFlight *flight = envelope->current;
+  uint64_t now = ClockMicros();
+  size_t len = 0;
+  int i;
+
+  *rc = SUCCESS;
+  if (!flight || flight->count == 0)
+    return NULL;
+  for (i = 0; i < flight->count; i++)
+    ttngwc_histogram_record(&envelope->latency,
+                            (uint32_t)(now - flight->items[i].queued));
+
+  if (!session->connected)
+    *rc = FAILURE;
+  else if ((len = ttngwc_envelope_compress(envelope)) == 0)
+    *rc = FAILURE;
+  else
+    *rc = ttngwc_outbox_push_raw(session, CLASS_BATCH,
+                                 envelope->compressed.data, len,
+                                 &ttngwc_envelope_done, flight);
+
+  if (*rc == SUCCESS) {
+    envelope->stats.envelopes++;
+    envelope->stats.uplinks += flight->count;
+    envelope->stats.raw_bytes += envelope->len;
+    envelope->stats.compressed_bytes += len;
+  } else {
+    envelope->stats.failures++;
+  }
+  envelope->current =
+      envelope->spares > 0 ? envelope->spare[--envelope->spares] : NULL;
+  envelope->len = 0;
+  return *rc == SUCCESS ? NULL : flight;
+}
+
+// Completes the uplinks of an envelope and makes it available again
+static void ttngwc_envelope_done(int rc, void *arg) {
+  struct EnvelopeFlight *flight = (struct EnvelopeFlight *)arg;
+  struct Session *session = flight->session;
+  struct Envelope *envelope = &session->envelope;
+  TTNCompletionHandler handler;
+  int i, completed = 0;
+
+  // Claim each handler, so that an uplink is either completed or canceled
+  for (i = 0; i < flight->count; i++) {
+    handler = __atomic_exchange_n(&flight->items[i].handler,
+                                  &ttngwc_envelope_canceled, __ATOMIC_ACQ_REL);
+    if (handler == &ttngwc_envelope_canceled)
+      continue;
+    completed++;
+    if (handler)
+      handler(rc, flight->items[i].arg);
+  }
+  ttngwc_counters_add(&session->counters,
+                      rc == SUCCESS ? COUNTER_UPLINKS_ACKED
+                                    : COUNTER_UPLINKS_FAILED,
+                      completed);
+
+  MutexLock(&envelope->mutex);
+  flight->count = 0;
+  if (!envelope->current)
+    envelope->current = flight;
+  else
+    envelope->spare[envelope->spares++] = flight;
+  MutexUnlock(&envelope->mutex);
+}
+
+static void ttngwc_envelope_run(void *arg) {
+  struct Session *session = (struct Session *)arg;
+  struct Envelope *envelope = &session->envelope;
+  uint64_t delay = (uint64_t)session->config.envelope_delay_ms * 1000;
+
+  while (!envelope->stop) {
+    struct EnvelopeFlight *failed = NULL;
+    int wait = -1, rc = SUCCESS, published = 0;
+
+    MutexLock(&envelope->mutex);
+    if (envelope->current && envelope->current->count > 0) {
+      uint64_t waited = ClockMicros() - envelope->current->items[0].queued;
+      if (waited >= delay) {
+        failed = ttngwc_envelope_publish(session, &rc);
+        published = 1;
+      } else {
+        wait = (int)((delay - waited + 999) / 1000);
+      }
+    }
+    MutexUnlock(&envelope->mutex);
+
+    if (failed)
+      ttngwc_envelope_done(rc, failed);
+    else if (published)
+      ttngwc_sender_pump(session);
+    if (!published)
+      EventWait(&envelope->wake, wait);
+  }
+
+  EventSet(&envelope->stopped);
+}
+
+void ttngwc_envelope_init(struct Session *session) {
+  struct Envelope *envelope = &session->envelope;
+  int size = session->config.envelope_size, i;
+
+  MutexInit(&envelope->mutex);
+  EventInit(&envelope->wake);
+  EventInit(&envelope->stopped);
+  // An envelope needs room for its headers in the largest packet
+  if (size <= 0 || session->config.max_buffer_size <= ENVELOPE_OVERHEAD)
+    return;
+
+  for (i = 0; i < ENVELOPE_FLIGHTS; i++) {
+    envelope->flights[i].session = session;
+    envelope->flights[i].items =
+        (struct EnvelopeItem *)calloc(size, sizeof(struct EnvelopeItem));
+    if (!envelope->flights[i].items)
+      goto fail;
+    envelope->spare[i] = &envelope->flights[i];
+  }
+  if (deflateInit(&envelope->stream, Z_DEFAULT_COMPRESSION) != Z_OK)
+    goto fail;
+  envelope->size = size;
+  envelope->spares = ENVELOPE_FLIGHTS - 1;
+  envelope->current = envelope->spare[ENVELOPE_FLIGHTS - 1];
+  envelope->records.limit = session->config.max_buffer_size - ENVELOPE_OVERHEAD;
+  envelope->compressed.limit = session->config.max_buffer_size;
+
+  envelope->stop = 0;
+  envelope->running = 1;
+  if (ThreadStart(&envelope->thread, &ttngwc_envelope_run, session) != 0) {
+    envelope->running = 0;
+    deflateEnd(&envelope->stream);
+    goto fail;
+  }
+  return;
+
+fail:
+  for (i = 0; i < ENVELOPE_FLIGHTS; i++) {
+    free(envelope->flights[i].items);
+    envelope->flights[i].items = NULL;
+  }
+  envelope->current = NULL;
+  envelope->spares = 0;
+  envelope->size = 0;
+}
+
+void ttngwc_envelope_stop(struct Session *session) {
+  struct Envelope *envelope = &session->envelope;
+
+  if (!envelope->running)
+    return;
+  envelope->stop = 1;
+  EventSet(&envelope->wake);
+  EventWait(&envelope->stopped, -1);
+  envelope->running = 0;
+  ttngwc_envelope_drop(session);
+}
+
+void ttngwc_envelope_destroy(struct Session *session) {
+  struct Envelope *envelope = &session->envelope;
+  int i;
+
+  ttngwc_envelope_stop(session);
+  if (envelope->size > 0)
+    deflateEnd(&envelope->stream);
+  for (i = 0; i < ENVELOPE_FLIGHTS; i++) {
+    free(envelope->flights[i].items);
+    envelope->flights[i].items = NULL;
+  }
+  envelope->current = NULL;
+  envelope->spares = 0;
+  envelope->size = 0;
+  ttngwc_arena_free(&envelope->records);
+  ttngwc_arena_free(&envelope->compressed);
+  EventDestroy(&envelope->wake);
+  EventDestroy(&envelope->stopped);
+}
+
+int ttngwc_envelope_wanted(struct Session *session) {
+  return session->envelope.running;
+}
+
+int ttngwc_envelope_push(struct Session *session,
+                         const ProtobufCMessage *message,
+                         TTNCompletionHandler handler, void *arg) {
+  struct Envelope *envelope = &session->envelope;
+  struct EnvelopeFlight *flight, *failed = NULL;
+  struct EnvelopeItem *item;
+  size_t size = protobuf_c_message_get_packed_size(message);
+  size_t needed = 10 + size;
+  uint8_t *records;
+  int rc = SUCCESS, published = 0;
+
+  MutexLock(&envelope->mutex);
+  // Publish what was collected when the uplink does not fit behind it
+  if (envelope->current && envelope->current->count > 0 &&
+      envelope->records.limit < envelope->len + needed) {
+    failed = ttngwc_envelope_publish(session, &rc);
+    published = 1;
+  }
+  flight = envelope->current;
+  records = ttngwc_arena_reserve(&envelope->records, envelope->len + needed);
+  if (!flight) {
+    MutexUnlock(&envelope->mutex);
+    if (failed)
+      ttngwc_envelope_done(rc, failed);
+    return TTNGWC_DROPPED;
+  }
+  if (!records) {
+    MutexUnlock(&envelope->mutex);
+    if (failed)
+      ttngwc_envelope_done(rc, failed);
+    return FAILURE;
+  }
+
+  envelope->len += ttngwc_envelope_varint(&records[envelope->len], size);
+  envelope->len += protobuf_c_message_pack(message, &records[envelope->len]);
+  item = &flight->items[flight->count++];
+  item->handler = handler;
+  item->arg = arg;
+  item->queued = ClockMicros();
+  if (flight->count == 1)
+    EventSet(&envelope->wake);
+  if (flight->count == envelope->size && !failed) {
+    failed = ttngwc_envelope_publish(session, &rc);
+    published = 1;
+  }
+  MutexUnlock(&envelope->mutex);
+
+  if (failed)
+    ttngwc_envelope_done(rc, failed);
+  else if (published)
+    ttngwc_sender_pump(session);
+  return SUCCESS;
+}
+
+void ttngwc_envelope_flush(struct Session *session) {
+  struct Envelope *envelope = &session->envelope;
+  struct EnvelopeFlight *failed;
+  int rc;
+
+  if (!envelope->running)
+    return;
+  MutexLock(&envelope->mutex);
+  failed = ttngwc_envelope_publish(session, &rc);
+  MutexUnlock(&envelope->mutex);
+
+  if (failed)
+    ttngwc_envelope_done(rc, failed);
+  else
+    ttngwc_sender_pump(session);
+}
+
+void ttngwc_envelope_drop(struct Session *session) {
+  struct Envelope *envelope = &session->envelope;
+  struct EnvelopeFlight *flight;
+
+  MutexLock(&envelope->mutex);
+  flight = envelope->current;
+  if (flight && flight->count > 0) {
+    envelope->current =
+        envelope->spares > 0 ? envelope->spare[--envelope->spares] : NULL;
+    envelope->len = 0;
+  } else {
+    flight = NULL;
+  }
+  MutexUnlock(&envelope->mutex);
+
+  if (flight)
+    ttngwc_envelope_done(TTNGWC_DROPPED, flight);
+}
+
+int ttngwc_envelope_cancel(struct Session *session, void *arg) {
+  struct Envelope *envelope = &session->envelope;
+  TTNCompletionHandler handler;
+  int i, j, canceled = 0;
+
+  MutexLock(&envelope->mutex);
+  for (i = 0; i < ENVELOPE_FLIGHTS && envelope->size > 0; i++) {
+    struct EnvelopeFlight *flight = &envelope->flights[i];
+    for (j = 0; j < flight->count; j++) {
+      if (flight->items[j].arg != arg)
+        continue;
+      handler = __atomic_exchange_n(&flight->items[j].handler,
+                                    &ttngwc_envelope_canceled,
+                                    __ATOMIC_ACQ_REL);
+      if (handler != &ttngwc_envelope_canceled)
+        canceled++;
+    }
+  }
+  MutexUnlock(&envelope->mutex);
+
+  ttngwc_counters_add(&session->counters, COUNTER_UPLINKS_FAILED, canceled);
+  return canceled;
+}
+
+void ttngwc_envelope_get_stats(struct Session *session,
+                               TTNEnvelopeStats *stats) {
+  struct Envelope *envelope = &session->envelope;
+  MutexLock(&envelope->mutex);
+  *stats = envelope->stats;
+  MutexUnlock(&envelope->mutex);
+}
+
+void ttngwc_envelope_get_latency(struct Session *session,
+                                 Api__Percentiles *percentiles) {
+  struct Envelope *envelope = &session->envelope;
+  MutexLock(&envelope->mutex);
+  ttngwc_histogram_percentiles(&envelope->latency, 1000, percentiles);
+  MutexUnlock(&envelope->mutex);
+}
+
+// Reads a varint from the records
+// Returns the number of bytes read or 0 when malformed
+static size_t ttngwc_envelope_read_varint(const uint8_t *data, size_t len,
+                                          uint64_t *value) {
+  size_t n;
+
+  *value = 0;
+  for (n = 0; n < len && n < 10; n++) {
+    *value |= (uint64_t)(data[n] & 127) << (7 * n);
+    if (!(data[n] & 128))
+      return n + 1;
+  }
+  return 0;
+}
+
+int ttngwc_envelope_decode(const uint8_t *data, size_t len,
+                           TTNUplinkHandler handler, void *arg) {
+  z_stream stream;
+  uint8_t *records = NULL, *grown;
+  size_t size = 0, used = 0, pos, n;
+  uint64_t record;
+  int zrc = Z_OK, count = 0;
+
+  if (len < 1 || data[0] != ENVELOPE_VERSION)
+    return FAILURE;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit(&stream) != Z_OK)
+    return FAILURE;
+  stream.next_in = (Bytef *)&data[1];
+  stream.avail_in = (uInt)(len - 1);
+  while (zrc != Z_STREAM_END) {
+    if (used == size) {
+      size = size ? size * 2 : 4 * len;
+      if (size > ENVELOPE_MAX_SIZE)
+        size = ENVELOPE_MAX_SIZE;
+      if (used == size || !(grown = (uint8_t *)realloc(records, size)))
+        goto fail;
+      records = grown;
+    }
+    stream.next_out = &records[used];
+    stream.avail_out = (uInt)(size - used);
+    zrc = inflate(&stream, Z_NO_FLUSH);
+    if (zrc == Z_NEED_DICT)
+      zrc = inflateSetDictionary(&stream, (const Bytef *)envelope_dictionary,
+                                 sizeof(envelope_dictionary) - 1);
+    used = size - stream.avail_out;
+    if (zrc != Z_OK && zrc != Z_STREAM_END)
+      goto fail;
+    // A truncated stream makes no progress
+    if (zrc == Z_OK && stream.avail_in == 0 && used < size)
+      goto fail;
+  }
+  inflateEnd(&stream);
+
+  for (pos = 0; pos < used; pos += record) {
+    Router__UplinkMessage *uplink;
+    n = ttngwc_envelope_read_varint(&records[pos], used - pos, &record);
+    if (n == 0 || record > used - pos - n)
+      break;
+    pos += n;
+    uplink = router__uplink_message__unpack(NULL, record, &records[pos]);
+    if (!uplink)
+      break;
+    if (handler)
+      handler(uplink, arg);
+    router__uplink_message__free_unpacked(uplink, NULL);
+    count++;
+  }
+  free(records);
+  return pos == used ? count : FAILURE;
+
+fail:
+  inflateEnd(&stream);
+  free(records);
+  return FAILURE;
+}
@@ -0,0 +1,110 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+#if !defined(__TTN_GW_ENVELOPE_H_)
+#define __TTN_GW_ENVELOPE_H_
+
+#include <stdint.h>
+
+#include <MQTTClient.h>
+#include <zlib.h>
+
+#include "arena.h"
+#include "connector.h"
+#include "histogram.h"
+#include "platform.h"
+
+// Version in the first byte of an envelope
+#define ENVELOPE_VERSION 1
+// Envelopes that may be queued or in flight at once
+#define ENVELOPE_FLIGHTS 8
+// Room left in the outbox packet for the topic and headers of an envelope
+#define ENVELOPE_OVERHEAD 256
+// Size up to which an envelope is decompressed
+#define ENVELOPE_MAX_SIZE (1 << 20)
+
+struct Session;
+
+// An uplink in an envelope. Canceling the uplink replaces its handler, so
+// that it is still published but no longer completed
+struct EnvelopeItem {
+  TTNCompletionHandler handler;
+  void *arg;
+  // Time in microseconds at which the uplink was queued
+  uint64_t queued;
+};
+
+// The uplinks of an envelope, which complete together
+struct EnvelopeFlight {
+  struct Session *session;
+  struct EnvelopeItem *items;
+  int count;
+};
+
+// Collects uplinks and publishes them as one compressed envelope once the
+// envelope is full or its first uplink has waited for the delay. The
+// envelope is a version byte followed by a zlib stream, compressed with a
+// preset dictionary, of the packed uplinks, each behind its length as a
+// varint
+struct Envelope {
+  Mutex mutex;
+  Thread thread;
+  Event wake;
+  Event stopped;
+  int running;
+  int stop;
+  // Uplinks per envelope
+  int size;
+  // Envelope that uplinks are added to, or NULL when all are in flight
+  struct EnvelopeFlight *current;
+  struct EnvelopeFlight flights[ENVELOPE_FLIGHTS];
+  struct EnvelopeFlight *spare[ENVELOPE_FLIGHTS];
+  int spares;
+  // Packed uplinks of the current envelope
+  struct Arena records;
+  size_t len;
+  z_stream stream;
+  struct Arena compressed;
+  // Time in microseconds that uplinks wait for their envelope
+  struct Histogram latency;
+  TTNEnvelopeStats stats;
+};
+
+// Initializes the envelope of the session, and starts it when configured
+void ttngwc_envelope_init(struct Session *session);
+
+// Stops collecting uplinks and drops the ones collected
+void ttngwc_envelope_stop(struct Session *session);
+
+// Releases the envelope. Call this after the outbox completed its messages
+void ttngwc_envelope_destroy(struct Session *session);
+
+// Returns whether uplinks are sent in envelopes
+int ttngwc_envelope_wanted(struct Session *session);
+
+// Adds the uplink to the current envelope, publishing it when full
+// Returns 0 when added, -1 on failure or -3 when all envelopes are in flight
+int ttngwc_envelope_push(struct Session *session,
+                         const ProtobufCMessage *message,
+                         TTNCompletionHandler handler, void *arg);
+
+// Publishes the current envelope right away
+void ttngwc_envelope_flush(struct Session *session);
+
+// Completes the uplinks of the current envelope as dropped
+void ttngwc_envelope_drop(struct Session *session);
+
+// Stops waiting for the uplinks with the given completion argument, in the
+// current envelope and in the ones in flight, without completing them
+// Returns the number of canceled uplinks
+int ttngwc_envelope_cancel(struct Session *session, void *arg);
+
+// Gets the counters of the envelopes
+void ttngwc_envelope_get_stats(struct Session *session,
+                               TTNEnvelopeStats *stats);
+
+// Fills the percentiles of the time in milliseconds that uplinks wait
+void ttngwc_envelope_get_latency(struct Session *session,
+                                 Api__Percentiles *percentiles);
+
+#endif
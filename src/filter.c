@@ -0,0 +1,196 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "crc.h"
+#include "network.h"
+
+// LoRaWAN message types in the top bits of the MHDR
+#define MTYPE_UNCONFIRMED_UP 2
+#define MTYPE_CONFIRMED_DOWN 5
+// Length of MHDR, FHDR without options and MIC
+#define DATA_MIN_LENGTH 12
+
+// Bits of the NwkID in a DevAddr per NetID type
+static const int nwk_id_bits[8] = {6, 6, 9, 11, 12, 13, 15, 17};
+
+void ttngwc_filter_init(struct Session *session) {
+  struct Filter *filter = &session->filter;
+  MutexInit(&filter->mutex);
+}
+
+void ttngwc_filter_destroy(struct Session *session) {
+  struct Filter *filter = &session->filter;
+  free(filter->bloom);
+  filter->bloom = NULL;
+}
+
+int ttngwc_filter_add_prefix(struct Session *session, uint32_t prefix,
+                             int bits) {
+  struct Filter *filter = &session->filter;
+  int rc = FAILURE;
+
+  if (bits < 0 || bits > 32)
+    return FAILURE;
+  MutexLock(&filter->mutex);
+  if (filter->count < FILTER_PREFIXES) {
+    filter->masks[filter->count] = bits ? UINT32_MAX << (32 - bits) : 0;
+    filter->prefixes[filter->count] = prefix & filter->masks[filter->count];
+    filter->count++;
+    __atomic_store_n(&filter->active, 1, __ATOMIC_RELEASE);
+    rc = SUCCESS;
+  }
+  MutexUnlock(&filter->mutex);
+
+  return rc;
+}
+
+int ttngwc_netid_prefix(uint32_t net_id, uint32_t *prefix, int *bits) {
+  int type = (net_id >> 21) & 7;
+  int id_bits = nwk_id_bits[type];
+  uint32_t nwk_id = net_id & ((1u << id_bits) - 1);
+
+  if (net_id > 0xffffff)
+    return FAILURE;
+  // The DevAddr starts with as many ones as the type, then a zero
+  *bits = type + 1 + id_bits;
+  *prefix = ((((1u << (type + 1)) - 2) << id_bits) | nwk_id) << (32 - *bits);
+  return SUCCESS;
+}
+
+int ttngwc_filter_set_bloom(struct Session *session, const uint8_t *data,
+                            size_t len) {
+  struct Filter *filter = &session->filter;
+  uint8_t *bloom = NULL;
+
+  if (len > 0) {
+    if (len < 3 || data[0] != FILTER_VERSION || data[1] < 1 ||
+        data[1] > FILTER_HASHES)
+      goto fail;
+    bloom = (uint8_t *)malloc(len - 2);
+    if (!bloom)
+      goto fail;
+    memcpy(bloom, &data[2], len - 2);
+  }
+
+  MutexLock(&filter->mutex);
+  free(filter->bloom);
+  filter->bloom = bloom;
+  filter->size = bloom ? len - 2 : 0;
+  filter->hashes = bloom ? data[1] : 0;
+  __atomic_store_n(&filter->active, filter->count > 0 || bloom != NULL,
+                   __ATOMIC_RELEASE);
+  filter->stats.updates++;
+  MutexUnlock(&filter->mutex);
+  return SUCCESS;
+
+fail:
+  MutexLock(&filter->mutex);
+  filter->stats.update_failures++;
+  MutexUnlock(&filter->mutex);
+  return FAILURE;
+}
+
+void ttngwc_filter_reset(struct Session *session) {
+  struct Filter *filter = &session->filter;
+  MutexLock(&filter->mutex);
+  free(filter->bloom);
+  filter->bloom = NULL;
+  filter->size = 0;
+  filter->hashes = 0;
+  filter->count = 0;
+  __atomic_store_n(&filter->active, 0, __ATOMIC_RELEASE);
+  MutexUnlock(&filter->mutex);
+}
+
+// Returns the bits of the DevAddr in a Bloom filter of bits bits, by double
+// hashing with CRC-32C of the DevAddr in little endian
+static uint32_t ttngwc_filter_hash(uint32_t dev_addr, int i, uint32_t bits) {
+  uint8_t addr[4] = {dev_addr & 0xff, (dev_addr >> 8) & 0xff,
+                     (dev_addr >> 16) & 0xff, dev_addr >> 24};
+  uint32_t h1 = ttngwc_crc32c(0, addr, sizeof(addr));
+  uint32_t h2 = ttngwc_crc32c(h1, addr, sizeof(addr)) | 1;
+  return (uint32_t)(((uint64_t)h1 + (uint64_t)i * h2) % bits);
+}
+
+int ttngwc_bloom_add(uint8_t *data, size_t len, uint32_t dev_addr) {
+  uint32_t bits, bit;
+  int i;
+
+  if (len < 3 || data[0] != FILTER_VERSION || data[1] < 1 ||
+      data[1] > FILTER_HASHES)
+    return FAILURE;
+  bits = (uint32_t)(len - 2) * 8;
+  for (i = 0; i < data[1]; i++) {
+    bit = ttngwc_filter_hash(dev_addr, i, bits);
+    data[2 + bit / 8] |= 1 << (bit % 8);
+  }
+  return SUCCESS;
+}
+
+// Returns whether the DevAddr matches a prefix or the Bloom filter
+static int ttngwc_filter_match(struct Filter *filter, uint32_t dev_addr) {
+  uint32_t bits, bit;
+  int i;
+
+  for (i = 0; i < filter->count; i++) {
+    if ((dev_addr & filter->masks[i]) == filter->prefixes[i])
+      return 1;
+  }
+  if (!filter->bloom)
+    return 0;
+  bits = (uint32_t)filter->size * 8;
+  for (i = 0; i < filter->hashes; i++) {
+    bit = ttngwc_filter_hash(dev_addr, i, bits);
+    if (!(filter->bloom[bit / 8] & (1 << (bit % 8))))
+      return 0;
+  }
+  return 1;
+}
+
+int ttngwc_filter_pass(struct Session *session,
+                       const Router__UplinkMessage *uplink) {
+  struct Filter *filter = &session->filter;
+  const uint8_t *frame = uplink->payload.data;
+  uint32_t dev_addr;
+  int mtype, pass = 1;
+
+  if (!__atomic_load_n(&filter->active, __ATOMIC_ACQUIRE) ||
+      !uplink->has_payload || uplink->payload.len < 1)
+    return 1;
+  mtype = frame[0] >> 5;
+
+  MutexLock(&filter->mutex);
+  if (filter->count == 0 && !filter->bloom)
+    goto exit;
+  filter->stats.checked++;
+  if (mtype < MTYPE_UNCONFIRMED_UP || mtype > MTYPE_CONFIRMED_DOWN ||
+      uplink->payload.len < DATA_MIN_LENGTH) {
+    filter->stats.passed_other++;
+    goto exit;
+  }
+  dev_addr = (uint32_t)frame[1] | (uint32_t)frame[2] << 8 |
+             (uint32_t)frame[3] << 16 | (uint32_t)frame[4] << 24;
+  pass = ttngwc_filter_match(filter, dev_addr);
+  if (!pass) {
+    filter->stats.filtered++;
+    filter->stats.bytes_saved += router__uplink_message__get_packed_size(uplink);
+  }
+exit:
+  MutexUnlock(&filter->mutex);
+
+  return pass;
+}
+
+void ttngwc_filter_cb(struct MessageData *data, void *s) {
+  ttngwc_filter_set_bloom((struct Session *)s,
+                          (const uint8_t *)data->message->payload,
+                          data->message->payloadlen);
+}
+
+void ttngwc_filter_get_stats(struct Session *session, TTNFilterStats *stats) {
+  struct Filter *filter = &session->filter;
+  MutexLock(&filter->mutex);
+  *stats = filter->stats;
+  MutexUnlock(&filter->mutex);
+}
@@ -0,0 +1,73 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+#if !defined(__TTN_GW_FILTER_H_)
+#define __TTN_GW_FILTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <MQTTClient.h>
+
+#include "connector.h"
+#include "platform.h"
+
+// Number of DevAddr prefixes that the filter holds
+#define FILTER_PREFIXES 16
+// Version of the encoded Bloom filter
+#define FILTER_VERSION 1
+// Most hash functions of a Bloom filter
+#define FILTER_HASHES 16
+
+struct Session;
+
+// Decides which uplinks are published by the DevAddr in their LoRaWAN frame.
+// A data frame passes when its DevAddr starts with one of the prefixes or is
+// in the Bloom filter. Other frames, such as join requests, always pass, as
+// do all frames while the filter is empty
+struct Filter {
+  Mutex mutex;
+  uint32_t prefixes[FILTER_PREFIXES];
+  uint32_t masks[FILTER_PREFIXES];
+  int count;
+  uint8_t *bloom;
+  // Size of the Bloom filter in bytes
+  size_t size;
+  int hashes;
+  // Whether there are prefixes or a Bloom filter, read without the mutex so
+  // that uplinks pass an empty filter without waiting
+  int active;
+  TTNFilterStats stats;
+};
+
+// Initializes the filter of the session without prefixes
+void ttngwc_filter_init(struct Session *session);
+
+// Releases the Bloom filter
+void ttngwc_filter_destroy(struct Session *session);
+
+// Adds the DevAddr prefix of the given length in bits
+// Returns 0 on success or -1 when the length is invalid or the table is full
+int ttngwc_filter_add_prefix(struct Session *session, uint32_t prefix,
+                             int bits);
+
+// Replaces the Bloom filter by an encoded one. An empty filter removes it
+// Returns 0 on success or -1 when malformed or out of memory
+int ttngwc_filter_set_bloom(struct Session *session, const uint8_t *data,
+                            size_t len);
+
+// Removes the prefixes and the Bloom filter
+void ttngwc_filter_reset(struct Session *session);
+
+// Checks whether the uplink is to be published
+// Returns 1 when it passes, 0 when it is filtered
+int ttngwc_filter_pass(struct Session *session,
+                       const Router__UplinkMessage *uplink);
+
+// Handles a Bloom filter published by the router on the filter topic
+void ttngwc_filter_cb(struct MessageData *data, void *s);
+
+// Gets the counters of the filter
+void ttngwc_filter_get_stats(struct Session *session, TTNFilterStats *stats);
+
+#endif
@@ -0,0 +1,76 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "histogram.h"
+
+static int ttngwc_histogram_index(uint32_t value) {
+  int shift;
+
+  if (value < 2 * HISTOGRAM_SUB_BUCKETS)
+    return value;
+  shift = 31 - __builtin_clz(value) - HISTOGRAM_BITS;
+  return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (value >> shift) -
+         HISTOGRAM_SUB_BUCKETS;
+}
+
+// Returns the middle of the range of values counted in the bucket
+static uint32_t ttngwc_histogram_middle(int index) {
+  int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+  uint32_t low;
+
+  if (shift <= 0)
+    return index;
+  low = (uint32_t)(index % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS)
+        << shift;
+  return low + ((1u << shift) - 1) / 2;
+}
+
+void ttngwc_histogram_record(struct Histogram *histogram, uint32_t value) {
+  histogram->counts[ttngwc_histogram_index(value)]++;
+  histogram->total++;
+}
+
+uint32_t ttngwc_histogram_value(const struct Histogram *histogram,
+                                double fraction) {
+  uint64_t rank, seen = 0;
+  int i;
+
+  if (histogram->total == 0)
+    return 0;
+  rank = (uint64_t)(fraction * histogram->total + 0.5);
+  if (rank < 1)
+    rank = 1;
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += histogram->counts[i];
+    if (seen >= rank)
+      return ttngwc_histogram_middle(i);
+  }
+  return ttngwc_histogram_middle(HISTOGRAM_BUCKETS - 1);
+}
+
+void ttngwc_histogram_percentiles(const struct Histogram *histogram,
+                                  double scale, Api__Percentiles *percentiles) {
+  struct {
+    protobuf_c_boolean *has;
+    float *value;
+    double fraction;
+  } fields[] = {
+      {&percentiles->has_percentile1, &percentiles->percentile1, 0.01},
+      {&percentiles->has_percentile5, &percentiles->percentile5, 0.05},
+      {&percentiles->has_percentile10, &percentiles->percentile10, 0.10},
+      {&percentiles->has_percentile25, &percentiles->percentile25, 0.25},
+      {&percentiles->has_percentile50, &percentiles->percentile50, 0.50},
+      {&percentiles->has_percentile75, &percentiles->percentile75, 0.75},
+      {&percentiles->has_percentile90, &percentiles->percentile90, 0.90},
+      {&percentiles->has_percentile95, &percentiles->percentile95, 0.95},
+      {&percentiles->has_percentile99, &percentiles->percentile99, 0.99},
+  };
+  int i;
+
+  for (i = 0; i < (int)(sizeof(fields) / sizeof(fields[0])); i++) {
+    *fields[i].has = histogram->total > 0;
+    *fields[i].value =
+        (float)(ttngwc_histogram_value(histogram, fields[i].fraction) / scale);
+  }
+}
@@ -0,0 +1,37 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+#if !defined(__TTN_GW_HISTOGRAM_H_)
+#define __TTN_GW_HISTOGRAM_H_
+
+#include <stdint.h>
+
+#include "github.com/TheThingsNetwork/ttn/api/api.pb-c.h"
+
+// Values below twice the number of sub-buckets are counted exactly. Larger
+// values are counted in buckets that double in width with each power of two,
+// each split in HISTOGRAM_SUB_BUCKETS, so that the error stays within 3%
+#define HISTOGRAM_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_BITS)
+#define HISTOGRAM_BUCKETS ((33 - HISTOGRAM_BITS) * HISTOGRAM_SUB_BUCKETS)
+
+// Log-linear histogram of 32-bit values in a fixed amount of memory
+struct Histogram {
+  uint32_t counts[HISTOGRAM_BUCKETS];
+  uint64_t total;
+};
+
+// Counts the value
+void ttngwc_histogram_record(struct Histogram *histogram, uint32_t value);
+
+// Returns the value below which the given fraction of the values fall, or 0
+// when nothing was counted
+uint32_t ttngwc_histogram_value(const struct Histogram *histogram,
+                                double fraction);
+
+// Fills the percentiles, dividing the values by the scale. Percentiles are
+// left unset when nothing was counted
+void ttngwc_histogram_percentiles(const struct Histogram *histogram,
+                                  double scale, Api__Percentiles *percentiles);
+
+#endif
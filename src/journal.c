@@ -0,0 +1,432 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "network.h"
+
+#if !defined(__harmony__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crc.h"
+
+#define JOURNAL_MAGIC 0x4a4e5454
+#define JOURNAL_VERSION 1
+#define JOURNAL_ALIGN 8
+#define JOURNAL_WRAP 0xffffffff
+
+struct JournalHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t generation;
+  uint32_t head_sequence;
+  uint64_t head;
+  uint32_t reserved;
+  uint32_t crc;
+};
+
+// A record with the wrap length marks that the ring continues at the start
+struct JournalRecord {
+  uint32_t length;
+  uint32_t sequence;
+  uint32_t crc;
+  uint32_t reserved;
+};
+
+#define JOURNAL_DATA_OFFSET (2 * sizeof(struct JournalHeader))
+
+static size_t ttngwc_journal_size(size_t length) {
+  size_t size = sizeof(struct JournalRecord) + length;
+  return (size + JOURNAL_ALIGN - 1) & ~(size_t)(JOURNAL_ALIGN - 1);
+}
+
+static uint32_t ttngwc_journal_crc(const struct JournalRecord *record) {
+  uint32_t crc = ttngwc_crc32c(0, record, offsetof(struct JournalRecord, crc));
+  if (record->length == JOURNAL_WRAP)
+    return crc;
+  return ttngwc_crc32c(crc, record + 1, record->length);
+}
+
+// Returns the record with the sequence number at the offset, following the
+// end of the ring, or NULL when there is no such record. The offset is set to
+// the position of the record
+static struct JournalRecord *ttngwc_journal_record(struct Journal *journal,
+                                                   size_t *offset,
+                                                   uint32_t sequence) {
+  struct JournalRecord *record;
+
+  if (journal->capacity - *offset < sizeof(struct JournalRecord))
+    *offset = 0;
+  record = (struct JournalRecord *)&journal->data[*offset];
+  if (record->sequence != sequence)
+    return NULL;
+  if (record->length == JOURNAL_WRAP) {
+    if (record->crc != ttngwc_journal_crc(record))
+      return NULL;
+    *offset = 0;
+    record = (struct JournalRecord *)journal->data;
+    if (record->sequence != sequence || record->length == JOURNAL_WRAP)
+      return NULL;
+  }
+  if (record->length > journal->capacity - *offset - sizeof(*record) ||
+      record->crc != ttngwc_journal_crc(record))
+    return NULL;
+  return record;
+}
+
+static void ttngwc_journal_write_header(struct Journal *journal) {
+  struct JournalHeader header;
+
+  header.magic = JOURNAL_MAGIC;
+  header.version = JOURNAL_VERSION;
+  header.generation = ++journal->generation;
+  header.head_sequence = journal->head_sequence;
+  header.head = journal->head;
+  header.reserved = 0;
+  header.crc = ttngwc_crc32c(0, &header, offsetof(struct JournalHeader, crc));
+  memcpy(&journal->map[(header.generation % 2) * sizeof(header)], &header,
+         sizeof(header));
+  journal->unsynced++;
+}
+
+static void ttngwc_journal_sync(struct Session *session) {
+  struct Journal *journal = &session->journal;
+  msync(journal->map, journal->map_size, MS_SYNC);
+  journal->unsynced = 0;
+  TimerCountdownMS(&journal->sync_timer,
+                   session->config.journal_sync_interval_ms);
+}
+
+// Drops the oldest record
+static void ttngwc_journal_pop(struct Journal *journal) {
+  size_t offset = journal->head;
+  struct JournalRecord *record =
+      ttngwc_journal_record(journal, &offset, journal->head_sequence);
+  if (!record) {
+    // The file was changed by someone else; forget what it holds
+    journal->head = journal->tail;
+    journal->head_sequence = journal->tail_sequence;
+    journal->acknowledged = 0;
+  } else {
+    journal->head = offset + ttngwc_journal_size(record->length);
+    journal->head_sequence++;
+    journal->acknowledged >>= 1;
+  }
+  if ((int32_t)(journal->cursor_sequence - journal->head_sequence) < 0) {
+    journal->cursor = journal->head;
+    journal->cursor_sequence = journal->head_sequence;
+  }
+}
+
+// Finds the most recent header and the end of the ring. Records are valid
+// when their CRC matches and their sequence number follows the previous one,
+// so a record that was partially written when the process stopped ends the
+// ring, like the stale records of an earlier pass over the file
+static void ttngwc_journal_recover(struct Journal *journal) {
+  struct JournalHeader *headers = (struct JournalHeader *)journal->map;
+  struct JournalHeader *header = NULL;
+  struct JournalRecord *record;
+  size_t offset;
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    if (headers[i].magic != JOURNAL_MAGIC ||
+        headers[i].version != JOURNAL_VERSION ||
+        headers[i].head > journal->capacity ||
+        headers[i].crc != ttngwc_crc32c(0, &headers[i],
+                                        offsetof(struct JournalHeader, crc)))
+      continue;
+    if (!header || (int32_t)(headers[i].generation - header->generation) > 0)
+      header = &headers[i];
+  }
+  if (header) {
+    journal->head = header->head & ~(size_t)(JOURNAL_ALIGN - 1);
+    journal->head_sequence = header->head_sequence;
+    journal->generation = header->generation;
+  } else {
+    journal->head = 0;
+    journal->head_sequence = 0;
+    journal->generation = 0;
+    memset(journal->data, 0, sizeof(struct JournalRecord));
+    ttngwc_journal_write_header(journal);
+  }
+
+  offset = journal->head;
+  journal->tail_sequence = journal->head_sequence;
+  while ((record = ttngwc_journal_record(journal, &offset,
+                                         journal->tail_sequence))) {
+    offset += ttngwc_journal_size(record->length);
+    journal->tail_sequence++;
+  }
+  journal->tail = offset;
+
+  journal->cursor = journal->head;
+  journal->cursor_sequence = journal->head_sequence;
+  journal->replay_sequence = journal->tail_sequence - 1;
+}
+
+int ttngwc_journal_open(struct Session *session) {
+  struct Journal *journal = &session->journal;
+  TTNConfig *config = &session->config;
+  struct stat st;
+  int i, created = 1;
+
+  journal->fd = -1;
+  MutexInit(&journal->mutex);
+  for (i = 0; i < JOURNAL_SPAN; i++)
+    journal->items[i].session = session;
+  if (!config->journal_path)
+    return SUCCESS;
+
+  int fd = open(config->journal_path, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0 && errno == EEXIST) {
+    created = 0;
+    fd = open(config->journal_path, O_RDWR);
+  }
+  if (fd < 0)
+    return FAILURE;
+  if (fstat(fd, &st) != 0)
+    goto fail;
+  // An existing file keeps its size, so that its records stay in place
+  size_t size = st.st_size;
+  if (size == 0) {
+    size = config->journal_size;
+    if (ftruncate(fd, size) != 0)
+      goto fail;
+  }
+  if (size < JOURNAL_DATA_OFFSET + 2 * ttngwc_journal_size(0))
+    goto fail;
+
+  journal->map =
+      mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (journal->map == MAP_FAILED)
+    goto fail;
+  journal->fd = fd;
+  journal->map_size = size;
+  journal->data = journal->map + JOURNAL_DATA_OFFSET;
+  journal->capacity =
+      (size - JOURNAL_DATA_OFFSET) & ~(size_t)(JOURNAL_ALIGN - 1);
+
+  ttngwc_journal_recover(journal);
+  TimerInit(&journal->replay_timer);
+  TimerInit(&journal->sync_timer);
+  ttngwc_journal_sync(session);
+  return SUCCESS;
+
+fail:
+  // A file that was created here is not left behind
+  if (created)
+    unlink(config->journal_path);
+  close(fd);
+  return FAILURE;
+}
+
+void ttngwc_journal_close(struct Session *session) {
+  struct Journal *journal = &session->journal;
+  if (journal->fd < 0)
+    return;
+  ttngwc_journal_sync(session);
+  munmap(journal->map, journal->map_size);
+  close(journal->fd);
+  journal->fd = -1;
+}
+
+int ttngwc_journal_enabled(struct Session *session) {
+  return session->journal.fd >= 0;
+}
+
+int ttngwc_journal_append(struct Session *session,
+                          const ProtobufCMessage *message) {
+  struct Journal *journal = &session->journal;
+  struct JournalRecord *record;
+  size_t len = protobuf_c_message_get_packed_size(message);
+  size_t size = ttngwc_journal_size(len);
+
+  if (size >= journal->capacity || len >= JOURNAL_WRAP)
+    return FAILURE;
+
+  MutexLock(&journal->mutex);
+  for (;;) {
+    if (journal->head_sequence == journal->tail_sequence) {
+      // The ring is empty, so it can start over anywhere
+      if (journal->capacity - journal->tail < size) {
+        journal->head = journal->tail = journal->cursor = 0;
+        ttngwc_journal_write_header(journal);
+      }
+      break;
+    }
+    if (journal->tail > journal->head) {
+      if (journal->capacity - journal->tail >= size)
+        break;
+      // Continue at the start of the ring
+      if (journal->capacity - journal->tail >= sizeof(struct JournalRecord)) {
+        record = (struct JournalRecord *)&journal->data[journal->tail];
+        record->length = JOURNAL_WRAP;
+        record->sequence = journal->tail_sequence;
+        record->reserved = 0;
+        record->crc = ttngwc_journal_crc(record);
+      }
+      journal->tail = 0;
+      continue;
+    }
+    if (journal->head - journal->tail >= size)
+      break;
+    // The journal is full, so the oldest uplink is lost
+    ttngwc_journal_pop(journal);
+    ttngwc_journal_write_header(journal);
+    journal->dropped++;
+  }
+
+  record = (struct JournalRecord *)&journal->data[journal->tail];
+  protobuf_c_message_pack(message, (uint8_t *)(record + 1));
+  record->length = len;
+  record->sequence = journal->tail_sequence;
+  record->reserved = 0;
+  record->crc = ttngwc_journal_crc(record);
+  journal->tail += size;
+  journal->tail_sequence++;
+
+  if (++journal->unsynced >= session->config.journal_sync_records)
+    ttngwc_journal_sync(session);
+  MutexUnlock(&journal->mutex);
+
+  return SUCCESS;
+}
+
+// Completes a record that was queued in the outbox. Acknowledged records are
+// removed once the records before them are acknowledged as well; the others
+// are queued again once nothing is outstanding
+static void ttngwc_journal_done(int rc, void *arg) {
+  struct JournalItem *item = (struct JournalItem *)arg;
+  struct Journal *journal = &item->session->journal;
+  int advanced = 0;
+
+  MutexLock(&journal->mutex);
+  journal->outstanding--;
+  item->pending = 0;
+  uint32_t index = item->sequence - journal->head_sequence;
+  if (index < JOURNAL_SPAN) {
+    if (rc == SUCCESS)
+      journal->acknowledged |= (uint64_t)1 << index;
+    else
+      journal->rewind = 1;
+  }
+  while ((journal->acknowledged & 1) &&
+         journal->head_sequence != journal->cursor_sequence) {
+    ttngwc_journal_pop(journal);
+    advanced = 1;
+  }
+  if (advanced)
+    ttngwc_journal_write_header(journal);
+  MutexUnlock(&journal->mutex);
+}
+
+void ttngwc_journal_feed(struct Session *session) {
+  struct Journal *journal = &session->journal;
+  int rate = session->config.journal_rate, queued = 0;
+
+  if (journal->fd < 0)
+    return;
+
+  MutexLock(&journal->mutex);
+  if (journal->rewind && journal->outstanding == 0) {
+    journal->cursor = journal->head;
+    journal->cursor_sequence = journal->head_sequence;
+    journal->rewind = 0;
+  }
+  while (session->connected && !journal->rewind &&
+         journal->cursor_sequence != journal->tail_sequence &&
+         journal->cursor_sequence - journal->head_sequence < JOURNAL_SPAN) {
+    uint32_t index = journal->cursor_sequence - journal->head_sequence;
+    size_t offset = journal->cursor;
+    struct JournalRecord *record =
+        ttngwc_journal_record(journal, &offset, journal->cursor_sequence);
+    if (!record)
+      break;
+
+    if (!(journal->acknowledged & ((uint64_t)1 << index))) {
+      int replay =
+          (int32_t)(journal->cursor_sequence - journal->replay_sequence) <= 0;
+      if (replay && rate > 0 && !TimerIsExpired(&journal->replay_timer))
+        break;
+      // The item may still be in use by a record that was dropped
+      struct JournalItem *item =
+          &journal->items[journal->cursor_sequence % JOURNAL_SPAN];
+      if (item->pending)
+        break;
+      item->sequence = journal->cursor_sequence;
+      if (ttngwc_outbox_push_raw(session, CLASS_UP, (uint8_t *)(record + 1),
+                                 record->length, &ttngwc_journal_done,
+                                 item) != SUCCESS)
+        break;
+      if (replay && rate > 0)
+        TimerCountdownMS(&journal->replay_timer, 1000 / rate);
+      item->pending = 1;
+      journal->outstanding++;
+      queued++;
+    }
+    journal->cursor = offset + ttngwc_journal_size(record->length);
+    journal->cursor_sequence++;
+  }
+  if (journal->unsynced > 0 && TimerIsExpired(&journal->sync_timer))
+    ttngwc_journal_sync(session);
+  MutexUnlock(&journal->mutex);
+
+  if (queued > 0)
+    ttngwc_sender_pump(session);
+}
+
+void ttngwc_journal_replay(struct Session *session) {
+  struct Journal *journal = &session->journal;
+  if (journal->fd < 0)
+    return;
+
+  MutexLock(&journal->mutex);
+  journal->replay_sequence = journal->tail_sequence - 1;
+  TimerInit(&journal->replay_timer);
+  MutexUnlock(&journal->mutex);
+
+  ttngwc_journal_feed(session);
+}
+
+int ttngwc_journal_records(struct Session *session) {
+  struct Journal *journal = &session->journal;
+  int depth;
+
+  if (journal->fd < 0)
+    return FAILURE;
+  MutexLock(&journal->mutex);
+  depth = journal->tail_sequence - journal->head_sequence;
+  MutexUnlock(&journal->mutex);
+  return depth;
+}
+
+#else
+
+// There is no file system to keep a journal on
+int ttngwc_journal_open(struct Session *session) {
+  session->journal.fd = -1;
+  return session->config.journal_path ? FAILURE : SUCCESS;
+}
+
+void ttngwc_journal_close(struct Session *session) {}
+
+int ttngwc_journal_enabled(struct Session *session) { return 0; }
+
+int ttngwc_journal_append(struct Session *session,
+                          const ProtobufCMessage *message) {
+  return FAILURE;
+}
+
+void ttngwc_journal_feed(struct Session *session) {}
+
+void ttngwc_journal_replay(struct Session *session) {}
+
+int ttngwc_journal_records(struct Session *session) { return FAILURE; }
+
+#endif
@@ -0,0 +1,91 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+#if !defined(__TTN_GW_JOURNAL_H_)
+#define __TTN_GW_JOURNAL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <MQTTClient.h>
+
+#include "connector.h"
+
+// Records that may be published before the oldest one is acknowledged
+#define JOURNAL_SPAN 64
+
+struct Session;
+
+// Completion argument of a record that is queued in the outbox
+struct JournalItem {
+  struct Session *session;
+  uint32_t sequence;
+  int pending;
+};
+
+// Uplinks are stored in a memory-mapped file that is used as a ring of
+// records. The file starts with two copies of the header, which are written
+// alternately so that one of them is always valid. The end of the ring is not
+// stored: records are read from the head for as long as their CRC and
+// sequence number are valid
+struct Journal {
+  int fd;
+  unsigned char *map;
+  size_t map_size;
+  unsigned char *data;
+  size_t capacity;
+  Mutex mutex;
+
+  // The ring holds the records from head up to tail
+  size_t head;
+  size_t tail;
+  uint32_t head_sequence;
+  uint32_t tail_sequence;
+  uint32_t generation;
+
+  // Records from cursor are not yet queued in the outbox. The acknowledged
+  // bitmap holds the records after head that were acknowledged out of order
+  size_t cursor;
+  uint32_t cursor_sequence;
+  uint64_t acknowledged;
+  struct JournalItem items[JOURNAL_SPAN];
+  int outstanding;
+  int rewind;
+
+  // Records up to replay_sequence were stored before the connection was made
+  // and are published at a limited rate
+  uint32_t replay_sequence;
+  Timer replay_timer;
+
+  int unsynced;
+  Timer sync_timer;
+  unsigned long dropped;
+};
+
+// Opens or creates the journal file of the session and recovers the records
+// that were not acknowledged. Without a journal path, the journal is disabled
+// Returns 0 on success, -1 on failure
+int ttngwc_journal_open(struct Session *session);
+
+// Syncs and closes the journal
+void ttngwc_journal_close(struct Session *session);
+
+// Returns whether the journal of the session is in use
+int ttngwc_journal_enabled(struct Session *session);
+
+// Stores an uplink, dropping the oldest records when the journal is full
+// Returns 0 when stored, -1 on failure
+int ttngwc_journal_append(struct Session *session,
+                          const ProtobufCMessage *message);
+
+// Queues stored records in the outbox, in order and at the replay rate for
+// records stored before connecting. Syncs the file when due
+void ttngwc_journal_feed(struct Session *session);
+
+// Starts replaying the stored records, for use when the connection is made
+void ttngwc_journal_replay(struct Session *session);
+
+// Returns the number of stored records
+int ttngwc_journal_records(struct Session *session);
+
+#endif
@@ -0,0 +1,252 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "network.h"
+
+// Room for the fixed header with the longest remaining length
+#define MAX_HEADER_SIZE 5
+
+// Makes room for len more bytes, moving unread bytes to the front when needed
+static int ttngwc_loopback_room(struct LoopbackPipe *pipe, size_t len) {
+  if (pipe->start > 0 && pipe->end + len > pipe->buffer.size) {
+    memmove(pipe->buffer.data, &pipe->buffer.data[pipe->start],
+            pipe->end - pipe->start);
+    pipe->end -= pipe->start;
+    pipe->start = 0;
+  }
+  return ttngwc_arena_reserve(&pipe->buffer, pipe->end + len) ? SUCCESS
+                                                               : FAILURE;
+}
+
+static int ttngwc_loopback_put(struct LoopbackPipe *pipe,
+                               const unsigned char *buf, size_t len) {
+  if (ttngwc_loopback_room(pipe, len) != SUCCESS)
+    return FAILURE;
+  memcpy(&pipe->buffer.data[pipe->end], buf, len);
+  pipe->end += len;
+  return SUCCESS;
+}
+
+static size_t ttngwc_loopback_available(struct LoopbackPipe *pipe) {
+  return pipe->end - pipe->start;
+}
+
+static void ttngwc_loopback_consume(struct LoopbackPipe *pipe, size_t len) {
+  pipe->start += len;
+  if (pipe->start == pipe->end)
+    pipe->start = pipe->end = 0;
+}
+
+static void ttngwc_loopback_answer(struct Loopback *loopback,
+                                   unsigned char type, unsigned short packetid,
+                                   int qos) {
+  unsigned char buf[5];
+  int len = 2;
+
+  buf[0] = type << 4;
+  buf[1] = 0;
+  if (type == CONNACK || type == PUBACK || type == SUBACK) {
+    buf[1] = 2;
+    buf[2] = type == CONNACK ? 0 : packetid >> 8;
+    buf[3] = type == CONNACK ? 0 : packetid & 0xff;
+    len = 4;
+  }
+  if (type == SUBACK) {
+    buf[1] = 3;
+    buf[4] = qos;
+    len = 5;
+  }
+  ttngwc_loopback_put(&loopback->to_client, buf, len);
+}
+
+// Answers the complete packets written by the client. Returns whether
+// anything was written back
+static int ttngwc_loopback_respond(struct Loopback *loopback) {
+  struct LoopbackPipe *pipe = &loopback->to_responder;
+  int answered = 0;
+
+  for (;;) {
+    unsigned char *p = &pipe->buffer.data[pipe->start];
+    size_t available = ttngwc_loopback_available(pipe), pos = 1;
+    int remaining = 0, multiplier = 1;
+    unsigned char c;
+
+    if (available < 2)
+      break;
+    do {
+      if (pos >= available || pos > 4)
+        return answered;
+      c = p[pos++];
+      remaining += (c & 127) * multiplier;
+      multiplier *= 128;
+    } while (c & 128);
+    if (available < pos + remaining)
+      break;
+
+    unsigned char *body = &p[pos];
+    MQTTHeader header;
+    header.byte = p[0];
+    switch (header.bits.type) {
+    case CONNECT:
+      loopback->connected = 1;
+      ttngwc_loopback_answer(loopback, CONNACK, 0, 0);
+      answered = 1;
+      break;
+    case PUBLISH:
+      loopback->published++;
+      if (header.bits.qos > 0) {
+        int topic_len = body[0] << 8 | body[1];
+        ttngwc_loopback_answer(loopback, PUBACK,
+                               body[2 + topic_len] << 8 | body[3 + topic_len],
+                               0);
+        answered = 1;
+      }
+      break;
+    case SUBSCRIBE:
+      // A single topic is subscribed, with its QoS in the last byte
+      ttngwc_loopback_answer(loopback, SUBACK, body[0] << 8 | body[1],
+                             body[remaining - 1]);
+      answered = 1;
+      break;
+    case PINGREQ:
+      ttngwc_loopback_answer(loopback, PINGRESP, 0, 0);
+      answered = 1;
+      break;
+    case DISCONNECT:
+      loopback->connected = 0;
+      break;
+    default:
+      // Acknowledgements of injected messages need no answer
+      break;
+    }
+    ttngwc_loopback_consume(pipe, pos + remaining);
+  }
+  return answered;
+}
+
+static int ttngwc_loopback_read(Network *n, unsigned char *buf, int len,
+                                int timeout_ms) {
+  struct Loopback *loopback = ((struct Session *)n)->loopback;
+  Timer timer;
+  int read = 0;
+
+  TimerInit(&timer);
+  TimerCountdownMS(&timer, timeout_ms);
+  for (;;) {
+    MutexLock(&loopback->mutex);
+    size_t available = ttngwc_loopback_available(&loopback->to_client);
+    if (available > 0) {
+      read = available < (size_t)(len - read) ? (int)available : len - read;
+      memcpy(buf, &loopback->to_client.buffer.data[loopback->to_client.start],
+             read);
+      ttngwc_loopback_consume(&loopback->to_client, read);
+    }
+    MutexUnlock(&loopback->mutex);
+    if (read > 0 || TimerIsExpired(&timer))
+      return read;
+    EventWait(&loopback->readable, TimerLeftMS(&timer));
+  }
+}
+
+static int ttngwc_loopback_write(Network *n, unsigned char *buf, int len,
+                                 int timeout_ms) {
+  struct Loopback *loopback = ((struct Session *)n)->loopback;
+  int answered = 0, rc = len;
+
+  MutexLock(&loopback->mutex);
+  if (ttngwc_loopback_put(&loopback->to_responder, buf, len) == SUCCESS)
+    answered = ttngwc_loopback_respond(loopback);
+  else
+    rc = FAILURE;
+  MutexUnlock(&loopback->mutex);
+
+  if (answered)
+    EventSet(&loopback->readable);
+  return rc;
+}
+
+static int ttngwc_loopback_connect(Network *n, char *host, int port) {
+  struct Loopback *loopback = ((struct Session *)n)->loopback;
+
+  MutexLock(&loopback->mutex);
+  loopback->to_client.start = loopback->to_client.end = 0;
+  loopback->to_responder.start = loopback->to_responder.end = 0;
+  MutexUnlock(&loopback->mutex);
+  return SUCCESS;
+}
+
+static void ttngwc_loopback_disconnect(Network *n) {
+  struct Loopback *loopback = ((struct Session *)n)->loopback;
+
+  MutexLock(&loopback->mutex);
+  loopback->connected = 0;
+  MutexUnlock(&loopback->mutex);
+}
+
+int ttngwc_loopback_attach(struct Session *session) {
+  struct Loopback *loopback;
+
+  if (session->loopback)
+    return SUCCESS;
+  loopback = (struct Loopback *)calloc(1, sizeof(struct Loopback));
+  if (!loopback)
+    return FAILURE;
+  MutexInit(&loopback->mutex);
+  EventInit(&loopback->readable);
+  session->loopback = loopback;
+  session->network_read = &ttngwc_loopback_read;
+  session->network_write = &ttngwc_loopback_write;
+  session->network_connect = &ttngwc_loopback_connect;
+  session->network_disconnect = &ttngwc_loopback_disconnect;
+  return SUCCESS;
+}
+
+void ttngwc_loopback_detach(struct Session *session) {
+  struct Loopback *loopback = session->loopback;
+
+  if (!loopback)
+    return;
+  EventDestroy(&loopback->readable);
+  ttngwc_arena_free(&loopback->to_client.buffer);
+  ttngwc_arena_free(&loopback->to_responder.buffer);
+  free(loopback);
+  session->loopback = NULL;
+}
+
+int ttngwc_loopback_inject(struct Session *session, const char *topic,
+                           const uint8_t *payload, size_t len) {
+  struct Loopback *loopback = session->loopback;
+  struct LoopbackPipe *pipe;
+  unsigned char header[MAX_HEADER_SIZE + 2];
+  unsigned char packetid[2];
+  size_t topic_len = strlen(topic);
+  int rc = FAILURE, n;
+
+  if (!loopback)
+    return FAILURE;
+  MutexLock(&loopback->mutex);
+  pipe = &loopback->to_client;
+  header[0] = PUBLISH << 4 | QOS1 << 1;
+  n = 1 + MQTTPacket_encode(&header[1], 2 + topic_len + 2 + len);
+  header[n++] = topic_len >> 8;
+  header[n++] = topic_len & 0xff;
+  // The packet is written at once, so that the client never reads a part
+  if (loopback->connected &&
+      ttngwc_loopback_room(pipe, n + topic_len + 2 + len) == SUCCESS) {
+    if (++loopback->packetid == 0)
+      loopback->packetid = 1;
+    packetid[0] = loopback->packetid >> 8;
+    packetid[1] = loopback->packetid & 0xff;
+    ttngwc_loopback_put(pipe, header, n);
+    ttngwc_loopback_put(pipe, (const unsigned char *)topic, topic_len);
+    ttngwc_loopback_put(pipe, packetid, 2);
+    ttngwc_loopback_put(pipe, payload, len);
+    rc = SUCCESS;
+  }
+  MutexUnlock(&loopback->mutex);
+
+  if (rc == SUCCESS)
+    EventSet(&loopback->readable);
+  return rc;
+}
@@ -0,0 +1,49 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+#if !defined(__TTN_GW_LOOPBACK_H_)
+#define __TTN_GW_LOOPBACK_H_
+
+#include <stddef.h>
+
+#include <MQTTClient.h>
+
+#include "arena.h"
+#include "platform.h"
+
+struct Session;
+
+// Bytes written by one side and not yet read by the other
+struct LoopbackPipe {
+  struct Arena buffer;
+  size_t start;
+  size_t end;
+};
+
+// In-process MQTT responder that the client talks to through memory instead
+// of a socket. Packets written by the client are answered right away on the
+// writing thread, so that reads only wait for injected downlinks
+struct Loopback {
+  Mutex mutex;
+  // Set when bytes are written to the client
+  Event readable;
+  struct LoopbackPipe to_client;
+  struct LoopbackPipe to_responder;
+  int connected;
+  unsigned short packetid;
+  unsigned long published;
+};
+
+// Replaces the network of the session with a loopback to a responder
+// Returns 0 on success, -1 on failure
+int ttngwc_loopback_attach(struct Session *session);
+
+// Releases the loopback of the session, if any
+void ttngwc_loopback_detach(struct Session *session);
+
+// Sends a message from the responder to the client on the topic
+// Returns 0 on success, -1 when not connected or out of memory
+int ttngwc_loopback_inject(struct Session *session, const char *topic,
+                           const uint8_t *payload, size_t len);
+
+#endif
@@ -0,0 +1,415 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include <string.h>
+
+#include "network.h"
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#define HAVE_SOCKET 1
+#define HAVE_WRITEV 1
+#endif
+
+// Room for the fixed header with the longest remaining length
+#define MAX_HEADER_SIZE 5
+
+// MQTTClient reads the remaining length of a packet before its body, so the
+// read buffer is grown in between when the packet does not fit
+static void ttngwc_network_grow(struct Session *session) {
+  struct PacketReader *reader = &session->outbox.reader;
+  MQTTClient *c = &session->client;
+
+  if (reader->state != READ_BODY || reader->pos > 0)
+    return;
+  size_t size = MAX_HEADER_SIZE + reader->remaining;
+  if (size <= (size_t)c->readbuf_size)
+    return;
+  // When over the limit, MQTTClient rejects the packet
+  if (ttngwc_arena_reserve(&session->read_buffer, size)) {
+    c->readbuf = session->read_buffer.data;
+    c->readbuf_size = session->read_buffer.size;
+  }
+}
+
+// Marks the connection as lost and wakes up the supervisor
+static void ttngwc_network_fail(struct Session *session) {
+  if (!session->connected || session->lost)
+    return;
+  session->lost = 1;
+  EventSet(&session->supervisor.wake);
+}
+
+// The router answers pings at the keep alive interval, so a silence of one
+// and a half interval means that the connection is lost. Without keep alive,
+// the connection is only lost when it fails
+static void ttngwc_network_alive(struct Session *session) {
+  if (session->config.keep_alive_interval <= 0)
+    return;
+  TimerCountdownMS(&session->liveness,
+                   session->config.keep_alive_interval * 1500);
+}
+
+static void ttngwc_network_received(struct Session *session, int len) {
+  ttngwc_counters_add(&session->counters, COUNTER_BYTES_IN, len);
+  ttngwc_network_alive(session);
+}
+
+// Hands out the bytes that ttngwc_poll received. While polling, only complete
+// packets are handed out
+static int ttngwc_network_take(struct Session *session, unsigned char *buf,
+                               int len) {
+  size_t end = session->polling ? session->inbound_ready : session->inbound_end;
+  size_t n = end - session->inbound_start;
+
+  if (n > (size_t)len)
+    n = len;
+  if (n == 0)
+    return 0;
+  memcpy(buf, &session->inbound.data[session->inbound_start], n);
+  session->inbound_start += n;
+  if (session->inbound_ready < session->inbound_start)
+    session->inbound_ready = session->inbound_start;
+  if (session->inbound_start == session->inbound_end) {
+    session->inbound_start = 0;
+    session->inbound_ready = 0;
+    session->inbound_end = 0;
+  }
+  return (int)n;
+}
+
+// The network is the first member of the session
+static int ttngwc_network_read(Network *n, unsigned char *buf, int len,
+                               int timeout_ms) {
+  struct Session *session = (struct Session *)n;
+  int rc = ttngwc_network_take(session, buf, len);
+  if (rc < len && !session->polling) {
+    int more = session->network_read(n, &buf[rc], len - rc, timeout_ms);
+    if (more < 0)
+      ttngwc_network_fail(session);
+    if (more > 0) {
+      ttngwc_network_received(session, more);
+      rc += more;
+    } else if (rc == 0) {
+      rc = more;
+    }
+  }
+  if (rc > 0) {
+    ttngwc_outbox_read(session, buf, rc);
+    ttngwc_network_grow(session);
+    // Acknowledgements make room for stored uplinks
+    if (session->outbox.reader.state == READ_HEADER) {
+      ttngwc_journal_feed(session);
+      ttngwc_backlog_feed(session);
+    }
+  } else {
+    ttngwc_sender_pump(session);
+    ttngwc_journal_feed(session);
+    ttngwc_backlog_feed(session);
+  }
+  return rc;
+}
+
+static int ttngwc_network_write(Network *n, unsigned char *buf, int len,
+                                int timeout_ms) {
+  struct Session *session = (struct Session *)n;
+  // A ping response confirms the messages written before the request
+  if (len > 0 && buf[0] == PINGREQ << 4)
+    ttngwc_outbox_ping(session);
+  MutexLock(&session->write_mutex);
+  int rc = session->network_write(n, buf, len, timeout_ms);
+  MutexUnlock(&session->write_mutex);
+  if (rc < 0)
+    ttngwc_network_fail(session);
+  if (rc > 0)
+    ttngwc_counters_add(&session->counters, COUNTER_BYTES_OUT, rc);
+  return rc;
+}
+
+void ttngwc_network_init(struct Session *session) {
+  NetworkInit(&session->network);
+  session->network_read = session->network.mqttread;
+  session->network_write = session->network.mqttwrite;
+  session->network_connect = &NetworkConnect;
+  session->network_disconnect = &NetworkDisconnect;
+  session->network.mqttread = &ttngwc_network_read;
+  session->network.mqttwrite = &ttngwc_network_write;
+  MutexInit(&session->write_mutex);
+  TimerInit(&session->liveness);
+  session->inbound.limit = session->config.max_buffer_size;
+  ttngwc_arena_reserve(&session->inbound, session->config.read_buffer_size);
+}
+
+void ttngwc_network_connected(struct Session *session) {
+  session->lost = 0;
+  session->ping_due = 0;
+  ttngwc_network_alive(session);
+  // Messages queued while disconnected get the full timeout to be sent
+  ttngwc_outbox_resume(session);
+  session->connected = 1;
+}
+
+int ttngwc_network_lost(struct Session *session) {
+  return session->lost ||
+         (session->connected && session->config.keep_alive_interval > 0 &&
+          TimerIsExpired(&session->liveness));
+}
+
+void ttngwc_network_close(struct Session *session) {
+  session->connected = 0;
+  session->client.isconnected = 0;
+  session->network_disconnect(&session->network);
+  // Bytes of the connection that were not read yet are dropped
+  session->inbound_start = 0;
+  session->inbound_ready = 0;
+  session->inbound_end = 0;
+  // Do not close the descriptor again once it has been reused
+  session->network.my_socket = -1;
+}
+
+void ttngwc_network_reserve(struct Session *session, size_t size) {
+  MQTTClient *c = &session->client;
+  if (size <= (size_t)c->buf_size)
+    return;
+  if (ttngwc_arena_reserve(&session->send_buffer, size)) {
+    c->buf = session->send_buffer.data;
+    c->buf_size = session->send_buffer.size;
+  }
+}
+
+// Returns the time left on the timer, at least 1 ms while it has not expired,
+// since a timeout of zero blocks until the socket has room
+static int ttngwc_network_left(Timer *timer) {
+  int left = TimerLeftMS(timer);
+  return left > 0 ? left : 1;
+}
+
+#if HAVE_WRITEV
+// Writes all vectors to the socket in as few system calls as possible
+static int ttngwc_network_writev(int fd, struct iovec *iov, int iovcnt,
+                                 Timer *timer) {
+  while (iovcnt > 0 && !TimerIsExpired(timer)) {
+    int left = ttngwc_network_left(timer);
+    struct timeval tv = {left / 1000, (left % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof(tv));
+
+    ssize_t rc = writev(fd, iov, iovcnt);
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      return FAILURE;
+    }
+    while (iovcnt > 0 && (size_t)rc >= iov->iov_len) {
+      rc -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + rc;
+      iov->iov_len -= rc;
+    }
+  }
+  return iovcnt == 0 ? SUCCESS : FAILURE;
+}
+#endif
+
+int ttngwc_network_sendv(struct Session *session, struct iovec *iov,
+                         int iovcnt) {
+  Timer timer;
+  size_t total = 0;
+  int rc = SUCCESS, i;
+
+  TimerInit(&timer);
+  TimerCountdownMS(&timer, session->config.command_timeout_ms);
+  for (i = 0; i < iovcnt; i++)
+    total += iov[i].iov_len;
+
+  MutexLock(&session->write_mutex);
+#if HAVE_WRITEV
+  if (session->network_write == &linux_write) {
+    rc = ttngwc_network_writev(session->network.my_socket, iov, iovcnt, &timer);
+    iovcnt = 0;
+  }
+#endif
+  for (i = 0; i < iovcnt && rc == SUCCESS; i++) {
+    unsigned char *buf = (unsigned char *)iov[i].iov_base;
+    int len = (int)iov[i].iov_len, sent = 0;
+    while (sent < len && !TimerIsExpired(&timer)) {
+      int n = session->network_write(&session->network, &buf[sent],
+                                     len - sent, ttngwc_network_left(&timer));
+      if (n < 0)
+        break;
+      sent += n;
+    }
+    if (sent < len)
+      rc = FAILURE;
+  }
+  MutexUnlock(&session->write_mutex);
+
+  if (rc != SUCCESS)
+    ttngwc_network_fail(session);
+  else
+    ttngwc_counters_add(&session->counters, COUNTER_BYTES_OUT, total);
+  return rc;
+}
+
+int ttngwc_network_fd(struct Session *session) {
+#if HAVE_SOCKET
+  if (session->connected && !session->loopback)
+    return session->network.my_socket;
+#endif
+  return -1;
+}
+
+int ttngwc_network_interest(struct Session *session) {
+  if (!session->connected)
+    return 0;
+  if (ttngwc_outbox_sendable(session))
+    return TTN_POLL_READ | TTN_POLL_WRITE;
+  return TTN_POLL_READ;
+}
+
+// Reads the bytes that arrived without waiting
+// Returns the number of bytes, 0 when none arrived or -1 when the connection
+// failed
+static int ttngwc_network_receive(struct Session *session, unsigned char *buf,
+                                  int len) {
+#if HAVE_SOCKET
+  if (!session->loopback) {
+    ssize_t rc = recv(session->network.my_socket, buf, len, MSG_DONTWAIT);
+    if (rc > 0)
+      return (int)rc;
+    // The router closed the connection
+    if (rc == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+      return FAILURE;
+    return 0;
+  }
+#endif
+  return session->network_read(&session->network, buf, len, 0);
+}
+
+// Marks the packets that were received completely as ready
+// Returns the size of the next packet once its fixed header is complete, 0
+// before, or -1 when its remaining length is malformed or over the limit
+static int ttngwc_network_scan(struct Session *session) {
+  unsigned char *data = session->inbound.data;
+
+  for (;;) {
+    size_t start = session->inbound_ready, pos = start + 1, remaining = 0;
+    int shift = 0;
+    do {
+      if (pos - start >= MAX_HEADER_SIZE)
+        return FAILURE;
+      if (pos >= session->inbound_end)
+        return 0;
+      remaining |= (size_t)(data[pos] & 127) << shift;
+      shift += 7;
+    } while (data[pos++] & 128);
+    // MQTTClient could not read the packet into its buffer either
+    if (MAX_HEADER_SIZE + remaining > session->read_buffer.limit)
+      return FAILURE;
+    if (session->inbound_end - start < pos - start + remaining)
+      return (int)(pos - start + remaining);
+    session->inbound_ready = pos + remaining;
+  }
+}
+
+// MQTTClient fails when a packet arrives partially, and drops the bytes that it
+// read. The bytes that arrived are buffered instead, until packets are
+// complete
+// Returns -1 when the connection failed or a packet cannot be read
+static int ttngwc_network_fill(struct Session *session) {
+  struct Arena *inbound = &session->inbound;
+  int size, rc, drained = 0;
+  size_t room;
+
+  // Make room behind the packet that is not complete yet
+  if (session->inbound_start > 0) {
+    memmove(inbound->data, &inbound->data[session->inbound_start],
+            session->inbound_end - session->inbound_start);
+    session->inbound_ready -= session->inbound_start;
+    session->inbound_end -= session->inbound_start;
+    session->inbound_start = 0;
+  }
+  for (;;) {
+    size = ttngwc_network_scan(session);
+    if (size < 0)
+      return FAILURE;
+    if (session->inbound_ready + size > inbound->size &&
+        !ttngwc_arena_reserve(inbound, session->inbound_ready + size))
+      return FAILURE;
+    // Read until nothing is left, or until the buffer is full of packets
+    room = inbound->size - session->inbound_end;
+    if (drained || room == 0)
+      return SUCCESS;
+    rc = ttngwc_network_receive(session, &inbound->data[session->inbound_end],
+                                (int)room);
+    if (rc < 0)
+      return FAILURE;
+    if (rc > 0) {
+      ttngwc_network_received(session, rc);
+      session->inbound_end += rc;
+    }
+    drained = (size_t)rc < room;
+  }
+}
+
+// The client sends pings only while it reads, so these are sent here
+static void ttngwc_network_ping(struct Session *session) {
+  unsigned char buf[2];
+  int len = MQTTSerialize_pingreq(buf, sizeof(buf));
+  if (len > 0) {
+    ttngwc_outbox_ping(session);
+    ttngwc_network_send(session, buf, len);
+  }
+}
+
+int ttngwc_network_poll(struct Session *session, unsigned long now) {
+  long wait;
+
+  if (!session->connected)
+    return FAILURE;
+  if (ttngwc_network_fill(session) != SUCCESS)
+    ttngwc_network_fail(session);
+  // The client reads one packet per cycle, from the buffer only
+  session->polling = 1;
+  while (session->inbound_start < session->inbound_ready) {
+    size_t start = session->inbound_start;
+    MQTTYield(&session->client, 0);
+    if (session->inbound_start == start)
+      break;
+  }
+  session->polling = 0;
+
+  if (session->config.keep_alive_interval > 0) {
+    if (session->ping_due == 0)
+      session->ping_due = now + session->config.keep_alive_interval * 1000UL;
+    if ((long)(now - session->ping_due) >= 0) {
+      ttngwc_network_ping(session);
+      session->ping_due = now + session->config.keep_alive_interval * 1000UL;
+    }
+  }
+
+  ttngwc_sender_pump(session);
+  ttngwc_journal_feed(session);
+  ttngwc_backlog_feed(session);
+  if (ttngwc_network_lost(session))
+    return FAILURE;
+
+  // Messages in flight time out within the command timeout
+  wait = session->config.command_timeout_ms;
+  if (session->config.keep_alive_interval > 0 &&
+      (long)(session->ping_due - now) < wait)
+    wait = (long)(session->ping_due - now);
+  return wait > 0 ? (int)wait : 0;
+}
+
+int ttngwc_network_send(struct Session *session, unsigned char *buf, int len) {
+  struct iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  return ttngwc_network_sendv(session, &iov, 1);
+}
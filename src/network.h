@@ -7,6 +7,15 @@
 #include <MQTTClient.h>
 #include <MQTTPacket.h>
 
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/uio.h>
+#else
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+#endif
+
 #include "connector.h"
 #include "session.h"
 #include "github.com/TheThingsNetwork/ttn/api/router/router.pb-c.h"
@@ -15,6 +24,32 @@
 #define COMMAND_TIMEOUT 2000
 #define READ_BUFFER_SIZE 512
 #define SEND_BUFFER_SIZE 512
+#define MAX_BUFFER_SIZE 16384
+// Initial size of the memory in which downlinks are decoded
+#define DOWNLINK_ARENA_SIZE 1024
+
+#define JOURNAL_SIZE (1 << 20)
+#define JOURNAL_RATE 10
+#define JOURNAL_SYNC_RECORDS 32
+#define JOURNAL_SYNC_INTERVAL 1000
+
+#define BACKLOG_SIZE 0
+#define BACKLOG_POLICY TTN_DROP_OLDEST
+#define BACKLOG_MAX_AGE 0
+
+#define SCHEDULER_SIZE 16
+#define SCHEDULER_LEAD 50
+
+#define DEDUP_WINDOW 0
+#define FILTER_UPDATES 0
+
+#define ENVELOPE_SIZE 0
+#define ENVELOPE_DELAY 1000
+
+#define SENDER_QUEUE_SIZE 64
+
+#define RECONNECT_MIN 1000
+#define RECONNECT_MAX 60000
 
 #define QOS_STATUS QOS1
 #define QOS_DOWN QOS1
@@ -22,4 +57,44 @@
 #define QOS_CONNECT QOS1
 #define QOS_WILL QOS1
 
+#define TTNGWC_TIMEOUT -2
+#define TTNGWC_DROPPED -3
+
+// Wraps the network of the session to serialize writes and to track PUBACKs
+void ttngwc_network_init(struct Session *session);
+
+// Marks the session as connected and starts watching the connection
+void ttngwc_network_connected(struct Session *session);
+
+// Returns whether the connection failed or the router went silent
+int ttngwc_network_lost(struct Session *session);
+
+// Closes the connection without talking to the router
+void ttngwc_network_close(struct Session *session);
+
+// Returns the socket of the connection, or -1 when not connected
+int ttngwc_network_fd(struct Session *session);
+
+// Returns the socket events of interest as TTN_POLL_READ and TTN_POLL_WRITE
+int ttngwc_network_interest(struct Session *session);
+
+// Reads the packets that arrived completely, sends pings and queued messages
+// without waiting for the socket. Returns the time in milliseconds until the next call is due,
+// or -1 when not connected or the connection is lost
+int ttngwc_network_poll(struct Session *session, unsigned long now);
+
+// Grows the send buffer of the client to hold a packet of size bytes, up to
+// the maximum buffer size
+void ttngwc_network_reserve(struct Session *session, size_t size);
+
+// Writes a complete packet to the network, serialized with other writers
+// Returns 0 on success, -1 on failure
+int ttngwc_network_send(struct Session *session, unsigned char *buf, int len);
+
+// Writes complete packets to the network at once, serialized with other
+// writers. The vectors are modified
+// Returns 0 on success, -1 on failure
+int ttngwc_network_sendv(struct Session *session, struct iovec *iov,
+                         int iovcnt);
+
 #endif
@@ -0,0 +1,522 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "network.h"
+
+// Room for the fixed header with the longest remaining length
+#define PUBLISH_HEADER_SIZE 5
+
+struct Completion {
+  TTNCompletionHandler handler;
+  void *arg;
+  int rc;
+};
+
+static enum QoS ttngwc_outbox_qos(struct Session *session,
+                                  enum MessageClass class) {
+  if (class == CLASS_STATUS)
+    return (enum QoS)session->config.qos_status;
+  return (enum QoS)session->config.qos_up;
+}
+
+static int ttngwc_outbox_inflight(struct Outbox *outbox) {
+  uint32_t bits = outbox->inflight;
+  int n = 0;
+  for (; bits; bits &= bits - 1)
+    n++;
+  return n;
+}
+
+// Generates a fresh packet identifier for the slot
+static unsigned short ttngwc_outbox_packetid(struct Outbox *outbox, int slot) {
+  unsigned int offset =
+      (outbox->generation++ * OUTBOX_SIZE + slot) % OUTBOX_PACKET_IDS;
+  return OUTBOX_FIRST_PACKET_ID + offset;
+}
+
+// Frees the entry and records its completion
+static void ttngwc_outbox_complete(struct Session *session, int slot,
+                                   struct Completion *done, int rc) {
+  struct Outbox *outbox = &session->outbox;
+  struct OutboxEntry *entry = &outbox->entries[slot];
+  if (entry->class == CLASS_UP)
+    ttngwc_counters_add(&session->counters,
+                        rc == SUCCESS ? COUNTER_UPLINKS_ACKED
+                                      : COUNTER_UPLINKS_FAILED,
+                        1);
+  if (done) {
+    done->handler = entry->handler;
+    done->arg = entry->arg;
+    done->rc = rc;
+  }
+  entry->state = ENTRY_FREE;
+  outbox->inflight &= ~(1u << slot);
+  outbox->count--;
+
+  while (outbox->used > 0 &&
+         outbox->entries[outbox->head].state == ENTRY_FREE) {
+    outbox->head = (outbox->head + 1) % OUTBOX_SIZE;
+    outbox->used--;
+  }
+  if (outbox->count == 0)
+    EventSet(&outbox->drained);
+}
+
+// Calls the completion handlers. This must be done without holding the lock,
+// so that handlers can queue new messages
+static void ttngwc_outbox_notify(struct Completion *done, int n) {
+  int i;
+  for (i = 0; i < n; i++) {
+    if (done[i].handler)
+      done[i].handler(done[i].rc, done[i].arg);
+  }
+}
+
+// Serializes a PUBLISH packet with the message packed directly behind the
+// topic, or the payload when there is no message. The remaining length is only
+// known afterwards, so the fixed header is written last, right in front of the
+// variable header
+static int ttngwc_outbox_serialize(struct OutboxEntry *entry,
+                                   const char *topic_name,
+                                   const ProtobufCMessage *message,
+                                   const uint8_t *payload, size_t len) {
+  MQTTString topic = MQTTString_initializer;
+  MQTTHeader header = {0};
+  struct ArenaAppender appender;
+  unsigned char *ptr;
+  size_t offset, remaining;
+  int lenlen;
+
+  topic.cstring = (char *)topic_name;
+  offset = PUBLISH_HEADER_SIZE + 2 + strlen(topic_name);
+  entry->packetid_pos = offset;
+  if (entry->qos > 0)
+    offset += 2;
+
+  ptr = ttngwc_arena_reserve(&entry->packet, offset);
+  if (!ptr)
+    return FAILURE;
+  ptr += PUBLISH_HEADER_SIZE;
+  writeMQTTString(&ptr, topic);
+
+  ttngwc_arena_appender_init(&appender, &entry->packet, offset);
+  if (message)
+    protobuf_c_message_pack_to_buffer(message, &appender.base);
+  else
+    appender.base.append(&appender.base, len, payload);
+  if (appender.failed)
+    return FAILURE;
+
+  remaining = appender.len - PUBLISH_HEADER_SIZE;
+  lenlen = remaining < 128 ? 1 : remaining < 16384 ? 2
+                                : remaining < 2097152 ? 3 : 4;
+  entry->start = PUBLISH_HEADER_SIZE - 1 - lenlen;
+  entry->len = appender.len - entry->start;
+
+  header.bits.type = PUBLISH;
+  header.bits.qos = entry->qos;
+  entry->packet.data[entry->start] = header.byte;
+  MQTTPacket_encode(&entry->packet.data[entry->start + 1], remaining);
+  return SUCCESS;
+}
+
+void ttngwc_outbox_init(struct Session *session) {
+  struct Outbox *outbox = &session->outbox;
+  int slot;
+
+  MutexInit(&outbox->mutex);
+  EventInit(&outbox->drained);
+  outbox->window = OUTBOX_WINDOW;
+  // Messages that do not fit in the largest buffer fail to queue
+  for (slot = 0; slot < OUTBOX_SIZE; slot++)
+    outbox->entries[slot].packet.limit = session->config.max_buffer_size;
+}
+
+void ttngwc_outbox_destroy(struct Session *session) {
+  struct Outbox *outbox = &session->outbox;
+  int slot;
+
+  ttngwc_outbox_drop(session);
+  for (slot = 0; slot < OUTBOX_SIZE; slot++)
+    ttngwc_arena_free(&outbox->entries[slot].packet);
+  EventDestroy(&outbox->drained);
+}
+
+static int ttngwc_outbox_queue(struct Session *session, enum MessageClass class,
+                               const ProtobufCMessage *message,
+                               const uint8_t *payload, size_t len,
+                               TTNCompletionHandler handler, void *arg) {
+  struct Outbox *outbox = &session->outbox;
+  const char *topic = class == CLASS_STATUS  ? session->status_topic
+                      : class == CLASS_BATCH ? session->batch_topic
+                                             : session->uplink_topic;
+  int rc = SUCCESS;
+
+  MutexLock(&outbox->mutex);
+  struct OutboxEntry *entry =
+      &outbox->entries[(outbox->head + outbox->used) % OUTBOX_SIZE];
+  if (outbox->used == OUTBOX_SIZE) {
+    rc = TTNGWC_DROPPED;
+  } else {
+    entry->qos = ttngwc_outbox_qos(session, class);
+    rc = ttngwc_outbox_serialize(entry, topic, message, payload, len);
+  }
+  if (rc == SUCCESS) {
+    entry->class = class;
+    entry->state = ENTRY_QUEUED;
+    entry->dup = 0;
+    entry->packetid = 0;
+    entry->handler = handler;
+    entry->arg = arg;
+    TimerInit(&entry->timer);
+    TimerCountdownMS(&entry->timer, session->config.command_timeout_ms);
+    outbox->used++;
+    outbox->count++;
+  }
+  MutexUnlock(&outbox->mutex);
+
+  return rc;
+}
+
+int ttngwc_outbox_push(struct Session *session, enum MessageClass class,
+                       const ProtobufCMessage *message,
+                       TTNCompletionHandler handler, void *arg) {
+  return ttngwc_outbox_queue(session, class, message, NULL, 0, handler, arg);
+}
+
+int ttngwc_outbox_push_raw(struct Session *session, enum MessageClass class,
+                           const uint8_t *payload, size_t len,
+                           TTNCompletionHandler handler, void *arg) {
+  return ttngwc_outbox_queue(session, class, NULL, payload, len, handler, arg);
+}
+
+void ttngwc_outbox_pump(struct Session *session) {
+  struct Outbox *outbox = &session->outbox;
+  struct Completion done[OUTBOX_SIZE];
+  struct iovec iov[OUTBOX_SIZE];
+  int sending[OUTBOX_SIZE];
+  int n = 0, count = 0, i, slot, inflight, head, used;
+  uint64_t now;
+
+  MutexLock(&outbox->mutex);
+  for (slot = 0; slot < OUTBOX_SIZE; slot++) {
+    struct OutboxEntry *entry = &outbox->entries[slot];
+    if (((outbox->inflight & (1u << slot)) ||
+         (entry->state == ENTRY_QUEUED && session->connected)) &&
+        TimerIsExpired(&entry->timer))
+      ttngwc_outbox_complete(session, slot, &done[n++], TTNGWC_TIMEOUT);
+  }
+
+  // Gather the packets that fit in the window to write them all at once
+  inflight = ttngwc_outbox_inflight(outbox);
+  head = outbox->head;
+  used = outbox->used;
+  for (i = 0; i < used && inflight + count < outbox->window &&
+              session->connected;
+       i++) {
+    slot = (head + i) % OUTBOX_SIZE;
+    struct OutboxEntry *entry = &outbox->entries[slot];
+    if (entry->state != ENTRY_QUEUED)
+      continue;
+
+    unsigned char *packet = &entry->packet.data[entry->start];
+    if (entry->qos > 0) {
+      // Retransmissions keep their packet identifier
+      if (!entry->dup)
+        entry->packetid = ttngwc_outbox_packetid(outbox, slot);
+      unsigned char *ptr = &entry->packet.data[entry->packetid_pos];
+      writeInt(&ptr, entry->packetid);
+    }
+    if (entry->dup) {
+      MQTTHeader header;
+      header.byte = packet[0];
+      header.bits.dup = 1;
+      packet[0] = header.byte;
+    }
+    iov[count].iov_base = packet;
+    iov[count].iov_len = entry->len;
+    sending[count++] = slot;
+  }
+
+  // Keep the messages queued to retry on the next pump
+  if (count > 0 && ttngwc_network_sendv(session, iov, count) != SUCCESS) {
+    for (i = 0; i < count; i++) {
+      if (outbox->entries[sending[i]].qos == QOS0)
+        outbox->send_failures++;
+    }
+    count = 0;
+  }
+
+  // Completing an entry may advance the head, so this is done after gathering
+  now = count > 0 ? ClockMicros() : 0;
+  for (i = 0; i < count; i++) {
+    slot = sending[i];
+    struct OutboxEntry *entry = &outbox->entries[slot];
+    if (entry->qos == QOS0) {
+      outbox->sequence++;
+      ttngwc_outbox_complete(session, slot, &done[n++], SUCCESS);
+      continue;
+    }
+    entry->sequence = outbox->sequence;
+    entry->sent = now;
+    entry->state = ENTRY_INFLIGHT;
+    TimerInit(&entry->timer);
+    TimerCountdownMS(&entry->timer, session->config.command_timeout_ms);
+    outbox->inflight |= 1u << slot;
+  }
+  MutexUnlock(&outbox->mutex);
+
+  ttngwc_outbox_notify(done, n);
+}
+
+static void ttngwc_outbox_ack(struct Session *session,
+                              unsigned short packetid) {
+  struct Outbox *outbox = &session->outbox;
+  struct Completion done;
+  int n = 0;
+
+  if (packetid < OUTBOX_FIRST_PACKET_ID)
+    return;
+
+  MutexLock(&outbox->mutex);
+  int slot = (packetid - OUTBOX_FIRST_PACKET_ID) % OUTBOX_SIZE;
+  struct OutboxEntry *entry = &outbox->entries[slot];
+  if ((outbox->inflight & (1u << slot)) && entry->packetid == packetid) {
+    if (entry->sequence > outbox->confirmed)
+      outbox->confirmed = entry->sequence;
+    if (!entry->dup) {
+      uint64_t rtt = ClockMicros() - entry->sent;
+      ttngwc_histogram_record(&outbox->rtt[entry->class],
+                              rtt > UINT32_MAX ? UINT32_MAX : (uint32_t)rtt);
+    }
+    ttngwc_outbox_complete(session, slot, &done, SUCCESS);
+    n++;
+  }
+  MutexUnlock(&outbox->mutex);
+
+  ttngwc_outbox_notify(&done, n);
+  if (n > 0)
+    ttngwc_sender_pump(session);
+}
+
+static void ttngwc_outbox_pong(struct Session *session) {
+  struct Outbox *outbox = &session->outbox;
+  MutexLock(&outbox->mutex);
+  if (outbox->ping_sequence > outbox->confirmed)
+    outbox->confirmed = outbox->ping_sequence;
+  MutexUnlock(&outbox->mutex);
+}
+
+// Handles a packet that has been read completely
+static void ttngwc_outbox_received(struct Session *session,
+                                   struct PacketReader *reader) {
+  reader->state = READ_HEADER;
+  if (reader->type == PUBACK)
+    ttngwc_outbox_ack(session, reader->packetid);
+  else if (reader->type == PINGRESP)
+    ttngwc_outbox_pong(session);
+}
+
+void ttngwc_outbox_read(struct Session *session, unsigned char *buf, int len) {
+  struct PacketReader *reader = &session->outbox.reader;
+  int i;
+
+  for (i = 0; i < len; i++) {
+    unsigned char c = buf[i];
+    switch (reader->state) {
+    case READ_HEADER:
+      reader->type = c >> 4;
+      reader->remaining = 0;
+      reader->multiplier = 1;
+      reader->pos = 0;
+      reader->packetid = 0;
+      reader->state = READ_LENGTH;
+      break;
+    case READ_LENGTH:
+      reader->remaining += (c & 127) * reader->multiplier;
+      reader->multiplier *= 128;
+      if (c & 128)
+        break;
+      if (reader->remaining > 0)
+        reader->state = READ_BODY;
+      else
+        ttngwc_outbox_received(session, reader);
+      break;
+    case READ_BODY:
+      if (reader->pos++ < 2)
+        reader->packetid = (reader->packetid << 8) | c;
+      if (--reader->remaining == 0)
+        ttngwc_outbox_received(session, reader);
+      break;
+    }
+  }
+}
+
+int ttngwc_outbox_cancel(struct Session *session, void *arg) {
+  struct Outbox *outbox = &session->outbox;
+  int i, removed = 0;
+
+  MutexLock(&outbox->mutex);
+  for (i = outbox->used - 1; i >= 0; i--) {
+    int slot = (outbox->head + i) % OUTBOX_SIZE;
+    if (outbox->entries[slot].state != ENTRY_FREE &&
+        outbox->entries[slot].arg == arg) {
+      ttngwc_outbox_complete(session, slot, NULL, TTNGWC_DROPPED);
+      removed++;
+    }
+  }
+  MutexUnlock(&outbox->mutex);
+
+  return removed;
+}
+
+int ttngwc_outbox_flush(struct Session *session, int timeout_ms) {
+  Timer timer;
+  TimerInit(&timer);
+  TimerCountdownMS(&timer, timeout_ms);
+
+  // Messages waiting for the I/O thread, including one that did not fit in
+  // the outbox, are not flushed yet
+  for (;;) {
+    ttngwc_sender_pump(session);
+    if (ttngwc_outbox_depth(session) == 0 && ttngwc_sender_depth(session) == 0)
+      return SUCCESS;
+    if (TimerIsExpired(&timer))
+      return TTNGWC_TIMEOUT;
+    EventWait(&session->outbox.drained, TimerLeftMS(&timer));
+  }
+}
+
+void ttngwc_outbox_drop(struct Session *session) {
+  struct Outbox *outbox = &session->outbox;
+  struct Completion done[OUTBOX_SIZE];
+  int n = 0;
+
+  MutexLock(&outbox->mutex);
+  while (outbox->used > 0)
+    ttngwc_outbox_complete(session, outbox->head, &done[n++], TTNGWC_DROPPED);
+  MutexUnlock(&outbox->mutex);
+
+  ttngwc_outbox_notify(done, n);
+}
+
+int ttngwc_outbox_depth(struct Session *session) {
+  struct Outbox *outbox = &session->outbox;
+  int count;
+
+  MutexLock(&outbox->mutex);
+  count = outbox->count;
+  MutexUnlock(&outbox->mutex);
+
+  return count;
+}
+
+int ttngwc_outbox_sendable(struct Session *session) {
+  struct Outbox *outbox = &session->outbox;
+  int i, sendable = 0;
+
+  MutexLock(&outbox->mutex);
+  if (ttngwc_outbox_inflight(outbox) < outbox->window) {
+    for (i = 0; i < outbox->used && !sendable; i++) {
+      if (outbox->entries[(outbox->head + i) % OUTBOX_SIZE].state ==
+          ENTRY_QUEUED)
+        sendable = 1;
+    }
+  }
+  MutexUnlock(&outbox->mutex);
+
+  return sendable;
+}
+
+void ttngwc_outbox_set_window(struct Session *session, int window) {
+  struct Outbox *outbox = &session->outbox;
+  if (window < 1)
+    window = 1;
+  if (window > OUTBOX_SIZE)
+    window = OUTBOX_SIZE;
+
+  MutexLock(&outbox->mutex);
+  outbox->window = window;
+  MutexUnlock(&outbox->mutex);
+}
+
+void ttngwc_outbox_set_qos(struct Session *session, enum MessageClass class,
+                           enum QoS qos) {
+  struct Outbox *outbox = &session->outbox;
+  MutexLock(&outbox->mutex);
+  if (class == CLASS_STATUS)
+    session->config.qos_status = qos;
+  else
+    session->config.qos_up = qos;
+  MutexUnlock(&outbox->mutex);
+}
+
+void ttngwc_outbox_ping(struct Session *session) {
+  struct Outbox *outbox = &session->outbox;
+  MutexLock(&outbox->mutex);
+  outbox->ping_sequence = outbox->sequence;
+  MutexUnlock(&outbox->mutex);
+}
+
+void ttngwc_outbox_loss_stats(struct Session *session, TTNLossStats *stats) {
+  struct Outbox *outbox = &session->outbox;
+  MutexLock(&outbox->mutex);
+  stats->sent = outbox->sequence;
+  stats->confirmed = outbox->confirmed - outbox->lost;
+  stats->unconfirmed = outbox->sequence - outbox->confirmed;
+  stats->lost = outbox->lost;
+  stats->send_failures = outbox->send_failures;
+  MutexUnlock(&outbox->mutex);
+}
+
+void ttngwc_outbox_rtt(struct Session *session, enum MessageClass class,
+                       Api__Percentiles *percentiles) {
+  struct Outbox *outbox = &session->outbox;
+  MutexLock(&outbox->mutex);
+  ttngwc_histogram_percentiles(&outbox->rtt[class], 1000, percentiles);
+  MutexUnlock(&outbox->mutex);
+}
+
+uint32_t ttngwc_outbox_rtt_median(struct Session *session,
+                                  enum MessageClass class) {
+  struct Outbox *outbox = &session->outbox;
+  uint32_t median;
+
+  MutexLock(&outbox->mutex);
+  median = ttngwc_histogram_value(&outbox->rtt[class], 0.5);
+  MutexUnlock(&outbox->mutex);
+
+  return (median + 500) / 1000;
+}
+
+void ttngwc_outbox_resume(struct Session *session) {
+  struct Outbox *outbox = &session->outbox;
+  int slot;
+
+  MutexLock(&outbox->mutex);
+  for (slot = 0; slot < OUTBOX_SIZE; slot++) {
+    if (outbox->entries[slot].state == ENTRY_QUEUED)
+      TimerCountdownMS(&outbox->entries[slot].timer,
+                       session->config.command_timeout_ms);
+  }
+  MutexUnlock(&outbox->mutex);
+}
+
+void ttngwc_outbox_reset(struct Session *session) {
+  struct Outbox *outbox = &session->outbox;
+  int slot;
+
+  MutexLock(&outbox->mutex);
+  memset(&outbox->reader, 0, sizeof(struct PacketReader));
+  for (slot = 0; slot < OUTBOX_SIZE; slot++) {
+    if (outbox->inflight & (1u << slot)) {
+      outbox->entries[slot].state = ENTRY_QUEUED;
+      outbox->entries[slot].dup = 1;
+    }
+  }
+  outbox->inflight = 0;
+  outbox->lost += outbox->sequence - outbox->confirmed;
+  outbox->confirmed = outbox->sequence;
+  MutexUnlock(&outbox->mutex);
+}
@@ -0,0 +1,162 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+#if !defined(__TTN_GW_OUTBOX_H_)
+#define __TTN_GW_OUTBOX_H_
+
+#include <MQTTClient.h>
+
+#include "arena.h"
+#include "connector.h"
+#include "histogram.h"
+#include "platform.h"
+
+// The in-flight bitmap holds one bit per slot, so the size is at most 32
+#define OUTBOX_SIZE 32
+#define OUTBOX_WINDOW 8
+
+// Packet identifiers of the outbox are taken from the upper half of the range.
+// MQTTClient takes those of the lower half, as ttngwc_connect starts it over
+// at 1 on every connection. The slot of a message is encoded in the lower bits
+// to match acknowledgements directly
+#define OUTBOX_FIRST_PACKET_ID 0x8000
+#define OUTBOX_PACKET_IDS 0x8000
+
+struct Session;
+
+enum MessageClass { CLASS_UP, CLASS_STATUS, CLASS_BATCH, CLASS_COUNT };
+
+enum EntryState { ENTRY_FREE, ENTRY_QUEUED, ENTRY_INFLIGHT };
+
+// The PUBLISH packet is serialized when the message is queued. Its packet
+// identifier and DUP flag are filled in when it is sent
+struct OutboxEntry {
+  enum MessageClass class;
+  enum EntryState state;
+  enum QoS qos;
+  unsigned char dup;
+  unsigned short packetid;
+  unsigned long sequence;
+  // Deadline to be sent while queued, then to be acknowledged while in flight
+  Timer timer;
+  // Time in microseconds at which the message was first published
+  uint64_t sent;
+  struct Arena packet;
+  size_t start;
+  size_t len;
+  size_t packetid_pos;
+  TTNCompletionHandler handler;
+  void *arg;
+};
+
+enum ReaderState { READ_HEADER, READ_LENGTH, READ_BODY };
+
+// Tracks the incoming byte stream to pick out PUBACKs
+struct PacketReader {
+  enum ReaderState state;
+  unsigned char type;
+  int remaining;
+  int multiplier;
+  int pos;
+  unsigned short packetid;
+};
+
+// Messages are kept in a ring in submission order. Acknowledgements may
+// arrive out of order, leaving free slots until the head catches up
+struct Outbox {
+  Mutex mutex;
+  Event drained;
+  struct OutboxEntry entries[OUTBOX_SIZE];
+  int head;
+  int used;
+  int count;
+  int window;
+  uint32_t inflight;
+  unsigned short generation;
+  struct PacketReader reader;
+  // Delivery of QoS 0 messages is estimated from their sequence number. An
+  // acknowledgement or a ping response confirms everything written before
+  unsigned long sequence;
+  unsigned long confirmed;
+  unsigned long ping_sequence;
+  unsigned long lost;
+  unsigned long send_failures;
+  // Time in microseconds from publishing to acknowledgement per class.
+  // Retransmitted messages are not counted, as it is unknown which of the
+  // copies is acknowledged
+  struct Histogram rtt[CLASS_COUNT];
+};
+
+// Initializes the outbox of a session
+void ttngwc_outbox_init(struct Session *session);
+
+// Drops all messages and releases the outbox of a session
+void ttngwc_outbox_destroy(struct Session *session);
+
+// Queues a message, serializing it in the memory of its slot
+// Returns 0 when queued, -1 on failure or -3 when the outbox is full
+int ttngwc_outbox_push(struct Session *session, enum MessageClass class,
+                       const ProtobufCMessage *message,
+                       TTNCompletionHandler handler, void *arg);
+
+// Queues a message that has already been packed
+// Returns 0 when queued, -1 on failure or -3 when the outbox is full
+int ttngwc_outbox_push_raw(struct Session *session, enum MessageClass class,
+                           const uint8_t *payload, size_t len,
+                           TTNCompletionHandler handler, void *arg);
+
+// Sends queued messages while the window allows and completes messages that
+// timed out. Queued messages only time out while connected
+void ttngwc_outbox_pump(struct Session *session);
+
+// Feeds bytes read from the network to complete acknowledged messages
+void ttngwc_outbox_read(struct Session *session, unsigned char *buf, int len);
+
+// Removes the messages with the given completion argument without completing
+// them. Returns the number of removed messages
+int ttngwc_outbox_cancel(struct Session *session, void *arg);
+
+// Waits at most timeout_ms for the outbox to drain
+// Returns 0 when drained, -2 on timeout
+int ttngwc_outbox_flush(struct Session *session, int timeout_ms);
+
+// Completes all messages as dropped
+void ttngwc_outbox_drop(struct Session *session);
+
+// Returns the number of queued and unacknowledged messages
+int ttngwc_outbox_depth(struct Session *session);
+
+// Returns whether queued messages can be sent within the window
+int ttngwc_outbox_sendable(struct Session *session);
+
+// Sets the number of messages that may be in flight, between 1 and OUTBOX_SIZE
+void ttngwc_outbox_set_window(struct Session *session, int window);
+
+// Sets the QoS of messages of the class that are queued from now on
+void ttngwc_outbox_set_qos(struct Session *session, enum MessageClass class,
+                           enum QoS qos);
+
+// Records that a ping request is written to the network
+void ttngwc_outbox_ping(struct Session *session);
+
+// Returns the delivery estimate of messages published at QoS 0
+void ttngwc_outbox_loss_stats(struct Session *session, TTNLossStats *stats);
+
+// Fills the percentiles of the round-trip time of the class in milliseconds
+void ttngwc_outbox_rtt(struct Session *session, enum MessageClass class,
+                       Api__Percentiles *percentiles);
+
+// Returns the median round-trip time of the class in milliseconds, or 0 when
+// no acknowledgement was received
+uint32_t ttngwc_outbox_rtt_median(struct Session *session,
+                                  enum MessageClass class);
+
+// Restarts the deadlines of the queued messages, for use once connected
+void ttngwc_outbox_resume(struct Session *session);
+
+// Forgets the partially read packet and marks the messages in flight for
+// retransmission, for use when the connection is reset. QoS 0 messages that
+// were not confirmed are counted as lost
+void ttngwc_outbox_reset(struct Session *session);
+
+#endif
@@ -0,0 +1,99 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "platform.h"
+
+#if defined(__harmony__)
+
+void EventInit(Event *event) { event->sem = xSemaphoreCreateBinary(); }
+
+void EventDestroy(Event *event) { vSemaphoreDelete(event->sem); }
+
+void EventSet(Event *event) { xSemaphoreGive(event->sem); }
+
+int EventWait(Event *event, int timeout_ms) {
+  TickType_t ticks =
+      timeout_ms < 0 ? portMAX_DELAY : timeout_ms / portTICK_PERIOD_MS;
+  return xSemaphoreTake(event->sem, ticks) == pdTRUE ? 0 : -2;
+}
+
+uint64_t ClockMicros(void) {
+  return (uint64_t)xTaskGetTickCount() * portTICK_PERIOD_MS * 1000;
+}
+
+int64_t ClockUnixNanos(void) { return 0; }
+
+#else
+
+#include <errno.h>
+#include <time.h>
+
+void EventInit(Event *event) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+#if defined(__linux__)
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+  pthread_cond_init(&event->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&event->mutex, NULL);
+  event->set = 0;
+}
+
+void EventDestroy(Event *event) {
+  pthread_cond_destroy(&event->cond);
+  pthread_mutex_destroy(&event->mutex);
+}
+
+void EventSet(Event *event) {
+  pthread_mutex_lock(&event->mutex);
+  event->set = 1;
+  pthread_cond_signal(&event->cond);
+  pthread_mutex_unlock(&event->mutex);
+}
+
+int EventWait(Event *event, int timeout_ms) {
+  struct timespec deadline;
+  int rc = 0;
+
+  if (timeout_ms >= 0) {
+#if defined(__linux__)
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+#else
+    clock_gettime(CLOCK_REALTIME, &deadline);
+#endif
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+  }
+
+  pthread_mutex_lock(&event->mutex);
+  while (!event->set && rc != ETIMEDOUT) {
+    if (timeout_ms < 0)
+      pthread_cond_wait(&event->cond, &event->mutex);
+    else
+      rc = pthread_cond_timedwait(&event->cond, &event->mutex, &deadline);
+  }
+  rc = event->set ? 0 : -2;
+  event->set = 0;
+  pthread_mutex_unlock(&event->mutex);
+  return rc;
+}
+
+uint64_t ClockMicros(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+int64_t ClockUnixNanos(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+#endif
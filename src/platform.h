@@ -0,0 +1,45 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+#if !defined(__TTN_GW_PLATFORM_H_)
+#define __TTN_GW_PLATFORM_H_
+
+#include <stdint.h>
+
+#if defined(__harmony__)
+#include "FreeRTOS.h"
+#include "semphr.h"
+
+typedef struct Event {
+  SemaphoreHandle_t sem;
+} Event;
+#else
+#include <pthread.h>
+
+typedef struct Event {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int set;
+} Event;
+#endif
+
+// Initializes an auto-reset event
+void EventInit(Event *event);
+
+// Releases the resources of an event
+void EventDestroy(Event *event);
+
+// Sets the event, waking up a waiter if there is one
+void EventSet(Event *event);
+
+// Waits for the event to be set and resets it. A negative timeout waits forever
+// Returns 0 when the event was set or -2 on timeout
+int EventWait(Event *event, int timeout_ms);
+
+// Returns a monotonic time in microseconds
+uint64_t ClockMicros(void);
+
+// Returns the system time in Unix nanoseconds, or 0 when it is not known
+int64_t ClockUnixNanos(void);
+
+#endif
@@ -0,0 +1,554 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "crc.h"
+#include "network.h"
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+// Events handled per wait
+#define REACTOR_EVENTS 64
+
+// Interval in milliseconds at which a disconnected session is checked
+#define REACTOR_RETRY 1000
+
+// Each loop runs on its own thread with an epoll instance. The sessions of a
+// loop share one timer heap, ordered by the time at which they are polled.
+// Attempts to connect resolve names and wait for the router, so each loop has
+// a connect worker that makes them in turn and hands the sessions back
+struct ReactorLoop {
+  pthread_t thread;
+  int started;
+  pthread_mutex_t mutex;
+  // Signalled after the events of a wait have been handled
+  pthread_cond_t passed;
+  unsigned long pass;
+  int waiting;
+  int epoll_fd;
+  // Wakes up the loop when a session is added
+  int event_fd;
+  struct ReactorSlot **heap;
+  int count;
+  int capacity;
+  int stop;
+  pthread_t worker;
+  int worker_started;
+  // Signalled when an attempt is queued, and after an attempt has ended
+  pthread_cond_t queued;
+  pthread_cond_t attempted;
+  // Sessions waiting for an attempt of the connect worker
+  struct ReactorSlot *first;
+  struct ReactorSlot *last;
+};
+
+struct Reactor {
+  struct ReactorLoop *loops;
+  int count;
+};
+
+static unsigned long ttngwc_reactor_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct Session *ttngwc_reactor_session(struct ReactorSlot *slot) {
+  return (struct Session *)((char *)slot - offsetof(struct Session, reactor));
+}
+
+static int ttngwc_reactor_before(struct ReactorSlot *a, struct ReactorSlot *b) {
+  return (long)(a->due - b->due) < 0;
+}
+
+static void ttngwc_reactor_place(struct ReactorLoop *loop, int i,
+                                 struct ReactorSlot *slot) {
+  loop->heap[i] = slot;
+  slot->heap_index = i;
+}
+
+// Moves the slot at i to its place in the heap
+static void ttngwc_reactor_sift(struct ReactorLoop *loop, int i) {
+  struct ReactorSlot *slot = loop->heap[i];
+
+  while (i > 0 && ttngwc_reactor_before(slot, loop->heap[(i - 1) / 2])) {
+    ttngwc_reactor_place(loop, i, loop->heap[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  for (;;) {
+    int child = 2 * i + 1;
+    if (child >= loop->count)
+      break;
+    if (child + 1 < loop->count &&
+        ttngwc_reactor_before(loop->heap[child + 1], loop->heap[child]))
+      child++;
+    if (!ttngwc_reactor_before(loop->heap[child], slot))
+      break;
+    ttngwc_reactor_place(loop, i, loop->heap[child]);
+    i = child;
+  }
+  ttngwc_reactor_place(loop, i, slot);
+}
+
+static void ttngwc_reactor_schedule(struct ReactorLoop *loop,
+                                    struct ReactorSlot *slot,
+                                    unsigned long due) {
+  slot->due = due;
+  ttngwc_reactor_sift(loop, slot->heap_index);
+}
+
+static void ttngwc_reactor_unlink(struct ReactorLoop *loop,
+                                  struct ReactorSlot *slot) {
+  int i = slot->heap_index;
+
+  loop->count--;
+  if (i < loop->count) {
+    ttngwc_reactor_place(loop, i, loop->heap[loop->count]);
+    ttngwc_reactor_sift(loop, i);
+  }
+  slot->heap_index = -1;
+}
+
+// Follows the socket of the session, which changes when it reconnects
+static void ttngwc_reactor_watch(struct ReactorLoop *loop,
+                                 struct ReactorSlot *slot, int fd,
+                                 int events) {
+  struct epoll_event ev;
+
+  if (slot->fd >= 0 && slot->fd != fd) {
+    // Fails when the socket is already closed, which also unregisters it
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, slot->fd, NULL);
+    slot->fd = -1;
+  }
+  if (fd < 0)
+    return;
+  ev.events = events;
+  ev.data.ptr = slot;
+  if (slot->fd < 0) {
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+      slot->fd = fd;
+      slot->events = events;
+    }
+  } else if (slot->events != events) {
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0)
+      slot->events = events;
+  }
+}
+
+// Has the connect worker make an attempt for the session
+static void ttngwc_reactor_queue(struct ReactorLoop *loop,
+                                 struct ReactorSlot *slot) {
+  slot->connecting = 1;
+  slot->next = NULL;
+  if (loop->last)
+    loop->last->next = slot;
+  else
+    loop->first = slot;
+  loop->last = slot;
+  pthread_cond_signal(&loop->queued);
+}
+
+// Drops the queued attempt of the session, if any, and waits for the attempt
+// that is being made to end
+static void ttngwc_reactor_settle(struct ReactorLoop *loop,
+                                  struct ReactorSlot *slot) {
+  struct ReactorSlot **p = &loop->first, *prev = NULL;
+
+  while (*p && *p != slot) {
+    prev = *p;
+    p = &(*p)->next;
+  }
+  if (*p) {
+    *p = slot->next;
+    if (loop->last == slot)
+      loop->last = prev;
+    slot->next = NULL;
+    slot->connecting = 0;
+    if (slot->heap_index >= 0)
+      ttngwc_reactor_schedule(loop, slot, ttngwc_reactor_now());
+  }
+  while (slot->connecting)
+    pthread_cond_wait(&loop->attempted, &loop->mutex);
+}
+
+static void ttngwc_reactor_service(struct ReactorLoop *loop,
+                                   struct ReactorSlot *slot,
+                                   unsigned long now) {
+  struct Session *session = ttngwc_reactor_session(slot);
+  int driven = session->supervisor.running && session->supervisor.driven;
+  int wait, interest;
+
+  // The connect worker schedules the session again after its attempt
+  if (slot->connecting) {
+    ttngwc_reactor_schedule(loop, slot, now + REACTOR_RETRY);
+    return;
+  }
+  // Sessions that connect automatically wait for their next attempt in the
+  // heap, rather than on a thread of their own
+  if (driven && (!session->connected || ttngwc_network_lost(session))) {
+    ttngwc_reactor_watch(loop, slot, -1, 0);
+    ttngwc_reactor_queue(loop, slot);
+    ttngwc_reactor_schedule(loop, slot, now + REACTOR_RETRY);
+    return;
+  }
+  wait = session->connected ? ttngwc_network_poll(session, now) : FAILURE;
+  if (wait < 0) {
+    // Stop watching the lost connection until the session reconnects. The
+    // loop closes the connection of a driven session right away
+    ttngwc_reactor_watch(loop, slot, -1, 0);
+    ttngwc_reactor_schedule(loop, slot, driven ? now : now + REACTOR_RETRY);
+    return;
+  }
+  interest = ttngwc_network_interest(session);
+  ttngwc_reactor_watch(loop, slot, ttngwc_network_fd(session),
+                       (interest & TTN_POLL_READ ? EPOLLIN : 0) |
+                           (interest & TTN_POLL_WRITE ? EPOLLOUT : 0));
+  ttngwc_reactor_schedule(loop, slot, now + wait);
+}
+
+static void *ttngwc_reactor_run(void *arg) {
+  struct ReactorLoop *loop = (struct ReactorLoop *)arg;
+  struct epoll_event events[REACTOR_EVENTS];
+  unsigned long now;
+  int i, n, timeout;
+
+  pthread_mutex_lock(&loop->mutex);
+  while (!loop->stop) {
+    now = ttngwc_reactor_now();
+    timeout = -1;
+    if (loop->count > 0) {
+      long wait = (long)(loop->heap[0]->due - now);
+      timeout = wait > 0 ? (int)wait : 0;
+    }
+    loop->waiting = 1;
+    pthread_mutex_unlock(&loop->mutex);
+    n = epoll_wait(loop->epoll_fd, events, REACTOR_EVENTS, timeout);
+    pthread_mutex_lock(&loop->mutex);
+    loop->waiting = 0;
+
+    now = ttngwc_reactor_now();
+    for (i = 0; i < n; i++) {
+      struct ReactorSlot *slot = (struct ReactorSlot *)events[i].data.ptr;
+      if (!slot) {
+        uint64_t value;
+        if (read(loop->event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+          break;
+        continue;
+      }
+      // Removed while waiting
+      if (slot->loop != loop || slot->heap_index < 0)
+        continue;
+      ttngwc_reactor_service(loop, slot, now);
+    }
+    loop->pass++;
+    pthread_cond_broadcast(&loop->passed);
+    // Sessions that are due, including those that were just added
+    while (loop->count > 0 && (long)(loop->heap[0]->due - now) <= 0)
+      ttngwc_reactor_service(loop, loop->heap[0], now);
+  }
+  pthread_cond_broadcast(&loop->passed);
+  pthread_mutex_unlock(&loop->mutex);
+  return NULL;
+}
+
+static void ttngwc_reactor_wake(struct ReactorLoop *loop) {
+  uint64_t value = 1;
+  if (write(loop->event_fd, &value, sizeof(value)) < 0) {
+    // The counter is saturated, so the loop wakes up anyway
+  }
+}
+
+// Makes the queued attempts without holding the lock of the loop, so that
+// the loop keeps servicing its other sessions meanwhile
+static void *ttngwc_reactor_connect(void *arg) {
+  struct ReactorLoop *loop = (struct ReactorLoop *)arg;
+  struct ReactorSlot *slot;
+  struct Session *session;
+  int wait;
+
+  pthread_mutex_lock(&loop->mutex);
+  while (!loop->stop) {
+    slot = loop->first;
+    if (!slot) {
+      pthread_cond_wait(&loop->queued, &loop->mutex);
+      continue;
+    }
+    loop->first = slot->next;
+    if (!loop->first)
+      loop->last = NULL;
+    slot->next = NULL;
+    session = ttngwc_reactor_session(slot);
+    wait = 0;
+    if (session->supervisor.running && session->supervisor.driven) {
+      pthread_mutex_unlock(&loop->mutex);
+      wait = ttngwc_supervisor_step(session);
+      pthread_mutex_lock(&loop->mutex);
+    }
+    slot->connecting = 0;
+    if (slot->heap_index >= 0)
+      ttngwc_reactor_schedule(loop, slot, ttngwc_reactor_now() + wait);
+    pthread_cond_broadcast(&loop->attempted);
+    ttngwc_reactor_wake(loop);
+  }
+  // The attempts that were still queued are not made
+  while ((slot = loop->first) != NULL) {
+    loop->first = slot->next;
+    slot->next = NULL;
+    slot->connecting = 0;
+  }
+  loop->last = NULL;
+  pthread_cond_broadcast(&loop->attempted);
+  pthread_mutex_unlock(&loop->mutex);
+  return NULL;
+}
+
+static int ttngwc_reactor_start(struct ReactorLoop *loop, int cpu) {
+  struct epoll_event ev;
+  cpu_set_t set;
+
+  pthread_mutex_init(&loop->mutex, NULL);
+  pthread_cond_init(&loop->passed, NULL);
+  pthread_cond_init(&loop->queued, NULL);
+  pthread_cond_init(&loop->attempted, NULL);
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  loop->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (loop->epoll_fd < 0 || loop->event_fd < 0)
+    return FAILURE;
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->event_fd, &ev) != 0)
+    return FAILURE;
+  if (pthread_create(&loop->worker, NULL, &ttngwc_reactor_connect, loop) != 0)
+    return FAILURE;
+  loop->worker_started = 1;
+  if (pthread_create(&loop->thread, NULL, &ttngwc_reactor_run, loop) != 0)
+    return FAILURE;
+  loop->started = 1;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(loop->thread, sizeof(set), &set);
+  return SUCCESS;
+}
+
+int ttngwc_reactor_create(TTNReactor **r, int loops) {
+  struct Reactor *reactor;
+  int i;
+
+  if (loops <= 0)
+    loops = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (loops <= 0)
+    loops = 1;
+  reactor = (struct Reactor *)calloc(1, sizeof(struct Reactor));
+  if (!reactor)
+    return FAILURE;
+  reactor->loops =
+      (struct ReactorLoop *)calloc(loops, sizeof(struct ReactorLoop));
+  if (!reactor->loops) {
+    free(reactor);
+    return FAILURE;
+  }
+  for (i = 0; i < loops; i++) {
+    reactor->loops[i].epoll_fd = -1;
+    reactor->loops[i].event_fd = -1;
+  }
+  for (i = 0; i < loops; i++) {
+    if (ttngwc_reactor_start(&reactor->loops[i], i) != SUCCESS)
+      break;
+    reactor->count++;
+  }
+  *r = (TTNReactor *)reactor;
+  if (reactor->count < loops) {
+    // Also releases the descriptors of the loop that failed to start
+    reactor->count = loops;
+    ttngwc_reactor_destroy(reactor);
+    *r = NULL;
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+void ttngwc_reactor_destroy(TTNReactor *r) {
+  struct Reactor *reactor = (struct Reactor *)r;
+  int i;
+
+  for (i = 0; i < reactor->count; i++) {
+    struct ReactorLoop *loop = &reactor->loops[i];
+    if (loop->started || loop->worker_started) {
+      pthread_mutex_lock(&loop->mutex);
+      loop->stop = 1;
+      pthread_cond_signal(&loop->queued);
+      pthread_mutex_unlock(&loop->mutex);
+    }
+    if (loop->started) {
+      ttngwc_reactor_wake(loop);
+      pthread_join(loop->thread, NULL);
+    }
+    if (loop->worker_started)
+      pthread_join(loop->worker, NULL);
+    while (loop->count > 0) {
+      struct ReactorSlot *slot = loop->heap[0];
+      ttngwc_reactor_unlink(loop, slot);
+      slot->loop = NULL;
+      slot->fd = -1;
+    }
+    free(loop->heap);
+    if (loop->epoll_fd >= 0)
+      close(loop->epoll_fd);
+    if (loop->event_fd >= 0)
+      close(loop->event_fd);
+    pthread_mutex_destroy(&loop->mutex);
+    pthread_cond_destroy(&loop->passed);
+    pthread_cond_destroy(&loop->queued);
+    pthread_cond_destroy(&loop->attempted);
+  }
+  free(reactor->loops);
+  free(reactor);
+}
+
+int ttngwc_reactor_add(TTNReactor *r, TTN *s) {
+  struct Reactor *reactor = (struct Reactor *)r;
+  struct Session *session = (struct Session *)s;
+  struct ReactorSlot *slot = &session->reactor;
+  struct ReactorLoop *loop;
+
+  if (slot->loop)
+    return FAILURE;
+  // Sessions stay on the same loop across restarts
+  loop = &reactor->loops[ttngwc_crc32c(0, session->id, strlen(session->id)) %
+                         reactor->count];
+
+  pthread_mutex_lock(&loop->mutex);
+  if (loop->count == loop->capacity) {
+    int capacity = loop->capacity ? 2 * loop->capacity : 64;
+    struct ReactorSlot **heap = (struct ReactorSlot **)realloc(
+        loop->heap, capacity * sizeof(struct ReactorSlot *));
+    if (!heap) {
+      pthread_mutex_unlock(&loop->mutex);
+      return FAILURE;
+    }
+    loop->heap = heap;
+    loop->capacity = capacity;
+  }
+  // A session that connects automatically is driven by the loop from now on
+  ttngwc_supervisor_drive(session);
+  slot->loop = loop;
+  slot->fd = -1;
+  slot->events = 0;
+  slot->connecting = 0;
+  slot->next = NULL;
+  slot->due = ttngwc_reactor_now();
+  ttngwc_reactor_place(loop, loop->count++, slot);
+  ttngwc_reactor_sift(loop, slot->heap_index);
+  pthread_mutex_unlock(&loop->mutex);
+
+  ttngwc_reactor_wake(loop);
+  return SUCCESS;
+}
+
+int ttngwc_reactor_remove(TTNReactor *r, TTN *s) {
+  struct Reactor *reactor = (struct Reactor *)r;
+  struct Session *session = (struct Session *)s;
+  struct ReactorLoop *loop = session->reactor.loop;
+
+  // The session was added to another reactor
+  if (!loop || loop < reactor->loops || loop >= &reactor->loops[reactor->count])
+    return FAILURE;
+  return ttngwc_reactor_detach(session);
+}
+
+int ttngwc_reactor_detach(struct Session *session) {
+  struct ReactorSlot *slot = &session->reactor;
+  struct ReactorLoop *loop = slot->loop;
+
+  if (!loop)
+    return FAILURE;
+  pthread_mutex_lock(&loop->mutex);
+  ttngwc_reactor_settle(loop, slot);
+  ttngwc_reactor_watch(loop, slot, -1, 0);
+  ttngwc_reactor_unlink(loop, slot);
+  slot->loop = NULL;
+  // Events of the session may have been returned by the current wait, so the
+  // session can only be released once they have been skipped
+  if (loop->waiting) {
+    unsigned long pass = loop->pass;
+    ttngwc_reactor_wake(loop);
+    while (loop->pass == pass && !loop->stop)
+      pthread_cond_wait(&loop->passed, &loop->mutex);
+  }
+  pthread_mutex_unlock(&loop->mutex);
+  return SUCCESS;
+}
+
+void ttngwc_reactor_lock(struct Session *session) {
+  struct ReactorLoop *loop = session->reactor.loop;
+  if (loop) {
+    pthread_mutex_lock(&loop->mutex);
+    ttngwc_reactor_settle(loop, &session->reactor);
+  }
+}
+
+void ttngwc_reactor_unlock(struct Session *session) {
+  struct ReactorLoop *loop = session->reactor.loop;
+  if (loop)
+    pthread_mutex_unlock(&loop->mutex);
+}
+
+void ttngwc_reactor_resume(struct Session *session) {
+  struct ReactorSlot *slot = &session->reactor;
+  struct ReactorLoop *loop = slot->loop;
+
+  if (!loop)
+    return;
+  pthread_mutex_lock(&loop->mutex);
+  if (slot->heap_index >= 0)
+    ttngwc_reactor_schedule(loop, slot, ttngwc_reactor_now());
+  pthread_mutex_unlock(&loop->mutex);
+  ttngwc_reactor_wake(loop);
+}
+
+#else
+
+int ttngwc_reactor_create(TTNReactor **r, int loops) {
+  (void)loops;
+  *r = NULL;
+  return FAILURE;
+}
+
+void ttngwc_reactor_destroy(TTNReactor *r) { (void)r; }
+
+int ttngwc_reactor_add(TTNReactor *r, TTN *s) {
+  (void)r;
+  (void)s;
+  return FAILURE;
+}
+
+int ttngwc_reactor_remove(TTNReactor *r, TTN *s) {
+  (void)r;
+  (void)s;
+  return FAILURE;
+}
+
+int ttngwc_reactor_detach(struct Session *session) {
+  (void)session;
+  return FAILURE;
+}
+
+void ttngwc_reactor_lock(struct Session *session) { (void)session; }
+
+void ttngwc_reactor_unlock(struct Session *session) { (void)session; }
+
+void ttngwc_reactor_resume(struct Session *session) { (void)session; }
+
+#endif
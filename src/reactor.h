@@ -0,0 +1,39 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+#if !defined(__TTN_GW_REACTOR_H_)
+#define __TTN_GW_REACTOR_H_
+
+#include "connector.h"
+
+struct ReactorLoop;
+struct Session;
+
+// Registration of a session with a loop of the reactor
+struct ReactorSlot {
+  struct ReactorLoop *loop;
+  // Socket and events registered with epoll, or -1 when not registered
+  int fd;
+  int events;
+  // Time at which the session is polled, and its position in the timer heap
+  unsigned long due;
+  int heap_index;
+  // Set while an attempt to connect is queued for the connect worker of the
+  // loop or being made by it, and the next slot in that queue
+  int connecting;
+  struct ReactorSlot *next;
+};
+
+// Removes the session from its loop, if any
+// Returns 0 on success, -1 when the session was not added
+int ttngwc_reactor_detach(struct Session *session);
+
+// Waits until the loop of the session, if any, is neither servicing it nor
+// connecting it, and keeps it from doing so until unlocked
+void ttngwc_reactor_lock(struct Session *session);
+void ttngwc_reactor_unlock(struct Session *session);
+
+// Has the loop of the session, if any, service it right away
+void ttngwc_reactor_resume(struct Session *session);
+
+#endif
@@ -0,0 +1,343 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "network.h"
+
+// Longest time in milliseconds that the thread sleeps, so that a counter that
+// jumps, for example when the concentrator restarts, is noticed
+#define SCHEDULER_POLL 1000
+
+// Downlinks are released at most this many microseconds early, as the thread
+// sleeps in whole milliseconds
+#define SCHEDULER_SLACK 1000
+
+// LoRa preamble length in symbols
+#define LORA_PREAMBLE 8
+
+// FSK preamble, sync word, length byte and CRC in bytes
+#define FSK_OVERHEAD 11
+
+// Returns whether time a comes before time b
+static int ttngwc_scheduler_before(uint32_t a, uint32_t b) {
+  return (int32_t)(a - b) < 0;
+}
+
+// Returns the current value of the concentrator counter, read by the function
+// of the application or estimated by the clock of the session
+static uint32_t ttngwc_scheduler_now(struct Session *session) {
+  struct Scheduler *scheduler = &session->scheduler;
+  if (scheduler->counter)
+    return scheduler->counter(scheduler->arg);
+  return ttngwc_clock_counter(session);
+}
+
+// Returns the time on air of the downlink in microseconds, or 0 when the
+// modulation is not known
+static uint32_t ttngwc_scheduler_airtime(struct DownlinkView *view) {
+  const Protocol__TxConfiguration *protocol = ttngwc_view_protocol(view);
+  const Lorawan__TxConfiguration *lorawan;
+  const uint8_t *payload;
+  size_t size = 0;
+  int length, sf, bw, cr = 5, de, bits, symbols = 0;
+  uint64_t symbol;
+
+  if (!protocol ||
+      protocol->protocol_case != PROTOCOL__TX_CONFIGURATION__PROTOCOL_LORAWAN ||
+      !protocol->lorawan)
+    return 0;
+  lorawan = protocol->lorawan;
+  ttngwc_view_payload(view, &payload, &size);
+  length = (int)size;
+  if (lorawan->has_modulation &&
+      lorawan->modulation == LORAWAN__MODULATION__FSK) {
+    if (!lorawan->has_bit_rate || lorawan->bit_rate == 0)
+      return 0;
+    return (uint32_t)((FSK_OVERHEAD + length) * 8 * 1000000ULL /
+                      lorawan->bit_rate);
+  }
+  if (!lorawan->data_rate ||
+      sscanf(lorawan->data_rate, "SF%dBW%d", &sf, &bw) != 2 || sf < 6 ||
+      sf > 12 || bw <= 0)
+    return 0;
+  if (lorawan->coding_rate)
+    sscanf(lorawan->coding_rate, "4/%d", &cr);
+  if (cr < 5 || cr > 8)
+    cr = 5;
+
+  // Downlinks have an explicit header and no payload CRC. Low data rate
+  // optimization is on when symbols take 16 ms or longer
+  de = sf >= 11 && bw == 125;
+  symbol = ((uint64_t)1000 << sf) / bw;
+  bits = 8 * length - 4 * sf + 28;
+  if (bits > 0)
+    symbols = (bits + 4 * (sf - 2 * de) - 1) / (4 * (sf - 2 * de)) * cr;
+  // The preamble is followed by 4.25 symbols of sync word and 8 symbols of
+  // header and payload
+  return (uint32_t)((4 * (LORA_PREAMBLE + 8 + symbols) + 17) * symbol / 4);
+}
+
+static void ttngwc_scheduler_swap(struct Scheduler *scheduler, int i, int j) {
+  struct ScheduledDownlink *entry = scheduler->heap[i];
+  scheduler->heap[i] = scheduler->heap[j];
+  scheduler->heap[j] = entry;
+}
+
+static void ttngwc_scheduler_up(struct Scheduler *scheduler, int i) {
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (!ttngwc_scheduler_before(scheduler->heap[i]->start,
+                                 scheduler->heap[parent]->start))
+      break;
+    ttngwc_scheduler_swap(scheduler, i, parent);
+    i = parent;
+  }
+}
+
+static void ttngwc_scheduler_down(struct Scheduler *scheduler, int i) {
+  for (;;) {
+    int first = i, child;
+    for (child = 2 * i + 1; child <= 2 * i + 2; child++) {
+      if (child < scheduler->count &&
+          ttngwc_scheduler_before(scheduler->heap[child]->start,
+                                  scheduler->heap[first]->start))
+        first = child;
+    }
+    if (first == i)
+      break;
+    ttngwc_scheduler_swap(scheduler, i, first);
+    i = first;
+  }
+}
+
+// Returns whether the window overlaps with a held downlink or the last
+// released downlink on the same RF chain
+static int ttngwc_scheduler_collides(struct Scheduler *scheduler,
+                                     uint32_t rf_chain, uint32_t start,
+                                     uint32_t end) {
+  int i;
+
+  if (rf_chain < SCHEDULER_RF_CHAINS && scheduler->busy[rf_chain] &&
+      ttngwc_scheduler_before(start, scheduler->busy_until[rf_chain]))
+    return 1;
+  for (i = 0; i < scheduler->count; i++) {
+    struct ScheduledDownlink *entry = scheduler->heap[i];
+    if (entry->rf_chain == rf_chain &&
+        ttngwc_scheduler_before(start, entry->end) &&
+        ttngwc_scheduler_before(entry->start, end))
+      return 1;
+  }
+  return 0;
+}
+
+// Passes the downlink to the handler and makes its entry available
+static void ttngwc_scheduler_release(struct Session *session,
+                                     struct ScheduledDownlink *entry) {
+  struct Scheduler *scheduler = &session->scheduler;
+
+  if (session->downlink_view_handler) {
+    ttngwc_view_deliver(session, &scheduler->allocator, entry->payload.data,
+                        entry->len, NULL);
+  } else {
+    Router__DownlinkMessage *downlink = router__downlink_message__unpack(
+        &scheduler->allocator.base, entry->len, entry->payload.data);
+    if (!downlink) {
+      ttngwc_counters_add(&session->counters, COUNTER_DOWNLINKS_DECODE_FAILED,
+                          1);
+    } else if (session->downlink_handler) {
+      ttngwc_counters_add(&session->counters, COUNTER_DOWNLINKS_DELIVERED, 1);
+      session->downlink_handler(downlink, session->cb_arg);
+    }
+  }
+  ttngwc_arena_allocator_reset(&scheduler->allocator);
+
+  MutexLock(&scheduler->mutex);
+  scheduler->spare[scheduler->spares++] = entry;
+  MutexUnlock(&scheduler->mutex);
+}
+
+static void ttngwc_scheduler_run(void *arg) {
+  struct Session *session = (struct Session *)arg;
+  struct Scheduler *scheduler = &session->scheduler;
+  uint32_t lead = (uint32_t)session->config.scheduler_lead_ms * 1000;
+
+  while (!scheduler->stop) {
+    struct ScheduledDownlink *entry = NULL;
+    int wait = SCHEDULER_POLL;
+
+    MutexLock(&scheduler->mutex);
+    if (scheduler->count > 0) {
+      uint32_t now = ttngwc_scheduler_now(session);
+      int32_t left = (int32_t)(scheduler->heap[0]->start - lead - now);
+      if (left < SCHEDULER_SLACK) {
+        entry = scheduler->heap[0];
+        scheduler->heap[0] = scheduler->heap[--scheduler->count];
+        ttngwc_scheduler_down(scheduler, 0);
+        if (entry->rf_chain < SCHEDULER_RF_CHAINS) {
+          scheduler->busy[entry->rf_chain] = 1;
+          scheduler->busy_until[entry->rf_chain] = entry->end;
+        }
+        scheduler->stats.released++;
+      } else if (left / 1000 < wait) {
+        wait = left / 1000;
+      }
+    }
+    MutexUnlock(&scheduler->mutex);
+
+    if (entry) {
+      ttngwc_scheduler_release(session, entry);
+      continue;
+    }
+    EventWait(&scheduler->wake, wait);
+  }
+
+  EventSet(&scheduler->stopped);
+}
+
+void ttngwc_scheduler_init(struct Session *session) {
+  struct Scheduler *scheduler = &session->scheduler;
+  MutexInit(&scheduler->mutex);
+  EventInit(&scheduler->wake);
+  EventInit(&scheduler->stopped);
+}
+
+void ttngwc_scheduler_destroy(struct Session *session) {
+  struct Scheduler *scheduler = &session->scheduler;
+  int i;
+
+  if (scheduler->running) {
+    scheduler->stop = 1;
+    EventSet(&scheduler->wake);
+    EventWait(&scheduler->stopped, -1);
+    scheduler->running = 0;
+  }
+  for (i = 0; i < scheduler->size; i++)
+    ttngwc_arena_free(&scheduler->entries[i].payload);
+  free(scheduler->entries);
+  free(scheduler->heap);
+  free(scheduler->spare);
+  scheduler->entries = NULL;
+  scheduler->heap = NULL;
+  scheduler->spare = NULL;
+  scheduler->size = 0;
+  scheduler->count = 0;
+  ttngwc_arena_allocator_free(&scheduler->allocator);
+  EventDestroy(&scheduler->wake);
+  EventDestroy(&scheduler->stopped);
+}
+
+int ttngwc_scheduler_start(struct Session *session, TTNCounterFunc counter,
+                           void *arg) {
+  struct Scheduler *scheduler = &session->scheduler;
+  int size = session->config.scheduler_size, i;
+
+  if (scheduler->running || size <= 0)
+    return FAILURE;
+  scheduler->entries = (struct ScheduledDownlink *)calloc(
+      size, sizeof(struct ScheduledDownlink));
+  scheduler->heap = (struct ScheduledDownlink **)calloc(
+      size, sizeof(struct ScheduledDownlink *));
+  scheduler->spare = (struct ScheduledDownlink **)calloc(
+      size, sizeof(struct ScheduledDownlink *));
+  if (!scheduler->entries || !scheduler->heap || !scheduler->spare)
+    goto fail;
+  for (i = 0; i < size; i++) {
+    scheduler->entries[i].payload.limit = session->config.max_buffer_size;
+    scheduler->spare[i] = &scheduler->entries[i];
+  }
+  scheduler->size = size;
+  scheduler->count = 0;
+  scheduler->spares = size;
+  scheduler->counter = counter;
+  scheduler->arg = arg;
+  scheduler->stop = 0;
+  ttngwc_arena_allocator_init(&scheduler->allocator, DOWNLINK_ARENA_SIZE,
+                              session->config.max_buffer_size);
+
+  scheduler->running = 1;
+  if (ThreadStart(&scheduler->thread, &ttngwc_scheduler_run, session) != 0) {
+    scheduler->running = 0;
+    ttngwc_arena_allocator_free(&scheduler->allocator);
+    scheduler->size = 0;
+    goto fail;
+  }
+  return SUCCESS;
+
+fail:
+  free(scheduler->entries);
+  free(scheduler->heap);
+  free(scheduler->spare);
+  scheduler->entries = NULL;
+  scheduler->heap = NULL;
+  scheduler->spare = NULL;
+  return FAILURE;
+}
+
+int ttngwc_scheduler_wanted(struct Session *session,
+                            const Gateway__TxConfiguration *tx) {
+  return session->scheduler.running && tx->has_timestamp &&
+         (session->scheduler.counter || ttngwc_clock_synced(session));
+}
+
+int ttngwc_scheduler_push(struct Session *session, struct DownlinkView *view,
+                          const Gateway__TxConfiguration *tx) {
+  struct Scheduler *scheduler = &session->scheduler;
+  uint32_t lead = (uint32_t)session->config.scheduler_lead_ms * 1000;
+  uint32_t start = tx->timestamp;
+  uint32_t end = start + ttngwc_scheduler_airtime(view);
+  size_t len = view->len;
+  uint32_t rf_chain = tx->has_rf_chain ? tx->rf_chain : 0;
+  struct ScheduledDownlink *entry;
+  uint32_t now;
+  int rc = SUCCESS, first = 0, i;
+
+  MutexLock(&scheduler->mutex);
+  now = ttngwc_scheduler_now(session);
+  // Forget transmissions that ended, before their time rolls over
+  for (i = 0; i < SCHEDULER_RF_CHAINS; i++) {
+    if (scheduler->busy[i] &&
+        ttngwc_scheduler_before(scheduler->busy_until[i], now))
+      scheduler->busy[i] = 0;
+  }
+  if (ttngwc_scheduler_before(start - lead, now)) {
+    scheduler->stats.late++;
+    rc = TTNGWC_DROPPED;
+  } else if (ttngwc_scheduler_collides(scheduler, rf_chain, start, end)) {
+    scheduler->stats.collisions++;
+    rc = TTNGWC_DROPPED;
+  } else if (scheduler->spares == 0) {
+    scheduler->stats.rejected++;
+    rc = TTNGWC_DROPPED;
+  } else {
+    entry = scheduler->spare[scheduler->spares - 1];
+    if (!ttngwc_arena_reserve(&entry->payload, len)) {
+      rc = FAILURE;
+    } else {
+      scheduler->spares--;
+      memcpy(entry->payload.data, view->data, len);
+      entry->len = len;
+      entry->start = start;
+      entry->end = end;
+      entry->rf_chain = rf_chain;
+      scheduler->heap[scheduler->count++] = entry;
+      ttngwc_scheduler_up(scheduler, scheduler->count - 1);
+      first = scheduler->heap[0] == entry;
+      scheduler->stats.scheduled++;
+    }
+  }
+  MutexUnlock(&scheduler->mutex);
+
+  // The thread sleeps until the first downlink is due
+  if (first)
+    EventSet(&scheduler->wake);
+  return rc;
+}
+
+void ttngwc_scheduler_get_stats(struct Session *session,
+                                TTNSchedulerStats *stats) {
+  struct Scheduler *scheduler = &session->scheduler;
+  MutexLock(&scheduler->mutex);
+  *stats = scheduler->stats;
+  stats->depth = scheduler->count;
+  MutexUnlock(&scheduler->mutex);
+}
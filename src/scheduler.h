@@ -0,0 +1,86 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+#if !defined(__TTN_GW_SCHEDULER_H_)
+#define __TTN_GW_SCHEDULER_H_
+
+#include <stdint.h>
+
+#include <MQTTClient.h>
+
+#include "arena.h"
+#include "connector.h"
+#include "platform.h"
+
+// RF chains of which the end of the last released transmission is kept
+#define SCHEDULER_RF_CHAINS 2
+
+struct Session;
+struct DownlinkView;
+
+// A downlink waiting for its release, kept as received from the router
+struct ScheduledDownlink {
+  // Concentrator time in microseconds at which transmission starts and ends
+  uint32_t start;
+  uint32_t end;
+  uint32_t rf_chain;
+  struct Arena payload;
+  size_t len;
+};
+
+// Holds downlinks in a min-heap ordered by their transmission time and
+// releases them to the downlink handler from a background thread, the lead
+// time before they are transmitted. Times are compared by their difference,
+// so that the order is kept when the 32-bit counter rolls over
+struct Scheduler {
+  Mutex mutex;
+  Thread thread;
+  Event wake;
+  Event stopped;
+  int running;
+  int stop;
+  TTNCounterFunc counter;
+  void *arg;
+  struct ScheduledDownlink *entries;
+  struct ScheduledDownlink **heap;
+  // Entries that are neither held nor being released
+  struct ScheduledDownlink **spare;
+  int size;
+  int count;
+  int spares;
+  uint32_t busy_until[SCHEDULER_RF_CHAINS];
+  int busy[SCHEDULER_RF_CHAINS];
+  // Released downlinks are decoded on the scheduler thread
+  struct ArenaAllocator allocator;
+  TTNSchedulerStats stats;
+};
+
+// Initializes the scheduler of the session without starting it
+void ttngwc_scheduler_init(struct Session *session);
+
+// Stops the scheduler, if running, drops held downlinks and releases it
+void ttngwc_scheduler_destroy(struct Session *session);
+
+// Starts holding downlinks until their release. Without a counter function,
+// the clock of the session is used
+// Returns 0 on success, -1 on failure
+int ttngwc_scheduler_start(struct Session *session, TTNCounterFunc counter,
+                           void *arg);
+
+// Returns whether a downlink with the gateway configuration is held by the
+// scheduler rather than passed to the handler right away
+int ttngwc_scheduler_wanted(struct Session *session,
+                            const Gateway__TxConfiguration *tx);
+
+// Holds the downlink, of which the packed message is copied. Only the fields
+// that place it in time are decoded. Downlinks that are late, collide with
+// another downlink or do not fit are dropped
+// Returns 0 when held, -1 on failure or -3 when dropped
+int ttngwc_scheduler_push(struct Session *session, struct DownlinkView *view,
+                          const Gateway__TxConfiguration *tx);
+
+// Gets the counters of the scheduler
+void ttngwc_scheduler_get_stats(struct Session *session,
+                                TTNSchedulerStats *stats);
+
+#endif
@@ -0,0 +1,345 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "network.h"
+
+static void ttngwc_sender_link(struct Sender *sender, struct Parcel *parcel) {
+  struct Parcel *prev;
+
+  __atomic_store_n(&parcel->next, NULL, __ATOMIC_RELAXED);
+  prev = __atomic_exchange_n(&sender->tail, parcel, __ATOMIC_ACQ_REL);
+  // Until the link is stored, the I/O thread sees the queue end at prev
+  __atomic_store_n(&prev->next, parcel, __ATOMIC_RELEASE);
+}
+
+// Takes the first parcel. Returns NULL when the queue is empty or when a
+// producer is still linking the last parcel; that producer wakes up the I/O
+// thread once done
+static struct Parcel *ttngwc_sender_pop(struct Sender *sender) {
+  struct Parcel *head = sender->head;
+  struct Parcel *next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+
+  if (head == &sender->stub) {
+    if (!next)
+      return NULL;
+    sender->head = next;
+    head = next;
+    next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+  }
+  if (next) {
+    sender->head = next;
+    return head;
+  }
+  if (head != __atomic_load_n(&sender->tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  // The last parcel can only be taken with the stub behind it
+  ttngwc_sender_link(sender, &sender->stub);
+  next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+  if (next) {
+    sender->head = next;
+    return head;
+  }
+  return NULL;
+}
+
+// Only the first producer after the I/O thread went to sleep sets the event
+static void ttngwc_sender_wake(struct Sender *sender) {
+  if (__atomic_exchange_n(&sender->signalled, 1, __ATOMIC_ACQ_REL) == 0)
+    EventSet(&sender->wake);
+}
+
+// Claims a free parcel of the pool
+// Returns NULL when all parcels are in use
+static struct Parcel *ttngwc_sender_claim(struct Sender *sender) {
+  int words = (sender->size + 31) / 32, i;
+
+  for (i = 0; i < words; i++) {
+    uint32_t *word = &sender->available[i];
+    uint32_t bits = __atomic_load_n(word, __ATOMIC_RELAXED);
+    // A failed exchange reloads the bits that are free now
+    while (bits) {
+      uint32_t bit = bits & -bits;
+      if (__atomic_compare_exchange_n(word, &bits, bits & ~bit, 0,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return &sender->parcels[i * 32 + __builtin_ctz(bit)];
+    }
+  }
+  return NULL;
+}
+
+static void ttngwc_sender_release(struct Sender *sender,
+                                  struct Parcel *parcel) {
+  int index = (int)(parcel - sender->parcels);
+  __atomic_fetch_or(&sender->available[index / 32], 1u << (index % 32),
+                    __ATOMIC_RELEASE);
+}
+
+// Returns the parcel to the pool once it left the queue. The outbox may be
+// drained before the last parcel is accounted for, so flushing is woken up
+// again when the queue becomes empty
+static void ttngwc_sender_done(struct Session *session, struct Parcel *parcel) {
+  struct Sender *sender = &session->sender;
+
+  ttngwc_sender_release(sender, parcel);
+  if (__atomic_sub_fetch(&sender->depth, 1, __ATOMIC_ACQ_REL) == 0)
+    EventSet(&session->outbox.drained);
+}
+
+// Queues parcels in the outbox until it is full. Canceled parcels are
+// released without being published
+static void ttngwc_sender_drain(struct Session *session) {
+  struct Sender *sender = &session->sender;
+  struct Parcel *parcel;
+  TTNCompletionHandler handler;
+  enum MessageClass class;
+  void *arg;
+  int rc, canceled;
+
+  for (;;) {
+    parcel = sender->blocked ? sender->blocked : ttngwc_sender_pop(sender);
+    if (!parcel)
+      break;
+    MutexLock(&sender->mutex);
+    canceled = parcel->canceled;
+    rc = canceled ? SUCCESS
+                  : ttngwc_outbox_push_raw(session, parcel->class,
+                                           parcel->payload.data, parcel->len,
+                                           parcel->handler, parcel->arg);
+    // Retry once an acknowledgement makes room
+    if (rc == TTNGWC_DROPPED) {
+      MutexUnlock(&sender->mutex);
+      sender->blocked = parcel;
+      break;
+    }
+    __atomic_store_n(&parcel->queued, 0, __ATOMIC_RELAXED);
+    MutexUnlock(&sender->mutex);
+
+    sender->blocked = NULL;
+    class = parcel->class;
+    handler = parcel->handler;
+    arg = parcel->arg;
+    ttngwc_sender_done(session, parcel);
+    if (rc != SUCCESS && class == CLASS_UP)
+      ttngwc_counters_add(&session->counters, COUNTER_UPLINKS_FAILED, 1);
+    if (rc != SUCCESS && handler)
+      handler(rc, arg);
+  }
+}
+
+// Completes all parcels as dropped. Only called by the I/O thread or while it
+// is stopped
+static void ttngwc_sender_clear(struct Session *session) {
+  struct Sender *sender = &session->sender;
+  struct Parcel *parcel;
+  TTNCompletionHandler handler;
+  enum MessageClass class;
+  void *arg;
+  int canceled;
+
+  for (;;) {
+    parcel = sender->blocked ? sender->blocked : ttngwc_sender_pop(sender);
+    if (!parcel)
+      break;
+    MutexLock(&sender->mutex);
+    canceled = parcel->canceled;
+    __atomic_store_n(&parcel->queued, 0, __ATOMIC_RELAXED);
+    MutexUnlock(&sender->mutex);
+
+    sender->blocked = NULL;
+    class = parcel->class;
+    handler = parcel->handler;
+    arg = parcel->arg;
+    ttngwc_sender_done(session, parcel);
+    if (canceled)
+      continue;
+    if (class == CLASS_UP)
+      ttngwc_counters_add(&session->counters, COUNTER_UPLINKS_FAILED, 1);
+    if (handler)
+      handler(TTNGWC_DROPPED, arg);
+  }
+}
+
+static void ttngwc_sender_run(void *arg) {
+  struct Session *session = (struct Session *)arg;
+  struct Sender *sender = &session->sender;
+
+  while (!sender->stop) {
+    if (sender->drop) {
+      ttngwc_sender_clear(session);
+      sender->drop = 0;
+      EventSet(&sender->done);
+    }
+    // Producers that push from here on wake up the thread again
+    __atomic_store_n(&sender->signalled, 0, __ATOMIC_SEQ_CST);
+    for (;;) {
+      int depth;
+      // Producers leave stored uplinks to this thread
+      ttngwc_journal_feed(session);
+      ttngwc_backlog_feed(session);
+      ttngwc_sender_drain(session);
+      depth = ttngwc_outbox_depth(session);
+      ttngwc_outbox_pump(session);
+      // QoS 0 messages complete when written, making room for more
+      if (ttngwc_outbox_depth(session) >= depth)
+        break;
+    }
+    // Messages in flight time out even when nothing else happens
+    EventWait(&sender->wake, session->config.command_timeout_ms);
+  }
+
+  EventSet(&sender->done);
+}
+
+static int ttngwc_sender_start(struct Session *session) {
+  struct Sender *sender = &session->sender;
+
+  sender->stop = 0;
+  sender->running = 1;
+  if (ThreadStart(&sender->thread, &ttngwc_sender_run, session) != 0) {
+    sender->running = 0;
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+static void ttngwc_sender_stop(struct Session *session) {
+  struct Sender *sender = &session->sender;
+
+  if (!sender->running)
+    return;
+  sender->stop = 1;
+  EventSet(&sender->wake);
+  EventWait(&sender->done, -1);
+  sender->running = 0;
+}
+
+// Allocates the pool of parcels, of which the payloads grow on first use
+static int ttngwc_sender_alloc(struct Session *session) {
+  struct Sender *sender = &session->sender;
+  int size = session->config.sender_queue_size, i;
+
+  if (size <= 0)
+    return FAILURE;
+  sender->parcels = (struct Parcel *)calloc(size, sizeof(struct Parcel));
+  sender->available =
+      (uint32_t *)calloc((size + 31) / 32, sizeof(uint32_t));
+  if (!sender->parcels || !sender->available) {
+    free(sender->parcels);
+    free(sender->available);
+    sender->parcels = NULL;
+    sender->available = NULL;
+    return FAILURE;
+  }
+  for (i = 0; i < size; i++) {
+    sender->parcels[i].payload.limit = session->config.max_buffer_size;
+    sender->available[i / 32] |= 1u << (i % 32);
+  }
+  sender->size = size;
+  return SUCCESS;
+}
+
+void ttngwc_sender_init(struct Session *session) {
+  struct Sender *sender = &session->sender;
+
+  sender->stub.next = NULL;
+  sender->head = &sender->stub;
+  sender->tail = &sender->stub;
+  MutexInit(&sender->mutex);
+  EventInit(&sender->wake);
+  EventInit(&sender->done);
+  if (session->config.threaded && ttngwc_sender_alloc(session) == SUCCESS)
+    ttngwc_sender_start(session);
+}
+
+void ttngwc_sender_destroy(struct Session *session) {
+  struct Sender *sender = &session->sender;
+  int i;
+
+  ttngwc_sender_stop(session);
+  ttngwc_sender_clear(session);
+  for (i = 0; i < sender->size; i++)
+    ttngwc_arena_free(&sender->parcels[i].payload);
+  free(sender->parcels);
+  free(sender->available);
+  sender->parcels = NULL;
+  sender->available = NULL;
+  sender->size = 0;
+  EventDestroy(&sender->wake);
+  EventDestroy(&sender->done);
+}
+
+int ttngwc_sender_push(struct Session *session, enum MessageClass class,
+                       const ProtobufCMessage *message,
+                       TTNCompletionHandler handler, void *arg) {
+  struct Sender *sender = &session->sender;
+  size_t len = protobuf_c_message_get_packed_size(message);
+  struct Parcel *parcel = ttngwc_sender_claim(sender);
+
+  if (!parcel)
+    return TTNGWC_DROPPED;
+  if (!ttngwc_arena_reserve(&parcel->payload, len)) {
+    ttngwc_sender_release(sender, parcel);
+    return FAILURE;
+  }
+  parcel->class = class;
+  parcel->handler = handler;
+  parcel->arg = arg;
+  parcel->len = protobuf_c_message_pack(message, parcel->payload.data);
+  parcel->canceled = 0;
+  // Cancellation looks for the parcel from here on
+  __atomic_store_n(&parcel->queued, 1, __ATOMIC_RELEASE);
+
+  __atomic_add_fetch(&sender->depth, 1, __ATOMIC_RELAXED);
+  ttngwc_sender_link(sender, parcel);
+  ttngwc_sender_wake(sender);
+  return SUCCESS;
+}
+
+int ttngwc_sender_threaded(struct Session *session) {
+  return session->sender.running;
+}
+
+void ttngwc_sender_pump(struct Session *session) {
+  if (session->sender.running)
+    ttngwc_sender_wake(&session->sender);
+  else
+    ttngwc_outbox_pump(session);
+}
+
+void ttngwc_sender_drop(struct Session *session) {
+  struct Sender *sender = &session->sender;
+
+  if (!sender->running) {
+    ttngwc_sender_clear(session);
+    return;
+  }
+  sender->drop = 1;
+  EventSet(&sender->wake);
+  EventWait(&sender->done, -1);
+}
+
+int ttngwc_sender_depth(struct Session *session) {
+  return __atomic_load_n(&session->sender.depth, __ATOMIC_RELAXED);
+}
+
+int ttngwc_sender_cancel(struct Session *session, void *arg) {
+  struct Sender *sender = &session->sender;
+  int i, removed = 0;
+
+  MutexLock(&sender->mutex);
+  for (i = 0; i < sender->size; i++) {
+    struct Parcel *parcel = &sender->parcels[i];
+    if (!__atomic_load_n(&parcel->queued, __ATOMIC_ACQUIRE) ||
+        parcel->canceled || parcel->arg != arg)
+      continue;
+    parcel->canceled = 1;
+    if (parcel->class == CLASS_UP)
+      ttngwc_counters_add(&session->counters, COUNTER_UPLINKS_FAILED, 1);
+    removed++;
+  }
+  removed += ttngwc_outbox_cancel(session, arg);
+  MutexUnlock(&sender->mutex);
+
+  return removed;
+}
@@ -0,0 +1,99 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+#if !defined(__TTN_GW_SENDER_H_)
+#define __TTN_GW_SENDER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <MQTTClient.h>
+
+#include "arena.h"
+#include "connector.h"
+#include "outbox.h"
+#include "platform.h"
+
+struct Session;
+
+// A message packed by a producer, waiting for the I/O thread. Parcels are
+// taken from a pool and keep their memory, so that pushing does not allocate
+// once the payloads have grown to fit
+struct Parcel {
+  struct Parcel *next;
+  enum MessageClass class;
+  TTNCompletionHandler handler;
+  void *arg;
+  struct Arena payload;
+  size_t len;
+  // Set once the parcel is linked, and cleared when it leaves the queue
+  int queued;
+  // Set when the producer no longer waits for the parcel, which is then
+  // released without being published
+  int canceled;
+};
+
+// In threaded mode, producers push packed messages on an intrusive lock-free
+// queue with a single consumer. Producers swap the tail and link the previous
+// parcel, so they never wait for each other or for the I/O thread. The I/O
+// thread queues the parcels in the outbox and does all publishing, so that
+// producers do not contend for the outbox or the socket
+struct Sender {
+  // Last pushed parcel, shared by the producers
+  struct Parcel *tail;
+  // First parcel, owned by the I/O thread
+  struct Parcel *head;
+  struct Parcel stub;
+  // Parcel that was taken but did not fit in the outbox
+  struct Parcel *blocked;
+  // Pool of parcels, with a bit set in the bitmap for each parcel that
+  // producers can claim
+  struct Parcel *parcels;
+  uint32_t *available;
+  int size;
+  // Held while a parcel moves to the outbox or is canceled, so that a parcel
+  // is always found in one of the two
+  Mutex mutex;
+  // Parcels that are not yet queued in the outbox
+  int depth;
+  // Set by the first producer that wakes up the I/O thread
+  int signalled;
+  Thread thread;
+  Event wake;
+  // Set when a request to drop or stop has been handled
+  Event done;
+  int running;
+  int drop;
+  int stop;
+};
+
+// Initializes the queue and starts the I/O thread when the session is threaded
+void ttngwc_sender_init(struct Session *session);
+
+// Stops the I/O thread and drops the queued parcels
+void ttngwc_sender_destroy(struct Session *session);
+
+// Packs a message in a parcel of the pool and queues it for the I/O thread
+// Returns 0 when queued, -1 on failure or -3 when all parcels are in use
+int ttngwc_sender_push(struct Session *session, enum MessageClass class,
+                       const ProtobufCMessage *message,
+                       TTNCompletionHandler handler, void *arg);
+
+// Returns whether the session is threaded
+int ttngwc_sender_threaded(struct Session *session);
+
+// Has the I/O thread publish queued messages, or publishes them right away
+// when the session is not threaded
+void ttngwc_sender_pump(struct Session *session);
+
+// Drops the parcels that are not yet queued in the outbox
+void ttngwc_sender_drop(struct Session *session);
+
+// Returns the number of parcels that are not yet queued in the outbox
+int ttngwc_sender_depth(struct Session *session);
+
+// Removes the messages with the given completion argument from the queue and
+// the outbox without completing them. Returns the number of removed messages
+int ttngwc_sender_cancel(struct Session *session, void *arg);
+
+#endif
@@ -6,16 +6,71 @@
 
 #include <MQTTClient.h>
 
+#include "backlog.h"
+#include "clock.h"
+#include "counters.h"
+#include "dedup.h"
+#include "envelope.h"
+#include "filter.h"
+#include "journal.h"
+#include "loopback.h"
+#include "outbox.h"
+#include "reactor.h"
+#include "scheduler.h"
+#include "sender.h"
+#include "supervisor.h"
+#include "view.h"
+
 struct Session {
   Network network;
   MQTTClient client;
   TTNDownlinkHandler downlink_handler;
   void *cb_arg;
-  unsigned char *read_buffer;
-  unsigned char *send_buffer;
+  TTNDownlinkViewHandler downlink_view_handler;
+  void *view_arg;
+  TTNConfig config;
+  struct Arena read_buffer;
+  // Bytes that ttngwc_poll received and the client did not read yet. The
+  // packets before inbound_ready are complete
+  struct Arena inbound;
+  size_t inbound_start;
+  size_t inbound_ready;
+  size_t inbound_end;
+  // Whether the client is given the complete packets only
+  int polling;
+  struct Arena send_buffer;
   char *id;
   char *key;
+  char *uplink_topic;
+  char *batch_topic;
+  char *status_topic;
   char *downlink_topic;
+  char *filter_topic;
+  struct Arena scratch;
+  struct ArenaAllocator downlink_allocator;
+  int connected;
+  int lost;
+  Timer liveness;
+  // Time at which ttngwc_poll sends the next ping
+  unsigned long ping_due;
+  int (*network_read)(Network *, unsigned char *, int, int);
+  int (*network_write)(Network *, unsigned char *, int, int);
+  int (*network_connect)(Network *, char *, int);
+  void (*network_disconnect)(Network *);
+  struct Loopback *loopback;
+  Mutex write_mutex;
+  struct Outbox outbox;
+  struct Journal journal;
+  struct Backlog backlog;
+  struct Supervisor supervisor;
+  struct Sender sender;
+  struct ReactorSlot reactor;
+  struct Scheduler scheduler;
+  struct Clock clock;
+  struct Dedup dedup;
+  struct Filter filter;
+  struct Envelope envelope;
+  struct Counters counters;
 };
 
 #endif
@@ -0,0 +1,470 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "connector.h"
+
+// Latency samples kept per metric. Later samples replace random earlier ones
+#define MAX_SAMPLES (1 << 20)
+
+// Radio settings of simulated uplinks, as in examples/router/main.go
+struct Setting {
+  const char *name;
+  Lorawan__Modulation modulation;
+  char *data_rate;
+  uint32_t bit_rate;
+  uint64_t frequency;
+  int weight;
+};
+
+static struct Setting settings[] = {
+    {"7", LORAWAN__MODULATION__LORA, "SF7BW125", 0, 867100000, 1},
+    {"8", LORAWAN__MODULATION__LORA, "SF8BW125", 0, 867300000, 1},
+    {"9", LORAWAN__MODULATION__LORA, "SF9BW125", 0, 869525000, 1},
+    {"10", LORAWAN__MODULATION__LORA, "SF10BW125", 0, 867700000, 1},
+    {"11", LORAWAN__MODULATION__LORA, "SF11BW125", 0, 867900000, 1},
+    {"12", LORAWAN__MODULATION__LORA, "SF12BW125", 0, 867500000, 1},
+    {"fsk", LORAWAN__MODULATION__FSK, NULL, 50000, 868800000, 1},
+    {"7bw250", LORAWAN__MODULATION__LORA, "SF7BW250", 0, 868300000, 1},
+};
+
+#define SETTINGS (int)(sizeof(settings) / sizeof(settings[0]))
+
+struct Samples {
+  pthread_mutex_t mutex;
+  uint64_t *values;
+  unsigned long count;
+  unsigned long seen;
+};
+
+struct Gateway {
+  TTN *ttn;
+  char id[32];
+  uint32_t f_cnt;
+  uint64_t next_uplink;
+  uint64_t next_status;
+  // Time of the last uplink, to which the router answers with a downlink
+  uint64_t last_uplink;
+};
+
+// Completion argument of an uplink
+struct Pending {
+  uint64_t sent;
+};
+
+static struct {
+  const char *host;
+  int port;
+  const char *key;
+  const char *prefix;
+  int gateways;
+  double rate;
+  int min_size;
+  int max_size;
+  int status_interval;
+  int duration;
+  int report_interval;
+  int loops;
+} options = {"localhost", 1883, NULL, "sim", 10, 0.1, 10, 51, 30, 60, 10, 0};
+
+static volatile int running = 1;
+static struct Samples puback, downlink;
+static unsigned long uplinks, acked, failed, statuses, status_failed, downlinks;
+
+static void stop(int sig) {
+  signal(sig, SIG_DFL);
+  running = 0;
+}
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void count(unsigned long *counter) {
+  __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+static void record(struct Samples *samples, uint64_t value) {
+  pthread_mutex_lock(&samples->mutex);
+  if (samples->count < MAX_SAMPLES) {
+    samples->values[samples->count++] = value;
+  } else {
+    unsigned long i = (unsigned long)rand() % (samples->seen + 1);
+    if (i < MAX_SAMPLES)
+      samples->values[i] = value;
+  }
+  samples->seen++;
+  pthread_mutex_unlock(&samples->mutex);
+}
+
+static int compare(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void print_samples(const char *name, struct Samples *samples) {
+  unsigned long n;
+
+  pthread_mutex_lock(&samples->mutex);
+  n = samples->count;
+  if (n == 0) {
+    printf("%s: no samples\n", name);
+  } else {
+    qsort(samples->values, n, sizeof(uint64_t), &compare);
+    printf("%s (ms): p50 %.2f, p90 %.2f, p99 %.2f, p99.9 %.2f, max %.2f\n",
+           name, samples->values[n * 50 / 100] / 1000.0,
+           samples->values[n * 90 / 100] / 1000.0,
+           samples->values[n * 99 / 100] / 1000.0,
+           samples->values[n * 999 / 1000] / 1000.0,
+           samples->values[n - 1] / 1000.0);
+  }
+  pthread_mutex_unlock(&samples->mutex);
+}
+
+static void uplink_done(int rc, void *arg) {
+  struct Pending *pending = (struct Pending *)arg;
+  if (rc == 0) {
+    count(&acked);
+    record(&puback, now_us() - pending->sent);
+  } else {
+    count(&failed);
+  }
+  free(pending);
+}
+
+static void status_done(int rc, void *arg) {
+  if (rc != 0)
+    count(&status_failed);
+}
+
+static void receive_downlink(Router__DownlinkMessage *msg, void *arg) {
+  struct Gateway *gateway = (struct Gateway *)arg;
+  uint64_t last = __atomic_load_n(&gateway->last_uplink, __ATOMIC_RELAXED);
+  count(&downlinks);
+  if (last > 0)
+    record(&downlink, now_us() - last);
+}
+
+// Returns a random interval in microseconds for the given rate per second
+static uint64_t interval(double rate) {
+  double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+  return (uint64_t)(-log(u) / rate * 1000000);
+}
+
+static struct Setting *pick_setting(void) {
+  int total = 0, i, r;
+  for (i = 0; i < SETTINGS; i++)
+    total += settings[i].weight;
+  r = rand() % total;
+  for (i = 0; i < SETTINGS; i++) {
+    if (r < settings[i].weight)
+      break;
+    r -= settings[i].weight;
+  }
+  return &settings[i];
+}
+
+static void send_uplink(struct Gateway *gateway) {
+  unsigned char buf[256];
+  struct Setting *setting = pick_setting();
+  struct Pending *pending;
+  int size, i;
+
+  size = options.min_size + rand() % (options.max_size - options.min_size + 1);
+  // Unconfirmed data up, so that the connector does not take it for a join
+  buf[0] = 0x40;
+  for (i = 1; i < size; i++)
+    buf[i] = (unsigned char)rand();
+
+  Router__UplinkMessage up = ROUTER__UPLINK_MESSAGE__INIT;
+  up.has_payload = 1;
+  up.payload.len = size;
+  up.payload.data = buf;
+
+  Protocol__RxMetadata protocol = PROTOCOL__RX_METADATA__INIT;
+  protocol.protocol_case = PROTOCOL__RX_METADATA__PROTOCOL_LORAWAN;
+  Lorawan__Metadata lorawan = LORAWAN__METADATA__INIT;
+  lorawan.has_modulation = 1;
+  lorawan.modulation = setting->modulation;
+  lorawan.data_rate = setting->data_rate;
+  if (setting->bit_rate) {
+    lorawan.has_bit_rate = 1;
+    lorawan.bit_rate = setting->bit_rate;
+  }
+  lorawan.coding_rate = "4/5";
+  lorawan.has_f_cnt = 1;
+  lorawan.f_cnt = ++gateway->f_cnt;
+  protocol.lorawan = &lorawan;
+  up.protocol_metadata = &protocol;
+
+  Gateway__RxMetadata metadata = GATEWAY__RX_METADATA__INIT;
+  metadata.has_timestamp = 1;
+  metadata.timestamp = (uint32_t)now_us();
+  metadata.has_rf_chain = 1;
+  metadata.rf_chain = rand() % 2;
+  metadata.has_frequency = 1;
+  metadata.frequency = setting->frequency;
+  up.gateway_metadata = &metadata;
+
+  pending = (struct Pending *)malloc(sizeof(struct Pending));
+  if (!pending)
+    return;
+  pending->sent = now_us();
+  __atomic_store_n(&gateway->last_uplink, pending->sent, __ATOMIC_RELAXED);
+  count(&uplinks);
+  if (ttngwc_submit_uplink(gateway->ttn, &up, &uplink_done, pending) != 0) {
+    count(&failed);
+    free(pending);
+  }
+}
+
+static void send_status(struct Gateway *gateway) {
+  Gateway__Status status = GATEWAY__STATUS__INIT;
+  status.has_time = 1;
+  status.time = (int64_t)time(NULL) * 1000000000;
+  status.has_rx_in = 1;
+  status.rx_in = gateway->f_cnt;
+  count(&statuses);
+  if (ttngwc_submit_status(gateway->ttn, &status, &status_done, NULL) != 0)
+    count(&status_failed);
+}
+
+static void usage(const char *name) {
+  printf("usage: %s [options]\n"
+         "  -h host       router host (localhost)\n"
+         "  -p port       router port (1883)\n"
+         "  -k key        gateway key\n"
+         "  -g prefix     prefix of gateway identifiers (sim)\n"
+         "  -n count      number of gateways (10)\n"
+         "  -r rate       uplinks per second per gateway (0.1)\n"
+         "  -m mix        weights of data rates, for example 7=40,12=5,fsk=0\n"
+         "                (7, 8, 9, 10, 11, 12, fsk and 7bw250; 1 each)\n"
+         "  -s min:max    payload size in bytes (10:51)\n"
+         "  -i seconds    status interval (30)\n"
+         "  -d seconds    duration, or 0 until interrupted (60)\n"
+         "  -t seconds    report interval (10)\n"
+         "  -l loops      event loops, or 0 for one per core (0)\n",
+         name);
+}
+
+static int parse_mix(char *mix) {
+  char *item, *save = NULL;
+  int i;
+
+  for (item = strtok_r(mix, ",", &save); item;
+       item = strtok_r(NULL, ",", &save)) {
+    char *eq = strchr(item, '=');
+    if (!eq)
+      return -1;
+    *eq = '\0';
+    for (i = 0; i < SETTINGS; i++) {
+      if (strcmp(settings[i].name, item) == 0)
+        break;
+    }
+    if (i == SETTINGS)
+      return -1;
+    settings[i].weight = atoi(eq + 1);
+  }
+  for (i = 0; i < SETTINGS; i++) {
+    if (settings[i].weight > 0)
+      return 0;
+  }
+  return -1;
+}
+
+static int parse_options(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "h:p:k:g:n:r:m:s:i:d:t:l:")) != -1) {
+    switch (opt) {
+    case 'h':
+      options.host = optarg;
+      break;
+    case 'p':
+      options.port = atoi(optarg);
+      break;
+    case 'k':
+      options.key = optarg;
+      break;
+    case 'g':
+      options.prefix = optarg;
+      break;
+    case 'n':
+      options.gateways = atoi(optarg);
+      break;
+    case 'r':
+      options.rate = atof(optarg);
+      break;
+    case 'm':
+      if (parse_mix(optarg) != 0)
+        return -1;
+      break;
+    case 's':
+      if (sscanf(optarg, "%d:%d", &options.min_size, &options.max_size) != 2)
+        return -1;
+      break;
+    case 'i':
+      options.status_interval = atoi(optarg);
+      break;
+    case 'd':
+      options.duration = atoi(optarg);
+      break;
+    case 't':
+      options.report_interval = atoi(optarg);
+      break;
+    case 'l':
+      options.loops = atoi(optarg);
+      break;
+    default:
+      return -1;
+    }
+  }
+  if (options.gateways <= 0 || options.rate <= 0 || options.min_size < 1 ||
+      options.max_size < options.min_size || options.max_size > 256 ||
+      options.report_interval <= 0)
+    return -1;
+  return 0;
+}
+
+static void report(uint64_t elapsed_us, unsigned long sent) {
+  printf("%.0fs: %lu uplinks (%.1f/s), %lu acknowledged, %lu failed, %lu "
+         "status (%lu failed), %lu downlinks\n",
+         elapsed_us / 1e6, uplinks, (double)sent / options.report_interval,
+         acked, failed, statuses, status_failed, downlinks);
+  fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+  struct Gateway *gateways;
+  TTNReactor *reactor;
+  TTNConfig config;
+  uint64_t start, next_report, deadline;
+  unsigned long reported = 0;
+  int i, connected = 0;
+
+  if (parse_options(argc, argv) != 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  srand(time(NULL));
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  puback.values = (uint64_t *)malloc(MAX_SAMPLES * sizeof(uint64_t));
+  downlink.values = (uint64_t *)malloc(MAX_SAMPLES * sizeof(uint64_t));
+  pthread_mutex_init(&puback.mutex, NULL);
+  pthread_mutex_init(&downlink.mutex, NULL);
+  gateways = (struct Gateway *)calloc(options.gateways, sizeof(struct Gateway));
+  if (!gateways || !puback.values || !downlink.values) {
+    printf("out of memory\n");
+    return 1;
+  }
+  if (ttngwc_reactor_create(&reactor, options.loops) != 0) {
+    printf("failed to start event loops\n");
+    return 1;
+  }
+
+  ttngwc_config_init(&config);
+  printf("connecting %d gateways to %s:%d...\n", options.gateways,
+         options.host, options.port);
+  for (i = 0; i < options.gateways && running; i++) {
+    struct Gateway *gateway = &gateways[i];
+    snprintf(gateway->id, sizeof(gateway->id), "%s-%d", options.prefix, i);
+    if (ttngwc_init_ex(&gateway->ttn, gateway->id, &config, &receive_downlink,
+                       gateway) != 0 ||
+        ttngwc_reactor_add(reactor, gateway->ttn) != 0 ||
+        ttngwc_connect_auto(gateway->ttn, options.host, options.port,
+                            options.key, NULL, NULL) != 0) {
+      printf("%s: failed to start\n", gateway->id);
+      continue;
+    }
+    connected++;
+  }
+  // Wait for the connections to be made
+  for (i = 0; i < 100 && running; i++) {
+    int fds = 0, j;
+    for (j = 0; j < options.gateways; j++)
+      fds += gateways[j].ttn && ttngwc_fd(gateways[j].ttn) >= 0;
+    if (fds == connected)
+      break;
+    usleep(100000);
+  }
+  printf("started %d gateways\n", connected);
+
+  start = now_us();
+  for (i = 0; i < options.gateways; i++) {
+    gateways[i].next_uplink = start + interval(options.rate);
+    gateways[i].next_status =
+        start + (uint64_t)(rand() % (options.status_interval * 1000 + 1)) * 1000;
+  }
+  next_report = start + options.report_interval * 1000000ULL;
+  deadline = start + options.duration * 1000000ULL;
+
+  while (running) {
+    uint64_t now = now_us(), next = next_report;
+    if (options.duration > 0 && now >= deadline)
+      break;
+    for (i = 0; i < options.gateways; i++) {
+      struct Gateway *gateway = &gateways[i];
+      if (!gateway->ttn || ttngwc_fd(gateway->ttn) < 0)
+        continue;
+      while (gateway->next_uplink <= now) {
+        send_uplink(gateway);
+        gateway->next_uplink += interval(options.rate);
+      }
+      if (options.status_interval > 0 && gateway->next_status <= now) {
+        send_status(gateway);
+        gateway->next_status += options.status_interval * 1000000ULL;
+      }
+      if (gateway->next_uplink < next)
+        next = gateway->next_uplink;
+    }
+    if (now >= next_report) {
+      report(now - start, uplinks - reported);
+      reported = uplinks;
+      next_report += options.report_interval * 1000000ULL;
+    }
+    now = now_us();
+    if (next > now)
+      usleep(next - now > 100000 ? 100000 : next - now);
+  }
+
+  printf("stopping\n");
+  for (i = 0; i < options.gateways; i++) {
+    if (!gateways[i].ttn)
+      continue;
+    ttngwc_reactor_remove(reactor, gateways[i].ttn);
+    ttngwc_disconnect_flush(gateways[i].ttn, 1000);
+  }
+  ttngwc_reactor_destroy(reactor);
+
+  {
+    uint64_t elapsed = now_us() - start;
+    printf("\n%d gateways, %.1fs\n", connected, elapsed / 1e6);
+    printf("uplinks: %lu sent, %lu acknowledged, %lu failed, %.1f/s\n", uplinks,
+           acked, failed, acked * 1e6 / elapsed);
+    printf("status: %lu sent, %lu failed\n", statuses, status_failed);
+    printf("downlinks: %lu received, %.1f/s\n", downlinks,
+           downlinks * 1e6 / elapsed);
+    print_samples("puback latency", &puback);
+    print_samples("downlink latency", &downlink);
+  }
+
+  for (i = 0; i < options.gateways; i++) {
+    if (gateways[i].ttn)
+      ttngwc_cleanup(gateways[i].ttn);
+  }
+  free(gateways);
+  free(puback.values);
+  free(downlink.values);
+  return 0;
+}
@@ -0,0 +1,186 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include <time.h>
+
+#include "crc.h"
+#include "network.h"
+
+// Interval in milliseconds at which the liveness of the connection is checked
+#define SUPERVISOR_POLL 1000
+
+static uint32_t ttngwc_supervisor_random(struct Supervisor *supervisor) {
+  uint32_t x = supervisor->random;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  supervisor->random = x;
+  return x;
+}
+
+// Decorrelated jitter: the next delay is random between the minimum and three
+// times the previous delay, capped at the maximum. Gateways that lost the
+// router at the same time spread out their attempts
+static int ttngwc_supervisor_backoff(struct Session *session) {
+  struct Supervisor *supervisor = &session->supervisor;
+  int base = session->config.reconnect_min_ms;
+  int cap = session->config.reconnect_max_ms;
+  long upper = (long)supervisor->delay * 3;
+  long delay = base;
+
+  if (upper > cap)
+    upper = cap;
+  if (upper > base)
+    delay += ttngwc_supervisor_random(supervisor) % (upper - base + 1);
+  if (delay > cap)
+    delay = cap;
+  supervisor->delay = (int)delay;
+  return supervisor->delay;
+}
+
+static void ttngwc_supervisor_report(struct Session *session, TTNState state) {
+  struct Supervisor *supervisor = &session->supervisor;
+  if (supervisor->handler)
+    supervisor->handler(state, supervisor->arg);
+}
+
+// Makes one attempt to connect and reports the state
+// Returns 0 when connected, -1 on failure
+static int ttngwc_supervisor_attempt(struct Session *session) {
+  struct Supervisor *supervisor = &session->supervisor;
+
+  ttngwc_supervisor_report(session, TTN_STATE_CONNECTING);
+  if (ttngwc_connect(session, supervisor->host, supervisor->port,
+                     supervisor->key) != SUCCESS)
+    return FAILURE;
+  ttngwc_supervisor_report(session, TTN_STATE_CONNECTED);
+  supervisor->delay = session->config.reconnect_min_ms;
+  return SUCCESS;
+}
+
+static void ttngwc_supervisor_drop(struct Session *session) {
+  ttngwc_network_close(session);
+  ttngwc_supervisor_report(session, TTN_STATE_DISCONNECTED);
+}
+
+static void ttngwc_supervisor_run(void *arg) {
+  struct Session *session = (struct Session *)arg;
+  struct Supervisor *supervisor = &session->supervisor;
+
+  while (!supervisor->stop) {
+    if (ttngwc_supervisor_attempt(session) == SUCCESS) {
+      while (!supervisor->stop && !ttngwc_network_lost(session))
+        EventWait(&supervisor->wake, SUPERVISOR_POLL);
+      if (supervisor->stop)
+        break;
+    }
+    // A connection that is lost right away also waits, so that a router that
+    // drops gateways is not flooded with attempts
+    ttngwc_supervisor_drop(session);
+    if (!supervisor->stop)
+      EventWait(&supervisor->wake, ttngwc_supervisor_backoff(session));
+  }
+
+  EventSet(&supervisor->stopped);
+}
+
+// Stops the thread, keeping the settings
+static void ttngwc_supervisor_halt(struct Session *session) {
+  struct Supervisor *supervisor = &session->supervisor;
+
+  supervisor->stop = 1;
+  EventSet(&supervisor->wake);
+  EventWait(&supervisor->stopped, -1);
+}
+
+void ttngwc_supervisor_init(struct Session *session) {
+  struct Supervisor *supervisor = &session->supervisor;
+  EventInit(&supervisor->wake);
+  EventInit(&supervisor->stopped);
+}
+
+void ttngwc_supervisor_destroy(struct Session *session) {
+  struct Supervisor *supervisor = &session->supervisor;
+  ttngwc_supervisor_stop(session);
+  EventDestroy(&supervisor->wake);
+  EventDestroy(&supervisor->stopped);
+}
+
+int ttngwc_supervisor_start(struct Session *session, const char *host_name,
+                            int port, const char *key,
+                            TTNStateHandler handler, void *arg) {
+  struct Supervisor *supervisor = &session->supervisor;
+
+  if (supervisor->running)
+    return FAILURE;
+  supervisor->host = strdup(host_name);
+  supervisor->port = port;
+  supervisor->key = key ? strdup(key) : NULL;
+  supervisor->handler = handler;
+  supervisor->arg = arg;
+  supervisor->stop = 0;
+  supervisor->delay = session->config.reconnect_min_ms;
+  // Gateways that start at the same time draw different delays
+  supervisor->random =
+      ttngwc_crc32c(0, session->id, strlen(session->id)) ^ (uint32_t)time(NULL);
+  if (supervisor->random == 0)
+    supervisor->random = 1;
+
+  // The loop of the reactor makes the attempts of a session that was added
+  if (session->reactor.loop) {
+    ttngwc_reactor_lock(session);
+    supervisor->driven = 1;
+    supervisor->running = 1;
+    ttngwc_reactor_unlock(session);
+    ttngwc_reactor_resume(session);
+    return SUCCESS;
+  }
+  supervisor->driven = 0;
+  supervisor->running = 1;
+  if (ThreadStart(&supervisor->thread, &ttngwc_supervisor_run, session) != 0) {
+    supervisor->running = 0;
+    free(supervisor->host);
+    free(supervisor->key);
+    supervisor->host = NULL;
+    supervisor->key = NULL;
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+void ttngwc_supervisor_stop(struct Session *session) {
+  struct Supervisor *supervisor = &session->supervisor;
+
+  if (!supervisor->running)
+    return;
+  if (supervisor->driven) {
+    // Waits for an attempt of the loop to end
+    ttngwc_reactor_lock(session);
+    supervisor->running = 0;
+    ttngwc_reactor_unlock(session);
+  } else {
+    ttngwc_supervisor_halt(session);
+    supervisor->running = 0;
+  }
+  free(supervisor->host);
+  free(supervisor->key);
+  supervisor->host = NULL;
+  supervisor->key = NULL;
+}
+
+void ttngwc_supervisor_drive(struct Session *session) {
+  struct Supervisor *supervisor = &session->supervisor;
+
+  if (!supervisor->running || supervisor->driven)
+    return;
+  ttngwc_supervisor_halt(session);
+  supervisor->driven = 1;
+}
+
+int ttngwc_supervisor_step(struct Session *session) {
+  if (!session->connected && ttngwc_supervisor_attempt(session) == SUCCESS)
+    return 0;
+  ttngwc_supervisor_drop(session);
+  return ttngwc_supervisor_backoff(session);
+}
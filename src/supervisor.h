@@ -0,0 +1,61 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+#if !defined(__TTN_GW_SUPERVISOR_H_)
+#define __TTN_GW_SUPERVISOR_H_
+
+#include <stdint.h>
+
+#include <MQTTClient.h>
+
+#include "connector.h"
+#include "platform.h"
+
+struct Session;
+
+// Keeps the session connected from a background thread. The thread sleeps on
+// the wake event, which the network sets when the connection fails. Sessions
+// in a reactor are driven by their loop instead, without a thread of their own
+struct Supervisor {
+  Thread thread;
+  Event wake;
+  Event stopped;
+  int running;
+  int driven;
+  int stop;
+  char *host;
+  int port;
+  char *key;
+  TTNStateHandler handler;
+  void *arg;
+  // Previous delay between attempts in milliseconds
+  int delay;
+  uint32_t random;
+};
+
+// Initializes the supervisor of the session without starting it
+void ttngwc_supervisor_init(struct Session *session);
+
+// Stops the supervisor, if running, and releases it
+void ttngwc_supervisor_destroy(struct Session *session);
+
+// Starts connecting in the background and reconnects when the connection is
+// lost. Returns 0 on success, -1 on failure
+int ttngwc_supervisor_start(struct Session *session, const char *host_name,
+                            int port, const char *key,
+                            TTNStateHandler handler, void *arg);
+
+// Stops reconnecting and waits for the supervisor to return
+void ttngwc_supervisor_stop(struct Session *session);
+
+// Has the loop of the reactor make the attempts instead of the thread, which
+// is stopped if it was started
+void ttngwc_supervisor_drive(struct Session *session);
+
+// Makes the next attempt for the reactor, or closes the connection
+// when it is lost. Call only when not connected or when the connection is
+// lost. Returns 0 when connected, or the time in milliseconds until the next
+// attempt
+int ttngwc_supervisor_step(struct Session *session);
+
+#endif
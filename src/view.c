@@ -0,0 +1,212 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "network.h"
+
+// Field numbers of Router.DownlinkMessage and Gateway.TxConfiguration
+#define FIELD_PAYLOAD 1
+#define FIELD_PROTOCOL_CONFIGURATION 11
+#define FIELD_GATEWAY_CONFIGURATION 12
+#define FIELD_TIMESTAMP 11
+#define FIELD_RF_CHAIN 21
+#define FIELD_FREQUENCY 22
+#define FIELD_POWER 23
+#define FIELD_POLARIZATION_INVERSION 31
+#define FIELD_FREQUENCY_DEVIATION 32
+
+enum WireType {
+  WIRE_VARINT = 0,
+  WIRE_64BIT = 1,
+  WIRE_LENGTH_DELIMITED = 2,
+  WIRE_32BIT = 5
+};
+
+// Reads through a packed message one field at a time
+struct WireReader {
+  const uint8_t *data;
+  size_t len;
+  size_t pos;
+};
+
+static int ttngwc_view_varint(struct WireReader *reader, uint64_t *value) {
+  int shift;
+
+  *value = 0;
+  for (shift = 0; shift < 64 && reader->pos < reader->len; shift += 7) {
+    uint8_t c = reader->data[reader->pos++];
+    *value |= (uint64_t)(c & 127) << shift;
+    if (!(c & 128))
+      return SUCCESS;
+  }
+  return FAILURE;
+}
+
+// Reads the next field and its wire type. Varints are stored in value, other
+// fields are located by data and len
+// Returns 1 when a field was read, 0 at the end or -1 when malformed
+static int ttngwc_view_next(struct WireReader *reader, uint32_t *number,
+                            int *type, uint64_t *value, const uint8_t **data,
+                            size_t *len) {
+  uint64_t key, length;
+  size_t size;
+
+  if (reader->pos == reader->len)
+    return 0;
+  if (ttngwc_view_varint(reader, &key) != SUCCESS)
+    return FAILURE;
+  *number = (uint32_t)(key >> 3);
+  *type = (int)(key & 7);
+  switch (key & 7) {
+  case WIRE_VARINT:
+    return ttngwc_view_varint(reader, value) == SUCCESS ? 1 : FAILURE;
+  case WIRE_64BIT:
+    size = 8;
+    break;
+  case WIRE_32BIT:
+    size = 4;
+    break;
+  case WIRE_LENGTH_DELIMITED:
+    if (ttngwc_view_varint(reader, &length) != SUCCESS)
+      return FAILURE;
+    size = (size_t)length;
+    break;
+  default:
+    return FAILURE;
+  }
+  if (size > reader->len - reader->pos)
+    return FAILURE;
+  *data = &reader->data[reader->pos];
+  *len = size;
+  reader->pos += size;
+  return 1;
+}
+
+int ttngwc_view_init(struct DownlinkView *view,
+                     struct ArenaAllocator *allocator, const uint8_t *data,
+                     size_t len) {
+  struct WireReader reader = {data, len, 0};
+  struct ViewField *field;
+  uint32_t number;
+  uint64_t value;
+  const uint8_t *ptr;
+  size_t size;
+  int rc, type;
+
+  memset(view, 0, sizeof(struct DownlinkView));
+  view->allocator = allocator;
+  view->data = data;
+  view->len = len;
+  while ((rc = ttngwc_view_next(&reader, &number, &type, &value, &ptr,
+                                &size)) > 0) {
+    if (number == FIELD_PAYLOAD)
+      field = &view->payload;
+    else if (number == FIELD_PROTOCOL_CONFIGURATION)
+      field = &view->protocol_configuration;
+    else if (number == FIELD_GATEWAY_CONFIGURATION)
+      field = &view->gateway_configuration;
+    else
+      continue;
+    // Decoding rejects a known field of another type as well
+    if (type != WIRE_LENGTH_DELIMITED)
+      return FAILURE;
+    field->data = ptr;
+    field->len = size;
+    field->present = 1;
+  }
+  return rc == 0 ? SUCCESS : FAILURE;
+}
+
+int ttngwc_view_payload(struct DownlinkView *view, const uint8_t **data,
+                        size_t *len) {
+  if (!view->payload.present)
+    return FAILURE;
+  *data = view->payload.data;
+  *len = view->payload.len;
+  return SUCCESS;
+}
+
+int ttngwc_view_tx(struct DownlinkView *view, Gateway__TxConfiguration *tx) {
+  struct WireReader reader = {view->gateway_configuration.data,
+                              view->gateway_configuration.len, 0};
+  uint32_t number;
+  uint64_t value = 0;
+  const uint8_t *ptr;
+  size_t size;
+  int rc, type;
+
+  if (!view->gateway_configuration.present)
+    return FAILURE;
+  while ((rc = ttngwc_view_next(&reader, &number, &type, &value, &ptr,
+                                &size)) > 0) {
+    // All known fields of the configuration are varints
+    if (type != WIRE_VARINT) {
+      if (number == FIELD_TIMESTAMP || number == FIELD_RF_CHAIN ||
+          number == FIELD_FREQUENCY || number == FIELD_POWER ||
+          number == FIELD_POLARIZATION_INVERSION ||
+          number == FIELD_FREQUENCY_DEVIATION)
+        return FAILURE;
+      continue;
+    }
+    switch (number) {
+    case FIELD_TIMESTAMP:
+      tx->has_timestamp = 1;
+      tx->timestamp = (uint32_t)value;
+      break;
+    case FIELD_RF_CHAIN:
+      tx->has_rf_chain = 1;
+      tx->rf_chain = (uint32_t)value;
+      break;
+    case FIELD_FREQUENCY:
+      tx->has_frequency = 1;
+      tx->frequency = value;
+      break;
+    case FIELD_POWER:
+      tx->has_power = 1;
+      tx->power = (int32_t)value;
+      break;
+    case FIELD_POLARIZATION_INVERSION:
+      tx->has_polarization_inversion = 1;
+      tx->polarization_inversion = value != 0;
+      break;
+    case FIELD_FREQUENCY_DEVIATION:
+      tx->has_frequency_deviation = 1;
+      tx->frequency_deviation = (uint32_t)value;
+      break;
+    }
+  }
+  return rc == 0 ? SUCCESS : FAILURE;
+}
+
+Protocol__TxConfiguration *ttngwc_view_protocol(struct DownlinkView *view) {
+  if (!view->protocol_configuration.present)
+    return NULL;
+  if (view->decoded)
+    return view->decoded->protocol_configuration;
+  return protocol__tx_configuration__unpack(
+      &view->allocator->base, view->protocol_configuration.len,
+      view->protocol_configuration.data);
+}
+
+Router__DownlinkMessage *ttngwc_view_decode(struct DownlinkView *view) {
+  if (!view->decoded)
+    view->decoded = router__downlink_message__unpack(
+        &view->allocator->base, view->len, view->data);
+  return view->decoded;
+}
+
+int ttngwc_view_deliver(struct Session *session,
+                        struct ArenaAllocator *allocator, const uint8_t *data,
+                        size_t len, Router__DownlinkMessage *decoded) {
+  struct DownlinkView view;
+
+  if (ttngwc_view_init(&view, allocator, data, len) != SUCCESS) {
+    ttngwc_counters_add(&session->counters, COUNTER_DOWNLINKS_DECODE_FAILED,
+                        1);
+    return FAILURE;
+  }
+  view.decoded = decoded;
+  ttngwc_counters_add(&session->counters, COUNTER_DOWNLINKS_DELIVERED, 1);
+  session->downlink_view_handler(&view, session->view_arg);
+  return SUCCESS;
+}
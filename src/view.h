@@ -0,0 +1,66 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+#if !defined(__TTN_GW_VIEW_H_)
+#define __TTN_GW_VIEW_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "connector.h"
+
+struct Session;
+
+// A part of the packed message
+struct ViewField {
+  const uint8_t *data;
+  size_t len;
+  int present;
+};
+
+// A downlink as received from the router. Only the fields at the top level
+// are located when the view is created. Their contents are read when asked
+// for, and the whole message is only decoded on request
+struct DownlinkView {
+  struct ArenaAllocator *allocator;
+  const uint8_t *data;
+  size_t len;
+  struct ViewField payload;
+  struct ViewField protocol_configuration;
+  struct ViewField gateway_configuration;
+  Router__DownlinkMessage *decoded;
+};
+
+// Locates the fields of the packed downlink
+// Returns 0 on success or -1 when the message is malformed
+int ttngwc_view_init(struct DownlinkView *view,
+                     struct ArenaAllocator *allocator, const uint8_t *data,
+                     size_t len);
+
+// Gets the payload, pointing into the packed message
+// Returns 0 on success or -1 when the downlink has no payload
+int ttngwc_view_payload(struct DownlinkView *view, const uint8_t **data,
+                        size_t *len);
+
+// Decodes the gateway configuration into tx, which the caller initializes
+// Returns 0 on success or -1 when missing or malformed
+int ttngwc_view_tx(struct DownlinkView *view, Gateway__TxConfiguration *tx);
+
+// Decodes only the protocol configuration with the allocator of the view
+// Returns the configuration or NULL when missing or malformed
+Protocol__TxConfiguration *ttngwc_view_protocol(struct DownlinkView *view);
+
+// Decodes the whole downlink with the allocator of the view, once
+// Returns the downlink or NULL when malformed
+Router__DownlinkMessage *ttngwc_view_decode(struct DownlinkView *view);
+
+// Passes a packed downlink to the view handler of the session. When the
+// downlink is already decoded, the view hands out that one. The caller resets
+// the allocator after this returns
+// Returns 0 on success or -1 when the message is malformed
+int ttngwc_view_deliver(struct Session *session,
+                        struct ArenaAllocator *allocator, const uint8_t *data,
+                        size_t len, Router__DownlinkMessage *decoded);
+
+#endif
@@ -0,0 +1,217 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "test.h"
+
+#if defined(__GLIBC__)
+
+// The test program replaces malloc and friends, so that every allocation of
+// the connector, protobuf-c and the client is counted, not only the growth of
+// the buffers that the connector knows about
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static int counting;
+static unsigned long allocations;
+// Number of the counted allocation that fails, or 0 when none fails
+static unsigned long failure;
+
+// Returns whether the allocation fails
+static int count(void) {
+  if (!__atomic_load_n(&counting, __ATOMIC_RELAXED))
+    return 0;
+  return __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED) == failure;
+}
+
+void *malloc(size_t size) { return count() ? NULL : __libc_malloc(size); }
+
+void *calloc(size_t n, size_t size) {
+  return count() ? NULL : __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  return count() ? NULL : __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) { __libc_free(ptr); }
+
+static void start_counting(void) {
+  allocations = 0;
+  __atomic_store_n(&counting, 1, __ATOMIC_SEQ_CST);
+}
+
+static unsigned long stop_counting(void) {
+  __atomic_store_n(&counting, 0, __ATOMIC_SEQ_CST);
+  return allocations;
+}
+
+#define ROUNDS 4
+
+static void downlink_count(Router__DownlinkMessage *downlink, void *arg) {
+  (*(int *)arg)++;
+}
+
+// Uplinks, status messages and downlinks of the same size as before do not
+// allocate once the buffers have grown
+static void test_steady(void) {
+  struct Session *session = test_connect(NULL);
+  Router__DownlinkMessage downlink = ROUTER__DOWNLINK_MESSAGE__INIT;
+  Gateway__Status status = GATEWAY__STATUS__INIT;
+  struct TestResults results = {0};
+  struct TestUplink u;
+  uint8_t payload[12] = {0x60};
+  int downlinks = 0, round, i;
+  unsigned long end;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  session->downlink_handler = &downlink_count;
+  session->cb_arg = &downlinks;
+  downlink.has_payload = 1;
+  downlink.payload.data = payload;
+  downlink.payload.len = sizeof(payload);
+  status.has_time = 1;
+
+  // Each slot of the outbox grows its buffer on first use, so counting starts
+  // once all slots have held an uplink
+  for (round = 0; round < ROUNDS; round++) {
+    if (round == ROUNDS - 1)
+      start_counting();
+    for (i = 0; i < 16; i++) {
+      test_uplink(&u, 0x26011234, 1000 + i);
+      ttngwc_submit_uplink(session, &u.up, &test_done, &results);
+    }
+    status.time = round;
+    ttngwc_submit_status(session, &status, &test_done, &results);
+    ttngwc_loopback_downlink(session, &downlink);
+    end = test_now() + 1000;
+    while ((results.count < 17 * (round + 1) || downlinks < round + 1) &&
+           (long)(end - test_now()) > 0)
+      ttngwc_poll(session, test_now());
+    if (round == ROUNDS - 1)
+      CHECK_EQ(stop_counting(), 0);
+  }
+  CHECK_EQ(results.count, 17 * ROUNDS);
+  CHECK_EQ(results.last, 0);
+  CHECK_EQ(downlinks, ROUNDS);
+  ttngwc_cleanup(session);
+}
+
+#define PARCELS 16
+
+// Submits an uplink, waiting while the I/O thread moves parcels to the outbox
+static int submit_threaded(struct Session *session, uint32_t timestamp,
+                           struct TestResults *results) {
+  struct TestUplink u;
+  unsigned long end = test_now() + 1000;
+  int rc;
+
+  test_uplink(&u, 0x26011234, timestamp);
+  while ((rc = ttngwc_submit_uplink(session, &u.up, &test_done, results)) ==
+             TTNGWC_DROPPED &&
+         (long)(end - test_now()) > 0)
+    test_sleep(1);
+  return rc;
+}
+
+static void wait_results(struct TestResults *results, int count) {
+  unsigned long end = test_now() + 1000;
+  while (__atomic_load_n(&results->count, __ATOMIC_ACQUIRE) < count &&
+         (long)(end - test_now()) > 0)
+    test_sleep(1);
+}
+
+// In threaded mode, uplinks are packed in parcels of a pool that keep their
+// memory, so pushing from another thread does not allocate either
+static void test_threaded(void) {
+  struct TestResults results = {0};
+  struct Session *session;
+  TTNConfig config;
+  int i;
+
+  ttngwc_config_init(&config);
+  config.threaded = 1;
+  config.sender_queue_size = PARCELS;
+  session = test_connect(&config);
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  CHECK(ttngwc_sender_threaded(session));
+
+  // Acknowledgements are only read once polling starts, so the uplinks fill
+  // all slots of the outbox and then all parcels, which grow their memory
+  for (i = 0; i < OUTBOX_SIZE + PARCELS; i++)
+    CHECK_EQ(submit_threaded(session, 1000 + i, &results), 0);
+  test_poll_start(session);
+  wait_results(&results, OUTBOX_SIZE + PARCELS);
+
+  start_counting();
+  for (i = 0; i < PARCELS; i++)
+    CHECK_EQ(submit_threaded(session, 2000 + i, &results), 0);
+  wait_results(&results, OUTBOX_SIZE + 2 * PARCELS);
+  CHECK_EQ(stop_counting(), 0);
+  test_poll_stop();
+  CHECK_EQ(results.count, OUTBOX_SIZE + 2 * PARCELS);
+  CHECK_EQ(results.last, 0);
+  ttngwc_cleanup(session);
+}
+
+// Allocations outside the counted section are not counted. The calls go
+// through pointers, so that the compiler does not leave them out
+static void test_counter(void) {
+  void *(*volatile allocate)(size_t) = &malloc;
+  void *(*volatile reallocate)(void *, size_t) = &realloc;
+  void *ptr;
+
+  start_counting();
+  ptr = allocate(16);
+  ptr = reallocate(ptr, 32);
+  CHECK_EQ(stop_counting(), 2);
+  free(ptr);
+  ptr = allocate(16);
+  CHECK_EQ(allocations, 2);
+  free(ptr);
+}
+
+// A session that cannot allocate everything it needs is not created, and the
+// parts that were allocated are released
+static void test_init(void) {
+  unsigned long n, counted;
+  TTN *ttn;
+  int rc;
+
+  // Without threads, as glibc does not expect their stacks to fail
+  for (n = 1;; n++) {
+    failure = n;
+    start_counting();
+    rc = ttngwc_init_ex(&ttn, "test", NULL, NULL, NULL);
+    counted = stop_counting();
+    failure = 0;
+    if (rc == SUCCESS)
+      ttngwc_cleanup(ttn);
+    else
+      CHECK(ttn == NULL);
+    // All allocations succeeded
+    if (counted < n) {
+      CHECK_EQ(rc, 0);
+      break;
+    }
+  }
+}
+
+const struct Test alloc_tests[] = {{"alloc/counter", &test_counter},
+                                   {"alloc/steady", &test_steady},
+                                   {"alloc/threaded", &test_threaded},
+                                   {"alloc/init", &test_init},
+                                   {NULL, NULL}};
+
+#else
+
+// Allocations are only counted with glibc
+const struct Test alloc_tests[] = {{NULL, NULL}};
+
+#endif
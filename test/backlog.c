@@ -0,0 +1,172 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "test.h"
+
+#define PENDING 1
+
+static void store_result(int rc, void *arg) { *(int *)arg = rc; }
+
+// Creates a session with a backlog of four uplinks that is not connected
+static TTN *open_backlog(TTNDropPolicy policy, int max_age_ms) {
+  TTNConfig config;
+  TTN *ttn;
+
+  ttngwc_config_init(&config);
+  config.backlog_size = 4;
+  config.backlog_policy = policy;
+  config.backlog_max_age_ms = max_age_ms;
+  ttngwc_init_ex(&ttn, "test", &config, NULL, NULL);
+  return ttn;
+}
+
+static int submit(TTN *ttn, const char *data_rate, int join, int i,
+                  int *results) {
+  struct TestUplink u;
+
+  test_uplink(&u, 0x26011234, 1000 + i);
+  u.lorawan.data_rate = (char *)data_rate;
+  if (join)
+    u.payload[0] = 0x00;
+  results[i] = PENDING;
+  return ttngwc_submit_uplink(ttn, &u.up, &store_result, &results[i]);
+}
+
+// Connects to the loopback responder and waits until the stored uplinks are
+// published
+static void drain(TTN *ttn) {
+  TTNBacklogStats stats;
+  int i;
+
+  CHECK_EQ(ttngwc_loopback(ttn), 0);
+  CHECK_EQ(ttngwc_connect(ttn, "loopback", 0, NULL), 0);
+  for (i = 0; i < 1000; i++) {
+    ttngwc_poll(ttn, test_now());
+    ttngwc_backlog_stats(ttn, &stats);
+    if (stats.depth == 0 && ttngwc_outbox_depth((struct Session *)ttn) == 0)
+      break;
+    test_sleep(1);
+  }
+}
+
+// The oldest uplinks make room for new uplinks
+static void test_oldest(void) {
+  TTN *ttn = open_backlog(TTN_DROP_OLDEST, 0);
+  TTNBacklogStats stats;
+  int results[6], i;
+
+  CHECK(ttn != NULL);
+  if (!ttn)
+    return;
+  for (i = 0; i < 6; i++)
+    CHECK_EQ(submit(ttn, "SF7BW125", 0, i, results), 0);
+  CHECK_EQ(results[0], TTNGWC_DROPPED);
+  CHECK_EQ(results[1], TTNGWC_DROPPED);
+  CHECK_EQ(results[2], PENDING);
+  ttngwc_backlog_stats(ttn, &stats);
+  CHECK_EQ(stats.stored, 6);
+  CHECK_EQ(stats.evicted, 2);
+  CHECK_EQ(stats.depth, 4);
+
+  drain(ttn);
+  for (i = 2; i < 6; i++)
+    CHECK_EQ(results[i], 0);
+  ttngwc_backlog_stats(ttn, &stats);
+  CHECK_EQ(stats.published, 4);
+  CHECK_EQ(stats.depth, 0);
+  ttngwc_cleanup(ttn);
+}
+
+// New uplinks are dropped when the backlog is full
+static void test_newest(void) {
+  TTN *ttn = open_backlog(TTN_DROP_NEWEST, 0);
+  TTNBacklogStats stats;
+  int results[6], i;
+
+  CHECK(ttn != NULL);
+  if (!ttn)
+    return;
+  for (i = 0; i < 4; i++)
+    CHECK_EQ(submit(ttn, "SF7BW125", 0, i, results), 0);
+  CHECK_EQ(submit(ttn, "SF7BW125", 0, 4, results), TTNGWC_DROPPED);
+  CHECK_EQ(submit(ttn, "SF7BW125", 0, 5, results), TTNGWC_DROPPED);
+  ttngwc_backlog_stats(ttn, &stats);
+  CHECK_EQ(stats.rejected, 2);
+  CHECK_EQ(stats.evicted, 0);
+
+  drain(ttn);
+  for (i = 0; i < 4; i++)
+    CHECK_EQ(results[i], 0);
+  ttngwc_cleanup(ttn);
+}
+
+// Join requests and lower spreading factors replace the oldest uplink with the
+// lowest priority, and uplinks of the lowest priority are rejected
+static void test_priority(void) {
+  TTN *ttn = open_backlog(TTN_DROP_PRIORITY, 0);
+  TTNBacklogStats stats;
+  int results[8];
+
+  CHECK(ttn != NULL);
+  if (!ttn)
+    return;
+  CHECK_EQ(submit(ttn, "SF12BW125", 0, 0, results), 0);
+  CHECK_EQ(submit(ttn, "SF9BW125", 0, 1, results), 0);
+  CHECK_EQ(submit(ttn, "SF12BW125", 0, 2, results), 0);
+  CHECK_EQ(submit(ttn, "SF10BW125", 0, 3, results), 0);
+
+  // SF7 replaces the oldest SF12 uplink, then the other one
+  CHECK_EQ(submit(ttn, "SF7BW125", 0, 4, results), 0);
+  CHECK_EQ(results[0], TTNGWC_DROPPED);
+  CHECK_EQ(results[2], PENDING);
+  CHECK_EQ(submit(ttn, "SF7BW125", 0, 5, results), 0);
+  CHECK_EQ(results[2], TTNGWC_DROPPED);
+
+  // A join request replaces the SF10 uplink, and SF12 has nothing to replace
+  CHECK_EQ(submit(ttn, "SF12BW125", 1, 6, results), 0);
+  CHECK_EQ(results[3], TTNGWC_DROPPED);
+  CHECK_EQ(submit(ttn, "SF12BW125", 0, 7, results), TTNGWC_DROPPED);
+  ttngwc_backlog_stats(ttn, &stats);
+  CHECK_EQ(stats.evicted, 3);
+  CHECK_EQ(stats.rejected, 1);
+
+  drain(ttn);
+  CHECK_EQ(results[1], 0);
+  CHECK_EQ(results[4], 0);
+  CHECK_EQ(results[5], 0);
+  CHECK_EQ(results[6], 0);
+  ttngwc_cleanup(ttn);
+}
+
+// Uplinks older than the age cutoff are dropped instead of published
+static void test_expiry(void) {
+  TTN *ttn = open_backlog(TTN_DROP_OLDEST, 50);
+  TTNBacklogStats stats;
+  int results[3], i;
+
+  CHECK(ttn != NULL);
+  if (!ttn)
+    return;
+  CHECK_EQ(submit(ttn, "SF7BW125", 0, 0, results), 0);
+  CHECK_EQ(submit(ttn, "SF7BW125", 0, 1, results), 0);
+  test_sleep(80);
+  CHECK_EQ(submit(ttn, "SF7BW125", 0, 2, results), 0);
+  CHECK_EQ(results[0], TTNGWC_DROPPED);
+  CHECK_EQ(results[1], TTNGWC_DROPPED);
+
+  drain(ttn);
+  CHECK_EQ(results[2], 0);
+  ttngwc_backlog_stats(ttn, &stats);
+  CHECK_EQ(stats.expired, 2);
+  CHECK_EQ(stats.published, 1);
+  for (i = 0; i < 3; i++)
+    CHECK(results[i] != PENDING);
+  ttngwc_cleanup(ttn);
+}
+
+const struct Test backlog_tests[] = {{"backlog/oldest", &test_oldest},
+                                     {"backlog/newest", &test_newest},
+                                     {"backlog/priority", &test_priority},
+                                     {"backlog/expiry", &test_expiry},
+                                     {NULL, NULL}};
@@ -0,0 +1,116 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "test.h"
+
+// The simulated concentrator counts 500 ppm fast, and rolls over shortly
+// after it starts
+#define DRIFT 1.0005
+#define START (0xffffffffu - 50000)
+
+static uint64_t started;
+
+static uint32_t concentrator(uint64_t monotonic) {
+  return START + (uint32_t)(int64_t)((double)(monotonic - started) * DRIFT);
+}
+
+static TTN *open_clock(void) {
+  TTN *ttn;
+
+  if (ttngwc_init_ex(&ttn, "test", NULL, NULL, NULL) != SUCCESS)
+    return NULL;
+  started = ClockMicros();
+  return ttn;
+}
+
+// Reports a reading of the counter every 10 ms for the given number of times
+static void sync_counter(TTN *ttn, int readings) {
+  int i;
+
+  for (i = 0; i < readings; i++) {
+    ttngwc_clock_sync(ttn, concentrator(ClockMicros()));
+    test_sleep(10);
+  }
+}
+
+// The rate of the counter is fitted over its rollover, and the counter is
+// estimated from the monotonic clock
+static void test_fit(void) {
+  TTN *ttn = open_clock();
+  struct Clock *clock;
+  uint32_t estimate, actual;
+
+  CHECK(ttn != NULL);
+  if (!ttn)
+    return;
+  clock = &((struct Session *)ttn)->clock;
+  CHECK(!ttngwc_clock_synced((struct Session *)ttn));
+  sync_counter(ttn, CLOCK_SAMPLES);
+
+  // The rollover is not taken for a restart
+  CHECK_EQ(clock->count, CLOCK_SAMPLES);
+  CHECK(fabs(clock->rate * DRIFT - 1) < 2e-4);
+  estimate = ttngwc_clock_counter((struct Session *)ttn);
+  actual = concentrator(ClockMicros());
+  CHECK(abs((int32_t)(actual - estimate)) < 200);
+  ttngwc_cleanup(ttn);
+}
+
+// A counter that jumps means that the concentrator restarted, so tracking
+// starts over and the PPS pulse is forgotten
+static void test_restart(void) {
+  TTN *ttn = open_clock();
+  struct Clock *clock;
+
+  CHECK(ttn != NULL);
+  if (!ttn)
+    return;
+  clock = &((struct Session *)ttn)->clock;
+  sync_counter(ttn, 4);
+  ttngwc_clock_sync_gps(ttn, concentrator(ClockMicros()), 1000000000);
+  CHECK_EQ(clock->gps, 1);
+
+  ttngwc_clock_sync(ttn, 0x80000000);
+  CHECK_EQ(clock->count, 1);
+  CHECK_EQ(clock->gps, 0);
+  CHECK(abs((int32_t)(ttngwc_clock_counter((struct Session *)ttn) -
+                      0x80000000)) < 1000);
+  ttngwc_cleanup(ttn);
+}
+
+// Counter values from before the rollover convert to the monotonic time at
+// which they were counted, and to the time of the PPS pulse plus the elapsed
+// microseconds
+static void test_convert(void) {
+  TTN *ttn = open_clock();
+  uint64_t monotonic;
+  uint32_t counter;
+  int64_t time;
+
+  CHECK(ttn != NULL);
+  if (!ttn)
+    return;
+  CHECK_EQ(ttngwc_clock_monotonic(ttn, 0, &monotonic), -1);
+  CHECK_EQ(ttngwc_clock_time(ttn, 0, &time), -1);
+
+  sync_counter(ttn, CLOCK_SAMPLES);
+  counter = concentrator(started + 20000);
+  CHECK(counter > START);
+  CHECK_EQ(ttngwc_clock_monotonic(ttn, counter, &monotonic), 0);
+  CHECK(llabs((int64_t)(monotonic - (started + 20000))) < 200);
+
+  ttngwc_clock_sync_gps(ttn, counter, 1000000000000LL);
+  CHECK_EQ(ttngwc_clock_time(ttn, counter + 1000000, &time), 0);
+  CHECK(llabs(time - (int64_t)(1000000000000LL + 1000000000 / DRIFT)) <
+        200000);
+  ttngwc_cleanup(ttn);
+}
+
+const struct Test clock_tests[] = {{"clock/fit", &test_fit},
+                                   {"clock/restart", &test_restart},
+                                   {"clock/convert", &test_convert},
+                                   {NULL, NULL}};
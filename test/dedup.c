@@ -0,0 +1,134 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "test.h"
+
+static struct Session *connect_dedup(int timeout_ms) {
+  TTNConfig config;
+
+  ttngwc_config_init(&config);
+  config.dedup_window_ms = 100;
+  config.command_timeout_ms = timeout_ms;
+  return test_connect(&config);
+}
+
+// A copy with a timestamp within the window is suppressed, and one outside
+// of it is sent
+static void test_window(void) {
+  struct Session *session = connect_dedup(2000);
+  struct TestResults results = {0};
+  struct TestUplink u;
+  TTNDedupStats stats;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  test_ignore_publish(session, 1);
+  test_uplink(&u, 0x26011234, 1000);
+  CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &results), 0);
+  u.gateway.timestamp = 1000 + 50000;
+  CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &results), 0);
+  CHECK_EQ(results.count, 1);
+  CHECK_EQ(results.last, 0);
+  u.gateway.timestamp = 1000 + 200000;
+  CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &results), 0);
+  CHECK_EQ(test_ignore_publish(session, 0), 2);
+
+  ttngwc_dedup_stats(session, &stats);
+  CHECK_EQ(stats.checked, 3);
+  CHECK_EQ(stats.suppressed, 1);
+  ttngwc_cleanup(session);
+}
+
+// Copies in one batch are sent once with the antennas of both, and share the
+// result
+static void test_merge(void) {
+  struct Session *session = connect_dedup(2000);
+  Gateway__RxMetadata__Antenna antennas[2];
+  Gateway__RxMetadata__Antenna *lists[2][1];
+  Router__UplinkMessage *uplinks[2];
+  struct TestUplink u[2];
+  TTNDedupStats stats;
+  unsigned long published;
+  int results[2], i;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  published = session->loopback->published;
+  test_poll_start(session);
+  for (i = 0; i < 2; i++) {
+    test_uplink(&u[i], 0x26011234, 1000 + i * 10);
+    gateway__rx_metadata__antenna__init(&antennas[i]);
+    antennas[i].has_antenna = 1;
+    antennas[i].antenna = i;
+    lists[i][0] = &antennas[i];
+    u[i].gateway.n_antennas = 1;
+    u[i].gateway.antennas = lists[i];
+    uplinks[i] = &u[i].up;
+  }
+  // The timestamp is not part of the payload
+  memcpy(u[1].payload, u[0].payload, sizeof(u[0].payload));
+  CHECK_EQ(ttngwc_send_uplinks(session, uplinks, 2, results), 2);
+  test_poll_stop();
+  CHECK_EQ(results[0], 0);
+  CHECK_EQ(results[1], 0);
+  CHECK_EQ(session->loopback->published - published, 1);
+
+  ttngwc_dedup_stats(session, &stats);
+  CHECK_EQ(stats.suppressed, 1);
+  CHECK_EQ(stats.merged, 1);
+  CHECK_EQ(stats.antennas_merged, 1);
+  // The caller's uplink is not changed
+  CHECK_EQ(u[0].gateway.n_antennas, 1);
+  ttngwc_cleanup(session);
+}
+
+// An uplink that failed is sent again rather than suppressed
+static void test_retry(void) {
+  struct Session *session = connect_dedup(50);
+  Router__UplinkMessage *uplinks[1];
+  struct TestUplink u;
+  TTNDedupStats stats;
+  unsigned long published;
+  int results[1];
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  published = session->loopback->published;
+  test_poll_start(session);
+  test_uplink(&u, 0x26011234, 1000);
+  uplinks[0] = &u.up;
+
+  // Timed out
+  test_ignore_publish(session, 1);
+  CHECK_EQ(ttngwc_send_uplink(session, &u.up), TTNGWC_TIMEOUT);
+  test_ignore_publish(session, 0);
+  CHECK_EQ(ttngwc_send_uplink(session, &u.up), 0);
+  CHECK_EQ(session->loopback->published - published, 1);
+
+  // Not connected
+  u.gateway.timestamp = 2000000;
+  ttngwc_network_close(session);
+  CHECK_EQ(ttngwc_send_uplinks(session, uplinks, 1, results), 0);
+  CHECK_EQ(results[0], -1);
+  CHECK_EQ(ttngwc_connect(session, "loopback", 0, NULL), 0);
+  CHECK_EQ(ttngwc_send_uplinks(session, uplinks, 1, results), 1);
+  CHECK_EQ(results[0], 0);
+  test_poll_stop();
+
+  ttngwc_dedup_stats(session, &stats);
+  CHECK_EQ(stats.suppressed, 0);
+  // The uplink that went through is remembered again
+  CHECK_EQ(ttngwc_send_uplink(session, &u.up), 0);
+  ttngwc_dedup_stats(session, &stats);
+  CHECK_EQ(stats.suppressed, 1);
+  ttngwc_cleanup(session);
+}
+
+const struct Test dedup_tests[] = {{"dedup/window", &test_window},
+                                   {"dedup/merge", &test_merge},
+                                   {"dedup/retry", &test_retry},
+                                   {NULL, NULL}};
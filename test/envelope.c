@@ -0,0 +1,205 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "test.h"
+
+// Keeps the payload of the last envelope written
+static int (*next_write)(Network *, unsigned char *, int, int);
+static uint8_t envelope[4096];
+static int envelope_len;
+static int envelopes;
+
+static int capture_write(Network *n, unsigned char *buf, int len,
+                         int timeout_ms) {
+  if (len > 0 && buf[0] >> 4 == PUBLISH) {
+    int pos = 1, remaining = 0, multiplier = 1, end, topic_len;
+    do {
+      remaining += (buf[pos] & 127) * multiplier;
+      multiplier *= 128;
+    } while (buf[pos++] & 128);
+    end = pos + remaining;
+    topic_len = buf[pos] << 8 | buf[pos + 1];
+    if (topic_len > 9 &&
+        !memcmp(&buf[pos + 2 + topic_len - 9], "/up/batch", 9)) {
+      pos += 2 + topic_len;
+      if (buf[0] & 0x06)
+        pos += 2;
+      if (end - pos <= (int)sizeof(envelope)) {
+        memcpy(envelope, &buf[pos], end - pos);
+        envelope_len = end - pos;
+      }
+      envelopes++;
+    }
+  }
+  return next_write(n, buf, len, timeout_ms);
+}
+
+static struct Session *connect_envelope(int size, int delay_ms,
+                                        int timeout_ms) {
+  struct Session *session;
+  TTNConfig config;
+
+  ttngwc_config_init(&config);
+  config.envelope_size = size;
+  config.envelope_delay_ms = delay_ms;
+  config.command_timeout_ms = timeout_ms;
+  session = test_connect(&config);
+  if (session) {
+    next_write = session->network_write;
+    session->network_write = &capture_write;
+    envelope_len = 0;
+    envelopes = 0;
+  }
+  return session;
+}
+
+struct Decoded {
+  int count;
+  uint32_t timestamps[16];
+};
+
+static void decoded(Router__UplinkMessage *uplink, void *arg) {
+  struct Decoded *d = (struct Decoded *)arg;
+  if (d->count < 16 && uplink->gateway_metadata)
+    d->timestamps[d->count] = uplink->gateway_metadata->timestamp;
+  d->count++;
+}
+
+// A full envelope is published at once and decodes to the same uplinks in
+// the same order
+static void test_round_trip(void) {
+  struct Session *session = connect_envelope(4, 10000, 2000);
+  struct TestResults results = {0};
+  struct Decoded d = {0};
+  struct TestUplink u;
+  TTNEnvelopeStats stats;
+  int i;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  for (i = 0; i < 4; i++) {
+    test_uplink(&u, 0x26011234, 1000 + i);
+    CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &results), 0);
+  }
+  CHECK_EQ(envelopes, 1);
+  test_poll(session, 1000, NULL);
+  CHECK_EQ(results.count, 4);
+  CHECK_EQ(results.last, 0);
+
+  CHECK_EQ(envelope[0], ENVELOPE_VERSION);
+  CHECK_EQ(ttngwc_envelope_decode(envelope, envelope_len, &decoded, &d), 4);
+  CHECK_EQ(d.count, 4);
+  for (i = 0; i < 4; i++)
+    CHECK_EQ(d.timestamps[i], 1000 + i);
+  ttngwc_envelope_stats(session, &stats);
+  CHECK_EQ(stats.envelopes, 1);
+  CHECK_EQ(stats.uplinks, 4);
+  CHECK(stats.compressed_bytes < stats.raw_bytes);
+
+  // A truncated envelope or another version is rejected
+  CHECK_EQ(ttngwc_envelope_decode(envelope, envelope_len / 2, NULL, NULL),
+           -1);
+  envelope[0] = ENVELOPE_VERSION + 1;
+  CHECK_EQ(ttngwc_envelope_decode(envelope, envelope_len, NULL, NULL), -1);
+  ttngwc_cleanup(session);
+}
+
+// An envelope that is not full is published after the delay
+static void test_delay(void) {
+  struct Session *session = connect_envelope(16, 50, 2000);
+  struct TestResults results = {0};
+  struct Decoded d = {0};
+  struct TestUplink u;
+  int i;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  for (i = 0; i < 2; i++) {
+    test_uplink(&u, 0x26011234, 1000 + i);
+    CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &results), 0);
+  }
+  CHECK_EQ(envelopes, 0);
+  test_poll(session, 1000, &results.count);
+  test_poll(session, 10, NULL);
+  CHECK_EQ(envelopes, 1);
+  CHECK_EQ(results.count, 2);
+  CHECK_EQ(results.last, 0);
+  CHECK_EQ(ttngwc_envelope_decode(envelope, envelope_len, &decoded, &d), 2);
+  ttngwc_cleanup(session);
+}
+
+// A blocking send gives up after the command timeout while its uplink waits
+// in an envelope, and the envelope no longer completes it
+static void test_cancel(void) {
+  struct Session *session = connect_envelope(16, 1000, 100);
+  struct TestUplink u;
+  TTNTrafficStats traffic;
+  unsigned long start;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  test_poll_start(session);
+  test_uplink(&u, 0x26011234, 1000);
+  start = test_now();
+  CHECK_EQ(ttngwc_send_uplink(session, &u.up), TTNGWC_TIMEOUT);
+  CHECK(test_now() - start < 500);
+  CHECK_EQ(envelopes, 0);
+
+  // The uplink is still published, but counted as failed only once
+  ttngwc_envelope_flush(session);
+  test_sleep(50);
+  test_poll_stop();
+  CHECK_EQ(envelopes, 1);
+  ttngwc_traffic_stats(session, &traffic);
+  CHECK_EQ(traffic.uplinks_failed, 1);
+  CHECK_EQ(traffic.uplinks_acked, 0);
+  ttngwc_cleanup(session);
+}
+
+// Buffers that leave no room for the headers of an envelope publish uplinks
+// one by one, and sizes of 0 or less take the defaults
+static void test_small_buffers(void) {
+  struct TestResults results = {0};
+  struct Session *session;
+  struct TestUplink u;
+  TTNConfig config;
+
+  ttngwc_config_init(&config);
+  config.envelope_size = 4;
+  config.read_buffer_size = 0;
+  config.send_buffer_size = -1;
+  session = test_connect(&config);
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  CHECK_EQ(session->config.read_buffer_size, READ_BUFFER_SIZE);
+  CHECK_EQ(session->config.send_buffer_size, SEND_BUFFER_SIZE);
+  CHECK_EQ(session->envelope.size, 4);
+  ttngwc_cleanup(session);
+
+  config.read_buffer_size = 128;
+  config.send_buffer_size = 128;
+  config.max_buffer_size = 128;
+  session = test_connect(&config);
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  CHECK_EQ(session->envelope.size, 0);
+  test_uplink(&u, 0x26011234, 1000);
+  CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &results), 0);
+  test_poll(session, 1000, &results.count);
+  CHECK_EQ(results.count, 1);
+  CHECK_EQ(results.last, 0);
+  ttngwc_cleanup(session);
+}
+
+const struct Test envelope_tests[] = {
+    {"envelope/round_trip", &test_round_trip},
+    {"envelope/delay", &test_delay},
+    {"envelope/cancel", &test_cancel},
+    {"envelope/small_buffers", &test_small_buffers},
+    {NULL, NULL}};
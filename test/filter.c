@@ -0,0 +1,141 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "test.h"
+
+// DevAddrs of The Things Network, NetID 0x000013, and of another network
+#define DEV_ADDR_TTN 0x26011234
+#define DEV_ADDR_OTHER 0x01020304
+
+static int pass(struct Session *session, uint32_t dev_addr) {
+  struct TestUplink u;
+
+  test_uplink(&u, dev_addr, 1000);
+  return ttngwc_filter_pass(session, &u.up);
+}
+
+// The prefix of a NetID holds the ones of its type, a zero and its NwkID
+static void test_netid(void) {
+  uint32_t prefix;
+  int bits;
+
+  CHECK_EQ(ttngwc_netid_prefix(0x000013, &prefix, &bits), 0);
+  CHECK_EQ(prefix, 0x26000000);
+  CHECK_EQ(bits, 7);
+  CHECK_EQ(ttngwc_netid_prefix(0x60002d, &prefix, &bits), 0);
+  CHECK_EQ(prefix, 0xe05a0000);
+  CHECK_EQ(bits, 15);
+  CHECK_EQ(ttngwc_netid_prefix(0xe00001, &prefix, &bits), 0);
+  CHECK_EQ(prefix, 0xfe000080);
+  CHECK_EQ(bits, 25);
+  CHECK_EQ(ttngwc_netid_prefix(0x1000000, &prefix, &bits), -1);
+}
+
+// Data frames pass by their prefix while other frames always pass, and all
+// frames pass while the filter is empty
+static void test_prefixes(void) {
+  struct Session *session = test_connect(NULL);
+  TTNFilterStats stats;
+  struct TestUplink u;
+  int i;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  CHECK_EQ(pass(session, DEV_ADDR_OTHER), 1);
+  CHECK_EQ(ttngwc_filter_netid(session, 0x000013), 0);
+  CHECK_EQ(pass(session, DEV_ADDR_TTN), 1);
+  CHECK_EQ(pass(session, DEV_ADDR_OTHER), 0);
+
+  // A join request has no DevAddr
+  test_uplink(&u, DEV_ADDR_OTHER, 1000);
+  u.payload[0] = 0x00;
+  CHECK_EQ(ttngwc_filter_pass(session, &u.up), 1);
+
+  ttngwc_filter_stats(session, &stats);
+  CHECK_EQ(stats.checked, 3);
+  CHECK_EQ(stats.passed_other, 1);
+  CHECK_EQ(stats.filtered, 1);
+  CHECK(stats.bytes_saved > 0);
+
+  CHECK_EQ(ttngwc_filter_prefix(session, 0, 33), -1);
+  for (i = 1; i < FILTER_PREFIXES; i++)
+    CHECK_EQ(ttngwc_filter_prefix(session, DEV_ADDR_OTHER, 32), 0);
+  CHECK_EQ(ttngwc_filter_prefix(session, DEV_ADDR_OTHER, 32), -1);
+  CHECK_EQ(pass(session, DEV_ADDR_OTHER), 1);
+  CHECK_EQ(pass(session, DEV_ADDR_OTHER + 1), 0);
+
+  ttngwc_filter_clear(session);
+  CHECK_EQ(pass(session, DEV_ADDR_OTHER + 1), 1);
+  ttngwc_cleanup(session);
+}
+
+// DevAddrs added to a Bloom filter pass, and a malformed filter is rejected
+// without replacing the current one
+static void test_bloom(void) {
+  struct Session *session = test_connect(NULL);
+  uint8_t bloom[2 + 64] = {FILTER_VERSION, 4};
+  uint8_t malformed[] = {FILTER_VERSION + 1, 4, 0xff};
+  TTNFilterStats stats;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  CHECK_EQ(ttngwc_bloom_add(bloom, sizeof(bloom), DEV_ADDR_OTHER), 0);
+  CHECK_EQ(ttngwc_bloom_add(malformed, sizeof(malformed), DEV_ADDR_OTHER), -1);
+  CHECK_EQ(ttngwc_filter_bloom(session, bloom, sizeof(bloom)), 0);
+  CHECK_EQ(pass(session, DEV_ADDR_OTHER), 1);
+  CHECK_EQ(pass(session, DEV_ADDR_TTN), 0);
+
+  CHECK_EQ(ttngwc_filter_bloom(session, malformed, sizeof(malformed)), -1);
+  CHECK_EQ(pass(session, DEV_ADDR_TTN), 0);
+  CHECK_EQ(ttngwc_filter_bloom(session, NULL, 0), 0);
+  CHECK_EQ(pass(session, DEV_ADDR_TTN), 1);
+
+  ttngwc_filter_stats(session, &stats);
+  CHECK_EQ(stats.updates, 2);
+  CHECK_EQ(stats.update_failures, 1);
+  ttngwc_cleanup(session);
+}
+
+// Filters published by the router replace the Bloom filter, and uplinks that
+// are filtered complete without being published
+static void test_updates(void) {
+  struct TestResults results = {0};
+  uint8_t bloom[2 + 64] = {FILTER_VERSION, 4};
+  struct Session *session;
+  TTNFilterStats stats;
+  struct TestUplink u;
+  TTNConfig config;
+
+  ttngwc_config_init(&config);
+  config.filter_updates = 1;
+  session = test_connect(&config);
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  ttngwc_bloom_add(bloom, sizeof(bloom), DEV_ADDR_TTN);
+  CHECK_EQ(ttngwc_loopback_inject(session, session->filter_topic, bloom,
+                                  sizeof(bloom)),
+           0);
+  ttngwc_poll(session, test_now());
+  ttngwc_filter_stats(session, &stats);
+  CHECK_EQ(stats.updates, 1);
+
+  test_ignore_publish(session, 1);
+  test_uplink(&u, DEV_ADDR_OTHER, 1000);
+  CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &results), 0);
+  CHECK_EQ(results.count, 1);
+  CHECK_EQ(results.last, 0);
+  test_uplink(&u, DEV_ADDR_TTN, 2000);
+  CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &results), 0);
+  CHECK_EQ(test_ignore_publish(session, 0), 1);
+  ttngwc_cleanup(session);
+}
+
+const struct Test filter_tests[] = {{"filter/netid", &test_netid},
+                                    {"filter/prefixes", &test_prefixes},
+                                    {"filter/bloom", &test_bloom},
+                                    {"filter/updates", &test_updates},
+                                    {NULL, NULL}};
@@ -0,0 +1,75 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include <stdlib.h>
+
+#include "test.h"
+
+// Checks that the value is within 3% of the expected value
+#define CHECK_CLOSE(value, expected)                                           \
+  CHECK(llabs((long long)(value) - (long long)(expected)) * 100 <=             \
+        3 * (long long)(expected))
+
+static struct Histogram histogram;
+
+// Small values are counted exactly
+static void test_exact(void) {
+  uint32_t i;
+
+  memset(&histogram, 0, sizeof(histogram));
+  CHECK_EQ(ttngwc_histogram_value(&histogram, 0.5), 0);
+  for (i = 0; i < 2 * HISTOGRAM_SUB_BUCKETS; i++)
+    ttngwc_histogram_record(&histogram, i);
+  CHECK_EQ(histogram.total, 2 * HISTOGRAM_SUB_BUCKETS);
+  CHECK_EQ(ttngwc_histogram_value(&histogram, 0), 0);
+  CHECK_EQ(ttngwc_histogram_value(&histogram, 0.5),
+           HISTOGRAM_SUB_BUCKETS - 1);
+  CHECK_EQ(ttngwc_histogram_value(&histogram, 1),
+           2 * HISTOGRAM_SUB_BUCKETS - 1);
+}
+
+// Larger values are counted within 3%, up to the largest 32-bit value
+static void test_error(void) {
+  uint32_t values[] = {100,    1000,      12345,       65537,
+                       999999, 123456789, 4000000000u, 0xffffffffu};
+  int i;
+
+  for (i = 0; i < (int)(sizeof(values) / sizeof(values[0])); i++) {
+    memset(&histogram, 0, sizeof(histogram));
+    ttngwc_histogram_record(&histogram, values[i]);
+    CHECK_CLOSE(ttngwc_histogram_value(&histogram, 0.5), values[i]);
+  }
+}
+
+// Percentiles of evenly spread values are close to the fractions, divided by
+// the scale
+static void test_percentiles(void) {
+  Api__Percentiles percentiles = API__PERCENTILES__INIT;
+  uint32_t i;
+
+  memset(&histogram, 0, sizeof(histogram));
+  ttngwc_histogram_percentiles(&histogram, 1, &percentiles);
+  CHECK(!percentiles.has_percentile50);
+
+  for (i = 1; i <= 100000; i++)
+    ttngwc_histogram_record(&histogram, i);
+  CHECK_CLOSE(ttngwc_histogram_value(&histogram, 0.01), 1000);
+  CHECK_CLOSE(ttngwc_histogram_value(&histogram, 0.5), 50000);
+  CHECK_CLOSE(ttngwc_histogram_value(&histogram, 0.99), 99000);
+
+  ttngwc_histogram_percentiles(&histogram, 1000, &percentiles);
+  CHECK(percentiles.has_percentile1);
+  CHECK(percentiles.has_percentile99);
+  CHECK_CLOSE(percentiles.percentile1 * 1000, 1000);
+  CHECK_CLOSE(percentiles.percentile50 * 1000, 50000);
+  CHECK_CLOSE(percentiles.percentile99 * 1000, 99000);
+  CHECK(percentiles.percentile25 <= percentiles.percentile50);
+  CHECK(percentiles.percentile50 <= percentiles.percentile75);
+}
+
+const struct Test histogram_tests[] = {
+    {"histogram/exact", &test_exact},
+    {"histogram/error", &test_error},
+    {"histogram/percentiles", &test_percentiles},
+    {NULL, NULL}};
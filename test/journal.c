@@ -0,0 +1,172 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "test.h"
+
+static char dir[64];
+static char path[96];
+
+static void make_path(void) {
+  strcpy(dir, "/tmp/ttngwc-test-XXXXXX");
+  if (!mkdtemp(dir))
+    dir[0] = '\0';
+  snprintf(path, sizeof(path), "%s/uplinks.journal", dir);
+}
+
+static void remove_path(void) {
+  unlink(path);
+  rmdir(dir);
+}
+
+static TTN *open_journal(int size) {
+  TTNConfig config;
+  TTN *ttn;
+
+  ttngwc_config_init(&config);
+  config.journal_path = path;
+  config.journal_size = size;
+  config.journal_rate = 0;
+  if (ttngwc_init_ex(&ttn, "test", &config, NULL, NULL) != SUCCESS)
+    return NULL;
+  return ttn;
+}
+
+// Size of a record in the file with an uplink of len bytes
+static size_t record_size(size_t len) { return (16 + len + 7) & ~(size_t)7; }
+
+// Uplinks stored while disconnected survive a restart and are published once
+// connected
+static void test_recover(void) {
+  struct TestUplink u;
+  TTN *ttn;
+  int i;
+
+  make_path();
+  ttn = open_journal(1 << 16);
+  CHECK(ttn != NULL);
+  if (!ttn)
+    return remove_path();
+  for (i = 0; i < 3; i++) {
+    test_uplink(&u, 0x26011234, 1000 + i);
+    CHECK_EQ(ttngwc_send_uplink(ttn, &u.up), 0);
+  }
+  CHECK_EQ(ttngwc_journal_depth(ttn), 3);
+  ttngwc_cleanup(ttn);
+
+  ttn = open_journal(1 << 16);
+  CHECK(ttn != NULL);
+  if (!ttn)
+    return remove_path();
+  CHECK_EQ(ttngwc_journal_depth(ttn), 3);
+  CHECK_EQ(ttngwc_loopback(ttn), 0);
+  CHECK_EQ(ttngwc_connect(ttn, "loopback", 0, NULL), 0);
+  for (i = 0; i < 1000 && ttngwc_journal_depth(ttn) > 0; i++) {
+    ttngwc_poll(ttn, test_now());
+    test_sleep(1);
+  }
+  CHECK_EQ(ttngwc_journal_depth(ttn), 0);
+  CHECK(((struct Session *)ttn)->loopback->published >= 3);
+  ttngwc_cleanup(ttn);
+
+  // Acknowledged uplinks are gone after a restart
+  ttn = open_journal(1 << 16);
+  CHECK(ttn != NULL);
+  if (ttn) {
+    CHECK_EQ(ttngwc_journal_depth(ttn), 0);
+    ttngwc_cleanup(ttn);
+  }
+  remove_path();
+}
+
+// A record that was partially written when the process stopped ends the ring
+static void test_torn(void) {
+  struct TestUplink u;
+  size_t len;
+  FILE *f;
+  TTN *ttn;
+  int i;
+
+  make_path();
+  ttn = open_journal(1 << 16);
+  CHECK(ttn != NULL);
+  if (!ttn)
+    return remove_path();
+  for (i = 0; i < 3; i++) {
+    test_uplink(&u, 0x26011234, 1000 + i);
+    CHECK_EQ(ttngwc_send_uplink(ttn, &u.up), 0);
+  }
+  len = router__uplink_message__get_packed_size(&u.up);
+  ttngwc_cleanup(ttn);
+
+  // Flip a byte of the payload of the last record, behind the two headers
+  f = fopen(path, "r+b");
+  CHECK(f != NULL);
+  if (f) {
+    long offset = 64 + 2 * record_size(len) + 16;
+    int c;
+    fseek(f, offset, SEEK_SET);
+    c = fgetc(f);
+    fseek(f, offset, SEEK_SET);
+    fputc(c ^ 0xff, f);
+    fclose(f);
+  }
+
+  ttn = open_journal(1 << 16);
+  CHECK(ttn != NULL);
+  if (ttn) {
+    CHECK_EQ(ttngwc_journal_depth(ttn), 2);
+    ttngwc_cleanup(ttn);
+  }
+  remove_path();
+}
+
+// The oldest uplinks are dropped when the journal is full
+static void test_full(void) {
+  struct TestUplink u;
+  size_t len;
+  TTN *ttn;
+  int i, depth;
+
+  make_path();
+  test_uplink(&u, 0x26011234, 1000);
+  len = router__uplink_message__get_packed_size(&u.up);
+  ttn = open_journal(64 + 4 * record_size(len));
+  CHECK(ttn != NULL);
+  if (!ttn)
+    return remove_path();
+  for (i = 0; i < 10; i++) {
+    test_uplink(&u, 0x26011234, 1000 + i);
+    CHECK_EQ(ttngwc_send_uplink(ttn, &u.up), 0);
+  }
+  depth = ttngwc_journal_depth(ttn);
+  CHECK(depth >= 3 && depth <= 4);
+  ttngwc_cleanup(ttn);
+  remove_path();
+}
+
+// A journal that cannot be opened fails the session, and a file that was
+// created for it is removed
+static void test_open_fail(void) {
+  TTN *ttn;
+
+  make_path();
+  snprintf(path, sizeof(path), "%s/missing/uplinks.journal", dir);
+  ttn = open_journal(1 << 16);
+  CHECK(ttn == NULL);
+
+  snprintf(path, sizeof(path), "%s/uplinks.journal", dir);
+  ttn = open_journal(16);
+  CHECK(ttn == NULL);
+  CHECK(access(path, F_OK) != 0);
+  remove_path();
+}
+
+const struct Test journal_tests[] = {{"journal/recover", &test_recover},
+                                     {"journal/torn", &test_torn},
+                                     {"journal/full", &test_full},
+                                     {"journal/open_fail", &test_open_fail},
+                                     {NULL, NULL}};
@@ -0,0 +1,98 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "test.h"
+
+// Hands out at most the allowance of bytes, as if the rest did not arrive yet
+static int (*next_read)(Network *, unsigned char *, int, int);
+static int allowance;
+
+static int trickle_read(Network *n, unsigned char *buf, int len,
+                        int timeout_ms) {
+  int rc;
+
+  if (len > allowance)
+    len = allowance;
+  if (len == 0)
+    return 0;
+  rc = next_read(n, buf, len, timeout_ms);
+  if (rc > 0)
+    allowance -= rc;
+  return rc;
+}
+
+struct Received {
+  int count;
+  size_t len;
+  uint8_t payload[256];
+};
+
+static void receive(Router__DownlinkMessage *downlink, void *arg) {
+  struct Received *r = (struct Received *)arg;
+  r->count++;
+  r->len = downlink->payload.len;
+  if (r->len <= sizeof(r->payload))
+    memcpy(r->payload, downlink->payload.data, r->len);
+}
+
+// A downlink that arrives a few bytes per poll is delivered once and intact
+static void test_partial(void) {
+  struct Session *session = test_connect(NULL);
+  Router__DownlinkMessage downlink = ROUTER__DOWNLINK_MESSAGE__INIT;
+  struct Received r = {0};
+  uint8_t payload[200];
+  int i;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  session->downlink_handler = &receive;
+  session->cb_arg = &r;
+  next_read = session->network_read;
+  session->network_read = &trickle_read;
+  for (i = 0; i < (int)sizeof(payload); i++)
+    payload[i] = i;
+  downlink.has_payload = 1;
+  downlink.payload.data = payload;
+  downlink.payload.len = sizeof(payload);
+  CHECK_EQ(ttngwc_loopback_downlink(session, &downlink), 0);
+
+  for (i = 0; i < 1000 && r.count == 0; i++) {
+    allowance = 3;
+    CHECK(ttngwc_poll(session, test_now()) >= 0);
+  }
+  CHECK_EQ(r.count, 1);
+  CHECK_EQ(r.len, sizeof(payload));
+  CHECK(!memcmp(r.payload, payload, sizeof(payload)));
+  CHECK(!ttngwc_network_lost(session));
+  ttngwc_cleanup(session);
+}
+
+// A packet that cannot fit in the read buffer fails the connection
+static void test_oversized(void) {
+  struct Received r = {0};
+  struct Session *session;
+  TTNConfig config;
+  uint8_t payload[2048] = {0};
+
+  ttngwc_config_init(&config);
+  config.max_buffer_size = 1024;
+  session = test_connect(&config);
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  session->downlink_handler = &receive;
+  session->cb_arg = &r;
+  CHECK_EQ(ttngwc_loopback_inject(session, session->downlink_topic, payload,
+                                  sizeof(payload)),
+           0);
+  CHECK_EQ(ttngwc_poll(session, test_now()), -1);
+  CHECK_EQ(r.count, 0);
+  CHECK(ttngwc_network_lost(session));
+  ttngwc_cleanup(session);
+}
+
+const struct Test network_tests[] = {{"network/partial", &test_partial},
+                                     {"network/oversized", &test_oversized},
+                                     {NULL, NULL}};
@@ -0,0 +1,316 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "test.h"
+
+// Records the header and packet identifier of the PUBLISH packets written
+static int (*next_write)(Network *, unsigned char *, int, int);
+static unsigned char last_header;
+static unsigned short last_packetid;
+static int published;
+
+static int capture_write(Network *n, unsigned char *buf, int len,
+                         int timeout_ms) {
+  if (len > 0 && buf[0] >> 4 == PUBLISH) {
+    int pos = 1, topic_len;
+    while (buf[pos++] & 128)
+      ;
+    topic_len = buf[pos] << 8 | buf[pos + 1];
+    pos += 2 + topic_len;
+    last_header = buf[0];
+    if (buf[0] & 0x06)
+      last_packetid = buf[pos] << 8 | buf[pos + 1];
+    published++;
+  }
+  return next_write(n, buf, len, timeout_ms);
+}
+
+static void capture(struct Session *session) {
+  next_write = session->network_write;
+  session->network_write = &capture_write;
+  published = 0;
+}
+
+static void test_ack(void) {
+  struct Session *session = test_connect(NULL);
+  struct TestResults results = {0};
+  struct TestUplink u;
+  TTNTrafficStats traffic;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  test_uplink(&u, 0x26011234, 1000);
+  CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &results), 0);
+  test_poll(session, 1000, &results.count);
+  CHECK_EQ(results.count, 1);
+  CHECK_EQ(results.last, 0);
+  CHECK_EQ(ttngwc_queue_depth(session), 0);
+
+  ttngwc_traffic_stats(session, &traffic);
+  CHECK_EQ(traffic.uplinks_submitted, 1);
+  CHECK_EQ(traffic.uplinks_acked, 1);
+  CHECK_EQ(traffic.uplinks_failed, 0);
+  ttngwc_cleanup(session);
+}
+
+static void test_blocking(void) {
+  struct Session *session = test_connect(NULL);
+  Gateway__Status status = GATEWAY__STATUS__INIT;
+  Router__UplinkMessage *uplinks[3];
+  struct TestUplink u[3];
+  int results[3], i;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  test_poll_start(session);
+  test_uplink(&u[0], 0x26011234, 1000);
+  CHECK_EQ(ttngwc_send_uplink(session, &u[0].up), 0);
+  CHECK_EQ(ttngwc_send_status(session, &status), 0);
+  for (i = 0; i < 3; i++) {
+    test_uplink(&u[i], 0x26011234, 2000 + i);
+    uplinks[i] = &u[i].up;
+  }
+  CHECK_EQ(ttngwc_send_uplinks(session, uplinks, 3, results), 3);
+  for (i = 0; i < 3; i++)
+    CHECK_EQ(results[i], 0);
+  test_poll_stop();
+  ttngwc_cleanup(session);
+}
+
+static void test_timeout(void) {
+  TTNConfig config;
+  struct Session *session;
+  struct TestResults results = {0};
+  struct TestUplink u;
+  unsigned long start;
+
+  ttngwc_config_init(&config);
+  config.command_timeout_ms = 50;
+  session = test_connect(&config);
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  test_ignore_publish(session, 1);
+  test_uplink(&u, 0x26011234, 1000);
+  CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &results), 0);
+  test_poll(session, 1000, &results.count);
+  CHECK_EQ(results.count, 1);
+  CHECK_EQ(results.last, TTNGWC_TIMEOUT);
+  CHECK_EQ(ttngwc_queue_depth(session), 0);
+
+  // A blocking send gives up after the command timeout
+  test_poll_start(session);
+  start = test_now();
+  CHECK_EQ(ttngwc_send_uplink(session, &u.up), TTNGWC_TIMEOUT);
+  CHECK(test_now() - start < 1000);
+  test_poll_stop();
+  CHECK_EQ(test_ignore_publish(session, 0), 2);
+  ttngwc_cleanup(session);
+}
+
+// Queued messages time out like the ones in flight, but not while
+// disconnected
+static void test_queued_timeout(void) {
+  TTNConfig config;
+  struct Session *session;
+  struct TestResults results = {0};
+  struct TestUplink u;
+  int i;
+
+  ttngwc_config_init(&config);
+  config.command_timeout_ms = 100;
+  session = test_connect(&config);
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  ttngwc_set_window(session, 1);
+  test_ignore_publish(session, 1);
+  for (i = 0; i < 2; i++) {
+    test_uplink(&u, 0x26011234, 1000 + i);
+    CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &results), 0);
+  }
+  test_poll(session, 150, NULL);
+  CHECK_EQ(results.count, 2);
+  CHECK_EQ(results.results[1], TTNGWC_TIMEOUT);
+  // The second message never left the queue
+  CHECK_EQ(test_ignore_publish(session, 0), 1);
+
+  ttngwc_network_close(session);
+  test_uplink(&u, 0x26011234, 2000);
+  CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &results), 0);
+  test_sleep(150);
+  ttngwc_outbox_pump(session);
+  CHECK_EQ(results.count, 2);
+  CHECK_EQ(ttngwc_connect(session, "loopback", 0, NULL), 0);
+  test_poll(session, 50, NULL);
+  CHECK_EQ(results.count, 3);
+  CHECK_EQ(results.last, 0);
+  ttngwc_cleanup(session);
+}
+
+static void test_window(void) {
+  struct Session *session = test_connect(NULL);
+  struct TestResults results = {0};
+  struct TestUplink u;
+  int i;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  ttngwc_set_window(session, 2);
+  test_ignore_publish(session, 1);
+  for (i = 0; i < 5; i++) {
+    test_uplink(&u, 0x26011234, 1000 + i);
+    CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &results), 0);
+  }
+  CHECK_EQ(test_ignore_publish(session, 1), 2);
+  CHECK_EQ(ttngwc_queue_depth(session), 5);
+  ttngwc_cleanup(session);
+  CHECK_EQ(results.count, 5);
+  CHECK_EQ(results.last, TTNGWC_DROPPED);
+}
+
+static void test_full(void) {
+  struct Session *session = test_connect(NULL);
+  struct TestUplink u;
+  int i;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  test_ignore_publish(session, 1);
+  test_uplink(&u, 0x26011234, 1000);
+  for (i = 0; i < OUTBOX_SIZE; i++)
+    CHECK_EQ(ttngwc_submit_uplink(session, &u.up, NULL, NULL), 0);
+  CHECK_EQ(ttngwc_submit_uplink(session, &u.up, NULL, NULL), TTNGWC_DROPPED);
+  ttngwc_cleanup(session);
+}
+
+static void test_retransmit(void) {
+  struct Session *session = test_connect(NULL);
+  struct TestResults results = {0};
+  struct TestUplink u;
+  unsigned short packetid;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  capture(session);
+  test_ignore_publish(session, 1);
+  test_uplink(&u, 0x26011234, 1000);
+  CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &results), 0);
+  CHECK_EQ(published, 1);
+  CHECK_EQ(last_header & 0x08, 0);
+  packetid = last_packetid;
+  CHECK(packetid >= OUTBOX_FIRST_PACKET_ID);
+
+  // The message in flight is published again with the DUP flag and the same
+  // packet identifier after reconnecting
+  test_ignore_publish(session, 0);
+  ttngwc_network_close(session);
+  CHECK_EQ(ttngwc_connect(session, "loopback", 0, NULL), 0);
+  CHECK_EQ(last_header & 0x08, 0x08);
+  CHECK_EQ(last_packetid, packetid);
+  test_poll(session, 1000, &results.count);
+  CHECK_EQ(results.count, 1);
+  CHECK_EQ(results.last, 0);
+  ttngwc_cleanup(session);
+}
+
+static void test_puback_split(void) {
+  struct Session *session = test_connect(NULL);
+  struct TestResults results = {0};
+  struct TestUplink u;
+  unsigned char puback[4];
+  int i;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  test_ignore_publish(session, 1);
+  capture(session);
+  test_uplink(&u, 0x26011234, 1000);
+  CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &results), 0);
+  CHECK_EQ(published, 1);
+
+  // The acknowledgement is picked out of the stream byte by byte, and one for
+  // another packet identifier completes nothing
+  puback[0] = PUBACK << 4;
+  puback[1] = 2;
+  puback[2] = (last_packetid + 1) >> 8;
+  puback[3] = (last_packetid + 1) & 0xff;
+  ttngwc_outbox_read(session, puback, sizeof(puback));
+  CHECK_EQ(results.count, 0);
+  puback[2] = last_packetid >> 8;
+  puback[3] = last_packetid & 0xff;
+  for (i = 0; i < (int)sizeof(puback); i++) {
+    CHECK_EQ(results.count, 0);
+    ttngwc_outbox_read(session, &puback[i], 1);
+  }
+  CHECK_EQ(results.count, 1);
+  CHECK_EQ(results.last, 0);
+  ttngwc_cleanup(session);
+}
+
+static void test_qos0(void) {
+  struct Session *session = test_connect(NULL);
+  struct TestResults results = {0};
+  struct TestUplink u;
+  TTNLossStats loss;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  ttngwc_set_qos(session, 0, 1);
+  capture(session);
+  test_uplink(&u, 0x26011234, 1000);
+  CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &results), 0);
+  // Completed once written
+  CHECK_EQ(results.count, 1);
+  CHECK_EQ(results.last, 0);
+  CHECK_EQ(last_header & 0x06, 0);
+  ttngwc_loss_stats(session, &loss);
+  CHECK_EQ(loss.sent, 1);
+  CHECK_EQ(loss.unconfirmed, 1);
+  ttngwc_cleanup(session);
+}
+
+// The packet identifiers of MQTTClient start over on every connection, so
+// that they stay below those of the outbox
+static void test_packet_ids(void) {
+  struct Session *session = test_connect(NULL);
+  struct TestResults results = {0};
+  struct TestUplink u;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  session->client.next_packetid = OUTBOX_FIRST_PACKET_ID - 1;
+  ttngwc_network_close(session);
+  CHECK_EQ(ttngwc_connect(session, "loopback", 0, NULL), 0);
+  CHECK(session->client.next_packetid < OUTBOX_FIRST_PACKET_ID);
+  capture(session);
+  test_uplink(&u, 0x26011234, 1000);
+  CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &results), 0);
+  test_poll(session, 1000, &results.count);
+  CHECK(last_packetid >= OUTBOX_FIRST_PACKET_ID);
+  CHECK_EQ(results.count, 1);
+  CHECK_EQ(results.last, 0);
+  ttngwc_cleanup(session);
+}
+
+const struct Test outbox_tests[] = {
+    {"outbox/ack", &test_ack},
+    {"outbox/blocking", &test_blocking},
+    {"outbox/timeout", &test_timeout},
+    {"outbox/queued_timeout", &test_queued_timeout},
+    {"outbox/window", &test_window},
+    {"outbox/full", &test_full},
+    {"outbox/retransmit", &test_retransmit},
+    {"outbox/puback_split", &test_puback_split},
+    {"outbox/qos0", &test_qos0},
+    {"outbox/packet_ids", &test_packet_ids},
+    {NULL, NULL}};
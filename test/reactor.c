@@ -0,0 +1,308 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include <pthread.h>
+
+#include "test.h"
+
+#define SESSIONS 4
+
+// Counts the connection attempts of a session and the threads that make
+// them, failing the attempts when asked
+struct Attempts {
+  struct Session *session;
+  int count;
+  int fail;
+  pthread_t thread;
+  int threads;
+  int connected;
+  int disconnected;
+  // Time in milliseconds that an attempt takes
+  int slow_ms;
+};
+
+static int (*next_connect)(Network *, char *, int);
+static struct Attempts attempts[SESSIONS];
+
+static int count_connect(Network *n, char *host, int port) {
+  struct Attempts *a = NULL;
+  int i;
+
+  for (i = 0; i < SESSIONS; i++)
+    if (attempts[i].session == (struct Session *)n)
+      a = &attempts[i];
+  if (!a)
+    return FAILURE;
+  if (a->count == 0 || !pthread_equal(a->thread, pthread_self())) {
+    a->thread = pthread_self();
+    a->threads++;
+  }
+  __atomic_add_fetch(&a->count, 1, __ATOMIC_SEQ_CST);
+  if (a->slow_ms)
+    test_sleep(a->slow_ms);
+  if (__atomic_load_n(&a->fail, __ATOMIC_SEQ_CST))
+    return FAILURE;
+  return next_connect(n, host, port);
+}
+
+static void record_state(TTNState state, void *arg) {
+  struct Attempts *a = (struct Attempts *)arg;
+  if (state == TTN_STATE_CONNECTED)
+    __atomic_add_fetch(&a->connected, 1, __ATOMIC_SEQ_CST);
+  if (state == TTN_STATE_DISCONNECTED)
+    __atomic_add_fetch(&a->disconnected, 1, __ATOMIC_SEQ_CST);
+}
+
+static int load(int *value) { return __atomic_load_n(value, __ATOMIC_SEQ_CST); }
+
+// Waits at most a second for the value to reach at least the minimum
+static void wait_for(int *value, int min) {
+  unsigned long end = test_now() + 1000;
+  while (load(value) < min && (long)(end - test_now()) > 0)
+    test_sleep(1);
+}
+
+// Creates a session on the loopback responder that is not connected, and
+// waits a fixed delay between attempts
+static struct Session *open_session(int index, int delay_ms, int fail) {
+  struct Attempts *a = &attempts[index];
+  struct Session *session;
+  TTNConfig config;
+  char id[16];
+  TTN *ttn;
+
+  ttngwc_config_init(&config);
+  config.reconnect_min_ms = delay_ms;
+  config.reconnect_max_ms = delay_ms;
+  config.command_timeout_ms = 100;
+  config.max_buffer_size = 1024;
+  snprintf(id, sizeof(id), "test-%d", index);
+  if (ttngwc_init_ex(&ttn, id, &config, NULL, NULL) != SUCCESS)
+    return NULL;
+  session = (struct Session *)ttn;
+  if (ttngwc_loopback(ttn) != SUCCESS) {
+    ttngwc_cleanup(ttn);
+    return NULL;
+  }
+  memset(a, 0, sizeof(*a));
+  a->session = session;
+  a->fail = fail;
+  next_connect = session->network_connect;
+  session->network_connect = &count_connect;
+  return session;
+}
+
+// A session in a reactor is connected by its loop, and connected again by it
+// when the connection is lost
+static void test_connect_loop(void) {
+  struct Attempts *a = &attempts[0];
+  struct TestResults results = {0};
+  struct Session *session;
+  TTNReactor *reactor;
+  struct TestUplink u;
+  uint8_t payload[2048] = {0};
+
+  CHECK_EQ(ttngwc_reactor_create(&reactor, 1), 0);
+  session = open_session(0, 50, 0);
+  CHECK(session != NULL);
+  if (!session) {
+    ttngwc_reactor_destroy(reactor);
+    return;
+  }
+  CHECK_EQ(ttngwc_reactor_add(reactor, session), 0);
+  CHECK_EQ(ttngwc_connect_auto(session, "loopback", 0, NULL, &record_state, a),
+           0);
+  wait_for(&a->connected, 1);
+  CHECK_EQ(load(&a->connected), 1);
+  CHECK_EQ(a->threads, 1);
+  CHECK(!pthread_equal(a->thread, pthread_self()));
+
+  test_uplink(&u, 0x26011234, 1000);
+  CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &results), 0);
+  wait_for(&results.count, 1);
+  CHECK_EQ(results.count, 1);
+  CHECK_EQ(results.last, 0);
+
+  // A packet over the limit fails the connection
+  CHECK_EQ(ttngwc_loopback_inject(session, session->downlink_topic, payload,
+                                  sizeof(payload)),
+           0);
+  wait_for(&a->connected, 2);
+  CHECK_EQ(load(&a->disconnected), 1);
+  CHECK_EQ(load(&a->connected), 2);
+  CHECK_EQ(load(&a->count), 2);
+  CHECK_EQ(a->threads, 1);
+
+  CHECK_EQ(ttngwc_reactor_remove(reactor, session), 0);
+  ttngwc_cleanup(session);
+  ttngwc_reactor_destroy(reactor);
+}
+
+// A session that was connecting automatically before it was added is
+// reconnected by the loop instead of its thread
+static void test_handoff(void) {
+  struct Attempts *a = &attempts[0];
+  struct Session *session;
+  TTNReactor *reactor;
+  pthread_t thread;
+  uint8_t payload[2048] = {0};
+
+  CHECK_EQ(ttngwc_reactor_create(&reactor, 1), 0);
+  session = open_session(0, 50, 0);
+  CHECK(session != NULL);
+  if (!session) {
+    ttngwc_reactor_destroy(reactor);
+    return;
+  }
+  CHECK_EQ(ttngwc_connect_auto(session, "loopback", 0, NULL, &record_state, a),
+           0);
+  wait_for(&a->connected, 1);
+  CHECK_EQ(load(&a->connected), 1);
+  thread = a->thread;
+  CHECK_EQ(ttngwc_reactor_add(reactor, session), 0);
+
+  CHECK_EQ(ttngwc_loopback_inject(session, session->downlink_topic, payload,
+                                  sizeof(payload)),
+           0);
+  wait_for(&a->connected, 2);
+  CHECK_EQ(load(&a->connected), 2);
+  CHECK_EQ(a->threads, 2);
+  CHECK(!pthread_equal(a->thread, thread));
+
+  CHECK_EQ(ttngwc_reactor_remove(reactor, session), 0);
+  ttngwc_cleanup(session);
+  ttngwc_reactor_destroy(reactor);
+}
+
+// Sessions of one loop are attempted at their own intervals, and a session
+// that was removed is no longer attempted
+static void test_heap(void) {
+  struct Session *sessions[SESSIONS];
+  int delays[SESSIONS] = {20, 40, 80, 160};
+  int counts[SESSIONS];
+  TTNReactor *reactor;
+  int i;
+
+  CHECK_EQ(ttngwc_reactor_create(&reactor, 1), 0);
+  for (i = 0; i < SESSIONS; i++) {
+    sessions[i] = open_session(i, delays[i], 1);
+    CHECK(sessions[i] != NULL);
+    if (!sessions[i])
+      break;
+    CHECK_EQ(ttngwc_reactor_add(reactor, sessions[i]), 0);
+    CHECK_EQ(ttngwc_connect_auto(sessions[i], "loopback", 0, NULL, NULL, NULL),
+             0);
+  }
+  if (i < SESSIONS) {
+    while (i-- > 0)
+      ttngwc_cleanup(sessions[i]);
+    ttngwc_reactor_destroy(reactor);
+    return;
+  }
+
+  test_sleep(640);
+  for (i = 0; i < SESSIONS; i++) {
+    counts[i] = load(&attempts[i].count);
+    CHECK(counts[i] >= 640 / delays[i] / 2);
+    CHECK(counts[i] <= 640 / delays[i] + 2);
+    CHECK_EQ(attempts[i].threads, 1);
+    CHECK(pthread_equal(attempts[i].thread, attempts[0].thread));
+  }
+  for (i = 1; i < SESSIONS; i++)
+    CHECK(counts[i] < counts[i - 1]);
+
+  CHECK_EQ(ttngwc_reactor_remove(reactor, sessions[1]), 0);
+  counts[1] = load(&attempts[1].count);
+  test_sleep(400);
+  for (i = 0; i < SESSIONS; i++) {
+    if (i == 1)
+      CHECK_EQ(load(&attempts[i].count), counts[i]);
+    else
+      CHECK(load(&attempts[i].count) > counts[i]);
+  }
+
+  ttngwc_reactor_destroy(reactor);
+  for (i = 0; i < SESSIONS; i++)
+    ttngwc_cleanup(sessions[i]);
+}
+
+// An attempt that waits for the router does not hold up the other sessions of
+// the loop, and a session can be removed while its attempt is made
+static void test_slow_connect(void) {
+  struct TestResults results = {0};
+  struct Session *fast, *slow;
+  TTNReactor *reactor;
+  struct TestUplink u;
+  unsigned long start;
+
+  CHECK_EQ(ttngwc_reactor_create(&reactor, 1), 0);
+  fast = open_session(0, 50, 0);
+  slow = open_session(1, 50, 0);
+  CHECK(fast != NULL && slow != NULL);
+  if (!fast || !slow) {
+    if (fast)
+      ttngwc_cleanup(fast);
+    if (slow)
+      ttngwc_cleanup(slow);
+    ttngwc_reactor_destroy(reactor);
+    return;
+  }
+  attempts[1].slow_ms = 500;
+  CHECK_EQ(ttngwc_reactor_add(reactor, fast), 0);
+  CHECK_EQ(ttngwc_connect_auto(fast, "loopback", 0, NULL, &record_state,
+                               &attempts[0]),
+           0);
+  wait_for(&attempts[0].connected, 1);
+  CHECK_EQ(ttngwc_reactor_add(reactor, slow), 0);
+  CHECK_EQ(ttngwc_connect_auto(slow, "loopback", 0, NULL, &record_state,
+                               &attempts[1]),
+           0);
+  wait_for(&attempts[1].count, 1);
+
+  start = test_now();
+  test_uplink(&u, 0x26011234, 1000);
+  CHECK_EQ(ttngwc_submit_uplink(fast, &u.up, &test_done, &results), 0);
+  wait_for(&results.count, 1);
+  CHECK_EQ(results.count, 1);
+  CHECK_EQ(results.last, 0);
+  CHECK(test_now() - start < 250);
+  CHECK_EQ(load(&attempts[1].connected), 0);
+
+  CHECK_EQ(ttngwc_reactor_remove(reactor, slow), 0);
+  CHECK_EQ(load(&attempts[1].count), 1);
+  CHECK_EQ(ttngwc_reactor_remove(reactor, fast), 0);
+  ttngwc_cleanup(slow);
+  ttngwc_cleanup(fast);
+  ttngwc_reactor_destroy(reactor);
+}
+
+// Only the reactor to which a session was added removes it
+static void test_remove(void) {
+  TTNReactor *reactor, *other;
+  struct Session *session;
+
+  CHECK_EQ(ttngwc_reactor_create(&reactor, 1), 0);
+  CHECK_EQ(ttngwc_reactor_create(&other, 1), 0);
+  session = open_session(0, 50, 0);
+  CHECK(session != NULL);
+  if (session) {
+    CHECK_EQ(ttngwc_reactor_remove(reactor, session), -1);
+    CHECK_EQ(ttngwc_reactor_add(reactor, session), 0);
+    CHECK_EQ(ttngwc_reactor_add(other, session), -1);
+    CHECK_EQ(ttngwc_reactor_remove(other, session), -1);
+    CHECK_EQ(ttngwc_reactor_remove(reactor, session), 0);
+    CHECK_EQ(ttngwc_reactor_remove(reactor, session), -1);
+    ttngwc_cleanup(session);
+  }
+  ttngwc_reactor_destroy(other);
+  ttngwc_reactor_destroy(reactor);
+}
+
+const struct Test reactor_tests[] = {{"reactor/connect", &test_connect_loop},
+                                     {"reactor/handoff", &test_handoff},
+                                     {"reactor/heap", &test_heap},
+                                     {"reactor/slow_connect",
+                                      &test_slow_connect},
+                                     {"reactor/remove", &test_remove},
+                                     {NULL, NULL}};
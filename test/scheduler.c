@@ -0,0 +1,225 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "test.h"
+
+// Time on air in microseconds of 20 bytes at SF12BW125 and coding rate 4/5,
+// and at 50 kbit/s FSK
+#define AIRTIME_SF12 1318912
+#define AIRTIME_FSK 4960
+
+// The counter runs with the monotonic clock from the offset
+static uint32_t offset;
+
+static uint32_t counter(void *arg) {
+  (void)arg;
+  return (uint32_t)(test_now() * 1000) + offset;
+}
+
+// Starts the counter at the given value
+static void set_counter(uint32_t value) {
+  offset = 0;
+  offset = value - counter(NULL);
+}
+
+struct TestDownlink {
+  Router__DownlinkMessage down;
+  Protocol__TxConfiguration protocol;
+  Lorawan__TxConfiguration lorawan;
+  Gateway__TxConfiguration gateway;
+  uint8_t payload[20];
+};
+
+// Sets up a downlink of 20 bytes at the LoRa data rate, or FSK when NULL
+static void test_downlink(struct TestDownlink *d, const char *data_rate,
+                          uint32_t timestamp, uint32_t rf_chain) {
+  router__downlink_message__init(&d->down);
+  protocol__tx_configuration__init(&d->protocol);
+  lorawan__tx_configuration__init(&d->lorawan);
+  gateway__tx_configuration__init(&d->gateway);
+  memset(d->payload, 0x40, sizeof(d->payload));
+  d->down.has_payload = 1;
+  d->down.payload.data = d->payload;
+  d->down.payload.len = sizeof(d->payload);
+  d->down.protocol_configuration = &d->protocol;
+  d->down.gateway_configuration = &d->gateway;
+  d->protocol.protocol_case = PROTOCOL__TX_CONFIGURATION__PROTOCOL_LORAWAN;
+  d->protocol.lorawan = &d->lorawan;
+  d->lorawan.has_modulation = 1;
+  if (data_rate) {
+    d->lorawan.modulation = LORAWAN__MODULATION__LORA;
+    d->lorawan.data_rate = (char *)data_rate;
+    d->lorawan.coding_rate = "4/5";
+  } else {
+    d->lorawan.modulation = LORAWAN__MODULATION__FSK;
+    d->lorawan.has_bit_rate = 1;
+    d->lorawan.bit_rate = 50000;
+  }
+  d->gateway.has_timestamp = 1;
+  d->gateway.timestamp = timestamp;
+  d->gateway.has_rf_chain = 1;
+  d->gateway.rf_chain = rf_chain;
+}
+
+// Has the responder send the downlink and reads it
+static void push(struct Session *session, const char *data_rate,
+                 uint32_t timestamp, uint32_t rf_chain) {
+  struct TestDownlink d;
+
+  test_downlink(&d, data_rate, timestamp, rf_chain);
+  CHECK_EQ(ttngwc_loopback_downlink(session, &d.down), 0);
+  ttngwc_poll(session, test_now());
+}
+
+struct Released {
+  int count;
+  uint32_t timestamps[8];
+  uint32_t counters[8];
+};
+
+static void release(Router__DownlinkMessage *downlink, void *arg) {
+  struct Released *r = (struct Released *)arg;
+  int i = __atomic_load_n(&r->count, __ATOMIC_SEQ_CST);
+
+  if (i < 8 && downlink->gateway_configuration) {
+    r->timestamps[i] = downlink->gateway_configuration->timestamp;
+    r->counters[i] = counter(NULL);
+  }
+  __atomic_store_n(&r->count, i + 1, __ATOMIC_SEQ_CST);
+}
+
+static struct Session *connect_scheduler(struct Released *r) {
+  struct Session *session = test_connect(NULL);
+
+  if (!session)
+    return NULL;
+  session->downlink_handler = &release;
+  session->cb_arg = r;
+  if (ttngwc_schedule_downlinks(session, &counter, NULL) != SUCCESS) {
+    ttngwc_cleanup(session);
+    return NULL;
+  }
+  return session;
+}
+
+// Downlinks are released in order of transmission, the lead time before it,
+// also when the counter rolls over in between
+static void test_order(void) {
+  struct Released r = {0};
+  struct Session *session = connect_scheduler(&r);
+  TTNSchedulerStats stats;
+  uint32_t now, lead = SCHEDULER_LEAD * 1000;
+  unsigned long end;
+  int i;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  set_counter(0xffffffff - 100000);
+  now = counter(NULL);
+  push(session, "SF7BW125", now + 300000, 0);
+  push(session, "SF7BW125", now + 150000, 0);
+  push(session, "SF7BW125", now + 80000, 0);
+  ttngwc_scheduler_stats(session, &stats);
+  CHECK_EQ(stats.scheduled, 3);
+  CHECK_EQ(stats.depth, 3);
+
+  end = test_now() + 1000;
+  while (__atomic_load_n(&r.count, __ATOMIC_SEQ_CST) < 3 &&
+         (long)(end - test_now()) > 0)
+    test_sleep(1);
+  CHECK_EQ(r.count, 3);
+  CHECK_EQ(r.timestamps[0], now + 80000);
+  CHECK_EQ(r.timestamps[1], now + 150000);
+  CHECK_EQ(r.timestamps[2], now + 300000);
+  for (i = 0; i < 3; i++) {
+    CHECK((int32_t)(r.counters[i] - (r.timestamps[i] - lead)) >= -1000);
+    CHECK((int32_t)(r.timestamps[i] - r.counters[i]) > 0);
+  }
+  ttngwc_scheduler_stats(session, &stats);
+  CHECK_EQ(stats.released, 3);
+  CHECK_EQ(stats.depth, 0);
+  ttngwc_cleanup(session);
+}
+
+// Downlinks that overlap on air on the same RF chain collide, up to the end of
+// their time on air, and downlinks within the lead time are late
+static void test_collisions(void) {
+  struct Released r = {0};
+  struct Session *session = connect_scheduler(&r);
+  TTNSchedulerStats stats;
+  uint32_t now, t;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  set_counter(1000000);
+  now = counter(NULL);
+  t = now + 2000000;
+
+  push(session, "SF12BW125", t, 0);
+  push(session, "SF12BW125", t + AIRTIME_SF12 - 1, 0);
+  push(session, "SF12BW125", t + 100000, 1);
+  push(session, "SF7BW125", t + AIRTIME_SF12, 0);
+  ttngwc_scheduler_stats(session, &stats);
+  CHECK_EQ(stats.scheduled, 3);
+  CHECK_EQ(stats.collisions, 1);
+
+  push(session, NULL, t - 100000, 1);
+  push(session, NULL, t - 100000 + AIRTIME_FSK - 1, 1);
+  push(session, NULL, t - 100000 + AIRTIME_FSK, 1);
+  ttngwc_scheduler_stats(session, &stats);
+  CHECK_EQ(stats.scheduled, 5);
+  CHECK_EQ(stats.collisions, 2);
+
+  push(session, "SF7BW125", now + 10000, 1);
+  ttngwc_scheduler_stats(session, &stats);
+  CHECK_EQ(stats.late, 1);
+  CHECK_EQ(stats.depth, 5);
+  CHECK_EQ(r.count, 0);
+  ttngwc_cleanup(session);
+}
+
+// Only the fields that place a downlink in time are read when it is held, so
+// a downlink that is malformed elsewhere fails to decode on release
+static void test_malformed(void) {
+  struct Released r = {0};
+  struct Session *session = connect_scheduler(&r);
+  struct TestDownlink d;
+  uint8_t buf[256];
+  size_t len;
+  unsigned long end;
+
+  // A trace with a string that runs past its end
+  static const uint8_t trace[] = {0xaa, 0x01, 0x02, 0x0a, 0x05};
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  set_counter(1000000);
+  test_downlink(&d, "SF7BW125", counter(NULL) + 100000, 0);
+  len = router__downlink_message__pack(&d.down, buf);
+  memcpy(&buf[len], trace, sizeof(trace));
+  len += sizeof(trace);
+  CHECK_EQ(ttngwc_loopback_inject(session, session->downlink_topic, buf, len),
+           0);
+  ttngwc_poll(session, test_now());
+
+  end = test_now() + 1000;
+  while (ttngwc_counters_get(&session->counters,
+                             COUNTER_DOWNLINKS_DECODE_FAILED) == 0 &&
+         (long)(end - test_now()) > 0)
+    test_sleep(1);
+  CHECK_EQ(ttngwc_counters_get(&session->counters,
+                               COUNTER_DOWNLINKS_DECODE_FAILED),
+           1);
+  CHECK_EQ(r.count, 0);
+  ttngwc_cleanup(session);
+}
+
+const struct Test scheduler_tests[] = {
+    {"scheduler/order", &test_order},
+    {"scheduler/collisions", &test_collisions},
+    {"scheduler/malformed", &test_malformed},
+    {NULL, NULL}};
@@ -0,0 +1,238 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include <pthread.h>
+
+#include "test.h"
+
+#define PRODUCERS 4
+#define MESSAGES 200
+
+struct Counts {
+  int acked;
+  int failed;
+};
+
+static void count_done(int rc, void *arg) {
+  struct Counts *counts = (struct Counts *)arg;
+  __atomic_add_fetch(rc == 0 ? &counts->acked : &counts->failed, 1,
+                     __ATOMIC_RELAXED);
+}
+
+// Checks that the uplinks of each producer are published in the order in
+// which they were pushed. The producer and its sequence number are in the
+// timestamp of the uplink
+static int (*next_write)(Network *, unsigned char *, int, int);
+static uint32_t last_sequence[PRODUCERS];
+static int out_of_order;
+
+static int order_write(Network *n, unsigned char *buf, int len,
+                       int timeout_ms) {
+  if (len > 0 && buf[0] >> 4 == PUBLISH) {
+    Router__UplinkMessage *uplink;
+    int pos = 1, remaining = 0, multiplier = 1, end;
+    do {
+      remaining += (buf[pos] & 127) * multiplier;
+      multiplier *= 128;
+    } while (buf[pos++] & 128);
+    end = pos + remaining;
+    pos += 2 + (buf[pos] << 8 | buf[pos + 1]);
+    if (buf[0] & 0x06)
+      pos += 2;
+    uplink = router__uplink_message__unpack(NULL, end - pos, &buf[pos]);
+    if (uplink && uplink->gateway_metadata) {
+      uint32_t timestamp = uplink->gateway_metadata->timestamp;
+      int producer = timestamp / MESSAGES;
+      uint32_t sequence = timestamp % MESSAGES + 1;
+      // A retransmission may repeat the last uplink
+      if (producer >= PRODUCERS || sequence < last_sequence[producer])
+        out_of_order++;
+      else
+        last_sequence[producer] = sequence;
+    }
+    if (uplink)
+      router__uplink_message__free_unpacked(uplink, NULL);
+  }
+  return next_write(n, buf, len, timeout_ms);
+}
+
+struct Producer {
+  pthread_t thread;
+  struct Session *session;
+  struct Counts *counts;
+  int index;
+  int retries;
+};
+
+// Pushes the uplinks of one producer, retrying while the queue is full
+static void *produce(void *arg) {
+  struct Producer *producer = (struct Producer *)arg;
+  struct TestUplink u;
+  int i, rc;
+
+  for (i = 0; i < MESSAGES; i++) {
+    test_uplink(&u, 0x26011234, producer->index * MESSAGES + i);
+    while ((rc = ttngwc_submit_uplink(producer->session, &u.up, &count_done,
+                                      producer->counts)) == TTNGWC_DROPPED) {
+      producer->retries++;
+      test_sleep(1);
+    }
+    if (rc != 0)
+      count_done(rc, producer->counts);
+  }
+  return NULL;
+}
+
+// Submits an uplink, waiting for the I/O thread to take parcels from the
+// queue while it is full
+static int submit(struct Session *session, uint32_t timestamp,
+                  struct Counts *counts) {
+  struct TestUplink u;
+  unsigned long end = test_now() + 1000;
+  int rc;
+
+  test_uplink(&u, 0x26011234, timestamp);
+  while ((rc = ttngwc_submit_uplink(session, &u.up, &count_done, counts)) ==
+             TTNGWC_DROPPED &&
+         (long)(end - test_now()) > 0)
+    test_sleep(1);
+  return rc;
+}
+
+static struct Session *connect_threaded(int queue_size, int timeout_ms) {
+  TTNConfig config;
+
+  ttngwc_config_init(&config);
+  config.threaded = 1;
+  config.sender_queue_size = queue_size;
+  config.command_timeout_ms = timeout_ms;
+  return test_connect(&config);
+}
+
+// Producers on several threads have all their uplinks published in order
+static void test_producers(void) {
+  struct Session *session = connect_threaded(16, 2000);
+  struct Producer producers[PRODUCERS];
+  struct Counts counts = {0};
+  unsigned long end;
+  int i;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  CHECK(ttngwc_sender_threaded(session));
+  next_write = session->network_write;
+  session->network_write = &order_write;
+  memset(last_sequence, 0, sizeof(last_sequence));
+  out_of_order = 0;
+
+  test_poll_start(session);
+  for (i = 0; i < PRODUCERS; i++) {
+    producers[i].session = session;
+    producers[i].counts = &counts;
+    producers[i].index = i;
+    producers[i].retries = 0;
+    pthread_create(&producers[i].thread, NULL, &produce, &producers[i]);
+  }
+  for (i = 0; i < PRODUCERS; i++)
+    pthread_join(producers[i].thread, NULL);
+  end = test_now() + 5000;
+  while (__atomic_load_n(&counts.acked, __ATOMIC_RELAXED) +
+                 __atomic_load_n(&counts.failed, __ATOMIC_RELAXED) <
+             PRODUCERS * MESSAGES &&
+         (long)(end - test_now()) > 0)
+    test_sleep(1);
+  test_poll_stop();
+
+  CHECK_EQ(counts.acked, PRODUCERS * MESSAGES);
+  CHECK_EQ(counts.failed, 0);
+  CHECK_EQ(out_of_order, 0);
+  for (i = 0; i < PRODUCERS; i++)
+    CHECK_EQ(last_sequence[i], MESSAGES);
+  CHECK_EQ(ttngwc_queue_depth(session), 0);
+  ttngwc_cleanup(session);
+}
+
+// Once all parcels wait behind a full outbox, pushing fails as dropped
+static void test_full(void) {
+  struct Session *session = connect_threaded(4, 2000);
+  struct Counts counts = {0};
+  struct TestUplink u;
+  unsigned long end;
+  int i;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  test_ignore_publish(session, 1);
+  for (i = 0; i < OUTBOX_SIZE; i++)
+    CHECK_EQ(submit(session, i, &counts), 0);
+  end = test_now() + 1000;
+  while (ttngwc_outbox_depth(session) < OUTBOX_SIZE &&
+         (long)(end - test_now()) > 0)
+    test_sleep(1);
+  CHECK_EQ(ttngwc_outbox_depth(session), OUTBOX_SIZE);
+
+  for (i = 0; i < 4; i++) {
+    test_uplink(&u, 0x26011234, 100 + i);
+    CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &count_done, &counts), 0);
+  }
+  test_uplink(&u, 0x26011234, 200);
+  CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &count_done, &counts),
+           TTNGWC_DROPPED);
+  CHECK_EQ(ttngwc_sender_depth(session), 4);
+  CHECK_EQ(ttngwc_queue_depth(session), OUTBOX_SIZE + 4);
+
+  // All messages complete when the session is cleaned up
+  ttngwc_cleanup(session);
+  CHECK_EQ(counts.acked + counts.failed, OUTBOX_SIZE + 4);
+}
+
+// A blocking send gives up after the command timeout while its message still
+// waits for room in the outbox
+static void test_cancel(void) {
+  struct Session *session = connect_threaded(64, 100);
+  struct Counts counts = {0};
+  struct TestUplink u;
+  unsigned long start;
+  int i;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  test_ignore_publish(session, 1);
+  for (i = 0; i < OUTBOX_SIZE + 2; i++)
+    CHECK_EQ(submit(session, i, &counts), 0);
+  start = test_now();
+  test_uplink(&u, 0x26011234, 100);
+  CHECK_EQ(ttngwc_send_uplink(session, &u.up), TTNGWC_TIMEOUT);
+  CHECK(test_now() - start < 1000);
+  ttngwc_cleanup(session);
+  CHECK_EQ(counts.acked + counts.failed, OUTBOX_SIZE + 2);
+}
+
+// Flushing waits for the messages that the I/O thread did not queue yet
+static void test_flush(void) {
+  struct Session *session = connect_threaded(64, 2000);
+  struct Counts counts = {0};
+  int i;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  test_poll_start(session);
+  for (i = 0; i < 48; i++)
+    CHECK_EQ(submit(session, i, &counts), 0);
+  CHECK_EQ(ttngwc_disconnect_flush(session, 2000), 0);
+  test_poll_stop();
+  CHECK_EQ(counts.acked, 48);
+  CHECK_EQ(counts.failed, 0);
+  ttngwc_cleanup(session);
+}
+
+const struct Test sender_tests[] = {{"sender/producers", &test_producers},
+                                    {"sender/full", &test_full},
+                                    {"sender/cancel", &test_cancel},
+                                    {"sender/flush", &test_flush},
+                                    {NULL, NULL}};
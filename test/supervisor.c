@@ -0,0 +1,219 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "test.h"
+
+#define ATTEMPTS 10
+
+// Records the attempts of the supervisor thread and the states it reports,
+// failing connections or writes when asked
+struct Supervised {
+  struct Session *session;
+  int (*next_connect)(Network *, char *, int);
+  int (*next_write)(Network *, unsigned char *, int, int);
+  int fail_connect;
+  int fail_writes;
+  int attempts;
+  unsigned long times[ATTEMPTS];
+  int subscribes;
+  int states[2 * ATTEMPTS];
+  int reported;
+  int connected;
+};
+
+static struct Supervised supervised;
+
+static int load(int *value) { return __atomic_load_n(value, __ATOMIC_SEQ_CST); }
+
+// Waits at most the given time for the value to reach at least the minimum
+static void wait_for(int *value, int min, int ms) {
+  unsigned long end = test_now() + ms;
+  while (load(value) < min && (long)(end - test_now()) > 0)
+    test_sleep(1);
+}
+
+static int record_connect(Network *n, char *host, int port) {
+  struct Supervised *s = &supervised;
+  int attempt = load(&s->attempts);
+
+  if (attempt < ATTEMPTS)
+    s->times[attempt] = test_now();
+  __atomic_add_fetch(&s->attempts, 1, __ATOMIC_SEQ_CST);
+  if (load(&s->fail_connect))
+    return FAILURE;
+  return s->next_connect(n, host, port);
+}
+
+static int record_write(Network *n, unsigned char *buf, int len,
+                        int timeout_ms) {
+  struct Supervised *s = &supervised;
+
+  if (len > 0 && buf[0] >> 4 == SUBSCRIBE)
+    __atomic_add_fetch(&s->subscribes, 1, __ATOMIC_SEQ_CST);
+  if (len > 0 && buf[0] >> 4 == PUBLISH && load(&s->fail_writes) > 0) {
+    __atomic_sub_fetch(&s->fail_writes, 1, __ATOMIC_SEQ_CST);
+    return FAILURE;
+  }
+  return s->next_write(n, buf, len, timeout_ms);
+}
+
+static void record_state(TTNState state, void *arg) {
+  struct Supervised *s = (struct Supervised *)arg;
+  int reported = load(&s->reported);
+
+  if (reported < (int)(sizeof(s->states) / sizeof(s->states[0])))
+    s->states[reported] = state;
+  __atomic_add_fetch(&s->reported, 1, __ATOMIC_SEQ_CST);
+  if (state == TTN_STATE_CONNECTED)
+    __atomic_add_fetch(&s->connected, 1, __ATOMIC_SEQ_CST);
+}
+
+// Creates a session on the loopback responder that is not connected
+static struct Session *open_session(int min_ms, int max_ms,
+                                    int keep_alive_interval) {
+  struct Supervised *s = &supervised;
+  struct Session *session;
+  TTNConfig config;
+  TTN *ttn;
+
+  ttngwc_config_init(&config);
+  config.reconnect_min_ms = min_ms;
+  config.reconnect_max_ms = max_ms;
+  config.keep_alive_interval = keep_alive_interval;
+  config.command_timeout_ms = 100;
+  if (ttngwc_init_ex(&ttn, "test", &config, NULL, NULL) != SUCCESS)
+    return NULL;
+  session = (struct Session *)ttn;
+  if (ttngwc_loopback(ttn) != SUCCESS) {
+    ttngwc_cleanup(ttn);
+    return NULL;
+  }
+  memset(s, 0, sizeof(*s));
+  s->session = session;
+  s->next_connect = session->network_connect;
+  s->next_write = session->network_write;
+  session->network_connect = &record_connect;
+  session->network_write = &record_write;
+  return session;
+}
+
+// Failed attempts are spread out between the minimum and maximum delay, and
+// each attempt is reported as connecting
+static void test_backoff(void) {
+  struct Supervised *s = &supervised;
+  struct Session *session = open_session(20, 80, 60);
+  int i, gap;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  s->fail_connect = 1;
+  CHECK_EQ(ttngwc_connect_auto(session, "loopback", 0, NULL, &record_state, s),
+           0);
+  wait_for(&s->attempts, ATTEMPTS, 2000);
+  ttngwc_disconnect(session);
+  CHECK(s->attempts >= ATTEMPTS);
+  CHECK_EQ(s->reported, 2 * s->attempts);
+  CHECK_EQ(s->connected, 0);
+  for (i = 1; i < ATTEMPTS; i++) {
+    gap = (int)(s->times[i] - s->times[i - 1]);
+    CHECK(gap >= 19);
+    CHECK(gap <= 80 + 50);
+  }
+  for (i = 0; i < ATTEMPTS; i++) {
+    CHECK_EQ(s->states[2 * i], TTN_STATE_CONNECTING);
+    CHECK_EQ(s->states[2 * i + 1], TTN_STATE_DISCONNECTED);
+  }
+  ttngwc_cleanup(session);
+}
+
+static void delivered(Router__DownlinkMessage *downlink, void *arg) {
+  (*(int *)arg)++;
+}
+
+// A connection that fails is closed and made again, subscribing to downlinks
+// once more, and the states are reported in order
+static void test_reconnect(void) {
+  struct Supervised *s = &supervised;
+  struct Session *session = open_session(20, 20, 60);
+  Router__DownlinkMessage down = ROUTER__DOWNLINK_MESSAGE__INIT;
+  struct TestResults results = {0};
+  struct TestUplink u;
+  int downlinks = 0;
+
+  static const int states[] = {TTN_STATE_CONNECTING, TTN_STATE_CONNECTED,
+                               TTN_STATE_DISCONNECTED, TTN_STATE_CONNECTING,
+                               TTN_STATE_CONNECTED};
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  session->downlink_handler = &delivered;
+  session->cb_arg = &downlinks;
+  CHECK_EQ(ttngwc_connect_auto(session, "loopback", 0, NULL, &record_state, s),
+           0);
+  wait_for(&s->connected, 1, 1000);
+  CHECK_EQ(load(&s->connected), 1);
+  CHECK_EQ(load(&s->subscribes), 1);
+  CHECK_EQ(session->supervisor.delay, 20);
+
+  // The write fails the connection, and the uplink is published again on
+  // the next one
+  s->fail_writes = 1;
+  test_uplink(&u, 0x26011234, 1000);
+  CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &results), 0);
+  wait_for(&s->connected, 2, 1000);
+  CHECK_EQ(load(&s->connected), 2);
+  CHECK_EQ(load(&s->attempts), 2);
+  CHECK_EQ(load(&s->subscribes), 2);
+  CHECK_EQ(load(&s->reported), 5);
+  CHECK(!memcmp(s->states, states, sizeof(states)));
+  CHECK(!ttngwc_network_lost(session));
+  test_poll(session, 1000, &results.count);
+  CHECK_EQ(results.count, 1);
+  CHECK_EQ(results.last, 0);
+
+  CHECK_EQ(ttngwc_loopback_downlink(session, &down), 0);
+  test_poll(session, 1000, &downlinks);
+  CHECK_EQ(downlinks, 1);
+  ttngwc_disconnect(session);
+  ttngwc_cleanup(session);
+}
+
+// Without keep alive, a connection that stays silent is not taken as lost
+static void test_no_keep_alive(void) {
+  struct Supervised *s = &supervised;
+  struct Session *session = open_session(20, 20, 0);
+  struct TestResults results = {0};
+  struct TestUplink u;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  CHECK_EQ(ttngwc_connect_auto(session, "loopback", 0, NULL, &record_state, s),
+           0);
+  wait_for(&s->connected, 1, 1000);
+  CHECK_EQ(load(&s->connected), 1);
+  CHECK(!ttngwc_network_lost(session));
+
+  // The supervisor checks the connection at least once a second
+  test_poll(session, 1200, NULL);
+  CHECK(!ttngwc_network_lost(session));
+  CHECK_EQ(load(&s->attempts), 1);
+  CHECK_EQ(load(&s->reported), 2);
+  CHECK(session->connected);
+
+  test_uplink(&u, 0x26011234, 1000);
+  CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &results), 0);
+  test_poll(session, 1000, &results.count);
+  CHECK_EQ(results.last, 0);
+  ttngwc_disconnect(session);
+  ttngwc_cleanup(session);
+}
+
+const struct Test supervisor_tests[] = {
+    {"supervisor/backoff", &test_backoff},
+    {"supervisor/reconnect", &test_reconnect},
+    {"supervisor/no_keep_alive", &test_no_keep_alive},
+    {NULL, NULL}};
@@ -0,0 +1,190 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "test.h"
+
+static const struct Test *suites[] = {outbox_tests,    alloc_tests,
+                                      journal_tests,   backlog_tests,
+                                      sender_tests,    envelope_tests,
+                                      dedup_tests,     network_tests,
+                                      reactor_tests,   histogram_tests,
+                                      scheduler_tests, clock_tests,
+                                      view_tests,      filter_tests,
+                                      traffic_tests,   supervisor_tests};
+
+static int failures;
+static const char *current;
+
+void test_fail(const char *file, int line, const char *cond) {
+  fprintf(stderr, "%s: %s:%d: %s\n", current, file, line, cond);
+  __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+}
+
+void test_fail_eq(const char *file, int line, const char *a, const char *b,
+                  long long va, long long vb) {
+  fprintf(stderr, "%s: %s:%d: %s == %s: %lld != %lld\n", current, file, line,
+          a, b, va, vb);
+  __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+}
+
+unsigned long test_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void test_sleep(int ms) {
+  struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+  nanosleep(&ts, NULL);
+}
+
+void test_poll(struct Session *session, int ms, volatile int *until) {
+  unsigned long end = test_now() + ms;
+
+  while ((long)(end - test_now()) > 0 && !(until && *until)) {
+    ttngwc_poll(session, test_now());
+    test_sleep(1);
+  }
+}
+
+static pthread_t poller;
+static volatile int polling;
+
+static void *test_poll_run(void *arg) {
+  struct Session *session = (struct Session *)arg;
+  while (polling) {
+    ttngwc_poll(session, test_now());
+    test_sleep(1);
+  }
+  return NULL;
+}
+
+void test_poll_start(struct Session *session) {
+  polling = 1;
+  pthread_create(&poller, NULL, &test_poll_run, session);
+}
+
+void test_poll_stop(void) {
+  polling = 0;
+  pthread_join(poller, NULL);
+}
+
+// The responder answers on the writing thread, so ignoring a PUBLISH means not
+// passing it on
+static int (*loopback_write)(Network *, unsigned char *, int, int);
+static int ignoring;
+static int ignored;
+
+static int test_write(Network *n, unsigned char *buf, int len,
+                      int timeout_ms) {
+  if (ignoring && len > 0 && buf[0] >> 4 == PUBLISH) {
+    ignored++;
+    return len;
+  }
+  return loopback_write(n, buf, len, timeout_ms);
+}
+
+int test_ignore_publish(struct Session *session, int ignore) {
+  int n = ignored;
+  ignoring = ignore;
+  ignored = 0;
+  return n;
+}
+
+struct Session *test_connect(const TTNConfig *config) {
+  struct Session *session;
+  TTN *ttn;
+
+  ttngwc_init_ex(&ttn, "test", config, NULL, NULL);
+  if (!ttn)
+    return NULL;
+  session = (struct Session *)ttn;
+  if (ttngwc_loopback(ttn) != SUCCESS) {
+    ttngwc_cleanup(ttn);
+    return NULL;
+  }
+  loopback_write = session->network_write;
+  session->network_write = &test_write;
+  ignoring = 0;
+  if (ttngwc_connect(ttn, "loopback", 0, NULL) != SUCCESS) {
+    ttngwc_cleanup(ttn);
+    return NULL;
+  }
+  return session;
+}
+
+void test_uplink(struct TestUplink *u, uint32_t dev_addr, uint32_t timestamp) {
+  int i;
+
+  router__uplink_message__init(&u->up);
+  // Unconfirmed data up with the DevAddr in little endian, FCtrl and FCnt
+  u->payload[0] = 0x40;
+  for (i = 0; i < 4; i++)
+    u->payload[1 + i] = (uint8_t)(dev_addr >> (8 * i));
+  for (i = 5; i < (int)sizeof(u->payload); i++)
+    u->payload[i] = (uint8_t)(timestamp + i);
+  u->up.has_payload = 1;
+  u->up.payload.len = sizeof(u->payload);
+  u->up.payload.data = u->payload;
+
+  protocol__rx_metadata__init(&u->protocol);
+  lorawan__metadata__init(&u->lorawan);
+  u->protocol.protocol_case = PROTOCOL__RX_METADATA__PROTOCOL_LORAWAN;
+  u->lorawan.has_modulation = 1;
+  u->lorawan.modulation = LORAWAN__MODULATION__LORA;
+  u->lorawan.data_rate = "SF7BW125";
+  u->lorawan.coding_rate = "4/5";
+  u->protocol.lorawan = &u->lorawan;
+  u->up.protocol_metadata = &u->protocol;
+
+  gateway__rx_metadata__init(&u->gateway);
+  u->gateway.has_timestamp = 1;
+  u->gateway.timestamp = timestamp;
+  u->gateway.has_frequency = 1;
+  u->gateway.frequency = 868100000;
+  u->up.gateway_metadata = &u->gateway;
+}
+
+void test_done(int rc, void *arg) {
+  struct TestResults *results = (struct TestResults *)arg;
+  int i = __atomic_fetch_add(&results->count, 1, __ATOMIC_ACQ_REL);
+  if (i < (int)(sizeof(results->results) / sizeof(results->results[0])))
+    results->results[i] = rc;
+  results->last = rc;
+}
+
+// Runs the tests of which the name starts with one of the arguments, or all
+// tests without arguments
+int main(int argc, char **argv) {
+  const struct Test *test;
+  int i, j, run = 0, failed = 0;
+
+  for (i = 0; i < (int)(sizeof(suites) / sizeof(suites[0])); i++) {
+    for (test = suites[i]; test->name; test++) {
+      int wanted = argc < 2;
+      for (j = 1; j < argc && !wanted; j++)
+        wanted = strncmp(test->name, argv[j], strlen(argv[j])) == 0;
+      if (!wanted)
+        continue;
+
+      int before = failures;
+      current = test->name;
+      test->run();
+      run++;
+      if (failures > before) {
+        failed++;
+        printf("FAIL %s\n", test->name);
+      } else {
+        printf("ok   %s\n", test->name);
+      }
+    }
+  }
+
+  printf("%d tests, %d failed\n", run, failed);
+  return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,98 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in the LICENSE file.
+
+#if !defined(__TTN_GW_TEST_H_)
+#define __TTN_GW_TEST_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "network.h"
+
+// Records a failure of the running test when the condition does not hold
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond))                                                               \
+      test_fail(__FILE__, __LINE__, #cond);                                    \
+  } while (0)
+
+// Records a failure when two integers differ, printing both
+#define CHECK_EQ(a, b)                                                         \
+  do {                                                                         \
+    long long a_ = (long long)(a), b_ = (long long)(b);                        \
+    if (a_ != b_)                                                              \
+      test_fail_eq(__FILE__, __LINE__, #a, #b, a_, b_);                        \
+  } while (0)
+
+struct Test {
+  const char *name;
+  void (*run)(void);
+};
+
+// Tests of each module, ending with an entry without name
+extern const struct Test outbox_tests[];
+extern const struct Test alloc_tests[];
+extern const struct Test journal_tests[];
+extern const struct Test backlog_tests[];
+extern const struct Test sender_tests[];
+extern const struct Test envelope_tests[];
+extern const struct Test dedup_tests[];
+extern const struct Test network_tests[];
+extern const struct Test reactor_tests[];
+extern const struct Test histogram_tests[];
+extern const struct Test scheduler_tests[];
+extern const struct Test clock_tests[];
+extern const struct Test view_tests[];
+extern const struct Test filter_tests[];
+extern const struct Test traffic_tests[];
+extern const struct Test supervisor_tests[];
+
+void test_fail(const char *file, int line, const char *cond);
+void test_fail_eq(const char *file, int line, const char *a, const char *b,
+                  long long va, long long vb);
+
+// Returns a monotonic time in milliseconds
+unsigned long test_now(void);
+
+// Sleeps for the given time in milliseconds
+void test_sleep(int ms);
+
+// Creates a session with the given settings, or the defaults if config is
+// NULL, connected to the loopback responder
+struct Session *test_connect(const TTNConfig *config);
+
+// Polls the session for the given time in milliseconds, or until the flag is
+// set when it is not NULL
+void test_poll(struct Session *session, int ms, volatile int *until);
+
+// Polls the session from a background thread, for use with the blocking
+// functions. Stop the thread before cleaning up the session
+void test_poll_start(struct Session *session);
+void test_poll_stop(void);
+
+// Has the responder of a loopback session ignore PUBLISH packets, or answer
+// them again when ignore is 0. Returns the number of ignored packets since the
+// last call
+int test_ignore_publish(struct Session *session, int ignore);
+
+// Uplink with a LoRaWAN data frame of the given DevAddr
+struct TestUplink {
+  Router__UplinkMessage up;
+  Protocol__RxMetadata protocol;
+  Lorawan__Metadata lorawan;
+  Gateway__RxMetadata gateway;
+  uint8_t payload[16];
+};
+
+void test_uplink(struct TestUplink *u, uint32_t dev_addr, uint32_t timestamp);
+
+// Records the results passed to test_done
+struct TestResults {
+  int count;
+  int last;
+  int results[64];
+};
+
+void test_done(int rc, void *arg);
+
+#endif
@@ -0,0 +1,189 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "test.h"
+
+// Keeps the payload of the last status message written
+static int (*next_write)(Network *, unsigned char *, int, int);
+static uint8_t status[512];
+static int status_len;
+
+static int capture_write(Network *n, unsigned char *buf, int len,
+                         int timeout_ms) {
+  if (len > 0 && buf[0] >> 4 == PUBLISH) {
+    int pos = 1, remaining = 0, multiplier = 1, end, topic_len;
+    do {
+      remaining += (buf[pos] & 127) * multiplier;
+      multiplier *= 128;
+    } while (buf[pos++] & 128);
+    end = pos + remaining;
+    topic_len = buf[pos] << 8 | buf[pos + 1];
+    if (topic_len > 7 &&
+        !memcmp(&buf[pos + 2 + topic_len - 7], "/status", 7)) {
+      pos += 2 + topic_len;
+      if (buf[0] & 0x06)
+        pos += 2;
+      if (end - pos <= (int)sizeof(status)) {
+        memcpy(status, &buf[pos], end - pos);
+        status_len = end - pos;
+      }
+    }
+  }
+  return next_write(n, buf, len, timeout_ms);
+}
+
+static void delivered(Router__DownlinkMessage *downlink, void *arg) {
+  (*(int *)arg)++;
+}
+
+// Has the responder send a downlink and reads it
+static void push_downlink(struct Session *session) {
+  Router__DownlinkMessage down = ROUTER__DOWNLINK_MESSAGE__INIT;
+  uint8_t payload[4] = {0x60, 0x01, 0x02, 0x03};
+
+  down.has_payload = 1;
+  down.payload.data = payload;
+  down.payload.len = sizeof(payload);
+  CHECK_EQ(ttngwc_loopback_downlink(session, &down), 0);
+  ttngwc_poll(session, test_now());
+}
+
+// Uplinks are counted when submitted, and once more when acknowledged or
+// when they fail, time out or are dropped. Downlinks are counted when
+// received, and once more when delivered or when they cannot be decoded
+static void test_counters(void) {
+  struct TestResults acked = {0}, ignored = {0};
+  struct Session *session;
+  TTNTrafficStats traffic;
+  struct TestUplink u;
+  TTNConfig config;
+  int downlinks = 0, i;
+
+  static const uint8_t malformed[] = {0x0a, 0x05};
+
+  ttngwc_config_init(&config);
+  config.command_timeout_ms = 100;
+  session = test_connect(&config);
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  session->downlink_handler = &delivered;
+  session->cb_arg = &downlinks;
+
+  test_uplink(&u, 0x26011234, 1000);
+  CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &acked), 0);
+  test_poll(session, 1000, &acked.count);
+  CHECK_EQ(acked.last, 0);
+
+  // The outbox fills up, after which an uplink is dropped, and the others
+  // time out
+  test_ignore_publish(session, 1);
+  for (i = 0; i < OUTBOX_SIZE; i++) {
+    test_uplink(&u, 0x26011234, 2000 + i);
+    CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &ignored), 0);
+  }
+  test_uplink(&u, 0x26011234, 3000);
+  CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &ignored),
+           TTNGWC_DROPPED);
+  while (ignored.count < OUTBOX_SIZE) {
+    int count = ignored.count;
+    test_poll(session, 1000, NULL);
+    if (ignored.count == count)
+      break;
+  }
+  CHECK_EQ(ignored.count, OUTBOX_SIZE);
+  CHECK_EQ(ignored.last, TTNGWC_TIMEOUT);
+  test_ignore_publish(session, 0);
+
+  push_downlink(session);
+  CHECK_EQ(ttngwc_loopback_inject(session, session->downlink_topic, malformed,
+                                  sizeof(malformed)),
+           0);
+  ttngwc_poll(session, test_now());
+  CHECK_EQ(downlinks, 1);
+
+  ttngwc_traffic_stats(session, &traffic);
+  CHECK_EQ(traffic.uplinks_submitted, OUTBOX_SIZE + 2);
+  CHECK_EQ(traffic.uplinks_acked, 1);
+  CHECK_EQ(traffic.uplinks_failed, OUTBOX_SIZE + 1);
+  CHECK_EQ(traffic.downlinks_received, 2);
+  CHECK_EQ(traffic.downlinks_delivered, 1);
+  CHECK_EQ(traffic.downlinks_decode_failed, 1);
+  CHECK(traffic.bytes_in > 0);
+  CHECK(traffic.bytes_out > 0);
+  ttngwc_cleanup(session);
+}
+
+// Sends the status message and decodes it as it was published
+static Gateway__Status *publish_status(struct Session *session,
+                                       Gateway__Status *message) {
+  struct TestResults results = {0};
+
+  status_len = 0;
+  CHECK_EQ(ttngwc_submit_status(session, message, &test_done, &results), 0);
+  test_poll(session, 1000, &results.count);
+  CHECK_EQ(results.last, 0);
+  return gateway__status__unpack(NULL, status_len, status);
+}
+
+// The traffic counters fill in the fields of a status message that the
+// caller left unset, and leave the others as they are
+static void test_status(void) {
+  struct Session *session = test_connect(NULL);
+  struct TestResults results = {0};
+  Gateway__Status message = GATEWAY__STATUS__INIT;
+  Gateway__Status *sent;
+  struct TestUplink u;
+  int downlinks = 0;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  next_write = session->network_write;
+  session->network_write = &capture_write;
+  session->downlink_handler = &delivered;
+  session->cb_arg = &downlinks;
+  test_uplink(&u, 0x26011234, 1000);
+  CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &results), 0);
+  test_uplink(&u, 0x26011234, 2000);
+  CHECK_EQ(ttngwc_submit_uplink(session, &u.up, &test_done, &results), 0);
+  test_poll(session, 1000, NULL);
+  CHECK_EQ(results.count, 2);
+  push_downlink(session);
+
+  sent = publish_status(session, &message);
+  CHECK(sent != NULL);
+  if (sent) {
+    CHECK(sent->has_rx_in && sent->has_rx_ok);
+    CHECK(sent->has_tx_in && sent->has_tx_ok);
+    CHECK_EQ(sent->rx_in, 2);
+    CHECK_EQ(sent->rx_ok, 2);
+    CHECK_EQ(sent->tx_in, 1);
+    CHECK_EQ(sent->tx_ok, 1);
+    gateway__status__free_unpacked(sent, NULL);
+  }
+
+  message.has_rx_in = 1;
+  message.rx_in = 7;
+  message.has_tx_ok = 1;
+  message.tx_ok = 0;
+  sent = publish_status(session, &message);
+  CHECK(sent != NULL);
+  if (sent) {
+    CHECK_EQ(sent->rx_in, 7);
+    CHECK_EQ(sent->rx_ok, 2);
+    CHECK_EQ(sent->tx_in, 1);
+    CHECK(sent->has_tx_ok);
+    CHECK_EQ(sent->tx_ok, 0);
+    gateway__status__free_unpacked(sent, NULL);
+  }
+  // The message of the caller is not changed
+  CHECK(!message.has_rx_ok);
+  CHECK(!message.has_tx_in);
+  ttngwc_cleanup(session);
+}
+
+const struct Test traffic_tests[] = {{"traffic/counters", &test_counters},
+                                     {"traffic/status", &test_status},
+                                     {NULL, NULL}};
@@ -0,0 +1,202 @@
+// Copyright © 2016 The Things Network
+// Use of this source code is governed by the MIT license that can be found in
+// the LICENSE file.
+
+#include "test.h"
+
+struct TestDownlink {
+  Router__DownlinkMessage down;
+  Protocol__TxConfiguration protocol;
+  Lorawan__TxConfiguration lorawan;
+  Gateway__TxConfiguration gateway;
+  uint8_t payload[20];
+};
+
+// Sets up a downlink with all fields of the gateway configuration that the
+// view reads, and a protocol configuration
+static void test_downlink(struct TestDownlink *d) {
+  size_t i;
+
+  router__downlink_message__init(&d->down);
+  protocol__tx_configuration__init(&d->protocol);
+  lorawan__tx_configuration__init(&d->lorawan);
+  gateway__tx_configuration__init(&d->gateway);
+  for (i = 0; i < sizeof(d->payload); i++)
+    d->payload[i] = (uint8_t)i;
+  d->down.has_payload = 1;
+  d->down.payload.data = d->payload;
+  d->down.payload.len = sizeof(d->payload);
+  d->down.protocol_configuration = &d->protocol;
+  d->down.gateway_configuration = &d->gateway;
+  d->protocol.protocol_case = PROTOCOL__TX_CONFIGURATION__PROTOCOL_LORAWAN;
+  d->protocol.lorawan = &d->lorawan;
+  d->lorawan.data_rate = "SF7BW125";
+  d->lorawan.coding_rate = "4/5";
+  d->gateway.has_timestamp = 1;
+  d->gateway.timestamp = 0xfffffff0;
+  d->gateway.has_rf_chain = 1;
+  d->gateway.rf_chain = 1;
+  d->gateway.has_frequency = 1;
+  d->gateway.frequency = 869525000;
+  d->gateway.has_power = 1;
+  d->gateway.power = -3;
+  d->gateway.has_polarization_inversion = 1;
+  d->gateway.polarization_inversion = 1;
+  d->gateway.has_frequency_deviation = 1;
+  d->gateway.frequency_deviation = 25000;
+}
+
+static size_t pack(struct TestDownlink *d, uint8_t *buf) {
+  return router__downlink_message__pack(&d->down, buf);
+}
+
+// The payload and configurations are read from the packed message as they were
+// sent, and the whole downlink decodes on request
+static void test_fields(void) {
+  struct ArenaAllocator allocator;
+  Gateway__TxConfiguration tx = GATEWAY__TX_CONFIGURATION__INIT;
+  Protocol__TxConfiguration *protocol;
+  Router__DownlinkMessage *decoded;
+  struct DownlinkView view;
+  struct TestDownlink d;
+  const uint8_t *payload;
+  uint8_t buf[256];
+  size_t len;
+
+  ttngwc_arena_allocator_init(&allocator, DOWNLINK_ARENA_SIZE, 0);
+  test_downlink(&d);
+  len = pack(&d, buf);
+  CHECK_EQ(ttngwc_view_init(&view, &allocator, buf, len), 0);
+
+  CHECK_EQ(ttngwc_view_payload(&view, &payload, &len), 0);
+  CHECK_EQ(len, sizeof(d.payload));
+  CHECK(payload >= buf && payload + len <= buf + sizeof(buf));
+  CHECK(!memcmp(payload, d.payload, len));
+
+  protocol = ttngwc_view_protocol(&view);
+  CHECK(protocol != NULL);
+  if (protocol) {
+    CHECK(protocol->lorawan != NULL);
+    if (protocol->lorawan)
+      CHECK(!strcmp(protocol->lorawan->data_rate, "SF7BW125"));
+  }
+
+  CHECK_EQ(ttngwc_view_tx(&view, &tx), 0);
+  CHECK(tx.has_timestamp);
+  CHECK_EQ(tx.timestamp, 0xfffffff0);
+  CHECK_EQ(tx.rf_chain, 1);
+  CHECK_EQ(tx.frequency, 869525000);
+  CHECK_EQ(tx.power, -3);
+  CHECK_EQ(tx.polarization_inversion, 1);
+  CHECK_EQ(tx.frequency_deviation, 25000);
+
+  decoded = ttngwc_view_decode(&view);
+  CHECK(decoded != NULL);
+  CHECK(ttngwc_view_decode(&view) == decoded);
+  if (decoded) {
+    CHECK(decoded->protocol_configuration != NULL);
+    CHECK(decoded->gateway_configuration != NULL);
+  }
+  ttngwc_arena_allocator_free(&allocator);
+}
+
+// A downlink without payload or gateway configuration has a view, but not
+// these fields
+static void test_missing(void) {
+  Router__DownlinkMessage down = ROUTER__DOWNLINK_MESSAGE__INIT;
+  Gateway__TxConfiguration tx = GATEWAY__TX_CONFIGURATION__INIT;
+  struct DownlinkView view;
+  const uint8_t *payload;
+  uint8_t buf[16];
+  size_t len;
+
+  len = router__downlink_message__pack(&down, buf);
+  CHECK_EQ(ttngwc_view_init(&view, NULL, buf, len), 0);
+  CHECK_EQ(ttngwc_view_payload(&view, &payload, &len), -1);
+  CHECK_EQ(ttngwc_view_tx(&view, &tx), -1);
+  CHECK(!tx.has_timestamp);
+  CHECK(ttngwc_view_protocol(&view) == NULL);
+}
+
+// The view rejects what decoding the message rejects: truncated messages,
+// long varints, unknown wire types and known fields of another wire type
+static void test_malformed(void) {
+  struct ArenaAllocator allocator;
+  Router__DownlinkMessage *decoded;
+  Gateway__TxConfiguration tx;
+  struct DownlinkView view;
+  struct TestDownlink d;
+  uint8_t buf[256];
+  size_t len, i;
+  int ok;
+
+  static const uint8_t varint[] = {0x08, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+                                   0x80, 0x80, 0x80, 0x80, 0x01};
+  static const uint8_t group[] = {0x1b, 0x00};
+  static const uint8_t payload[] = {0x08, 0x01};
+  static const uint8_t timestamp[] = {0x62, 0x03, 0x5a, 0x01, 0x00};
+
+  ttngwc_arena_allocator_init(&allocator, DOWNLINK_ARENA_SIZE, 0);
+  test_downlink(&d);
+  len = pack(&d, buf);
+  for (i = 0; i < len; i++) {
+    decoded = router__downlink_message__unpack(&allocator.base, i, buf);
+    gateway__tx_configuration__init(&tx);
+    ok = ttngwc_view_init(&view, &allocator, buf, i) == SUCCESS &&
+         (!view.gateway_configuration.present ||
+          ttngwc_view_tx(&view, &tx) == SUCCESS);
+    CHECK_EQ(ok, decoded != NULL);
+    ttngwc_arena_allocator_reset(&allocator);
+  }
+
+  CHECK_EQ(ttngwc_view_init(&view, NULL, varint, sizeof(varint)), -1);
+  CHECK_EQ(ttngwc_view_init(&view, NULL, group, sizeof(group)), -1);
+  CHECK_EQ(ttngwc_view_init(&view, NULL, payload, sizeof(payload)), -1);
+  CHECK_EQ(ttngwc_view_init(&view, NULL, timestamp, sizeof(timestamp)), 0);
+  gateway__tx_configuration__init(&tx);
+  CHECK_EQ(ttngwc_view_tx(&view, &tx), -1);
+  ttngwc_arena_allocator_free(&allocator);
+}
+
+struct Viewed {
+  int count;
+  size_t len;
+  uint32_t timestamp;
+};
+
+static void viewed(const TTNDownlinkView *view, void *arg) {
+  struct Viewed *v = (struct Viewed *)arg;
+  Gateway__TxConfiguration tx = GATEWAY__TX_CONFIGURATION__INIT;
+  const uint8_t *payload;
+
+  v->count++;
+  if (ttngwc_downlink_payload(view, &payload, &v->len) != SUCCESS)
+    v->len = 0;
+  if (ttngwc_downlink_tx(view, &tx) == SUCCESS)
+    v->timestamp = tx.timestamp;
+}
+
+// Downlinks from the router are passed to the view handler
+static void test_handler(void) {
+  struct Session *session = test_connect(NULL);
+  struct Viewed v = {0};
+  struct TestDownlink d;
+
+  CHECK(session != NULL);
+  if (!session)
+    return;
+  ttngwc_set_downlink_view_handler(session, &viewed, &v);
+  test_downlink(&d);
+  CHECK_EQ(ttngwc_loopback_downlink(session, &d.down), 0);
+  test_poll(session, 1000, &v.count);
+  CHECK_EQ(v.count, 1);
+  CHECK_EQ(v.len, sizeof(d.payload));
+  CHECK_EQ(v.timestamp, 0xfffffff0);
+  ttngwc_cleanup(session);
+}
+
+const struct Test view_tests[] = {{"view/fields", &test_fields},
+                                  {"view/missing", &test_missing},
+                                  {"view/malformed", &test_malformed},
+                                  {"view/handler", &test_handler},
+                                  {NULL, NULL}};